@@ -0,0 +1,57 @@
+#include <stdlib.h>
+
+#include "arena.h"
+
+// ARENA
+// Bump allocator for the values of a run, nothing is freed until
+// the arena is reset. The newest chunk is the biggest one, a
+// reset keeps it and releases the others, so an arena reused for
+// many runs settles on a single chunk big enough for a run.
+
+void arena_init(Arena *arena)
+{
+    arena->chunks = NULL;
+}
+
+void *arena_alloc(Arena *arena, size_t size)
+{
+    size = (size + 7) & ~(size_t)7;
+    ArenaChunk *chunk = arena->chunks;
+    if (chunk == NULL || chunk->used + size > chunk->size) {
+        size_t chunk_size = chunk ? chunk->size * 2 : ARENA_CHUNK;
+        while (chunk_size < size) {
+            chunk_size *= 2;
+        }
+        ArenaChunk *new = malloc(sizeof(ArenaChunk) + chunk_size);
+        new->next = chunk;
+        new->used = 0;
+        new->size = chunk_size;
+        arena->chunks = chunk = new;
+    }
+    void *ptr = chunk->data + chunk->used;
+    chunk->used += size;
+    return ptr;
+}
+
+void arena_reset(Arena *arena)
+{
+    ArenaChunk *chunk = arena->chunks;
+    if (chunk == NULL) {
+        return;
+    }
+    ArenaChunk *next = chunk->next;
+    while (next) {
+        ArenaChunk *tmp = next->next;
+        free(next);
+        next = tmp;
+    }
+    chunk->next = NULL;
+    chunk->used = 0;
+}
+
+void arena_free(Arena *arena)
+{
+    arena_reset(arena);
+    free(arena->chunks);
+    arena->chunks = NULL;
+}
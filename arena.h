@@ -0,0 +1,26 @@
+#ifndef ARENA_H
+#define ARENA_H
+
+#include <stddef.h>
+
+// Size of the first chunk, every new chunk is twice as big
+#define ARENA_CHUNK 4096
+
+typedef struct arenachunk ArenaChunk;
+typedef struct arenachunk {
+    ArenaChunk *next;
+    size_t used;
+    size_t size;
+    char data[];
+} ArenaChunk;
+
+typedef struct {
+    ArenaChunk *chunks;
+} Arena;
+
+void arena_init(Arena *arena);
+void *arena_alloc(Arena *arena, size_t size);
+void arena_reset(Arena *arena);
+void arena_free(Arena *arena);
+
+#endif
@@ -0,0 +1,429 @@
+#include <math.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "vector.h"
+
+// BENCHMARKS
+// make bench runs every program of the corpus with every engine:
+//
+//   interpreter   ./interpreter file.l
+//   tiered        ./interpreter --tiered file.l
+//   lli           ./codegen -O2 -o file.bc file.l, then lli file.bc
+//   aot           ./codegen -O2 --obj file.o file.l, cc, then ./file
+//
+// Every program is run once to warm the caches and then runs
+// times. All the runs of all the engines must exit with the same
+// code, the one on the first line of the program when it starts
+// with "// exit n", otherwise the benchmark fails. The times are
+// written as JSON, for every engine the percentiles of the compile
+// time, of the run time and of their total, and the throughput in
+// programs per second:
+//
+//   "loops": {"lli": {"exit": 42, "compile_ms": {"p50": 31.2, ...
+//
+// The corpus also gets a program of generated functions, written
+// in the work directory, to measure the compilers on large sources.
+
+#define BENCH_RUNS 5
+#define BENCH_FUNCS 1000
+
+typedef enum {
+    ENGINE_INTERP,
+    ENGINE_TIERED,
+    ENGINE_LLI,
+    ENGINE_AOT,
+    NENGINES,
+} Engine;
+
+static char *engine_names[] = {
+    [ENGINE_INTERP] = "interpreter",
+    [ENGINE_TIERED] = "tiered",
+    [ENGINE_LLI] = "lli",
+    [ENGINE_AOT] = "aot",
+};
+
+typedef struct {
+    size_t size;
+    size_t capacity;
+    double *items;
+} Samples;
+
+// Exit is the code of the runs, -1 when a compilation failed
+// or when two runs did not agree
+typedef struct {
+    int exit;
+    Samples compile;
+    Samples run;
+    Samples total;
+} Result;
+
+typedef struct {
+    char *path;
+    char *name;
+    long bytes;
+    int expected;
+    Result results[NENGINES];
+} Workload;
+
+typedef struct {
+    size_t size;
+    size_t capacity;
+    Workload *items;
+} Workloads;
+
+typedef struct {
+    size_t runs;
+    size_t funcs;
+    char *output;
+    char *workdir;
+    char *lli;
+    char *cc;
+} Options;
+
+double bench_now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+// Runs the command with its output discarded, returns its exit
+// code, 128 plus the signal when it was killed, and its duration
+int spawn(char **argv, double *elapsed)
+{
+    // The child would write the buffer of the parent again
+    fflush(stdout);
+    double start = bench_now();
+    pid_t pid = fork();
+    if (pid < 0) {
+        perror("fork");
+        exit(1);
+    }
+    if (pid == 0) {
+        if (freopen("/dev/null", "w", stdout) == NULL
+                || freopen("/dev/null", "w", stderr) == NULL) {
+            _exit(127);
+        }
+        execvp(argv[0], argv);
+        _exit(127);
+    }
+    int status;
+    waitpid(pid, &status, 0);
+    *elapsed = bench_now() - start;
+    if (WIFSIGNALED(status)) {
+        return 128 + WTERMSIG(status);
+    }
+    return WEXITSTATUS(status);
+}
+
+char *work_path(Options *opts, Workload *w, char *ext)
+{
+    size_t len = strlen(opts->workdir) + strlen(w->name) + strlen(ext) + 2;
+    char *path = malloc(len);
+    snprintf(path, len, "%s/%s%s", opts->workdir, w->name, ext);
+    return path;
+}
+
+// Compiles the program for the engine, returns the exit code
+// of the first step that fails or 0
+int compile(Options *opts, Workload *w, Engine engine, double *elapsed)
+{
+    *elapsed = 0;
+    if (engine != ENGINE_LLI && engine != ENGINE_AOT) {
+        return 0;
+    }
+    char *bitcode = work_path(opts, w, ".bc");
+    char *object = work_path(opts, w, ".o");
+    char *exe = work_path(opts, w, "");
+    int status;
+    if (engine == ENGINE_LLI) {
+        char *argv[] = {"./codegen", "-O2", "-o", bitcode, w->path, NULL};
+        status = spawn(argv, elapsed);
+    } else {
+        char *argv[] = {"./codegen", "-O2", "--obj", object, "-o", bitcode, w->path, NULL};
+        status = spawn(argv, elapsed);
+        if (status == 0) {
+            double link;
+            char *link_argv[] = {opts->cc, "-o", exe, object, NULL};
+            status = spawn(link_argv, &link);
+            *elapsed += link;
+        }
+    }
+    free(exe);
+    free(object);
+    free(bitcode);
+    return status;
+}
+
+int run(Options *opts, Workload *w, Engine engine, double *elapsed)
+{
+    char *bitcode = work_path(opts, w, ".bc");
+    char *exe = work_path(opts, w, "");
+    int status = 0;
+    switch (engine) {
+    case ENGINE_INTERP: {
+        char *argv[] = {"./interpreter", w->path, NULL};
+        status = spawn(argv, elapsed);
+        break;
+    }
+    case ENGINE_TIERED: {
+        char *argv[] = {"./interpreter", "--tiered", w->path, NULL};
+        status = spawn(argv, elapsed);
+        break;
+    }
+    case ENGINE_LLI: {
+        char *argv[] = {opts->lli, bitcode, NULL};
+        status = spawn(argv, elapsed);
+        break;
+    }
+    case ENGINE_AOT: {
+        char *argv[] = {exe, NULL};
+        status = spawn(argv, elapsed);
+        break;
+    }
+    default:
+        break;
+    }
+    free(exe);
+    free(bitcode);
+    return status;
+}
+
+// The first run only warms up and sets the exit code
+void bench_engine(Options *opts, Workload *w, Engine engine)
+{
+    Result *res = &w->results[engine];
+    v_init(res->compile);
+    v_init(res->run);
+    v_init(res->total);
+    for (size_t i = 0; i <= opts->runs; i++) {
+        double compile_time, run_time;
+        if (compile(opts, w, engine, &compile_time) != 0) {
+            res->exit = -1;
+            return;
+        }
+        int status = run(opts, w, engine, &run_time);
+        if (i == 0) {
+            res->exit = status;
+            continue;
+        }
+        if (status != res->exit) {
+            res->exit = -1;
+            return;
+        }
+        v_append(res->compile, compile_time);
+        v_append(res->run, run_time);
+        v_append(res->total, compile_time + run_time);
+    }
+}
+
+int double_compare(const void *a, const void *b)
+{
+    double x = *(const double *)a;
+    double y = *(const double *)b;
+    return (x > y) - (x < y);
+}
+
+// Nearest rank percentile of sorted samples
+double percentile(Samples *s, double p)
+{
+    if (s->size == 0) {
+        return 0;
+    }
+    size_t rank = (size_t)ceil(p / 100 * s->size);
+    return s->items[rank > 0 ? rank - 1 : 0];
+}
+
+double mean(Samples *s)
+{
+    double sum = 0;
+    for (size_t i = 0; i < s->size; i++) {
+        sum += s->items[i];
+    }
+    return s->size ? sum / s->size : 0;
+}
+
+void write_samples(FILE *f, char *name, Samples *s)
+{
+    qsort(s->items, s->size, sizeof(double), double_compare);
+    fprintf(f, "\"%s\": {\"min\": %.3f, \"p50\": %.3f, \"p90\": %.3f, \"p99\": %.3f, "
+        "\"max\": %.3f, \"mean\": %.3f}", name, s->size ? s->items[0] * 1e3 : 0,
+        percentile(s, 50) * 1e3, percentile(s, 90) * 1e3, percentile(s, 99) * 1e3,
+        s->size ? s->items[s->size - 1] * 1e3 : 0, mean(s) * 1e3);
+}
+
+void write_json(Options *opts, Workloads *ws, bool ok)
+{
+    FILE *f = fopen(opts->output, "w");
+    if (f == NULL) {
+        printf("Could not create file %s\n", opts->output);
+        exit(1);
+    }
+    fprintf(f, "{\"runs\": %zu, \"ok\": %s, \"workloads\": {", opts->runs,
+        ok ? "true" : "false");
+    for (size_t i = 0; i < ws->size; i++) {
+        Workload *w = &ws->items[i];
+        fprintf(f, "%s\n  \"%s\": {\"source\": \"%s\", \"bytes\": %ld, \"expected\": %d, "
+            "\"engines\": {", i ? "," : "", w->name, w->path, w->bytes, w->expected);
+        for (int e = 0; e < NENGINES; e++) {
+            Result *res = &w->results[e];
+            double total = mean(&res->total);
+            fprintf(f, "%s\n    \"%s\": {\"exit\": %d, ", e ? "," : "", engine_names[e],
+                res->exit);
+            write_samples(f, "compile_ms", &res->compile);
+            fprintf(f, ", ");
+            write_samples(f, "run_ms", &res->run);
+            fprintf(f, ", ");
+            write_samples(f, "total_ms", &res->total);
+            fprintf(f, ", \"throughput_per_s\": %.3f}", total > 0 ? 1 / total : 0);
+        }
+        fprintf(f, "}}");
+    }
+    fprintf(f, "\n}}\n");
+    fclose(f);
+}
+
+// Functions that are each called once by main, the exit code
+// tells whether the sum of their results is the expected one
+char *generate(Options *opts, size_t nfuncs)
+{
+    size_t len = strlen(opts->workdir) + sizeof("/generated.l");
+    char *path = malloc(len);
+    snprintf(path, len, "%s/generated.l", opts->workdir);
+    FILE *f = fopen(path, "w");
+    if (f == NULL) {
+        printf("Could not create file %s\n", path);
+        exit(1);
+    }
+    fprintf(f, "// exit 17\n// Generated by bench.c\n");
+    double sum = 0;
+    for (size_t i = 0; i < nfuncs; i++) {
+        fprintf(f, "fn f%zu x {\n    let a = x + %zu;\n    if a > %zu {\n"
+            "        a = a - %zu;\n    }\n    return a * 2;\n}\n\n", i, i, nfuncs, nfuncs);
+        double a = i % 17 + i;
+        sum += (a > nfuncs ? a - nfuncs : a) * 2;
+    }
+    fprintf(f, "let sum = 0;\n");
+    for (size_t i = 0; i < nfuncs; i++) {
+        fprintf(f, "sum = sum + f%zu(%zu);\n", i, i % 17);
+    }
+    fprintf(f, "if sum == %.0f {\n    return 17;\n}\nreturn 4;\n", sum);
+    fclose(f);
+    return path;
+}
+
+// Name is the file name without the extension, expected
+// comes from the first line or is -1
+void workload_add(Workloads *ws, char *path)
+{
+    FILE *f = fopen(path, "r");
+    if (f == NULL) {
+        printf("Could not open file %s\n", path);
+        exit(1);
+    }
+    Workload w = {.path = path, .expected = -1};
+    if (fscanf(f, "// exit %d", &w.expected) != 1) {
+        w.expected = -1;
+    }
+    fseek(f, 0, SEEK_END);
+    w.bytes = ftell(f);
+    fclose(f);
+
+    char *slash = strrchr(path, '/');
+    w.name = strdup(slash ? slash + 1 : path);
+    char *dot = strrchr(w.name, '.');
+    if (dot) {
+        *dot = '\0';
+    }
+    v_append(*ws, w);
+}
+
+int main(int argc, char **argv)
+{
+    Options opts = {
+        .runs = BENCH_RUNS,
+        .funcs = BENCH_FUNCS,
+        .output = "bench.json",
+        .workdir = "bench.out",
+        .lli = "lli",
+        .cc = "cc",
+    };
+    Workloads ws;
+    v_init(ws);
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "-n") == 0 && i + 1 < argc) {
+            opts.runs = strtoul(argv[++i], NULL, 10);
+        } else if (strcmp(argv[i], "-o") == 0 && i + 1 < argc) {
+            opts.output = argv[++i];
+        } else if (strcmp(argv[i], "-w") == 0 && i + 1 < argc) {
+            opts.workdir = argv[++i];
+        } else if (strcmp(argv[i], "--funcs") == 0 && i + 1 < argc) {
+            opts.funcs = strtoul(argv[++i], NULL, 10);
+        } else if (strcmp(argv[i], "--lli") == 0 && i + 1 < argc) {
+            opts.lli = argv[++i];
+        } else if (strcmp(argv[i], "--cc") == 0 && i + 1 < argc) {
+            opts.cc = argv[++i];
+        } else {
+            workload_add(&ws, argv[i]);
+        }
+    }
+    if (ws.size == 0 || opts.runs == 0) {
+        printf("Usage: %s [-n runs] [-o results.json] [-w workdir] [--funcs n]\n"
+               "          [--lli lli] [--cc cc] <source.l>...\n", argv[0]);
+        exit(1);
+    }
+
+    // The compilations are measured, not the cache
+    unsetenv("L_CACHE_DIR");
+    mkdir(opts.workdir, 0755);
+    if (opts.funcs) {
+        workload_add(&ws, generate(&opts, opts.funcs));
+    }
+
+    bool ok = true;
+    printf("%-12s %-12s %5s %12s %12s %12s\n", "workload", "engine", "exit",
+        "compile p50", "run p50", "run p90");
+    for (size_t i = 0; i < ws.size; i++) {
+        Workload *w = &ws.items[i];
+        for (int e = 0; e < NENGINES; e++) {
+            Result *res = &w->results[e];
+            bench_engine(&opts, w, e);
+            if (w->expected < 0) {
+                w->expected = res->exit;
+            }
+            bool agree = res->exit >= 0 && res->exit == w->expected;
+            ok = ok && agree;
+
+            qsort(res->compile.items, res->compile.size, sizeof(double), double_compare);
+            qsort(res->run.items, res->run.size, sizeof(double), double_compare);
+            printf("%-12s %-12s %5d %12.3f %12.3f %12.3f%s\n", w->name, engine_names[e],
+                res->exit, percentile(&res->compile, 50) * 1e3,
+                percentile(&res->run, 50) * 1e3, percentile(&res->run, 90) * 1e3,
+                agree ? "" : "  MISMATCH");
+            fflush(stdout);
+        }
+    }
+
+    write_json(&opts, &ws, ok);
+    printf("Results written to %s\n", opts.output);
+    if (!ok) {
+        printf("The engines did not all exit with the expected codes\n");
+    }
+    for (size_t i = 0; i < ws.size; i++) {
+        for (int e = 0; e < NENGINES; e++) {
+            free(ws.items[i].results[e].compile.items);
+            free(ws.items[i].results[e].run.items);
+            free(ws.items[i].results[e].total.items);
+        }
+        free(ws.items[i].name);
+    }
+    free(ws.items);
+    return ok ? 0 : 1;
+}
@@ -0,0 +1,99 @@
+#include <time.h>
+
+#include "error.h"
+#include "budget.h"
+
+// EXECUTION BUDGETS
+// A run can be limited in steps, wall clock time, heap and depth.
+// The checks are on the back edges of the loops and on the calls,
+// which every long running program goes through, and they are
+// cheap: a step only decrements the fuel, the slow path runs once
+// per tank, it counts the steps and reads the clock. A run over
+// its budget raises E_BUDGET, the host gets it from its handler
+// like any other error and the command line tools exit with
+// BUDGET_STATUS.
+//
+// Code compiled with a budget decrements the same fuel, see
+// gen_burn, so native loops cannot escape the limits either.
+
+double budget_now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+bool budget_limited(BudgetLimits limits)
+{
+    return limits.steps || limits.seconds > 0 || limits.heap || limits.depth;
+}
+
+// The tank is smaller than BUDGET_TANK when less steps remain,
+// the fuel then runs out exactly on the last allowed step and
+// the next one exceeds the budget
+void budget_fill(Budget *budget)
+{
+    int64_t tank = BUDGET_TANK;
+    size_t steps = budget->limits.steps;
+    if (steps && steps - budget->burnt < (size_t)tank) {
+        tank = steps == budget->burnt ? 1 : steps - budget->burnt;
+    }
+    budget->tank = tank;
+    budget->fuel = tank;
+}
+
+void budget_start(Budget *budget, BudgetLimits limits)
+{
+    budget->limits = limits;
+    budget->burnt = 0;
+    budget->heap = 0;
+    budget->depth = 0;
+    budget->deadline = limits.seconds > 0 ? budget_now() + limits.seconds : 0;
+    budget_fill(budget);
+}
+
+void budget_refuel(Budget *budget)
+{
+    budget->burnt += budget->tank - budget->fuel;
+    BudgetLimits limits = budget->limits;
+    if (limits.steps && budget->burnt > limits.steps) {
+        error_report(E_BUDGET, 0, "Step budget of %zu exceeded\n", limits.steps);
+    }
+    if (budget->deadline && budget_now() >= budget->deadline) {
+        error_report(E_BUDGET, 0, "Deadline of %g seconds exceeded\n", limits.seconds);
+    }
+    budget_fill(budget);
+}
+
+void budget_step(Budget *budget)
+{
+    if (budget && --budget->fuel <= 0) {
+        budget_refuel(budget);
+    }
+}
+
+void budget_alloc(Budget *budget, size_t size)
+{
+    if (budget && budget->limits.heap) {
+        budget->heap += size;
+        if (budget->heap > budget->limits.heap) {
+            error_report(E_BUDGET, 0, "Heap budget of %zu bytes exceeded\n",
+                budget->limits.heap);
+        }
+    }
+}
+
+void budget_enter(Budget *budget)
+{
+    if (budget && budget->limits.depth && ++budget->depth > budget->limits.depth) {
+        error_report(E_BUDGET, 0, "Recursion depth of %zu exceeded\n",
+            budget->limits.depth);
+    }
+}
+
+void budget_leave(Budget *budget)
+{
+    if (budget && budget->limits.depth) {
+        budget->depth--;
+    }
+}
@@ -0,0 +1,42 @@
+#ifndef BUDGET_H
+#define BUDGET_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// Number of steps between two readings of the clock
+#define BUDGET_TANK 4096
+
+// Limits of a run, 0 is no limit. Steps are the back edges of
+// the loops and the calls, heap is the bytes of the numbers
+// computed by the run and depth the number of nested calls.
+typedef struct {
+    size_t steps;
+    double seconds;
+    size_t heap;
+    size_t depth;
+} BudgetLimits;
+
+// Fuel comes first: native code decrements it through a pointer
+// to the budget and calls budget_refuel when it runs out. Tank is
+// the fuel given by the last refuel, burnt the steps before it.
+typedef struct budget {
+    int64_t fuel;
+    int64_t tank;
+    size_t burnt;
+    double deadline;
+    size_t heap;
+    size_t depth;
+    BudgetLimits limits;
+} Budget;
+
+bool budget_limited(BudgetLimits limits);
+void budget_start(Budget *budget, BudgetLimits limits);
+void budget_refuel(Budget *budget);
+void budget_step(Budget *budget);
+void budget_alloc(Budget *budget, size_t size);
+void budget_enter(Budget *budget);
+void budget_leave(Budget *budget);
+
+#endif
@@ -0,0 +1,214 @@
+#include <errno.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/stat.h>
+
+#include "llvm-c/Core.h"
+#include "llvm-c/BitReader.h"
+#include "llvm-c/TargetMachine.h"
+#include "llvm/Config/llvm-config.h"
+
+#include "lexer.h"
+#include "vector.h"
+#include "error.h"
+#include "codegen.h"
+#include "cache.h"
+
+// COMPILATION CACHE
+// Optimized modules are stored in a directory as bitcode together
+// with the native object compiled from them, when one was asked
+// for. The name of the files is a hash of everything that can
+// change the output: the source, the compiler and LLVM versions,
+// the host target and the options.
+//
+// Files are written under a temporary name and then renamed, rename
+// is atomic so concurrent compilers sharing the directory only ever
+// see complete files. Two compilers missing the same entry both
+// compile it and the last rename wins, which is harmless since the
+// contents are the same.
+
+void cache_init(Cache *cache, char *dir)
+{
+    cache->dir = dir;
+    cache->hash = FNV_OFFSET;
+    if (mkdir(dir, 0755) && errno != EEXIST) {
+        error_report(E_IO, 0, "Could not create cache directory %s\n", dir);
+    }
+
+    cache_add(cache, CACHE_VERSION, strlen(CACHE_VERSION));
+    cache_add(cache, LLVM_VERSION_STRING, strlen(LLVM_VERSION_STRING));
+
+    LLVMTargetMachineRef tm = host_machine();
+    char *triple = LLVMGetTargetMachineTriple(tm);
+    char *cpu = LLVMGetTargetMachineCPU(tm);
+    char *features = LLVMGetTargetMachineFeatureString(tm);
+    cache_add(cache, triple, strlen(triple));
+    cache_add(cache, cpu, strlen(cpu));
+    cache_add(cache, features, strlen(features));
+    LLVMDisposeMessage(features);
+    LLVMDisposeMessage(cpu);
+    LLVMDisposeMessage(triple);
+    LLVMDisposeTargetMachine(tm);
+}
+
+// The size is hashed too so that the concatenation
+// of different inputs gives different keys
+void cache_add(Cache *cache, const void *data, size_t size)
+{
+    cache->hash = fnv_hash(cache->hash, &size, sizeof(size));
+    cache->hash = fnv_hash(cache->hash, data, size);
+}
+
+void cache_add_file(Cache *cache, char *path)
+{
+    FILE *f = fopen(path, "r");
+    if (f == NULL) {
+        error_report(E_IO, 0, "Could not open file %s\n", path);
+    }
+    Buffer b;
+    v_init(b);
+    get_content(f, &b);
+    fclose(f);
+    cache_add(cache, b.items, b.size);
+    free(b.items);
+}
+
+char *cache_path(Cache *cache, char *ext)
+{
+    size_t size = strlen(cache->dir) + 32 + strlen(ext);
+    char *path = malloc(size);
+    snprintf(path, size, "%s/%016llx%s", cache->dir,
+            (unsigned long long)cache->hash, ext);
+    return path;
+}
+
+// Creates an empty file with a unique name next to path,
+// readable by the other users sharing the cache
+char *cache_tmp(char *path)
+{
+    size_t size = strlen(path) + 16;
+    char *tmp = malloc(size);
+    snprintf(tmp, size, "%s.XXXXXX", path);
+    int fd = mkstemp(tmp);
+    if (fd < 0) {
+        error_report(E_IO, 0, "Could not create temporary file %s\n", tmp);
+    }
+    fchmod(fd, 0644);
+    fclose(fdopen(fd, "w"));
+    return tmp;
+}
+
+void cache_commit(char *tmp, char *path)
+{
+    if (rename(tmp, path)) {
+        error_report(E_IO, 0, "Could not rename %s to %s\n", tmp, path);
+    }
+}
+
+// The object is only compiled by the builds that want one, it
+// is written before the bitcode: an entry is used when its
+// bitcode exists and, if an object is wanted, its object too
+bool cache_exists(Cache *cache, bool object)
+{
+    char *bc = cache_path(cache, ".bc");
+    char *obj = cache_path(cache, ".o");
+    struct stat st;
+    bool exists = stat(bc, &st) == 0 && (!object || stat(obj, &st) == 0);
+    free(obj);
+    free(bc);
+    return exists;
+}
+
+// Returns the bitcode of the entry, or NULL when it is missing
+LLVMMemoryBufferRef cache_read(Cache *cache)
+{
+    char *bc = cache_path(cache, ".bc");
+    LLVMMemoryBufferRef buffer = NULL;
+    char *error = NULL;
+    if (LLVMCreateMemoryBufferWithContentsOfFile(bc, &buffer, &error)) {
+        LLVMDisposeMessage(error);
+        buffer = NULL;
+    }
+    free(bc);
+    return buffer;
+}
+
+// Returns NULL when the bitcode cannot be read
+LLVMModuleRef cache_load(Cache *cache, LLVMContextRef context)
+{
+    LLVMMemoryBufferRef buffer = cache_read(cache);
+    LLVMModuleRef module = NULL;
+    if (buffer) {
+        if (LLVMParseBitcodeInContext2(context, buffer, &module)) {
+            module = NULL;
+        } else {
+            LLVMSetModuleIdentifier(module, "l_program", strlen("l_program"));
+        }
+        LLVMDisposeMemoryBuffer(buffer);
+    }
+    return module;
+}
+
+// Imported files are only stored as bitcode, they are linked
+// into programs and never compiled to objects on their own
+void cache_store_bitcode(Cache *cache, LLVMMemoryBufferRef bitcode)
+{
+    char *bc = cache_path(cache, ".bc");
+    char *tmp = cache_tmp(bc);
+    write_buffer(bitcode, tmp, NULL);
+    cache_commit(tmp, bc);
+    free(tmp);
+    free(bc);
+}
+
+void cache_store(Cache *cache, LLVMModuleRef module, LLVMMemoryBufferRef bitcode,
+        bool fast, bool object)
+{
+    if (object) {
+        char *obj = cache_path(cache, ".o");
+        char *tmp = cache_tmp(obj);
+        emit_object(module, tmp, fast);
+        cache_commit(tmp, obj);
+        free(tmp);
+        free(obj);
+    }
+
+    cache_store_bitcode(cache, bitcode);
+}
+
+// Copies a file of the entry, the destination is written
+// atomically too since it may be a shared build output,
+// the file is written to out when path is NULL
+void cache_copy(Cache *cache, char *ext, char *path, FILE *out)
+{
+    char *src = cache_path(cache, ext);
+    FILE *in = fopen(src, "rb");
+    if (in == NULL) {
+        error_report(E_IO, 0, "Could not open file %s\n", src);
+    }
+
+    char *tmp = path ? cache_tmp(path) : NULL;
+    if (tmp) {
+        out = fopen(tmp, "wb");
+    }
+    if (out == NULL) {
+        error_report(E_IO, 0, "Could not open file %s\n", tmp);
+    }
+
+    char buffer[4096];
+    size_t n;
+    while ((n = fread(buffer, 1, sizeof(buffer), in)) > 0) {
+        fwrite(buffer, 1, n, out);
+    }
+    fclose(in);
+    if (tmp ? fclose(out) : fflush(out)) {
+        error_report(E_IO, 0, "Could not write file %s\n", tmp ? tmp : "<output>");
+    }
+    if (tmp) {
+        cache_commit(tmp, path);
+    }
+
+    free(tmp);
+    free(src);
+}
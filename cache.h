@@ -0,0 +1,30 @@
+#ifndef CACHE_H
+#define CACHE_H
+
+#include <stdint.h>
+#include <stdio.h>
+
+#include "llvm-c/Core.h"
+
+// Bumped whenever the generated code changes, so that
+// modules compiled by older versions are not reused
+#define CACHE_VERSION "l-codegen-4"
+
+typedef struct {
+    char *dir;
+    uint64_t hash;
+} Cache;
+
+void cache_init(Cache *cache, char *dir);
+void cache_add(Cache *cache, const void *data, size_t size);
+void cache_add_file(Cache *cache, char *path);
+char *cache_path(Cache *cache, char *ext);
+bool cache_exists(Cache *cache, bool object);
+LLVMMemoryBufferRef cache_read(Cache *cache);
+LLVMModuleRef cache_load(Cache *cache, LLVMContextRef context);
+void cache_store_bitcode(Cache *cache, LLVMMemoryBufferRef bitcode);
+void cache_store(Cache *cache, LLVMModuleRef module, LLVMMemoryBufferRef bitcode,
+        bool fast, bool object);
+void cache_copy(Cache *cache, char *ext, char *path, FILE *out);
+
+#endif
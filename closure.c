@@ -0,0 +1,566 @@
+#include <stdio.h>
+#include <string.h>
+
+#include "vector.h"
+#include "error.h"
+#include "lexer.h"
+#include "parser.h"
+#include "closure.h"
+
+// CLOSURE COMPILATION
+// Instead of walking the tree and switching on the type of every
+// node at every visit, the program is converted once into a tree
+// of closures: each node holds a pointer to a C function that is
+// specialized for the shape of the node (e.g. adding a local and a
+// constant) and the operands it needs. Variables are resolved to
+// frame slots at compile time so no name lookup is left at run time.
+//
+// Values are unboxed doubles, booleans are 1 and 0 like in the
+// code generator, strings are not supported.
+
+Closure *make_closure(void)
+{
+    return calloc(1, sizeof(Closure));
+}
+
+// Expressions
+
+double eval_const(Closure *c, Frame *f)
+{
+    return c->n;
+}
+
+double eval_local(Closure *c, Frame *f)
+{
+    return f->slots[c->slot];
+}
+
+double eval_undefined(Closure *c, Frame *f)
+{
+    fprintf(error_stream(), "Undefined variable '");
+    fprint_token(error_stream(), c->token);
+    fprintf(error_stream(), "' at line %zu\n", c->token.line);
+    error_raise(E_RUNTIME, c->token.line);
+}
+
+double eval_neg(Closure *c, Frame *f)
+{
+    return -c->a->eval(c->a, f);
+}
+
+double eval_not(Closure *c, Frame *f)
+{
+    return c->a->eval(c->a, f) == 0;
+}
+
+double eval_and(Closure *c, Frame *f)
+{
+    return c->a->eval(c->a, f) != 0 && c->b->eval(c->b, f) != 0;
+}
+
+double eval_or(Closure *c, Frame *f)
+{
+    return c->a->eval(c->a, f) != 0 || c->b->eval(c->b, f) != 0;
+}
+
+double eval_assign(Closure *c, Frame *f)
+{
+    return f->slots[c->slot] = c->a->eval(c->a, f);
+}
+
+// Every binary operator has a generic version and two versions
+// for the common shapes 'local op constant' and 'local op local'
+#define BINOP(_name, _op) \
+    double eval_##_name(Closure *c, Frame *f) \
+    { \
+        return c->a->eval(c->a, f) _op c->b->eval(c->b, f); \
+    } \
+    double eval_##_name##_lc(Closure *c, Frame *f) \
+    { \
+        return f->slots[c->slot] _op c->n; \
+    } \
+    double eval_##_name##_ll(Closure *c, Frame *f) \
+    { \
+        return f->slots[c->slot] _op f->slots[c->slot2]; \
+    }
+
+BINOP(add, +)
+BINOP(sub, -)
+BINOP(mul, *)
+BINOP(div, /)
+BINOP(lt, <)
+BINOP(gt, >)
+BINOP(eq, ==)
+BINOP(ne, !=)
+
+typedef struct {
+    TokenType op;
+    ExprFn xx;
+    ExprFn lc;
+    ExprFn ll;
+} BinOp;
+
+static const BinOp binops[] = {
+    { T_PLUS, eval_add, eval_add_lc, eval_add_ll },
+    { T_MINUS, eval_sub, eval_sub_lc, eval_sub_ll },
+    { T_STAR, eval_mul, eval_mul_lc, eval_mul_ll },
+    { T_SLASH, eval_div, eval_div_lc, eval_div_ll },
+    { T_LESS, eval_lt, eval_lt_lc, eval_lt_ll },
+    { T_GREATER, eval_gt, eval_gt_lc, eval_gt_ll },
+    { T_2EQUAL, eval_eq, eval_eq_lc, eval_eq_ll },
+    { T_BANG_EQUAL, eval_ne, eval_ne_lc, eval_ne_ll },
+};
+
+static const size_t binops_size = (sizeof(binops) / sizeof(BinOp));
+
+double eval_call(Closure *c, Frame *f)
+{
+    CFunc *func = c->func;
+    double slots[func->nslots + 1];
+    for (size_t i = 0; i < c->size; i++) {
+        slots[i] = c->items[i]->eval(c->items[i], f);
+    }
+
+    Frame frame = {
+        .slots = slots,
+        .ret = 0,
+    };
+    func->body->exec(func->body, &frame);
+    return frame.ret;
+}
+
+// Statements return true when a return statement has been executed
+
+bool exec_expr(Closure *c, Frame *f)
+{
+    c->a->eval(c->a, f);
+    return false;
+}
+
+bool exec_let(Closure *c, Frame *f)
+{
+    f->slots[c->slot] = c->a->eval(c->a, f);
+    return false;
+}
+
+bool exec_if(Closure *c, Frame *f)
+{
+    if (c->a->eval(c->a, f) != 0) {
+        return c->b->exec(c->b, f);
+    } else {
+        return c->c->exec(c->c, f);
+    }
+}
+
+bool exec_while(Closure *c, Frame *f)
+{
+    while (c->a->eval(c->a, f) != 0) {
+        if (c->b->exec(c->b, f)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+bool exec_for(Closure *c, Frame *f)
+{
+    c->a->eval(c->a, f);
+    while (c->b->eval(c->b, f) != 0) {
+        if (c->d->exec(c->d, f)) {
+            return true;
+        }
+        c->c->eval(c->c, f);
+    }
+    return false;
+}
+
+bool exec_block(Closure *c, Frame *f)
+{
+    for (size_t i = 0; i < c->size; i++) {
+        if (c->items[i]->exec(c->items[i], f)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+bool exec_ret(Closure *c, Frame *f)
+{
+    f->ret = c->a->eval(c->a, f);
+    return true;
+}
+
+// Compilation
+
+ScopeNode *scope_lookup(Scope *scope, char *name)
+{
+    for (; scope; scope = scope->upper) {
+        for (ScopeNode *node = scope->names; node; node = node->next) {
+            if (strcmp(node->name, name) == 0) {
+                return node;
+            }
+        }
+    }
+    return NULL;
+}
+
+size_t scope_define(Compiler *comp, Token name)
+{
+    for (ScopeNode *node = comp->scope->names; node; node = node->next) {
+        if (strcmp(node->name, name.data) == 0) {
+            fprintf(error_stream(), "Variable '");
+            fprint_token(error_stream(), name);
+            fprintf(error_stream(), "' is already defined\n");
+            error_raise(E_RUNTIME, 0);
+        }
+    }
+
+    ScopeNode *node = malloc(sizeof(ScopeNode));
+    node->name = name.data;
+    node->slot = comp->nslots++;
+    node->next = comp->scope->names;
+    comp->scope->names = node;
+    return node->slot;
+}
+
+void scope_free(Scope *scope)
+{
+    ScopeNode *node = scope->names;
+    while (node) {
+        ScopeNode *next = node->next;
+        free(node);
+        node = next;
+    }
+}
+
+CFunc *compiler_func(Compiler *comp, Token name)
+{
+    for (size_t i = 0; i < comp->funcs.size; i++) {
+        if (strcmp(comp->funcs.items[i].name.data, name.data) == 0) {
+            return &comp->funcs.items[i];
+        }
+    }
+    return NULL;
+}
+
+Closure *compile_binexpr(Compiler *comp, BinExpr binexpr)
+{
+    Closure *c = make_closure();
+    TokenType op = binexpr.op.type;
+
+    if (op == T_EQUAL) {
+        if (binexpr.lexpr.type != TERMINAL
+                || binexpr.lexpr.as->termexpr.term.type != T_NAME) {
+            fprintf(error_stream(), "Expression ");
+            fprint_expr(error_stream(), binexpr.lexpr);
+            fprintf(error_stream(), " is not an lvalue\n");
+            error_raise(E_RUNTIME, 0);
+        }
+        Token name = binexpr.lexpr.as->termexpr.term;
+        ScopeNode *node = scope_lookup(comp->scope, name.data);
+        if (node == NULL) {
+            c->eval = eval_undefined;
+            c->token = name;
+            return c;
+        }
+        c->eval = eval_assign;
+        c->slot = node->slot;
+        c->a = compile_expr(comp, binexpr.rexpr);
+        return c;
+    }
+
+    c->a = compile_expr(comp, binexpr.lexpr);
+    c->b = compile_expr(comp, binexpr.rexpr);
+    if (op == T_AND || op == T_OR) {
+        c->eval = op == T_AND ? eval_and : eval_or;
+        return c;
+    }
+
+    const BinOp *binop = NULL;
+    for (size_t i = 0; i < binops_size; i++) {
+        if (binops[i].op == op) {
+            binop = &binops[i];
+        }
+    }
+    if (binop == NULL) {
+        fprintf(error_stream(), "Binary operation '");
+        fprint_token(error_stream(), binexpr.op);
+        fprintf(error_stream(), "' is not supported\n");
+        error_raise(E_RUNTIME, 0);
+    }
+
+    Closure *a = c->a;
+    Closure *b = c->b;
+    c->eval = binop->xx;
+    if (a->eval == eval_const && b->eval == eval_const) {
+        // Constant folding, the operands are not read from the frame
+        c->n = c->eval(c, NULL);
+        c->eval = eval_const;
+    } else if (a->eval == eval_local && b->eval == eval_const) {
+        c->eval = binop->lc;
+        c->slot = a->slot;
+        c->n = b->n;
+    } else if (a->eval == eval_local && b->eval == eval_local) {
+        c->eval = binop->ll;
+        c->slot = a->slot;
+        c->slot2 = b->slot;
+    } else {
+        return c;
+    }
+
+    closure_free(a);
+    closure_free(b);
+    c->a = c->b = NULL;
+    return c;
+}
+
+Closure *compile_termexpr(Compiler *comp, TermExpr termexpr)
+{
+    Closure *c = make_closure();
+    Token term = termexpr.term;
+    switch (term.type) {
+    case T_DOUBLE:
+        c->eval = eval_const;
+        c->n = get_ddata(term);
+        break;
+    case T_TRUE:
+    case T_FALSE:
+        c->eval = eval_const;
+        c->n = term.type == T_TRUE;
+        break;
+    case T_NAME: {
+        ScopeNode *node = scope_lookup(comp->scope, term.data);
+        if (node) {
+            c->eval = eval_local;
+            c->slot = node->slot;
+        } else {
+            c->eval = eval_undefined;
+            c->token = term;
+        }
+        break;
+    }
+    default:
+        fprintf(error_stream(), "Could not compile literal '");
+        fprint_token(error_stream(), term);
+        fprintf(error_stream(), "'\n");
+        error_raise(E_RUNTIME, 0);
+    }
+    return c;
+}
+
+Closure *compile_callexpr(Compiler *comp, CallExpr callexpr)
+{
+    CFunc *func = compiler_func(comp, callexpr.name);
+    if (func == NULL) {
+        fprintf(error_stream(), "Undefined function '");
+        fprint_token(error_stream(), callexpr.name);
+        fprintf(error_stream(), "' at line %zu\n", callexpr.name.line);
+        error_raise(E_RUNTIME, callexpr.name.line);
+    }
+    if (func->argc != callexpr.args.size) {
+        fprintf(error_stream(), "Wrong number of arguments to '");
+        fprint_token(error_stream(), callexpr.name);
+        fprintf(error_stream(), "' at line %zu\n", callexpr.name.line);
+        error_raise(E_RUNTIME, callexpr.name.line);
+    }
+
+    Closure *c = make_closure();
+    c->eval = eval_call;
+    c->func = func;
+    c->size = callexpr.args.size;
+    c->items = malloc(c->size * sizeof(Closure *));
+    for (size_t i = 0; i < c->size; i++) {
+        c->items[i] = compile_expr(comp, callexpr.args.items[i]);
+    }
+    return c;
+}
+
+Closure *compile_expr(Compiler *comp, Expr expr)
+{
+    switch (expr.type) {
+    case UNARY: {
+        Closure *c = make_closure();
+        c->a = compile_expr(comp, expr.as->unexpr.expr);
+        c->eval = expr.as->unexpr.op.type == T_BANG
+            ? eval_not
+            : eval_neg;
+        return c;
+    }
+    case BINARY:
+        return compile_binexpr(comp, expr.as->binexpr);
+    case GROUPING:
+        return compile_expr(comp, expr.as->groupexpr.expr);
+    case TERMINAL:
+        return compile_termexpr(comp, expr.as->termexpr);
+    case CALL:
+        return compile_callexpr(comp, expr.as->callexpr);
+    default:
+        fprintf(error_stream(), "Expression '");
+        fprint_expr(error_stream(), expr);
+        fprintf(error_stream(), "' is not supported\n");
+        error_raise(E_RUNTIME, 0);
+    }
+}
+
+// Blocks get a new scope, the slots of their variables
+// are not reused after the end of the block
+Closure *compile_block(Compiler *comp, Block block)
+{
+    Scope scope = {
+        .upper = comp->scope,
+    };
+    comp->scope = &scope;
+
+    Closure *c = make_closure();
+    c->exec = exec_block;
+    c->size = block.size;
+    c->items = malloc(block.size * sizeof(Closure *));
+    for (size_t i = 0; i < block.size; i++) {
+        c->items[i] = compile_stmt(comp, block.items[i]);
+    }
+
+    comp->scope = scope.upper;
+    scope_free(&scope);
+    return c;
+}
+
+Closure *compile_stmt(Compiler *comp, Stmt stmt)
+{
+    Closure *c = make_closure();
+    switch (stmt.type) {
+    case S_LET:
+        // The value is compiled before defining the name,
+        // like in the interpreter
+        c->exec = exec_let;
+        c->a = compile_expr(comp, stmt.as->letstmt.value);
+        c->slot = scope_define(comp, stmt.as->letstmt.name);
+        break;
+    case S_IF:
+        c->exec = exec_if;
+        c->a = compile_expr(comp, stmt.as->ifstmt.cond);
+        c->b = compile_stmt(comp, stmt.as->ifstmt.thenb);
+        c->c = compile_stmt(comp, stmt.as->ifstmt.elseb);
+        break;
+    case S_FOR:
+        c->exec = exec_for;
+        c->a = compile_expr(comp, stmt.as->forstmt.init);
+        c->b = compile_expr(comp, stmt.as->forstmt.cond);
+        c->c = compile_expr(comp, stmt.as->forstmt.step);
+        c->d = compile_stmt(comp, stmt.as->forstmt.thenb);
+        break;
+    case S_WHILE:
+        c->exec = exec_while;
+        c->a = compile_expr(comp, stmt.as->whilestmt.cond);
+        c->b = compile_stmt(comp, stmt.as->whilestmt.thenb);
+        break;
+    case S_BLOCK:
+        free(c);
+        return compile_block(comp, stmt.as->blockstmt.block);
+    case S_EXPR:
+        c->exec = exec_expr;
+        c->a = compile_expr(comp, stmt.as->exprstmt.expr);
+        break;
+    case S_RET:
+        c->exec = exec_ret;
+        c->a = compile_expr(comp, stmt.as->retstmt.expr);
+        break;
+    case S_FUNC:
+        error_report(E_RUNTIME, 0, "Functions can only be defined at the top level\n");
+    }
+    return c;
+}
+
+// All the functions are collected before compiling any body so
+// that calls can be resolved to their CFunc, which must not move
+void compile_program(Compiler *comp, Program *pr, Closure **prog)
+{
+    v_init(comp->funcs);
+    for (size_t i = 0; i < pr->size; i++) {
+        if (pr->items[i].type == S_FUNC) {
+            FuncStmt *funcstmt = &pr->items[i].as->funcstmt;
+            if (compiler_func(comp, funcstmt->name)) {
+                fprintf(error_stream(), "Function '");
+                fprint_token(error_stream(), funcstmt->name);
+                fprintf(error_stream(), "' is already defined\n");
+                error_raise(E_RUNTIME, 0);
+            }
+            CFunc func = {
+                .name = funcstmt->name,
+                .argc = funcstmt->args.size,
+            };
+            v_append(comp->funcs, func);
+        }
+    }
+
+    size_t f = 0;
+    for (size_t i = 0; i < pr->size; i++) {
+        if (pr->items[i].type == S_FUNC) {
+            FuncStmt *funcstmt = &pr->items[i].as->funcstmt;
+            CFunc *func = &comp->funcs.items[f++];
+
+            Scope scope = {0};
+            comp->scope = &scope;
+            comp->nslots = 0;
+            for (size_t j = 0; j < funcstmt->args.size; j++) {
+                scope_define(comp, funcstmt->args.items[j]);
+            }
+            func->body = compile_block(comp, funcstmt->block);
+            func->nslots = comp->nslots;
+            scope_free(&scope);
+        }
+    }
+
+    Scope scope = {0};
+    comp->scope = &scope;
+    comp->nslots = 0;
+    Closure *c = make_closure();
+    c->exec = exec_block;
+    v_init(*c);
+    for (size_t i = 0; i < pr->size; i++) {
+        if (pr->items[i].type != S_FUNC) {
+            Closure *stmt = compile_stmt(comp, pr->items[i]);
+            v_append(*c, stmt);
+        }
+    }
+    scope_free(&scope);
+    comp->scope = NULL;
+    *prog = c;
+}
+
+void closure_free(Closure *c)
+{
+    if (c) {
+        closure_free(c->a);
+        closure_free(c->b);
+        closure_free(c->c);
+        closure_free(c->d);
+        for (size_t i = 0; i < c->size; i++) {
+            closure_free(c->items[i]);
+        }
+        free(c->items);
+        free(c);
+    }
+}
+
+int closure_run(Program *pr)
+{
+    Compiler comp = {0};
+    Closure *prog;
+    compile_program(&comp, pr, &prog);
+
+    double *slots = calloc(comp.nslots + 1, sizeof(double));
+    Frame frame = {
+        .slots = slots,
+    };
+    int status = prog->exec(prog, &frame)
+        ? frame.ret
+        : 0;
+
+    free(slots);
+    closure_free(prog);
+    for (size_t i = 0; i < comp.funcs.size; i++) {
+        closure_free(comp.funcs.items[i].body);
+    }
+    free(comp.funcs.items);
+    return status;
+}
@@ -0,0 +1,80 @@
+#ifndef CLOSURE_H
+#define CLOSURE_H
+
+#include "parser.h"
+
+typedef struct closure Closure;
+typedef struct frame Frame;
+
+typedef double (*ExprFn)(Closure *c, Frame *f);
+typedef bool (*StmtFn)(Closure *c, Frame *f);
+
+typedef struct {
+    Token name;
+    size_t argc;
+    size_t nslots;
+    Closure *body;
+} CFunc;
+
+// A node of the closure tree, the function pointer is chosen
+// at compile time for the shape of the node and the operands
+// it needs are captured in the other fields
+typedef struct closure {
+    union {
+        ExprFn eval;
+        StmtFn exec;
+    };
+    Closure *a;
+    Closure *b;
+    Closure *c;
+    Closure *d;
+    size_t size;
+    size_t capacity;
+    Closure **items;
+    double n;
+    size_t slot;
+    size_t slot2;
+    Token token;
+    CFunc *func;
+} Closure;
+
+// Variables are resolved to slots at compile time, every
+// function call gets a new frame of slots
+typedef struct frame {
+    double *slots;
+    double ret;
+} Frame;
+
+typedef struct scopenode ScopeNode;
+typedef struct scopenode {
+    char *name;
+    size_t slot;
+    ScopeNode *next;
+} ScopeNode;
+
+typedef struct scope Scope;
+typedef struct scope {
+    ScopeNode *names;
+    Scope *upper;
+} Scope;
+
+typedef struct {
+    size_t size;
+    size_t capacity;
+    CFunc *items;
+} CFuncs;
+
+typedef struct {
+    CFuncs funcs;
+    Scope *scope;
+    size_t nslots;
+} Compiler;
+
+Closure *compile_expr(Compiler *comp, Expr expr);
+Closure *compile_stmt(Compiler *comp, Stmt stmt);
+Closure *compile_block(Compiler *comp, Block block);
+void compile_program(Compiler *comp, Program *pr, Closure **prog);
+int closure_run(Program *pr);
+void closure_free(Closure *c);
+
+#endif
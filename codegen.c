@@ -1,12 +1,26 @@
+#include <pthread.h>
 #include <stdio.h>
+#include <stdint.h>
 #include <string.h>
 
 #include "llvm-c/Core.h"
+#include "llvm-c/Analysis.h"
+#include "llvm-c/BitReader.h"
+#include "llvm-c/BitWriter.h"
+#include "llvm-c/DebugInfo.h"
+#include "llvm-c/Linker.h"
+#include "llvm-c/Target.h"
+#include "llvm-c/TargetMachine.h"
+#include "llvm-c/Transforms/PassBuilder.h"
 
 #include "lexer.h"
 #include "parser.h"
+#include "ir.h"
 #include "codegen.h"
+#include "pool.h"
 #include "vector.h"
+#include "error.h"
+#include "stats.h"
 
 void print_module(LLVMModuleRef module)
 {
@@ -16,6 +30,47 @@ void print_module(LLVMModuleRef module)
     free(ir);
 }
 
+// Modules are written as bitcode, which is much faster to write
+// and to parse again than the text printed by print_module, the
+// text is only meant for debugging (codegen -S). The bitcode can
+// also be kept in memory by the consumers in the same process.
+LLVMMemoryBufferRef module_bitcode(LLVMModuleRef module)
+{
+    return LLVMWriteBitcodeToMemoryBuffer(module);
+}
+
+// Writes to out when path is NULL
+void write_buffer(LLVMMemoryBufferRef buffer, char *path, FILE *out)
+{
+    FILE *f = path ? fopen(path, "wb") : out;
+    if (f == NULL) {
+        error_report(E_IO, 0, "Could not open file %s\n", path);
+    }
+    size_t size = LLVMGetBufferSize(buffer);
+    if (fwrite(LLVMGetBufferStart(buffer), 1, size, f) != size
+            || (path ? fclose(f) : fflush(f))) {
+        error_report(E_IO, 0, "Could not write file %s\n", path ? path : "<output>");
+    }
+}
+
+void write_module(LLVMModuleRef module, char *path, bool text, FILE *out)
+{
+    if (text && path == NULL) {
+        char *ir = LLVMPrintModuleToString(module);
+        fprintf(out, "%s\n", ir);
+        LLVMDisposeMessage(ir);
+    } else if (text) {
+        char *error = NULL;
+        if (LLVMPrintModuleToFile(module, path, &error)) {
+            error_report(E_IO, 0, "Could not write file %s: %s\n", path, error);
+        }
+    } else {
+        LLVMMemoryBufferRef buffer = module_bitcode(module);
+        write_buffer(buffer, path, out);
+        LLVMDisposeMemoryBuffer(buffer);
+    }
+}
+
 NvNode *nvnode_insert(NvNode *node, char *name, LLVMValueRef value)
 {
     if (node) {
@@ -27,8 +82,7 @@ NvNode *nvnode_insert(NvNode *node, char *name, LLVMValueRef value)
             node->right = nvnode_insert(node->right, name, value);
             return node;
         } else {
-            printf("Name %s is already defined\n", name);
-            exit(1);
+            error_report(E_CODEGEN, 0, "Name %s is already defined\n", name);
         }
     } else {
         node = malloc(sizeof(NVNode));
@@ -39,9 +93,22 @@ NvNode *nvnode_insert(NvNode *node, char *name, LLVMValueRef value)
     }
 }
 
+// Depth of the node of name, 1 for the root
+size_t nvnode_depth(NvNode *node, char *name)
+{
+    size_t depth = 1;
+    for (int cmp; (cmp = strcmp(name, node->name)) != 0; depth++) {
+        node = cmp < 0 ? node->left : node->right;
+    }
+    return depth;
+}
+
 void nv_insert(NamedValues *nvalues, char *name, LLVMValueRef value)
 {
     nvalues->root = nvnode_insert(nvalues->root, name, value);
+    if (stats.format) {
+        stats_node(&stats.nvnodes, &stats.nvdepth, nvnode_depth(nvalues->root, name));
+    }
 }
 
 NvNode *nvnode_lookup(NvNode *node, char *name)
@@ -56,8 +123,7 @@ NvNode *nvnode_lookup(NvNode *node, char *name)
             return node;
         }
     } else {
-        printf("Name %s is not defined\n", name);
-        exit(1);
+        error_report(E_CODEGEN, 0, "Name %s is not defined\n", name);
     }
 }
 
@@ -66,27 +132,97 @@ LLVMValueRef nv_lookup(NamedValues *nvalues, char *name)
     return nvnode_lookup(nvalues->root, name)->value;
 }
 
+void free_nvnode(NvNode *node)
+{
+    if (node) {
+        free_nvnode(node->left);
+        free_nvnode(node->right);
+        free(node);
+    }
+}
+
 LLVMValueRef gen_unexpr(Codegen *codegen, UnExpr unexpr)
 {
     // printf("UNEXPR\n");
     LLVMValueRef value = gen_expr(codegen, unexpr.expr);
     switch (unexpr.op.type) {
     case T_BANG:
-        return LLVMBuildNot(codegen->builder, value, "negtmp");
+        return LLVMBuildNot(codegen->builder, gen_cond(codegen, value), "negtmp");
     case T_MINUS:
-        return LLVMBuildFNeg(codegen->builder, value, "negtmp");
+        return LLVMBuildFNeg(codegen->builder, gen_double(codegen, value), "negtmp");
     default:
-        printf("Token '");
-        print_token(unexpr.op);
-        printf("' is not a unary operator\n");
-        exit(1);
+        fprintf(error_stream(), "Token '");
+        fprint_token(error_stream(), unexpr.op);
+        fprintf(error_stream(), "' is not a unary operator\n");
+        error_raise(E_CODEGEN, 0);
     }
 }
 
+// Comparisons and logical operators produce i1 values while
+// variables and arithmetic work on doubles, these two helpers
+// convert between the two representations
+LLVMValueRef gen_cond(Codegen *codegen, LLVMValueRef value)
+{
+    if (LLVMTypeOf(value) == LLVMInt1TypeInContext(codegen->context)) {
+        return value;
+    }
+    return LLVMBuildFCmp(codegen->builder, LLVMRealUNE, value,
+        LLVMConstReal(LLVMDoubleTypeInContext(codegen->context), 0), "condtmp");
+}
+
+LLVMValueRef gen_double(Codegen *codegen, LLVMValueRef value)
+{
+    if (LLVMTypeOf(value) == LLVMDoubleTypeInContext(codegen->context)) {
+        return value;
+    }
+    return LLVMBuildUIToFP(codegen->builder, value,
+        LLVMDoubleTypeInContext(codegen->context), "booltmp");
+}
+
+// Short circuit evaluation: the right operand gets its own basic
+// block which is only entered when the left operand does not
+// already decide the result, the two paths are merged with a phi
+LLVMValueRef gen_logicexpr(Codegen *codegen, BinExpr binexpr)
+{
+    LLVMContextRef context = codegen->context;
+    LLVMValueRef lhs = gen_cond(codegen, gen_expr(codegen, binexpr.lexpr));
+    LLVMBasicBlockRef lhsb = LLVMGetInsertBlock(codegen->builder);
+    LLVMValueRef parent = LLVMGetBasicBlockParent(lhsb);
+    LLVMBasicBlockRef rhsb = LLVMAppendBasicBlockInContext(context, parent, "rhs");
+    LLVMBasicBlockRef end = LLVMAppendBasicBlockInContext(context, parent, "logicend");
+
+    bool is_and = binexpr.op.type == T_AND;
+    if (is_and) {
+        LLVMBuildCondBr(codegen->builder, lhs, rhsb, end);
+    } else {
+        LLVMBuildCondBr(codegen->builder, lhs, end, rhsb);
+    }
+
+    LLVMPositionBuilderAtEnd(codegen->builder, rhsb);
+    LLVMValueRef rhs = gen_cond(codegen, gen_expr(codegen, binexpr.rexpr));
+    rhsb = LLVMGetInsertBlock(codegen->builder); // Rhs may add blocks
+    LLVMBuildBr(codegen->builder, end);
+
+    LLVMPositionBuilderAtEnd(codegen->builder, end);
+    LLVMValueRef phi = LLVMBuildPhi(codegen->builder, LLVMInt1TypeInContext(context),
+        "logictmp");
+    LLVMValueRef values[] = {
+        LLVMConstInt(LLVMInt1TypeInContext(context), is_and ? 0 : 1, false),
+        rhs,
+    };
+    LLVMBasicBlockRef blocks[] = { lhsb, rhsb };
+    LLVMAddIncoming(phi, values, blocks, 2);
+    return phi;
+}
+
 LLVMValueRef gen_binexpr(Codegen *codegen, BinExpr binexpr)
 {
-    LLVMValueRef lhs = gen_expr(codegen, binexpr.lexpr);
-    LLVMValueRef rhs = gen_expr(codegen, binexpr.rexpr);
+    if (binexpr.op.type == T_AND || binexpr.op.type == T_OR) {
+        return gen_logicexpr(codegen, binexpr);
+    }
+
+    LLVMValueRef lhs = gen_double(codegen, gen_expr(codegen, binexpr.lexpr));
+    LLVMValueRef rhs = gen_double(codegen, gen_expr(codegen, binexpr.rexpr));
     switch (binexpr.op.type) {
     case T_PLUS:
         return LLVMBuildFAdd(codegen->builder, lhs, rhs, "addtmp");
@@ -97,33 +233,39 @@ LLVMValueRef gen_binexpr(Codegen *codegen, BinExpr binexpr)
     case T_SLASH:
         return LLVMBuildFDiv(codegen->builder, lhs, rhs, "divtmp");
     case T_LESS: {
-        LLVMValueRef cmp = LLVMBuildFCmp(codegen->builder, LLVMRealULT, lhs, rhs, "lttmp");
-        return LLVMBuildFPCast(codegen->builder, cmp, LLVMInt1Type(), "lesstmp");
+        LLVMValueRef cmp = LLVMBuildFCmp(codegen->builder, LLVMRealOLT, lhs, rhs, "lttmp");
+        return LLVMBuildFPCast(codegen->builder, cmp,
+            LLVMInt1TypeInContext(codegen->context), "lesstmp");
     }
     case T_GREATER: {
-        LLVMValueRef cmp = LLVMBuildFCmp(codegen->builder, LLVMRealUGT, lhs, rhs, "lttmp");
-        return LLVMBuildFPCast(codegen->builder, cmp, LLVMInt1Type(), "lesstmp");
+        LLVMValueRef cmp = LLVMBuildFCmp(codegen->builder, LLVMRealOGT, lhs, rhs, "lttmp");
+        return LLVMBuildFPCast(codegen->builder, cmp,
+            LLVMInt1TypeInContext(codegen->context), "lesstmp");
     }
+    case T_2EQUAL:
+        return LLVMBuildFCmp(codegen->builder, LLVMRealOEQ, lhs, rhs, "eqtmp");
+    case T_BANG_EQUAL:
+        return LLVMBuildFCmp(codegen->builder, LLVMRealUNE, lhs, rhs, "netmp");
     case T_EQUAL: {
         if (binexpr.lexpr.type != TERMINAL) {
-            printf("Expression ");
-            print_expr(binexpr.lexpr);
-            printf(" is not an lvalue\n");
-            exit(1);
+            fprintf(error_stream(), "Expression ");
+            fprint_expr(error_stream(), binexpr.lexpr);
+            fprintf(error_stream(), " is not an lvalue\n");
+            error_raise(E_CODEGEN, 0);
         }
 
         // Since mutable variables are stored in the stack we
         // need the store instruction to perform the assignment
         Token name = binexpr.lexpr.as->termexpr.term;
         LLVMValueRef lvalue = nv_lookup(codegen->nvalues, name.data);
-        LLVMValueRef rvalue = gen_expr(codegen, binexpr.rexpr);
-        return LLVMBuildStore(codegen->builder, rvalue, lvalue);
+        LLVMBuildStore(codegen->builder, rhs, lvalue);
+        return rhs;
     }
     default:
-        printf("Token '");
-        print_token(binexpr.op);
-        printf("' is not a binary operator\n");
-        exit(1);
+        fprintf(error_stream(), "Token '");
+        fprint_token(error_stream(), binexpr.op);
+        fprintf(error_stream(), "' is not a binary operator\n");
+        error_raise(E_CODEGEN, 0);
     }
 }
 
@@ -132,27 +274,53 @@ LLVMValueRef gen_termexpr(Codegen *codegen, TermExpr termexpr)
     switch (termexpr.term.type) {
     case T_DOUBLE: {
         double value = get_ddata(termexpr.term);
-        return LLVMConstReal(LLVMDoubleType(), value);
+        return LLVMConstReal(LLVMDoubleTypeInContext(codegen->context), value);
     }
     case T_TRUE: {
-        return LLVMConstInt(LLVMIntType(1), 1, false);
+        return LLVMConstInt(LLVMInt1TypeInContext(codegen->context), 1, false);
     }
     case T_FALSE: {
-        return LLVMConstInt(LLVMIntType(1), 0, false);
+        return LLVMConstInt(LLVMInt1TypeInContext(codegen->context), 0, false);
     }
     case T_NAME: {
         // Mutable variables are stored as pointers to the stack
         // (alloca instruction) so we need to load them with the load
         // instruction
         LLVMValueRef ptr = nv_lookup(codegen->nvalues, termexpr.term.data);
-        return LLVMBuildLoad2(codegen->builder, LLVMGetAllocatedType(ptr), ptr, termexpr.term.data);
+        return LLVMBuildLoad2(codegen->builder, LLVMDoubleTypeInContext(codegen->context),
+            ptr, termexpr.term.data);
     }
     default:
-        printf("Could not evaluate '");
-        print_token(termexpr.term);
-        printf("'\n");
-        exit(1);
+        fprintf(error_stream(), "Could not evaluate '");
+        fprint_token(error_stream(), termexpr.term);
+        fprintf(error_stream(), "'\n");
+        error_raise(E_CODEGEN, 0);
+    }
+}
+
+LLVMValueRef gen_callexpr(Codegen *codegen, CallExpr callexpr)
+{
+    Token name = callexpr.name;
+    LLVMValueRef func = LLVMGetNamedFunction(codegen->module, name.data);
+    if (func == NULL) {
+        error_report(E_CODEGEN, name.line, "Undefined function '%s' at line %zu\n",
+                (char *)name.data, name.line);
+    }
+
+    LLVMTypeRef func_type = LLVMGlobalGetValueType(func);
+    if (LLVMCountParamTypes(func_type) != callexpr.args.size) {
+        error_report(E_CODEGEN, name.line, "Wrong number of arguments to '%s' at line %zu\n",
+                (char *)name.data, name.line);
+    }
+
+    LLVMValueRef *args = malloc(callexpr.args.size * sizeof(LLVMValueRef));
+    for (size_t i = 0; i < callexpr.args.size; i++) {
+        args[i] = gen_double(codegen, gen_expr(codegen, callexpr.args.items[i]));
     }
+    LLVMValueRef call = LLVMBuildCall2(codegen->builder, func_type, func,
+        args, callexpr.args.size, "calltmp");
+    free(args);
+    return call;
 }
 
 LLVMValueRef gen_expr(Codegen *codegen, Expr expr)
@@ -166,20 +334,77 @@ LLVMValueRef gen_expr(Codegen *codegen, Expr expr)
         return gen_expr(codegen, expr.as->groupexpr.expr);
     case TERMINAL:
         return gen_termexpr(codegen, expr.as->termexpr);
+    case CALL:
+        return gen_callexpr(codegen, expr.as->callexpr);
     default:
-        printf("Expression '");
-        print_expr(expr);
-        printf("' is not supported\n");
-        exit(1);
+        fprintf(error_stream(), "Expression '");
+        fprint_expr(error_stream(), expr);
+        fprintf(error_stream(), "' is not supported\n");
+        error_raise(E_CODEGEN, 0);
     }
 }
 
 void gen_retstmt(Codegen *codegen, RetStmt retstmt)
 {
-    LLVMValueRef value = gen_expr(codegen, retstmt.expr);
-    LLVMValueRef ret_value = LLVMBuildCast(codegen->builder, LLVMFPToUI, value,
-        LLVMInt32Type(), "rettmp");
-    LLVMBuildRet(codegen->builder, ret_value);
+    LLVMContextRef context = codegen->context;
+    LLVMValueRef value = gen_double(codegen, gen_expr(codegen, retstmt.expr));
+    LLVMBasicBlockRef bb = LLVMGetInsertBlock(codegen->builder);
+    LLVMValueRef parent = LLVMGetBasicBlockParent(bb);
+
+    // Functions return doubles while main returns the exit code
+    LLVMTypeRef ret_type = LLVMGetReturnType(LLVMGlobalGetValueType(parent));
+    if (ret_type == LLVMDoubleTypeInContext(context)) {
+        LLVMBuildRet(codegen->builder, value);
+    } else {
+        if (codegen->returned) {
+            LLVMBuildStore(codegen->builder,
+                LLVMConstInt(LLVMInt1TypeInContext(context), 1, false), codegen->returned);
+        }
+        LLVMValueRef ret_value = LLVMBuildCast(codegen->builder, LLVMFPToUI, value,
+            LLVMInt32TypeInContext(context), "rettmp");
+        LLVMBuildRet(codegen->builder, ret_value);
+    }
+
+    // A basic block cannot continue after its terminator, the
+    // statements following the return go in an unreachable block
+    LLVMBasicBlockRef dead = LLVMAppendBasicBlockInContext(context, parent, "afterret");
+    LLVMPositionBuilderAtEnd(codegen->builder, dead);
+}
+
+// The variables of main are globals when it is split in chunks
+LLVMValueRef gen_global(Codegen *codegen, char *name)
+{
+    LLVMTypeRef type = LLVMDoubleTypeInContext(codegen->context);
+    LLVMValueRef global = LLVMAddGlobal(codegen->module, type, name);
+    LLVMSetLinkage(global, LLVMInternalLinkage);
+    LLVMSetInitializer(global, LLVMConstReal(type, 0));
+    return global;
+}
+
+// Allocas are always placed at the beginning of the entry block,
+// even for variables declared inside loops, since mem2reg only
+// promotes entry block allocas
+LLVMValueRef gen_alloca(Codegen *codegen, char *name)
+{
+    if (codegen->returned) {
+        return gen_global(codegen, name);
+    }
+
+    LLVMBasicBlockRef bb = LLVMGetInsertBlock(codegen->builder);
+    LLVMValueRef parent = LLVMGetBasicBlockParent(bb);
+    LLVMBasicBlockRef entry = LLVMGetEntryBasicBlock(parent);
+
+    LLVMBuilderRef builder = LLVMCreateBuilderInContext(codegen->context);
+    LLVMValueRef first = LLVMGetFirstInstruction(entry);
+    if (first) {
+        LLVMPositionBuilderBefore(builder, first);
+    } else {
+        LLVMPositionBuilderAtEnd(builder, entry);
+    }
+    LLVMValueRef ptr = LLVMBuildAlloca(builder,
+        LLVMDoubleTypeInContext(codegen->context), name);
+    LLVMDisposeBuilder(builder);
+    return ptr;
 }
 
 // STACK ALLOCATION
@@ -203,86 +428,421 @@ void gen_retstmt(Codegen *codegen, RetStmt retstmt)
 // cat prova.ll | llvm-as | opt -passes=mem2reg | llvm-dis
 void gen_letstmt(Codegen *codegen, LetStmt letstmt)
 {
-    LLVMValueRef ptr = LLVMBuildAlloca(codegen->builder, LLVMDoubleType(), letstmt.name.data);
-    LLVMBuildStore(codegen->builder, gen_expr(codegen, letstmt.value), ptr);
+    LLVMValueRef ptr = gen_alloca(codegen, letstmt.name.data);
+    LLVMValueRef value = gen_double(codegen, gen_expr(codegen, letstmt.value));
+    LLVMBuildStore(codegen->builder, value, ptr);
     nv_insert(codegen->nvalues, letstmt.name.data, ptr);
 }
 
 void gen_ifstmt(Codegen *codegen, IfStmt ifstmt)
 {
+    LLVMContextRef context = codegen->context;
     // Cond
-    LLVMValueRef cond = gen_expr(codegen, ifstmt.cond);
-    LLVMValueRef intcond = LLVMBuildFPToUI(codegen->builder, cond,
-        LLVMInt1Type(), "intcond");
+    LLVMValueRef intcond = gen_cond(codegen, gen_expr(codegen, ifstmt.cond));
     LLVMBasicBlockRef bb = LLVMGetInsertBlock(codegen->builder);
     LLVMValueRef parent = LLVMGetBasicBlockParent(bb);
+    LLVMBasicBlockRef thenb = LLVMAppendBasicBlockInContext(context, parent, "then");
+    LLVMBasicBlockRef elseb = LLVMAppendBasicBlockInContext(context, parent, "else");
+    LLVMBasicBlockRef end = LLVMAppendBasicBlockInContext(context, parent, "end");
+    LLVMValueRef br = LLVMBuildCondBr(codegen->builder, intcond, thenb, elseb);
+    gen_weights(br, ifstmt.prof);
 
-    // Then
-    LLVMBasicBlockRef thenb = LLVMAppendBasicBlock(parent, "then");
+    // Then, the branch to the end is added to the block where the
+    // statement ended since nested statements may append new blocks
     LLVMPositionBuilderAtEnd(codegen->builder, thenb);
     gen_stmt(codegen, ifstmt.thenb);
+    LLVMBuildBr(codegen->builder, end);
 
     // Else
-    LLVMBasicBlockRef elseb = LLVMAppendBasicBlock(parent, "else");
     LLVMPositionBuilderAtEnd(codegen->builder, elseb);
     gen_stmt(codegen, ifstmt.elseb);
-
-    // End
-    LLVMBasicBlockRef end = LLVMAppendBasicBlock(parent, "end");
-    LLVMPositionBuilderAtEnd(codegen->builder, thenb);
-    LLVMBuildBr(codegen->builder, end);
-    LLVMPositionBuilderAtEnd(codegen->builder, elseb);
     LLVMBuildBr(codegen->builder, end);
 
-    LLVMPositionBuilderAtEnd(codegen->builder, bb);
-    LLVMValueRef br = LLVMBuildCondBr(codegen->builder, intcond, thenb, elseb);
+    // End
     LLVMPositionBuilderAtEnd(codegen->builder, end);
 }
 
-void gen_forstmt(Codegen *codegen, ForStmt forstmt)
+// Builds a single loop property, value can be NULL
+// for properties that are just a name
+LLVMMetadataRef gen_mdhint(LLVMContextRef context, char *name, LLVMValueRef value)
+{
+    LLVMMetadataRef ops[2];
+    ops[0] = LLVMMDStringInContext2(context, name, strlen(name));
+    if (value) {
+        ops[1] = LLVMValueAsMetadata(value);
+    }
+    return LLVMMDNodeInContext2(context, ops, value ? 2 : 1);
+}
+
+// Builds the self referencing 'llvm.loop' node read by the
+// LoopVectorize and LoopUnroll passes. Since all the values are
+// doubles, loops are mostly floating point reductions that
+// LoopVectorize only reorders when explicitly requested with
+// the 'vectorize' hint:
+// !0 = !{!0, !1, ...}
+// !1 = !{!"llvm.loop.unroll.count", i32 8}
+// Loops are not marked mustprogress, 'while 1 { ... }' without
+// a return is a valid program that never ends and LLVM would
+// treat it as undefined behavior and delete it.
+LLVMMetadataRef gen_loopmd(LLVMContextRef context, LoopHints hints)
+{
+    LLVMMetadataRef ops[5];
+    size_t size = 0;
+
+    LLVMMetadataRef tmp = LLVMTemporaryMDNode(context, NULL, 0);
+    ops[size++] = tmp;
+
+    switch (hints.vectorize) {
+    case H_DEFAULT:
+        break;
+    case H_ENABLE:
+        ops[size++] = gen_mdhint(context, "llvm.loop.vectorize.enable",
+            LLVMConstInt(LLVMInt1TypeInContext(context), 1, false));
+        if (hints.width) {
+            ops[size++] = gen_mdhint(context, "llvm.loop.vectorize.width",
+                LLVMConstInt(LLVMInt32TypeInContext(context), hints.width, false));
+        }
+        break;
+    case H_DISABLE:
+        ops[size++] = gen_mdhint(context, "llvm.loop.vectorize.width",
+            LLVMConstInt(LLVMInt32TypeInContext(context), 1, false));
+        break;
+    }
+
+    switch (hints.unroll) {
+    case H_DEFAULT:
+        break;
+    case H_ENABLE:
+        ops[size++] = hints.count
+            ? gen_mdhint(context, "llvm.loop.unroll.count",
+                LLVMConstInt(LLVMInt32TypeInContext(context), hints.count, false))
+            : gen_mdhint(context, "llvm.loop.unroll.enable", NULL);
+        break;
+    case H_DISABLE:
+        ops[size++] = gen_mdhint(context, "llvm.loop.unroll.disable", NULL);
+        break;
+    }
+
+    LLVMMetadataRef loopmd = LLVMMDNodeInContext2(context, ops, size);
+    LLVMMetadataReplaceAllUsesWith(tmp, loopmd);
+    return loopmd;
+}
+
+// PROFILE GUIDED OPTIMIZATION
+// The counters collected by the interpreter become the weights of
+// the two targets of a conditional branch:
+// br i1 %cond, label %then, label %else, !prof !0
+// !0 = !{!"branch_weights", i32 taken, i32 skipped}
+// On the exit branch of a loop they also give LLVM the estimated
+// trip count used by the unroller, there is no separate metadata
+// for it. Weights are 32 bits so large counts are scaled down.
+void gen_weights(LLVMValueRef br, BranchProfile prof)
 {
-    // Init
-    LLVMValueRef init = gen_expr(codegen, forstmt.init);
+    if (prof.taken == 0 && prof.skipped == 0) {
+        return;
+    }
+    while (prof.taken > UINT32_MAX || prof.skipped > UINT32_MAX) {
+        prof.taken /= 2;
+        prof.skipped /= 2;
+    }
+
+    LLVMContextRef context = LLVMGetTypeContext(LLVMTypeOf(br));
+    LLVMTypeRef i32 = LLVMInt32TypeInContext(context);
+    LLVMMetadataRef ops[] = {
+        LLVMMDStringInContext2(context, "branch_weights", strlen("branch_weights")),
+        LLVMValueAsMetadata(LLVMConstInt(i32, prof.taken, false)),
+        LLVMValueAsMetadata(LLVMConstInt(i32, prof.skipped, false)),
+    };
+    unsigned kind = LLVMGetMDKindIDInContext(context, "prof", strlen("prof"));
+    LLVMSetMetadata(br, kind, LLVMMetadataAsValue(context,
+        LLVMMDNodeInContext2(context, ops, 3)));
+}
+
+// EXECUTION BUDGETS
+// Code compiled with a budget burns one unit of fuel on every
+// back edge and at the entry of every function, the refuel
+// function is called when it runs out:
+//
+//   %f = load i64, i64* %fuel
+//   %n = sub i64 %f, 1
+//   store i64 %n, i64* %fuel
+//   %empty = icmp sle i64 %n, 0
+//   br i1 %empty, label %refuel, label %burnt
+//   refuel:
+//     call void %refuel(i64* %fuel)
+//
+// The JIT points fuel at the budget of the run and refuel at
+// budget_refuel, which aborts the run or gives more fuel. A
+// program compiled with --max-steps gets them from gen_budget.
+
+// void refuel(i64 *fuel)
+LLVMTypeRef refuel_type(LLVMContextRef context)
+{
+    LLVMTypeRef ptr = LLVMPointerType(LLVMInt64TypeInContext(context), 0);
+    return LLVMFunctionType(LLVMVoidTypeInContext(context), &ptr, 1, false);
+}
+
+void gen_burn(Codegen *codegen)
+{
+    if (codegen->fuel == NULL) {
+        return;
+    }
+    LLVMContextRef context = codegen->context;
+    LLVMBuilderRef builder = codegen->builder;
+    LLVMTypeRef i64 = LLVMInt64TypeInContext(context);
+    LLVMValueRef parent = LLVMGetBasicBlockParent(LLVMGetInsertBlock(builder));
+    LLVMBasicBlockRef refuel = LLVMAppendBasicBlockInContext(context, parent, "refuel");
+    LLVMBasicBlockRef burnt = LLVMAppendBasicBlockInContext(context, parent, "burnt");
+
+    LLVMValueRef fuel = LLVMBuildLoad2(builder, i64, codegen->fuel, "fuel");
+    fuel = LLVMBuildSub(builder, fuel, LLVMConstInt(i64, 1, false), "fuel");
+    LLVMBuildStore(builder, fuel, codegen->fuel);
+    LLVMValueRef empty = LLVMBuildICmp(builder, LLVMIntSLE, fuel,
+        LLVMConstInt(i64, 0, false), "empty");
+    LLVMValueRef br = LLVMBuildCondBr(builder, empty, refuel, burnt);
+    gen_weights(br, (BranchProfile) {.taken = 1, .skipped = 1 << 20});
+
+    LLVMPositionBuilderAtEnd(builder, refuel);
+    LLVMBuildCall2(builder, refuel_type(context), codegen->refuel,
+        &codegen->fuel, 1, "");
+    LLVMBuildBr(builder, burnt);
+    LLVMPositionBuilderAtEnd(builder, burnt);
+}
+
+// Declares the fuel and the refuel function of the program
+// in the module of a unit
+void gen_fuel(Codegen *codegen)
+{
+    LLVMModuleRef module = codegen->module;
+    codegen->fuel = LLVMGetNamedGlobal(module, "l.fuel");
+    if (codegen->fuel == NULL) {
+        codegen->fuel = LLVMAddGlobal(module,
+            LLVMInt64TypeInContext(codegen->context), "l.fuel");
+    }
+    codegen->refuel = LLVMGetNamedFunction(module, "l.refuel");
+    if (codegen->refuel == NULL) {
+        codegen->refuel = LLVMAddFunction(module, "l.refuel",
+            refuel_type(codegen->context));
+    }
+}
+
+// The functions of the program share the namespace of the C
+// library, one of them cannot take the name of a function used
+LLVMValueRef gen_libc(LLVMModuleRef module, char *name, LLVMTypeRef type)
+{
+    LLVMValueRef func = LLVMGetNamedFunction(module, name);
+    if (func == NULL) {
+        return LLVMAddFunction(module, name, type);
+    }
+    if (LLVMGlobalGetValueType(func) != type) {
+        error_report(E_CODEGEN, 0, "The function '%s' is reserved with a budget\n", name);
+    }
+    return func;
+}
+
+// Defines the fuel of a program, which has no clock: the refuel
+// function prints a message and exits like timeout(1) the first
+// time it is called
+void gen_budget(LLVMModuleRef module, size_t steps)
+{
+    LLVMContextRef context = LLVMGetModuleContext(module);
+    LLVMBuilderRef builder = LLVMCreateBuilderInContext(context);
+    Codegen codegen = {
+        .context = context,
+        .builder = builder,
+        .module = module,
+    };
+    gen_fuel(&codegen);
+    LLVMTypeRef i32 = LLVMInt32TypeInContext(context);
+    LLVMTypeRef i64 = LLVMInt64TypeInContext(context);
+    LLVMSetInitializer(codegen.fuel, LLVMConstInt(i64, steps + 1, false));
+
+    // i64 write(i32, i8*, i64) and void exit(i32)
+    LLVMTypeRef write_params[] = {
+        i32, LLVMPointerType(LLVMInt8TypeInContext(context), 0), i64,
+    };
+    LLVMTypeRef write_type = LLVMFunctionType(i64, write_params, 3, false);
+    LLVMValueRef write = gen_libc(module, "write", write_type);
+    LLVMTypeRef exit_type = LLVMFunctionType(LLVMVoidTypeInContext(context), &i32, 1, false);
+    LLVMValueRef exit = gen_libc(module, "exit", exit_type);
+
+    char message[64];
+    int size = snprintf(message, sizeof(message), "Step budget of %zu exceeded\n", steps);
+    LLVMPositionBuilderAtEnd(builder,
+        LLVMAppendBasicBlockInContext(context, codegen.refuel, "entry"));
+    LLVMValueRef args[] = {
+        LLVMConstInt(i32, 2, false),
+        LLVMBuildGlobalStringPtr(builder, message, "budget"),
+        LLVMConstInt(i64, size, false),
+    };
+    LLVMBuildCall2(builder, write_type, write, args, 3, "");
+    LLVMValueRef status = LLVMConstInt(i32, BUDGET_STATUS, false);
+    LLVMBuildCall2(builder, exit_type, exit, &status, 1, "");
+    LLVMBuildUnreachable(builder);
+    LLVMDisposeBuilder(builder);
+}
+
+// DEBUG INFO
+// With -g every unit gets a compile unit for its source file and
+// every function a subprogram, the instructions generated for a
+// statement carry its line so that perf annotate, gdb and
+// addr2line map the machine code back to the .l source:
+//
+//   %addtmp = fadd double %a, %b, !dbg !12
+//   !12 = !DILocation(line: 3, scope: !8)
+//
+// Only the lines are described, not the variables. Without -g
+// the builder is NULL and these functions do nothing.
+void gen_debuginfo(Codegen *codegen, char *path, bool optimized)
+{
+    LLVMContextRef context = codegen->context;
+    LLVMModuleRef module = codegen->module;
+    LLVMTypeRef i32 = LLVMInt32TypeInContext(context);
+    LLVMAddModuleFlag(module, LLVMModuleFlagBehaviorWarning, "Debug Info Version",
+        strlen("Debug Info Version"),
+        LLVMValueAsMetadata(LLVMConstInt(i32, LLVMDebugMetadataVersion(), false)));
+    LLVMAddModuleFlag(module, LLVMModuleFlagBehaviorWarning, "Dwarf Version",
+        strlen("Dwarf Version"), LLVMValueAsMetadata(LLVMConstInt(i32, 4, false)));
+
+    char *slash = strrchr(path, '/');
+    char *name = slash ? slash + 1 : path;
+    char *dir = slash ? path : ".";
+    size_t dirlen = slash ? (size_t)(slash - path) : 1;
+    codegen->dib = LLVMCreateDIBuilder(module);
+    codegen->file = LLVMDIBuilderCreateFile(codegen->dib, name, strlen(name), dir, dirlen);
+    LLVMDIBuilderCreateCompileUnit(codegen->dib, LLVMDWARFSourceLanguageC, codegen->file,
+        "codegen", strlen("codegen"), optimized, "", 0, 0, "", 0,
+        LLVMDWARFEmissionFull, 0, false, false, "", 0, "", 0);
+}
+
+LLVMMetadataRef gen_ditype(Codegen *codegen, LLVMTypeRef type)
+{
+    if (LLVMGetTypeKind(type) == LLVMDoubleTypeKind) {
+        // DW_ATE_float
+        return LLVMDIBuilderCreateBasicType(codegen->dib, "double", strlen("double"),
+            64, 0x04, LLVMDIFlagZero);
+    }
+    // DW_ATE_signed
+    return LLVMDIBuilderCreateBasicType(codegen->dib, "int", strlen("int"),
+        32, 0x05, LLVMDIFlagZero);
+}
+
+// Attaches a subprogram starting at line to the function and
+// moves the location of the builder into it
+void gen_subprogram(Codegen *codegen, LLVMValueRef func, size_t line)
+{
+    if (codegen->dib == NULL) {
+        return;
+    }
+    LLVMTypeRef proto = LLVMGlobalGetValueType(func);
+    unsigned argc = LLVMCountParamTypes(proto);
+    LLVMTypeRef *params = malloc((argc + 1) * sizeof(LLVMTypeRef));
+    LLVMGetParamTypes(proto, params);
+    LLVMMetadataRef *types = malloc((argc + 1) * sizeof(LLVMMetadataRef));
+    types[0] = gen_ditype(codegen, LLVMGetReturnType(proto));
+    for (unsigned i = 0; i < argc; i++) {
+        types[i + 1] = gen_ditype(codegen, params[i]);
+    }
+    LLVMMetadataRef type = LLVMDIBuilderCreateSubroutineType(codegen->dib, codegen->file,
+        types, argc + 1, LLVMDIFlagZero);
+    free(types);
+    free(params);
+
+    size_t len;
+    const char *name = LLVMGetValueName2(func, &len);
+    codegen->scope = LLVMDIBuilderCreateFunction(codegen->dib, codegen->file, name, len,
+        name, len, codegen->file, line, type, false, true, line,
+        LLVMDIFlagPrototyped, false);
+    LLVMSetSubprogram(func, codegen->scope);
+    gen_location(codegen, line);
+}
+
+// Statements built by the parser have no line, they keep the
+// location of the statement they are in
+void gen_location(Codegen *codegen, size_t line)
+{
+    if (codegen->dib == NULL || line == 0) {
+        return;
+    }
+    LLVMSetCurrentDebugLocation2(codegen->builder,
+        LLVMDIBuilderCreateDebugLocation(codegen->context, line, 0, codegen->scope, NULL));
+}
+
+void gen_debugfinish(Codegen *codegen)
+{
+    if (codegen->dib == NULL) {
+        return;
+    }
+    LLVMDIBuilderFinalize(codegen->dib);
+    LLVMDisposeDIBuilder(codegen->dib);
+    codegen->dib = NULL;
+}
+
+// LOOP LOWERING
+// Loops are lowered in the canonical shape expected by the
+// LLVM loop passes, the condition is generated only once in
+// the header and the latch is the single back edge, which
+// carries the loop metadata:
+//
+//   preheader:  init; br header
+//   header:     cond; br cond, body, exit
+//   body:       stmt; br latch
+//   latch:      step; burn; br header, !llvm.loop
+//   exit:
+void gen_loop(Codegen *codegen, Expr *cond, Expr *step, Stmt thenb,
+        LoopHints hints, BranchProfile prof)
+{
+    LLVMContextRef context = codegen->context;
     LLVMBasicBlockRef bb = LLVMGetInsertBlock(codegen->builder);
     LLVMValueRef parent = LLVMGetBasicBlockParent(bb);
-    LLVMBasicBlockRef loop = LLVMAppendBasicBlock(parent, "loop");
-    LLVMBasicBlockRef end = LLVMAppendBasicBlock(parent, "end");
-    LLVMValueRef cond1 = gen_expr(codegen, forstmt.cond);
-    LLVMValueRef intcond1 = LLVMBuildFPToUI(codegen->builder, cond1,
-        LLVMInt1Type(), "intcond1");
-    LLVMBuildCondBr(codegen->builder, intcond1, loop, end);
-    LLVMPositionBuilderAtEnd(codegen->builder, loop);
-
-    // Loop
-    gen_stmt(codegen, forstmt.thenb);
-    gen_expr(codegen, forstmt.step);
-    LLVMValueRef cond2 = gen_expr(codegen, forstmt.cond);
-    LLVMValueRef intcond2 = LLVMBuildFPToUI(codegen->builder, cond2,
-        LLVMInt1Type(), "intcond2");
-    LLVMBuildCondBr(codegen->builder, intcond2, loop, end);
-    LLVMPositionBuilderAtEnd(codegen->builder, end);
+    LLVMBasicBlockRef header = LLVMAppendBasicBlockInContext(context, parent, "header");
+    LLVMBasicBlockRef body = LLVMAppendBasicBlockInContext(context, parent, "body");
+    LLVMBasicBlockRef latch = LLVMAppendBasicBlockInContext(context, parent, "latch");
+    LLVMBasicBlockRef exit = LLVMAppendBasicBlockInContext(context, parent, "exit");
+    LLVMMetadataRef loc = LLVMGetCurrentDebugLocation2(codegen->builder);
+    LLVMBuildBr(codegen->builder, header);
+
+    // Header
+    LLVMPositionBuilderAtEnd(codegen->builder, header);
+    LLVMValueRef intcond = gen_cond(codegen, gen_expr(codegen, *cond));
+    LLVMValueRef condbr = LLVMBuildCondBr(codegen->builder, intcond, body, exit);
+    gen_weights(condbr, prof);
+
+    // Body
+    LLVMPositionBuilderAtEnd(codegen->builder, body);
+    gen_stmt(codegen, thenb);
+    LLVMBuildBr(codegen->builder, latch);
+
+    // Latch, the step belongs to the line of the loop
+    LLVMPositionBuilderAtEnd(codegen->builder, latch);
+    if (loc) {
+        LLVMSetCurrentDebugLocation2(codegen->builder, loc);
+    }
+    if (step) {
+        gen_expr(codegen, *step);
+    }
+    gen_burn(codegen);
+    LLVMValueRef br = LLVMBuildBr(codegen->builder, header);
+    unsigned kind = LLVMGetMDKindIDInContext(context, "llvm.loop",
+        strlen("llvm.loop"));
+    LLVMSetMetadata(br, kind, LLVMMetadataAsValue(context,
+        gen_loopmd(context, hints)));
+
+    // Exit
+    LLVMPositionBuilderAtEnd(codegen->builder, exit);
+}
+
+void gen_forstmt(Codegen *codegen, ForStmt forstmt)
+{
+    gen_expr(codegen, forstmt.init);
+    gen_loop(codegen, &forstmt.cond, &forstmt.step, forstmt.thenb,
+        forstmt.hints, forstmt.prof);
 }
 
 void gen_whilestmt(Codegen *codegen, WhileStmt whilestmt)
 {
-    // Init
-    LLVMBasicBlockRef bb = LLVMGetInsertBlock(codegen->builder);
-    LLVMValueRef parent = LLVMGetBasicBlockParent(bb);
-    LLVMValueRef cond1 = gen_expr(codegen, whilestmt.cond);
-    LLVMValueRef intcond1 = LLVMBuildFPToUI(codegen->builder, cond1,
-        LLVMInt1Type(), "intcond1");
-    LLVMBasicBlockRef loop = LLVMAppendBasicBlock(parent, "loop");
-    LLVMBasicBlockRef end = LLVMAppendBasicBlock(parent, "end");
-    LLVMBuildCondBr(codegen->builder, intcond1, loop, end);
-    LLVMPositionBuilderAtEnd(codegen->builder, loop);
-
-    // Loop
-    gen_stmt(codegen, whilestmt.thenb);
-    LLVMValueRef cond2 = gen_expr(codegen, whilestmt.cond);
-    LLVMValueRef intcond2 = LLVMBuildFPToUI(codegen->builder, cond2,
-        LLVMInt1Type(), "intcond2");
-    LLVMBuildCondBr(codegen->builder, intcond2, loop, end);
-    LLVMPositionBuilderAtEnd(codegen->builder, end);
+    gen_loop(codegen, &whilestmt.cond, NULL, whilestmt.thenb,
+        whilestmt.hints, whilestmt.prof);
 }
 
 void gen_blockstmt(Codegen *codegen, BlockStmt blockstmt)
@@ -300,6 +860,9 @@ void gen_exprstmt(Codegen *codegen, ExprStmt exprstmt)
 
 void gen_stmt(Codegen *codegen, Stmt stmt)
 {
+    if (stmt.type != S_BLOCK) {
+        gen_location(codegen, stmt.line);
+    }
     switch (stmt.type) {
     case S_LET:
         gen_letstmt(codegen, stmt.as->letstmt);
@@ -320,8 +883,7 @@ void gen_stmt(Codegen *codegen, Stmt stmt)
         gen_exprstmt(codegen, stmt.as->exprstmt);
         break;
     case S_FUNC:
-        printf("Functions are not implemented\n");
-        exit(1);
+        error_report(E_CODEGEN, 0, "Functions can only be defined at the top level\n");
         break;
     case S_RET:
         gen_retstmt(codegen, stmt.as->retstmt);
@@ -329,60 +891,818 @@ void gen_stmt(Codegen *codegen, Stmt stmt)
     }
 }
 
-void gen_main(LLVMModuleRef module, LLVMBuilderRef builder, Program program)
+// Every function takes and returns doubles
+LLVMValueRef gen_funcproto(LLVMModuleRef module, FuncStmt funcstmt)
+{
+    LLVMValueRef func = LLVMGetNamedFunction(module, funcstmt.name.data);
+    if (func) {
+        return func;
+    }
+
+    LLVMTypeRef type = LLVMDoubleTypeInContext(LLVMGetModuleContext(module));
+    size_t argc = funcstmt.args.size;
+    LLVMTypeRef *params = malloc(argc * sizeof(LLVMTypeRef));
+    for (size_t i = 0; i < argc; i++) {
+        params[i] = type;
+    }
+    LLVMTypeRef proto = LLVMFunctionType(type, params, argc, false);
+    free(params);
+    return LLVMAddFunction(module, funcstmt.name.data, proto);
+}
+
+// Function bodies have their own named values, the arguments are
+// copied in stack allocations like the variables defined with let
+void gen_funcstmt(Codegen *codegen, FuncStmt funcstmt)
+{
+    LLVMValueRef func = gen_funcproto(codegen->module, funcstmt);
+    LLVMBasicBlockRef bb = LLVMAppendBasicBlockInContext(codegen->context, func, "entry");
+    LLVMPositionBuilderAtEnd(codegen->builder, bb);
+    gen_subprogram(codegen, func, funcstmt.name.line);
+
+    NamedValues *upper = codegen->nvalues;
+    NamedValues nvalues = {0};
+    codegen->nvalues = &nvalues;
+
+    for (size_t i = 0; i < funcstmt.args.size; i++) {
+        char *name = funcstmt.args.items[i].data;
+        LLVMValueRef ptr = gen_alloca(codegen, name);
+        LLVMBuildStore(codegen->builder, LLVMGetParam(func, i), ptr);
+        nv_insert(codegen->nvalues, name, ptr);
+    }
+    gen_burn(codegen);
+
+    Block block = funcstmt.block;
+    for (size_t i = 0; i < block.size; i++) {
+        gen_stmt(codegen, block.items[i]);
+    }
+    LLVMBuildRet(codegen->builder,
+        LLVMConstReal(LLVMDoubleTypeInContext(codegen->context), 0));
+
+    free_nvnode(nvalues.root);
+    codegen->nvalues = upper;
+}
+
+// Functions are declared before generating any body so
+// that they can be called before their definition
+void gen_protos(LLVMModuleRef module, Program program)
+{
+    for (size_t i = 0; i < program.size; i++) {
+        if (program.items[i].type == S_FUNC) {
+            gen_funcproto(module, program.items[i].as->funcstmt);
+        }
+    }
+}
+
+// LONG PROGRAMS
+// Instruction selection and register allocation do not scale
+// linearly with the size of a function, so in the fast mode, when
+// main has more than chunk statements, they are outlined chunk at
+// a time into internal noinline functions that main calls in order. The variables become
+// internal globals visible to all the chunks, a return in a chunk
+// sets the returned flag and main stops after the call:
+//
+//   %r = call i32 @main.chunk()
+//   %f = load i1, ptr @returned
+//   br i1 %f, label %exit, label %next
+//
+// exit returns a phi of the values of the chunks.
+void gen_chunks(Codegen *codegen, Program program, LLVMValueRef main_func, size_t chunk)
+{
+    LLVMContextRef context = codegen->context;
+    LLVMTypeRef i1 = LLVMInt1TypeInContext(context);
+    LLVMTypeRef i32 = LLVMInt32TypeInContext(context);
+    LLVMTypeRef proto = LLVMFunctionType(i32, NULL, 0, false);
+    unsigned noinline = LLVMGetEnumAttributeKindForName("noinline", strlen("noinline"));
+
+    codegen->returned = LLVMAddGlobal(codegen->module, i1, "returned");
+    LLVMSetLinkage(codegen->returned, LLVMInternalLinkage);
+    LLVMSetInitializer(codegen->returned, LLVMConstInt(i1, 0, false));
+
+    LLVMBasicBlockRef bb = LLVMAppendBasicBlockInContext(context, main_func, "entry");
+    LLVMBasicBlockRef exit = LLVMAppendBasicBlockInContext(context, main_func, "exit");
+    LLVMPositionBuilderAtEnd(codegen->builder, exit);
+    LLVMValueRef phi = LLVMBuildPhi(codegen->builder, i32, "exitcode");
+    LLVMBuildRet(codegen->builder, phi);
+
+    // With debug info every chunk is a subprogram starting at
+    // its first statement, the calls are at the line of main
+    LLVMMetadataRef scope = codegen->scope;
+    size_t i = 0;
+    while (i < program.size) {
+        LLVMValueRef func = LLVMAddFunction(codegen->module, "main.chunk", proto);
+        LLVMSetLinkage(func, LLVMInternalLinkage);
+        LLVMAddAttributeAtIndex(func, LLVMAttributeFunctionIndex,
+            LLVMCreateEnumAttribute(context, noinline, 0));
+        LLVMPositionBuilderAtEnd(codegen->builder,
+            LLVMAppendBasicBlockInContext(context, func, "entry"));
+        gen_subprogram(codegen, func, program.items[i].line);
+        size_t size = 0;
+        for (; i < program.size && size < chunk; i++) {
+            if (program.items[i].type != S_FUNC) {
+                gen_stmt(codegen, program.items[i]);
+                size++;
+            }
+        }
+        LLVMBuildRet(codegen->builder, LLVMConstInt(i32, 0, false));
+
+        LLVMPositionBuilderAtEnd(codegen->builder, bb);
+        codegen->scope = scope;
+        gen_location(codegen, 1);
+        LLVMValueRef ret = LLVMBuildCall2(codegen->builder, proto, func, NULL, 0,
+            "chunktmp");
+        LLVMValueRef flag = LLVMBuildLoad2(codegen->builder, i1, codegen->returned,
+            "returned");
+        LLVMBasicBlockRef next = LLVMAppendBasicBlockInContext(context, main_func, "next");
+        LLVMBuildCondBr(codegen->builder, flag, exit, next);
+        LLVMAddIncoming(phi, &ret, &bb, 1);
+        bb = next;
+    }
+
+    LLVMPositionBuilderAtEnd(codegen->builder, bb);
+    LLVMBuildBr(codegen->builder, exit);
+    LLVMValueRef zero = LLVMConstInt(i32, 0, false);
+    LLVMAddIncoming(phi, &zero, &bb, 1);
+    codegen->returned = NULL;
+}
+
+// Main is made of the top level statements that are not functions,
+// chunk is 0 when main must not be split
+void gen_mainfunc(Codegen *codegen, Program program, size_t chunk)
 {
-    LLVMTypeRef main_proto = LLVMFunctionType(LLVMInt32Type(), NULL, 0, false);
-    LLVMValueRef main_func = LLVMAddFunction(module, "main", main_proto);
-    LLVMBasicBlockRef bb = LLVMAppendBasicBlock(main_func, "entry");
-    LLVMPositionBuilderAtEnd(builder, bb);
+    LLVMTypeRef i32 = LLVMInt32TypeInContext(codegen->context);
+    LLVMTypeRef main_proto = LLVMFunctionType(i32, NULL, 0, false);
+    LLVMValueRef main_func = LLVMAddFunction(codegen->module, "main", main_proto);
+    gen_subprogram(codegen, main_func, 1);
 
+    NamedValues *upper = codegen->nvalues;
     NamedValues nvalues = {0};
+    codegen->nvalues = &nvalues;
+
+    size_t size = 0;
+    for (size_t i = 0; i < program.size; i++) {
+        if (program.items[i].type != S_FUNC) {
+            size++;
+        }
+    }
+
+    if (chunk && size > chunk) {
+        gen_chunks(codegen, program, main_func, chunk);
+    } else {
+        LLVMBasicBlockRef bb = LLVMAppendBasicBlockInContext(codegen->context,
+            main_func, "entry");
+        LLVMPositionBuilderAtEnd(codegen->builder, bb);
+        for (size_t i = 0; i < program.size; i++) {
+            if (program.items[i].type != S_FUNC) {
+                gen_stmt(codegen, program.items[i]);
+            }
+        }
+        LLVMBuildRet(codegen->builder, LLVMConstInt(i32, 0, false));
+    }
+
+    free_nvnode(nvalues.root);
+    codegen->nvalues = upper;
+}
+
+void gen_main(LLVMModuleRef module, LLVMBuilderRef builder, Program program)
+{
     Codegen codegen = {
+        .context = LLVMGetModuleContext(module),
         .builder = builder,
-        .nvalues = &nvalues,
+        .module = module,
     };
 
+    gen_protos(module, program);
     for (size_t i = 0; i < program.size; i++) {
-        gen_stmt(&codegen, program.items[i]);
+        if (program.items[i].type == S_FUNC) {
+            gen_funcstmt(&codegen, program.items[i].as->funcstmt);
+        }
+    }
+    gen_mainfunc(&codegen, program, 0);
+}
+
+// IR BACKEND
+// Translates the mid-level IR of ir.c instead of the AST. The IR is
+// already in SSA form, so no stack allocations are needed, and it
+// has been optimized by the passes of iropt.c. Values are doubles,
+// comparisons are converted back to doubles with uitofp which LLVM
+// folds away when the result is only used as a condition.
+LLVMValueRef gen_irvalue(LLVMContextRef context, LLVMValueRef *values, IrInstr *instr)
+{
+    instr = ir_value(instr);
+    if (instr->op == I_CONST) {
+        return LLVMConstReal(LLVMDoubleTypeInContext(context), instr->n);
+    }
+    return values[instr->id];
+}
+
+LLVMValueRef gen_ircmp(LLVMBuilderRef builder, LLVMRealPredicate pred,
+        LLVMValueRef lhs, LLVMValueRef rhs)
+{
+    LLVMValueRef cmp = LLVMBuildFCmp(builder, pred, lhs, rhs, "cmptmp");
+    return LLVMBuildUIToFP(builder, cmp, LLVMTypeOf(lhs), "booltmp");
+}
+
+void gen_irinstr(LLVMBuilderRef builder, LLVMModuleRef module, IrFunc *func,
+        IrInstr *instr, LLVMValueRef *values, LLVMBasicBlockRef *bbs)
+{
+    LLVMContextRef context = LLVMGetModuleContext(module);
+    LLVMValueRef a = instr->ops.size > 0
+        ? gen_irvalue(context, values, instr->ops.items[0]) : NULL;
+    LLVMValueRef b = instr->ops.size > 1
+        ? gen_irvalue(context, values, instr->ops.items[1]) : NULL;
+    LLVMValueRef zero = LLVMConstReal(LLVMDoubleTypeInContext(context), 0);
+    LLVMValueRef res = NULL;
+
+    switch (instr->op) {
+    case I_PHI:
+        // Incoming values are added when all the blocks exist
+        res = LLVMBuildPhi(builder, LLVMDoubleTypeInContext(context), "phitmp");
+        break;
+    case I_COPY:
+        res = a;
+        break;
+    case I_ADD:
+        res = LLVMBuildFAdd(builder, a, b, "addtmp");
+        break;
+    case I_SUB:
+        res = LLVMBuildFSub(builder, a, b, "subtmp");
+        break;
+    case I_MUL:
+        res = LLVMBuildFMul(builder, a, b, "multmp");
+        break;
+    case I_DIV:
+        res = LLVMBuildFDiv(builder, a, b, "divtmp");
+        break;
+    case I_LT:
+        res = gen_ircmp(builder, LLVMRealOLT, a, b);
+        break;
+    case I_GT:
+        res = gen_ircmp(builder, LLVMRealOGT, a, b);
+        break;
+    case I_EQ:
+        res = gen_ircmp(builder, LLVMRealOEQ, a, b);
+        break;
+    case I_NE:
+        res = gen_ircmp(builder, LLVMRealUNE, a, b);
+        break;
+    case I_NEG:
+        res = LLVMBuildFNeg(builder, a, "negtmp");
+        break;
+    case I_NOT:
+        res = gen_ircmp(builder, LLVMRealOEQ, a, zero);
+        break;
+    case I_CALL: {
+        LLVMValueRef callee = LLVMGetNamedFunction(module, instr->callee->name.data);
+        size_t argc = instr->ops.size;
+        LLVMValueRef *args = malloc((argc + 1) * sizeof(LLVMValueRef));
+        for (size_t i = 0; i < argc; i++) {
+            args[i] = gen_irvalue(context, values, instr->ops.items[i]);
+        }
+        res = LLVMBuildCall2(builder, LLVMGlobalGetValueType(callee), callee,
+            args, argc, "calltmp");
+        free(args);
+        break;
     }
+    case I_BR: {
+        LLVMValueRef br = LLVMBuildBr(builder, bbs[instr->targets[0]->id]);
+        if (instr->block->latch) {
+            unsigned kind = LLVMGetMDKindIDInContext(context, "llvm.loop",
+                strlen("llvm.loop"));
+            LLVMSetMetadata(br, kind, LLVMMetadataAsValue(context,
+                gen_loopmd(context, instr->block->hints)));
+        }
+        break;
+    }
+    case I_CONDBR: {
+        LLVMValueRef cond = LLVMBuildFCmp(builder, LLVMRealUNE, a, zero, "condtmp");
+        LLVMValueRef br = LLVMBuildCondBr(builder, cond, bbs[instr->targets[0]->id],
+            bbs[instr->targets[1]->id]);
+        gen_weights(br, instr->prof);
+        break;
+    }
+    case I_RET:
+        // Main returns the exit code
+        if (func->is_main) {
+            a = LLVMBuildCast(builder, LLVMFPToUI, a, LLVMInt32TypeInContext(context),
+                "rettmp");
+        }
+        LLVMBuildRet(builder, a);
+        break;
+    default:
+        error_report(E_CODEGEN, 0, "Cannot generate IR instruction '%d'\n", instr->op);
+    }
+    values[instr->id] = res;
+}
 
-    LLVMBuildRet(builder, LLVMConstInt(LLVMInt32Type(), 0, false));
+// Blocks are generated in reverse postorder so that the operands
+// of an instruction, which dominate it, are generated before it
+void gen_irfunc(LLVMModuleRef module, LLVMBuilderRef builder, IrFunc *func)
+{
+    LLVMContextRef context = LLVMGetModuleContext(module);
+    LLVMValueRef fn = LLVMGetNamedFunction(module, func->name.data);
+    ir_order(func);
+    LLVMValueRef *values = calloc(func->nvalues, sizeof(LLVMValueRef));
+    LLVMBasicBlockRef *bbs = calloc(func->blocks.size, sizeof(LLVMBasicBlockRef));
+
+    for (size_t i = 0; i < func->params.size; i++) {
+        values[func->params.items[i]->id] = LLVMGetParam(fn, i);
+    }
+    for (size_t i = 0; i < func->order.size; i++) {
+        IrBlock *block = func->order.items[i];
+        bbs[block->id] = LLVMAppendBasicBlockInContext(context, fn,
+            i == 0 ? "entry" : "bb");
+    }
+
+    for (size_t i = 0; i < func->order.size; i++) {
+        IrBlock *block = func->order.items[i];
+        LLVMPositionBuilderAtEnd(builder, bbs[block->id]);
+        for (size_t j = 0; j < block->instrs.size; j++) {
+            gen_irinstr(builder, module, func, block->instrs.items[j], values, bbs);
+        }
+    }
+
+    for (size_t i = 0; i < func->order.size; i++) {
+        IrBlock *block = func->order.items[i];
+        for (size_t j = 0; j < block->instrs.size; j++) {
+            IrInstr *phi = block->instrs.items[j];
+            if (phi->op != I_PHI) {
+                continue;
+            }
+            for (size_t k = 0; k < phi->ops.size; k++) {
+                LLVMValueRef value = gen_irvalue(context, values, phi->ops.items[k]);
+                LLVMBasicBlockRef pred = bbs[block->preds.items[k]->id];
+                LLVMAddIncoming(values[phi->id], &value, &pred, 1);
+            }
+        }
+    }
+
+    free(bbs);
+    free(values);
 }
 
-int main(int argc, char **argv)
+void gen_irprotos(LLVMModuleRef module, IrModule *ir)
 {
-    if (argc < 2) {
-        printf("Usage: %s <source.l>\n", argv[0]);
-        exit(1);
+    LLVMContextRef context = LLVMGetModuleContext(module);
+    LLVMTypeRef type = LLVMDoubleTypeInContext(context);
+    for (size_t i = 0; i < ir->size; i++) {
+        IrFunc *func = ir->items[i];
+        LLVMTypeRef proto;
+        if (func->is_main) {
+            proto = LLVMFunctionType(LLVMInt32TypeInContext(context), NULL, 0, false);
+        } else {
+            size_t argc = func->params.size;
+            LLVMTypeRef *params = malloc((argc + 1) * sizeof(LLVMTypeRef));
+            for (size_t j = 0; j < argc; j++) {
+                params[j] = type;
+            }
+            proto = LLVMFunctionType(type, params, argc, false);
+            free(params);
+        }
+        LLVMAddFunction(module, func->name.data, proto);
     }
+}
 
-    Buffer b;
-    v_init(b);
-    FILE *f = fopen(argv[1], "r");
-    if (f == NULL) {
-        printf("Could not open file %s\n", argv[1]);
-        exit(1);
+void gen_irmodule(LLVMModuleRef module, LLVMBuilderRef builder, IrModule *ir)
+{
+    gen_irprotos(module, ir);
+    for (size_t i = 0; i < ir->size; i++) {
+        gen_irfunc(module, builder, ir->items[i]);
     }
-    get_content(f, &b);
+}
 
-    // Lex
-    Lexer l;
-    lexer_init(&l, b.items);
-    get_tokens(&l);
+// The host is queried once per process, every unit of every
+// compilation creates its own target machines from it since
+// they cannot be shared between threads
+static pthread_once_t host_once = PTHREAD_ONCE_INIT;
+static HostTarget host;
 
-    // Parse
-    Parser p;
-    parser_init(&p, &l);
-    Program pr = parse_program(&p);
+void host_init(void)
+{
+    LLVMInitializeNativeTarget();
+    LLVMInitializeNativeAsmPrinter();
+
+    host.triple = LLVMGetDefaultTargetTriple();
+    char *error = NULL;
+    if (LLVMGetTargetFromTriple(host.triple, &host.target, &error)) {
+        host.target = NULL;
+        host.error = error;
+    }
+    host.cpu = LLVMGetHostCPUName();
+    host.features = LLVMGetHostCPUFeatures();
+}
+
+// The target machine of the host, with all its CPU features. At
+// LLVMCodeGenLevelNone instruction selection uses FastISel and
+// registers are allocated with the fast allocator.
+LLVMTargetMachineRef target_machine(LLVMCodeGenOptLevel level)
+{
+    pthread_once(&host_once, host_init);
+    if (host.target == NULL) {
+        error_report(E_CODEGEN, 0, "Could not get target: %s\n", host.error);
+    }
+    return LLVMCreateTargetMachine(host.target, host.triple, host.cpu,
+        host.features, level, LLVMRelocPIC,
+        LLVMCodeModelDefault);
+}
+
+LLVMTargetMachineRef host_machine(void)
+{
+    return target_machine(LLVMCodeGenLevelDefault);
+}
+
+// Runs a textual pass pipeline on the module
+void run_passes(LLVMModuleRef module, char *passes, LLVMTargetMachineRef tm)
+{
+    LLVMPassBuilderOptionsRef options = LLVMCreatePassBuilderOptions();
+    LLVMPassBuilderOptionsSetLoopVectorization(options, true);
+    LLVMPassBuilderOptionsSetLoopUnrolling(options, true);
+    double wall = stats.format ? stats_wall() : 0;
+    double cpu = stats.format ? stats_thread_cpu() : 0;
+    LLVMErrorRef err = LLVMRunPasses(module, passes, tm, options);
+    if (stats.format) {
+        stats_passes(passes, stats_wall() - wall, stats_thread_cpu() - cpu);
+    }
+    if (err) {
+        char *msg = LLVMGetErrorMessage(err);
+        fprintf(error_stream(), "Could not optimize module: %s\n", msg);
+        LLVMDisposeErrorMessage(msg);
+        error_raise(E_CODEGEN, 0);
+    }
+    LLVMDisposePassBuilderOptions(options);
+}
+
+// Runs the default LLVM pipeline for the given level on the
+// module, the host target machine is needed by the vectorizer
+// to query the available vector registers
+void optimize_module(LLVMModuleRef module, int level)
+{
+    LLVMTargetMachineRef tm = host_machine();
+    char *triple = LLVMGetTargetMachineTriple(tm);
+
+    LLVMTargetDataRef layout = LLVMCreateTargetDataLayout(tm);
+    char *layout_str = LLVMCopyStringRepOfTargetData(layout);
+    LLVMSetTarget(module, triple);
+    LLVMSetDataLayout(module, layout_str);
+
+    if (level > 0) {
+        char passes[32];
+        snprintf(passes, sizeof(passes), "default<O%d>", level);
+        run_passes(module, passes, tm);
+    }
+
+    LLVMDisposeMessage(layout_str);
+    LLVMDisposeTargetData(layout);
+    LLVMDisposeTargetMachine(tm);
+    LLVMDisposeMessage(triple);
+}
+
+// Writes the module as a native object file for the host
+void emit_object(LLVMModuleRef module, char *path, bool fast)
+{
+    LLVMTargetMachineRef tm = target_machine(fast
+        ? LLVMCodeGenLevelNone : LLVMCodeGenLevelDefault);
+    char *error = NULL;
+    if (LLVMTargetMachineEmitToFile(tm, module, path, LLVMObjectFile, &error)) {
+        error_report(E_CODEGEN, 0, "Could not emit object file %s: %s\n", path, error);
+    }
+    LLVMDisposeTargetMachine(tm);
+}
+
+// PARALLEL CODE GENERATION
+// Every top level function, and main, is a unit that is generated,
+// verified and optimized by a worker of the pool in its own context
+// and module, which declares the functions called by the unit.
+// Contexts cannot be shared between threads, so the units come back
+// to the context of the compilation as bitcode and they are linked
+// in the order of the source: the output is the same for any number
+// of threads. The workers catch their own errors, the error of the
+// first unit that failed is raised again by the calling thread.
+//
+// INCREMENTAL COMPILATION
+// A unit only declares the functions it calls. With a cache the
+// optimized bitcode of every unit is also stored on its own, the key
+// is the hash of the tokens of the unit computed by the parser and
+// the prototypes of the functions it calls. After an edit only the
+// changed functions are generated again, with the callers of the ones
+// whose number of arguments changed, the other units are read back
+// from the cache and all of them are linked as before.
+
+int proto_compare(const void *a, const void *b)
+{
+    const Proto *pa = a;
+    const Proto *pb = b;
+    int cmp = strcmp(pa->name, pb->name);
+    if (cmp == 0) {
+        return pa->order < pb->order ? -1 : pa->order > pb->order;
+    }
+    return cmp;
+}
+
+void protos_add(Units *units, Program program)
+{
+    for (size_t i = 0; i < program.size; i++) {
+        if (program.items[i].type == S_FUNC) {
+            FuncStmt *func = &program.items[i].as->funcstmt;
+            Proto proto = { func->name.data, units->nprotos, func };
+            units->protos[units->nprotos++] = proto;
+        }
+    }
+}
+
+// The table is sorted by name and then by order, the first
+// definition of a name is the one that is declared
+Proto *proto_find(Units *units, char *name)
+{
+    size_t lo = 0;
+    size_t hi = units->nprotos;
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        if (strcmp(units->protos[mid].name, name) < 0) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    if (lo < units->nprotos && strcmp(units->protos[lo].name, name) == 0) {
+        return &units->protos[lo];
+    }
+    return NULL;
+}
+
+void calls_expr(Args *calls, Expr expr)
+{
+    switch (expr.type) {
+    case UNARY:
+        calls_expr(calls, expr.as->unexpr.expr);
+        break;
+    case BINARY:
+        calls_expr(calls, expr.as->binexpr.lexpr);
+        calls_expr(calls, expr.as->binexpr.rexpr);
+        break;
+    case GROUPING:
+        calls_expr(calls, expr.as->groupexpr.expr);
+        break;
+    case TERMINAL:
+        break;
+    case CALL: {
+        CallExpr callexpr = expr.as->callexpr;
+        v_append(*calls, callexpr.name);
+        for (size_t i = 0; i < callexpr.args.size; i++) {
+            calls_expr(calls, callexpr.args.items[i]);
+        }
+        break;
+    }
+    }
+}
+
+// Collects the names of the functions called by the statement
+void unit_calls(Args *calls, Stmt stmt)
+{
+    switch (stmt.type) {
+    case S_LET:
+        calls_expr(calls, stmt.as->letstmt.value);
+        break;
+    case S_IF:
+        calls_expr(calls, stmt.as->ifstmt.cond);
+        unit_calls(calls, stmt.as->ifstmt.thenb);
+        unit_calls(calls, stmt.as->ifstmt.elseb);
+        break;
+    case S_FOR:
+        calls_expr(calls, stmt.as->forstmt.init);
+        calls_expr(calls, stmt.as->forstmt.cond);
+        calls_expr(calls, stmt.as->forstmt.step);
+        unit_calls(calls, stmt.as->forstmt.thenb);
+        break;
+    case S_WHILE:
+        calls_expr(calls, stmt.as->whilestmt.cond);
+        unit_calls(calls, stmt.as->whilestmt.thenb);
+        break;
+    case S_BLOCK: {
+        Block block = stmt.as->blockstmt.block;
+        for (size_t i = 0; i < block.size; i++) {
+            unit_calls(calls, block.items[i]);
+        }
+        break;
+    }
+    case S_EXPR:
+        calls_expr(calls, stmt.as->exprstmt.expr);
+        break;
+    case S_FUNC: {
+        Block block = stmt.as->funcstmt.block;
+        for (size_t i = 0; i < block.size; i++) {
+            unit_calls(calls, block.items[i]);
+        }
+        break;
+    }
+    case S_RET:
+        calls_expr(calls, stmt.as->retstmt.expr);
+        break;
+    }
+}
+
+// An undefined function is hashed with no arguments,
+// the unit fails anyway and is never stored
+Cache unit_key(Units *units, uint64_t hash, Args *calls)
+{
+    Cache key = *units->cache;
+    cache_add(&key, &hash, sizeof(hash));
+    for (size_t i = 0; i < calls->size; i++) {
+        char *name = calls->items[i].data;
+        Proto *proto = proto_find(units, name);
+        size_t argc = proto ? proto->func->args.size : SIZE_MAX;
+        cache_add(&key, name, strlen(name));
+        cache_add(&key, &argc, sizeof(argc));
+    }
+    return key;
+}
+void gen_unit(void *arg, size_t index)
+{
+    Units *units = arg;
+    ErrorHandler handler;
+    error_push(&handler);
+    if (setjmp(handler.env) != 0) {
+        units->errors[index] = handler.diag;
+        return;
+    }
+
+    // The functions called by the unit, and the hash of its
+    // tokens, main is made of the statements outside of them
+    Program program = units->program;
+    FuncStmt *func = NULL;
+    uint64_t hash = program.hash;
+    Args calls;
+    v_init(calls);
+    if (units->ir == NULL) {
+        if (index < units->nfuncs) {
+            Stmt stmt = program.items[units->funcs[index]];
+            func = &stmt.as->funcstmt;
+            hash = func->hash;
+            unit_calls(&calls, stmt);
+        } else {
+            for (size_t i = 0; i < program.size; i++) {
+                if (program.items[i].type != S_FUNC) {
+                    unit_calls(&calls, program.items[i]);
+                }
+            }
+        }
+    }
+
+    Cache key;
+    bool use_cache = units->cache && units->ir == NULL;
+    if (use_cache) {
+        key = unit_key(units, hash, &calls);
+        units->bitcode[index] = cache_read(&key);
+        if (units->bitcode[index]) {
+            free(calls.items);
+            error_pop(&handler);
+            return;
+        }
+    }
 
-    // Generate
     LLVMContextRef context = LLVMContextCreate();
     LLVMModuleRef module = LLVMModuleCreateWithNameInContext("l_program", context);
     LLVMBuilderRef builder = LLVMCreateBuilderInContext(context);
 
-    gen_main(module, builder, pr);
+    if (units->ir) {
+        gen_irprotos(module, units->ir);
+        gen_irfunc(module, builder, units->ir->items[index]);
+    } else {
+        Codegen codegen = {
+            .context = context,
+            .builder = builder,
+            .module = module,
+        };
+        if (units->steps) {
+            gen_fuel(&codegen);
+        }
+        if (units->debug) {
+            gen_debuginfo(&codegen, units->debug, units->level > 0);
+        }
+        for (size_t i = 0; i < calls.size; i++) {
+            Proto *proto = proto_find(units, calls.items[i].data);
+            if (proto) {
+                gen_funcproto(module, *proto->func);
+            }
+        }
+        if (func) {
+            gen_funcstmt(&codegen, *func);
+        } else {
+            gen_mainfunc(&codegen, program, units->chunk);
+        }
+        gen_debugfinish(&codegen);
+    }
+    free(calls.items);
+    LLVMDisposeBuilder(builder);
+
+    char *error = NULL;
+    if (LLVMVerifyModule(module, LLVMReturnStatusAction, &error)) {
+        error_report(E_CODEGEN, 0, "Invalid module: %s\n", error);
+    }
+    LLVMDisposeMessage(error);
+    optimize_module(module, units->level);
+
+    units->bitcode[index] = module_bitcode(module);
+    if (use_cache) {
+        cache_store_bitcode(&key, units->bitcode[index]);
+    }
+    LLVMDisposeModule(module);
+    LLVMContextDispose(context);
+    error_pop(&handler);
+}
+
+// Generates the units in the context of the units, the calls
+// between them are only inlined by link_program. The functions
+// keep their name in the module, so none can be called main.
+LLVMModuleRef gen_units(Units *units, size_t nthreads)
+{
+    Program program = units->program;
+    units->nfuncs = 0;
+    units->funcs = malloc((program.size + 1) * sizeof(size_t));
+    for (size_t i = 0; i < program.size; i++) {
+        if (program.items[i].type == S_FUNC) {
+            Token name = program.items[i].as->funcstmt.name;
+            if (strcmp(name.data, "main") == 0) {
+                free(units->funcs);
+                error_report(E_CODEGEN, name.line, "The function 'main' is reserved at line %zu\n",
+                    name.line);
+            }
+            units->funcs[units->nfuncs++] = i;
+        }
+    }
+    units->nprotos = 0;
+    units->protos = malloc((program.size + units->externs.size + 1) * sizeof(Proto));
+    protos_add(units, program);
+    protos_add(units, units->externs);
+    qsort(units->protos, units->nprotos, sizeof(Proto), proto_compare);
+    size_t nunits = units->ir ? units->ir->size
+        : units->nfuncs + (units->library ? 0 : 1);
+    units->bitcode = calloc(nunits + 1, sizeof(LLVMMemoryBufferRef));
+    units->errors = calloc(nunits + 1, sizeof(Diagnostic));
+
+    // Targets are registered before starting the threads
+    LLVMInitializeNativeTarget();
+    LLVMInitializeNativeAsmPrinter();
+    pool_run(nthreads, nunits, gen_unit, units);
+    for (size_t i = 0; i < nunits; i++) {
+        Diagnostic diag = units->errors[i];
+        if (diag.kind != E_OK) {
+            free(units->errors);
+            error_report(diag.kind, diag.line, "%s\n", diag.message);
+        }
+    }
+
+    // Linking a module costs as much as the module it is linked
+    // into, so the units are linked by pairs in rounds, each
+    // one into the one before it to keep the order of the source
+    LLVMModuleRef *modules = malloc((nunits + 1) * sizeof(LLVMModuleRef));
+    for (size_t i = 0; i < nunits; i++) {
+        if (LLVMParseBitcodeInContext2(units->context, units->bitcode[i], &modules[i])) {
+            error_report(E_IO, 0, "Could not read the bitcode of unit %zu\n", i);
+        }
+        LLVMDisposeMemoryBuffer(units->bitcode[i]);
+    }
+    for (size_t step = 1; step < nunits; step *= 2) {
+        for (size_t i = 0; i + step < nunits; i += 2 * step) {
+            if (LLVMLinkModules2(modules[i], modules[i + step])) {
+                error_report(E_CODEGEN, 0, "Could not link unit %zu\n", i + step);
+            }
+        }
+    }
+    LLVMModuleRef module = nunits > 0 ? modules[0]
+        : LLVMModuleCreateWithNameInContext("l_program", units->context);
+    free(modules);
+    LLVMSetModuleIdentifier(module, "l_program", strlen("l_program"));
+    free(units->errors);
+    free(units->bitcode);
+    free(units->protos);
+    free(units->funcs);
+    return module;
+}
 
-    print_module(module);
+// WHOLE PROGRAM LINKING
+// The modules of the imported files are linked into the module of
+// the program, then every function but main is internalized: the
+// optimizer knows all the callers, so it inlines the calls between
+// units and files like any other call and drops unused functions.
+void link_program(LLVMModuleRef module, LLVMModuleRef *libs, size_t nlibs, int level)
+{
+    for (size_t i = 0; i < nlibs; i++) {
+        if (LLVMLinkModules2(module, libs[i])) {
+            error_report(E_CODEGEN, 0, "Could not link imported file %zu\n", i);
+        }
+    }
+
+    for (LLVMValueRef fn = LLVMGetFirstFunction(module); fn; fn = LLVMGetNextFunction(fn)) {
+        if (!LLVMIsDeclaration(fn) && strcmp(LLVMGetValueName(fn), "main") != 0) {
+            LLVMSetLinkage(fn, LLVMInternalLinkage);
+        }
+    }
 
-    return 0;
+    if (level > 0) {
+        LLVMTargetMachineRef tm = host_machine();
+        run_passes(module, level >= 2
+            ? "cgscc(inline),function(instcombine,simplifycfg),globaldce"
+            : "globaldce", tm);
+        LLVMDisposeTargetMachine(tm);
+    }
 }
@@ -2,8 +2,26 @@
 #define CODEGEN_H
 
 #include "llvm-c/Core.h"
+#include "llvm-c/DebugInfo.h"
+#include "llvm-c/TargetMachine.h"
+
+#include "parser.h"
+#include "ir.h"
+#include "error.h"
+#include "cache.h"
+
+typedef struct {
+    char *triple;
+    LLVMTargetRef target;
+    char *error;
+    char *cpu;
+    char *features;
+} HostTarget;
 
 void print_module(LLVMModuleRef module);
+LLVMMemoryBufferRef module_bitcode(LLVMModuleRef module);
+void write_buffer(LLVMMemoryBufferRef buffer, char *path, FILE *out);
+void write_module(LLVMModuleRef module, char *path, bool text, FILE *out);
 
 typedef struct nvnode NvNode;
 typedef struct nvnode {
@@ -17,27 +35,119 @@ typedef struct nvalues {
     NvNode *root;
 } NamedValues;
 
+// The context is the one of the module, the AST is generated
+// in any context so that functions can be built in parallel.
+// Returned is the flag set by a return in a chunk of main.
+// Fuel and refuel are NULL unless the code burns a budget,
+// see gen_burn. The debug info builder is NULL without -g,
+// scope is the subprogram of the function being generated.
 typedef struct {
+    LLVMContextRef context;
     LLVMBuilderRef builder;
+    LLVMModuleRef module;
     NamedValues *nvalues;
+    LLVMValueRef returned;
+    LLVMValueRef fuel;
+    LLVMValueRef refuel;
+    LLVMDIBuilderRef dib;
+    LLVMMetadataRef file;
+    LLVMMetadataRef scope;
 } Codegen;
 
 NvNode *nvnode_insert(NvNode *node, char *name, LLVMValueRef value);
 void nv_insert(NamedValues *nvalues, char *name, LLVMValueRef value);
 NvNode *nvnode_lookup(NvNode *node, char *name);
 LLVMValueRef nv_lookup(NamedValues *nvalues, char *name);
+void free_nvnode(NvNode *node);
 
+LLVMValueRef gen_cond(Codegen *codegen, LLVMValueRef value);
+LLVMValueRef gen_double(Codegen *codegen, LLVMValueRef value);
+LLVMValueRef gen_logicexpr(Codegen *codegen, BinExpr binexpr);
 LLVMValueRef gen_unexpr(Codegen *codegen, UnExpr unexpr);
 LLVMValueRef gen_binexpr(Codegen *codegen, BinExpr binexpr);
 LLVMValueRef gen_termexpr(Codegen *codegen, TermExpr termexpr);
+LLVMValueRef gen_callexpr(Codegen *codegen, CallExpr callexpr);
 LLVMValueRef gen_expr(Codegen *codegen, Expr expr);
 void gen_retstmt(Codegen *codegen, RetStmt retstmt);
 void gen_letstmt(Codegen *codegen, LetStmt letstmt);
 void gen_ifstmt(Codegen *codegen, IfStmt ifstmt);
+LLVMValueRef gen_global(Codegen *codegen, char *name);
+LLVMValueRef gen_alloca(Codegen *codegen, char *name);
+LLVMTypeRef refuel_type(LLVMContextRef context);
+void gen_burn(Codegen *codegen);
+void gen_fuel(Codegen *codegen);
+void gen_budget(LLVMModuleRef module, size_t steps);
+void gen_debuginfo(Codegen *codegen, char *path, bool optimized);
+void gen_subprogram(Codegen *codegen, LLVMValueRef func, size_t line);
+void gen_location(Codegen *codegen, size_t line);
+void gen_debugfinish(Codegen *codegen);
+LLVMMetadataRef gen_mdhint(LLVMContextRef context, char *name, LLVMValueRef value);
+LLVMMetadataRef gen_loopmd(LLVMContextRef context, LoopHints hints);
+void gen_weights(LLVMValueRef br, BranchProfile prof);
+void gen_loop(Codegen *codegen, Expr *cond, Expr *step, Stmt thenb,
+        LoopHints hints, BranchProfile prof);
 void gen_forstmt(Codegen *codegen, ForStmt forstmt);
+void gen_whilestmt(Codegen *codegen, WhileStmt whilestmt);
 void gen_blockstmt(Codegen *codegen, BlockStmt blockstmt);
 void gen_exprstmt(Codegen *codegen, ExprStmt exprstmt);
 void gen_stmt(Codegen *codegen, Stmt stmt);
+LLVMValueRef gen_funcproto(LLVMModuleRef module, FuncStmt funcstmt);
+void gen_funcstmt(Codegen *codegen, FuncStmt funcstmt);
+void gen_protos(LLVMModuleRef module, Program program);
+void gen_chunks(Codegen *codegen, Program program, LLVMValueRef main_func, size_t chunk);
+void gen_mainfunc(Codegen *codegen, Program program, size_t chunk);
 void gen_main(LLVMModuleRef module, LLVMBuilderRef builder, Program program);
+LLVMValueRef gen_irvalue(LLVMContextRef context, LLVMValueRef *values, IrInstr *instr);
+void gen_irinstr(LLVMBuilderRef builder, LLVMModuleRef module, IrFunc *func,
+        IrInstr *instr, LLVMValueRef *values, LLVMBasicBlockRef *bbs);
+void gen_irfunc(LLVMModuleRef module, LLVMBuilderRef builder, IrFunc *func);
+void gen_irprotos(LLVMModuleRef module, IrModule *ir);
+void gen_irmodule(LLVMModuleRef module, LLVMBuilderRef builder, IrModule *ir);
+LLVMTargetMachineRef target_machine(LLVMCodeGenOptLevel level);
+LLVMTargetMachineRef host_machine(void);
+void run_passes(LLVMModuleRef module, char *passes, LLVMTargetMachineRef tm);
+void optimize_module(LLVMModuleRef module, int level);
+void emit_object(LLVMModuleRef module, char *path, bool fast);
+
+// A function the units can call, see proto_find
+typedef struct {
+    char *name;
+    size_t order;
+    FuncStmt *func;
+} Proto;
+
+// The units are the top level functions followed by main, which
+// libraries do not have, or the functions of the IR. Externs are
+// the functions of the imported files, which are only declared.
+// Funcs are the indices of the functions in the program. Main
+// is split in chunks of that many statements, 0 disables it.
+// The units are linked in context.
+// Without a cache the units are always generated. Steps is
+// the budget of the program, the units only burn it. Debug
+// is the path of the source with -g, NULL without debug info.
+typedef struct {
+    LLVMContextRef context;
+    Cache *cache;
+    Program program;
+    Program externs;
+    IrModule *ir;
+    bool library;
+    int level;
+    size_t chunk;
+    size_t steps;
+    char *debug;
+    size_t *funcs;
+    size_t nfuncs;
+    Proto *protos;
+    size_t nprotos;
+    LLVMMemoryBufferRef *bitcode;
+    Diagnostic *errors;
+} Units;
+
+Proto *proto_find(Units *units, char *name);
+void unit_calls(Args *calls, Stmt stmt);
+void gen_unit(void *arg, size_t index);
+LLVMModuleRef gen_units(Units *units, size_t nthreads);
+void link_program(LLVMModuleRef module, LLVMModuleRef *libs, size_t nlibs, int level);
 
 #endif
@@ -0,0 +1,100 @@
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "vector.h"
+
+// COMPILE CLIENT
+// Sends the arguments to a server started with codegen --serve,
+// which writes the output to the standard output of the client.
+// The exit status and the errors are the ones of codegen.
+
+typedef struct {
+    size_t size;
+    size_t capacity;
+    char *items;
+} Request;
+
+void request_add(Request *req, char *s)
+{
+    for (size_t i = 0; i <= strlen(s); i++) {
+        v_append(*req, s[i]);
+    }
+}
+
+int main(int argc, char **argv)
+{
+    if (argc < 3) {
+        printf("Usage: %s <socket> <codegen arguments>\n", argv[0]);
+        exit(1);
+    }
+
+    int sock = socket(AF_UNIX, SOCK_STREAM, 0);
+    struct sockaddr_un addr = {
+        .sun_family = AF_UNIX,
+    };
+    if (sock < 0 || strlen(argv[1]) >= sizeof(addr.sun_path)) {
+        printf("Could not connect to %s\n", argv[1]);
+        exit(1);
+    }
+    strcpy(addr.sun_path, argv[1]);
+    if (connect(sock, (struct sockaddr *)&addr, sizeof(addr))) {
+        printf("Could not connect to %s\n", argv[1]);
+        exit(1);
+    }
+
+    Request req;
+    v_init(req);
+    char *cwd = getcwd(NULL, 0);
+    request_add(&req, cwd);
+    for (int i = 2; i < argc; i++) {
+        request_add(&req, argv[i]);
+    }
+
+    // The standard output goes with the size of the request
+    fflush(stdout);
+    uint32_t size = req.size;
+    int fd = STDOUT_FILENO;
+    char control[CMSG_SPACE(sizeof(int))] = {0};
+    struct iovec iov = {
+        .iov_base = &size,
+        .iov_len = sizeof(size),
+    };
+    struct msghdr msg = {
+        .msg_iov = &iov,
+        .msg_iovlen = 1,
+        .msg_control = control,
+        .msg_controllen = sizeof(control),
+    };
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+    memcpy(CMSG_DATA(cmsg), &fd, sizeof(int));
+    if (sendmsg(sock, &msg, 0) != sizeof(size)
+            || send(sock, req.items, req.size, 0) != (ssize_t)req.size) {
+        printf("Could not send the request to %s\n", argv[1]);
+        exit(1);
+    }
+
+    int32_t status;
+    if (recv(sock, &status, sizeof(status), MSG_WAITALL) != sizeof(status)) {
+        printf("Could not read the reply of %s\n", argv[1]);
+        exit(1);
+    }
+    char message[256];
+    ssize_t n = recv(sock, message, sizeof(message) - 1, MSG_WAITALL);
+    if (n > 0) {
+        message[n] = 0;
+        printf("%s\n", message);
+    }
+
+    close(sock);
+    free(req.items);
+    free(cwd);
+    return status;
+}
@@ -0,0 +1,609 @@
+#include <pthread.h>
+#include <semaphore.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "llvm-c/Core.h"
+#include "llvm-c/Analysis.h"
+
+#include "lexer.h"
+#include "parser.h"
+#include "ir.h"
+#include "iropt.h"
+#include "codegen.h"
+#include "profile.h"
+#include "cache.h"
+#include "import.h"
+#include "pool.h"
+#include "vector.h"
+#include "error.h"
+#include "stats.h"
+
+// Statements of main generated in each of its chunks with --fast
+#define CHUNK_SIZE 256
+
+// Largest request of a client, and number of requests the
+// server compiles at the same time
+#define SERVE_MAX_REQUEST (1 << 20)
+#define SERVE_MAX_WORKERS 16
+
+// Context is the LLVM context of the compilation and out the
+// stream written when there is no output file. Steps is the
+// budget of the program, 0 for none. Debug adds the line
+// tables of the sources with -g.
+typedef struct {
+    LLVMContextRef context;
+    FILE *out;
+    char *serve;
+    int level;
+    bool use_ir;
+    bool emit_ir;
+    char *profile;
+    char *cache_dir;
+    char *object;
+    char *output;
+    bool text;
+    size_t threads;
+    bool fast;
+    size_t steps;
+    bool debug;
+    StatsFormat stats;
+} Options;
+
+// The units are cached on their own too, keyed by the options
+// that change their code, see gen_unit. Returns NULL without
+// a cache directory.
+Cache *units_cache(Cache *cache, Options *opts)
+{
+    if (opts->cache_dir == NULL) {
+        return NULL;
+    }
+    cache_init(cache, opts->cache_dir);
+    char options[64];
+    snprintf(options, sizeof(options), "unit -O%d %d %zu %d", opts->level, opts->fast,
+        opts->steps, opts->debug);
+    cache_add(cache, options, strlen(options));
+    return cache;
+}
+
+// Imported files are compiled on their own as libraries, which
+// are cached separately so that a file imported by many programs
+// is compiled only once. The key covers the file, the files it
+// imports, whose functions it declares, and the level.
+LLVMModuleRef compile_import(Imports *imports, size_t index, Options *opts)
+{
+    Import *imp = imports->items[index];
+    Deps deps;
+    import_closure(imports, index, &deps);
+
+    Cache cache;
+    bool use_cache = opts->cache_dir != NULL;
+    if (use_cache) {
+        cache_init(&cache, opts->cache_dir);
+        cache_add(&cache, imp->content.items, imp->content.size);
+        for (size_t i = 0; i < deps.size; i++) {
+            Import *dep = imports->items[deps.items[i]];
+            cache_add(&cache, dep->content.items, dep->content.size);
+        }
+        char options[64];
+        snprintf(options, sizeof(options), "import -O%d %zu %d", opts->level, opts->steps,
+            opts->debug);
+        cache_add(&cache, options, strlen(options));
+        if (opts->debug) {
+            cache_add(&cache, imp->path, strlen(imp->path));
+        }
+
+        LLVMModuleRef module = cache_load(&cache, opts->context);
+        if (module) {
+            free(deps.items);
+            return module;
+        }
+    }
+
+    Cache unit_cache;
+    Units units = {
+        .context = opts->context,
+        .cache = opts->debug ? NULL : units_cache(&unit_cache, opts),
+        .program = imp->program,
+        .externs = import_externs(imports, &deps),
+        .library = true,
+        .level = opts->level,
+        .steps = opts->steps,
+        .debug = opts->debug ? imp->path : NULL,
+    };
+    LLVMModuleRef module = gen_units(&units, opts->threads);
+    if (use_cache) {
+        LLVMMemoryBufferRef bitcode = module_bitcode(module);
+        cache_store_bitcode(&cache, bitcode);
+        LLVMDisposeMemoryBuffer(bitcode);
+    }
+
+    free(units.externs.items);
+    free(units.externs.imports.items);
+    free(deps.items);
+    return module;
+}
+
+// Generates and optimizes the program, returns NULL
+// when the IR has been printed with --emit-ir
+LLVMModuleRef compile(Program *pr, Imports *imports, char *source, Options *opts)
+{
+    // With --ir the program goes through the mid-level IR,
+    // which is optimized at the same level before LLVM. The IR
+    // is lowered from a single program, so the functions of the
+    // imported files are spliced into it like in the interpreter.
+    // Functions generated from the IR do not burn a budget.
+    if (opts->use_ir && opts->steps) {
+        error_report(E_CODEGEN, 0, "--max-steps cannot be used with --ir\n");
+    }
+    if (opts->use_ir && opts->debug) {
+        error_report(E_CODEGEN, 0, "-g cannot be used with --ir\n");
+    }
+    if (opts->use_ir || opts->emit_ir) {
+        imports_splice(pr, imports);
+        if (opts->profile) {
+            profile_read(pr, opts->profile);
+        }
+        stats_begin(PHASE_IR);
+        IrModule *ir = ir_lower(pr);
+        ir_optimize(ir, opts->level);
+        stats_end(PHASE_IR);
+        if (opts->emit_ir) {
+            ir_print(ir);
+            ir_free(ir);
+            return NULL;
+        }
+        Units units = {
+            .context = opts->context,
+            .program = *pr,
+            .ir = ir,
+            .level = opts->level,
+        };
+        stats_begin(PHASE_CODEGEN);
+        LLVMModuleRef module = gen_units(&units, opts->threads);
+        stats_end(PHASE_CODEGEN);
+        ir_free(ir);
+        stats_begin(PHASE_LINK);
+        link_program(module, NULL, 0, opts->level);
+        stats_end(PHASE_LINK);
+        return module;
+    }
+
+    // The profile only covers the statements of the program,
+    // imported files are compiled without it
+    if (opts->profile) {
+        profile_read(pr, opts->profile);
+    }
+    stats_begin(PHASE_CODEGEN);
+    LLVMModuleRef *libs = malloc((imports->size + 1) * sizeof(LLVMModuleRef));
+    Deps all;
+    v_init(all);
+    for (size_t i = 0; i < imports->size; i++) {
+        libs[i] = compile_import(imports, i, opts);
+        v_append(all, i);
+    }
+
+    // The functions are then generated and optimized in parallel,
+    // a profile changes the branch weights of the functions
+    // so their cached bitcode is not used with one. Neither is
+    // it with -g: the hashes of the functions leave the lines
+    // out, the whole program is still cached.
+    Cache unit_cache;
+    bool unit_cached = opts->profile == NULL && !opts->debug;
+    Units units = {
+        .context = opts->context,
+        .cache = unit_cached ? units_cache(&unit_cache, opts) : NULL,
+        .program = *pr,
+        .externs = import_externs(imports, &all),
+        .level = opts->level,
+        .chunk = opts->fast ? CHUNK_SIZE : 0,
+        .steps = opts->steps,
+        .debug = opts->debug ? source : NULL,
+    };
+    LLVMModuleRef module = gen_units(&units, opts->threads);
+    if (opts->steps) {
+        gen_budget(module, opts->steps);
+    }
+    stats_end(PHASE_CODEGEN);
+    stats_begin(PHASE_LINK);
+    link_program(module, libs, imports->size, opts->level);
+    stats_end(PHASE_LINK);
+
+    free(units.externs.items);
+    free(units.externs.imports.items);
+    free(all.items);
+    free(libs);
+    return module;
+}
+
+// Returns the source file, or NULL when there is none
+char *parse_options(Options *opts, int argc, char **argv)
+{
+    char *source = NULL;
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--ir") == 0) {
+            opts->use_ir = true;
+        } else if (strcmp(argv[i], "--emit-ir") == 0) {
+            opts->emit_ir = true;
+        } else if (strcmp(argv[i], "--use-profile") == 0 && i + 1 < argc) {
+            opts->profile = argv[++i];
+        } else if (strcmp(argv[i], "--cache-dir") == 0 && i + 1 < argc) {
+            opts->cache_dir = argv[++i];
+        } else if (strcmp(argv[i], "--obj") == 0 && i + 1 < argc) {
+            opts->object = argv[++i];
+        } else if (strcmp(argv[i], "-o") == 0 && i + 1 < argc) {
+            opts->output = argv[++i];
+        } else if (strcmp(argv[i], "-j") == 0 && i + 1 < argc) {
+            opts->threads = atoi(argv[++i]);
+            if (opts->threads == 0) {
+                opts->threads = 1;
+            }
+        } else if (strcmp(argv[i], "--serve") == 0 && i + 1 < argc) {
+            opts->serve = argv[++i];
+        } else if (strcmp(argv[i], "--max-steps") == 0 && i + 1 < argc) {
+            opts->steps = strtoul(argv[++i], NULL, 10);
+        } else if (strcmp(argv[i], "--stats") == 0 || strcmp(argv[i], "--time-report") == 0) {
+            opts->stats = STATS_TEXT;
+        } else if (strcmp(argv[i], "--stats=json") == 0) {
+            opts->stats = STATS_JSON;
+        } else if (strcmp(argv[i], "--fast") == 0) {
+            opts->fast = true;
+        } else if (strcmp(argv[i], "-S") == 0) {
+            opts->text = true;
+        } else if (strcmp(argv[i], "-g") == 0) {
+            opts->debug = true;
+        } else if (strncmp(argv[i], "-O", 2) == 0
+                && argv[i][2] >= '0' && argv[i][2] <= '3') {
+            opts->level = argv[i][2] - '0';
+        } else {
+            source = argv[i];
+        }
+    }
+
+    // Fast compilation is meant for huge generated programs, it
+    // skips the optimizer, splits main in chunks and compiles the
+    // objects with FastISel
+    if (opts->fast) {
+        opts->level = 0;
+    }
+    return source;
+}
+
+void compile_file(char *source, Options *opts)
+{
+    Buffer b;
+    v_init(b);
+    FILE *f = fopen(source, "r");
+    if (f == NULL) {
+        error_report(E_IO, 0, "Could not open file %s\n", source);
+    }
+    get_content(f, &b);
+    fclose(f);
+
+    // The debug info and the imports name the file by its
+    // absolute path, so that the sources are found from anywhere
+    char *path = opts->debug ? realpath(source, NULL) : NULL;
+    if (path) {
+        source = path;
+    }
+
+    // Lex
+    stats_begin(PHASE_LEX);
+    Lexer l;
+    lexer_init(&l, b.items);
+    get_tokens(&l);
+    stats_end(PHASE_LEX);
+
+    // Parse
+    stats_begin(PHASE_PARSE);
+    Parser p;
+    parser_init(&p, &l);
+    Program pr = parse_program(&p);
+    stats_end(PHASE_PARSE);
+    stats_begin(PHASE_IMPORT);
+    Imports imports;
+    imports_load(&imports, &pr, source);
+    stats_end(PHASE_IMPORT);
+    stats.tokens = l.size;
+    stats_program(&pr);
+    for (size_t i = 0; i < imports.size; i++) {
+        stats.tokens += imports.items[i]->lexer.size;
+        stats_program(&imports.items[i]->program);
+    }
+
+    // The cache directory comes from --cache-dir or from the
+    // L_CACHE_DIR environment variable, the key covers the source,
+    // the imported files and every option that changes the code
+    Cache cache;
+    bool cached = false;
+    bool use_cache = opts->cache_dir && !opts->emit_ir;
+    LLVMModuleRef module = NULL;
+    if (use_cache) {
+        cache_init(&cache, opts->cache_dir);
+        cache_add(&cache, b.items, b.size);
+        for (size_t i = 0; i < imports.size; i++) {
+            Import *imp = imports.items[i];
+            cache_add(&cache, imp->content.items, imp->content.size);
+        }
+        char options[64];
+        snprintf(options, sizeof(options), "-O%d %d %d %zu %d", opts->level, opts->use_ir,
+            opts->fast, opts->steps, opts->debug);
+        cache_add(&cache, options, strlen(options));
+        if (opts->debug) {
+            cache_add(&cache, source, strlen(source));
+        }
+        if (opts->profile) {
+            cache_add_file(&cache, opts->profile);
+        }
+        cached = cache_exists(&cache, opts->object != NULL);
+    }
+
+    // A hit only copies the files of the entry, the module
+    // is parsed again only to print it as text
+    if (cached && opts->text) {
+        module = cache_load(&cache, opts->context);
+        cached = module != NULL;
+    }
+    if (cached) {
+        stats_begin(PHASE_EMIT);
+        if (opts->object) {
+            cache_copy(&cache, ".o", opts->object, NULL);
+        }
+        if (opts->text) {
+            write_module(module, opts->output, true, opts->out);
+        } else {
+            cache_copy(&cache, ".bc", opts->output, opts->out);
+        }
+        stats_end(PHASE_EMIT);
+    } else {
+        module = compile(&pr, &imports, source, opts);
+    }
+    if (cached || module == NULL) {
+        program_free(&pr);
+        imports_free(&imports);
+        lexer_free(&l);
+        free(b.items);
+        free(path);
+        return;
+    }
+
+    stats_begin(PHASE_EMIT);
+    LLVMMemoryBufferRef bitcode = module_bitcode(module);
+    if (use_cache) {
+        cache_store(&cache, module, bitcode, opts->fast, opts->object != NULL);
+    }
+
+    if (opts->object) {
+        if (use_cache) {
+            cache_copy(&cache, ".o", opts->object, NULL);
+        } else {
+            emit_object(module, opts->object, opts->fast);
+        }
+    }
+
+    if (opts->text) {
+        write_module(module, opts->output, true, opts->out);
+    } else {
+        write_buffer(bitcode, opts->output, opts->out);
+    }
+    LLVMDisposeMemoryBuffer(bitcode);
+    LLVMDisposeModule(module);
+    stats_end(PHASE_EMIT);
+
+    program_free(&pr);
+    imports_free(&imports);
+    lexer_free(&l);
+    free(b.items);
+    free(path);
+}
+
+// COMPILE SERVER
+// codegen --serve path listens on a Unix socket and compiles every
+// request on its own thread, in its own LLVM context. The process
+// stays warm between requests: LLVM is initialized once, the host
+// target is queried once and the cache directory of the server is
+// the default of the requests. A request is the working directory
+// of the client followed by its arguments, NUL terminated, and the
+// client sends its standard output with the request so that the
+// output is written there directly. The reply is the status and
+// the error message, if any. The memory of a failed compilation is
+// not released. Requests larger than SERVE_MAX_REQUEST are dropped,
+// at most SERVE_MAX_WORKERS are compiled at a time and the next
+// connections wait in the backlog of the socket.
+
+static sem_t serve_slots;
+
+// Paths of the requests are relative to the client
+char *serve_path(char *cwd, char *path)
+{
+    if (path == NULL || path[0] == '/') {
+        return path;
+    }
+    char *joined = malloc(strlen(cwd) + strlen(path) + 2);
+    sprintf(joined, "%s/%s", cwd, path);
+    return joined;
+}
+
+// Reads the size of the request and the output of the client
+bool serve_recv_header(int conn, uint32_t *size, int *fd)
+{
+    char control[CMSG_SPACE(sizeof(int))];
+    struct iovec iov = {
+        .iov_base = size,
+        .iov_len = sizeof(uint32_t),
+    };
+    struct msghdr msg = {
+        .msg_iov = &iov,
+        .msg_iovlen = 1,
+        .msg_control = control,
+        .msg_controllen = sizeof(control),
+    };
+    if (recvmsg(conn, &msg, MSG_WAITALL) != sizeof(uint32_t)) {
+        return false;
+    }
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+    if (cmsg == NULL || cmsg->cmsg_type != SCM_RIGHTS) {
+        return false;
+    }
+    memcpy(fd, CMSG_DATA(cmsg), sizeof(int));
+    return true;
+}
+
+typedef struct {
+    int conn;
+    Options *defaults;
+} Request;
+
+void *serve_request(void *arg)
+{
+    Request *req = arg;
+    int conn = req->conn;
+    Options opts = *req->defaults;
+    free(req);
+
+    uint32_t size;
+    int fd;
+    if (!serve_recv_header(conn, &size, &fd)) {
+        close(conn);
+        return NULL;
+    }
+    if (size == 0 || size > SERVE_MAX_REQUEST) {
+        close(fd);
+        close(conn);
+        return NULL;
+    }
+    char *data = malloc((size_t)size + 1);
+    if (recv(conn, data, size, MSG_WAITALL) != (ssize_t)size) {
+        free(data);
+        close(fd);
+        close(conn);
+        return NULL;
+    }
+    data[size] = 0;
+
+    // The working directory takes the place of argv[0]
+    char **argv = malloc((size + 1) * sizeof(char *));
+    int argc = 0;
+    for (uint32_t i = 0; i < size; i += strlen(data + i) + 1) {
+        argv[argc++] = data + i;
+    }
+    char *cwd = argv[0];
+
+    opts.context = LLVMContextCreate();
+    opts.out = fdopen(fd, "w");
+    int32_t status = 0;
+    Diagnostic diag = {0};
+    ErrorHandler handler;
+    error_push(&handler);
+    if (setjmp(handler.env) == 0) {
+        char *source = parse_options(&opts, argc, argv);
+        if (source == NULL) {
+            error_report(E_IO, 0, "No source file\n");
+        }
+        if (opts.serve || opts.emit_ir || opts.stats) {
+            error_report(E_IO, 0, "--serve, --emit-ir and --stats are not supported by the server\n");
+        }
+        opts.profile = serve_path(cwd, opts.profile);
+        opts.cache_dir = serve_path(cwd, opts.cache_dir);
+        opts.object = serve_path(cwd, opts.object);
+        opts.output = serve_path(cwd, opts.output);
+        compile_file(serve_path(cwd, source), &opts);
+        error_pop(&handler);
+    } else {
+        diag = handler.diag;
+        status = 1;
+    }
+    fclose(opts.out);
+    LLVMContextDispose(opts.context);
+
+    send(conn, &status, sizeof(status), MSG_NOSIGNAL);
+    send(conn, diag.message, strlen(diag.message), MSG_NOSIGNAL);
+    close(conn);
+    free(argv);
+    free(data);
+    return NULL;
+}
+
+// Gives the slot of the request back when it is done
+void *serve_worker(void *arg)
+{
+    serve_request(arg);
+    sem_post(&serve_slots);
+    return NULL;
+}
+
+void serve(char *path, Options *defaults)
+{
+    int sock = socket(AF_UNIX, SOCK_STREAM, 0);
+    struct sockaddr_un addr = {
+        .sun_family = AF_UNIX,
+    };
+    if (sock < 0 || strlen(path) >= sizeof(addr.sun_path)) {
+        printf("Could not create socket %s\n", path);
+        exit(1);
+    }
+    strcpy(addr.sun_path, path);
+    unlink(path);
+    if (bind(sock, (struct sockaddr *)&addr, sizeof(addr)) || listen(sock, 64)) {
+        printf("Could not listen on socket %s\n", path);
+        exit(1);
+    }
+    signal(SIGPIPE, SIG_IGN);
+    defaults->serve = NULL;
+    LLVMDisposeTargetMachine(host_machine());
+    sem_init(&serve_slots, 0, SERVE_MAX_WORKERS);
+
+    for (;;) {
+        sem_wait(&serve_slots);
+        int conn = accept(sock, NULL, NULL);
+        if (conn < 0) {
+            sem_post(&serve_slots);
+            continue;
+        }
+        Request *req = malloc(sizeof(Request));
+        req->conn = conn;
+        req->defaults = defaults;
+        pthread_t thread;
+        if (pthread_create(&thread, NULL, serve_worker, req)) {
+            close(conn);
+            free(req);
+            sem_post(&serve_slots);
+            continue;
+        }
+        pthread_detach(thread);
+    }
+}
+
+int main(int argc, char **argv)
+{
+    Options opts = {
+        .context = LLVMGetGlobalContext(),
+        .out = stdout,
+        .cache_dir = getenv("L_CACHE_DIR"),
+        .threads = pool_threads(),
+    };
+    char *source = parse_options(&opts, argc, argv);
+
+    if (opts.serve) {
+        serve(opts.serve, &opts);
+    }
+
+    if (source == NULL) {
+        printf("Usage: %s [-O0|-O1|-O2|-O3] [--fast] [-g] [-S] [-o file] [-j threads] [--ir]\n"
+               "       [--emit-ir] [--use-profile file] [--cache-dir dir] [--obj file.o]\n"
+               "       [--max-steps n] [--stats[=json]] <source.l>\n"
+               "       %s --serve socket [--cache-dir dir]\n",
+               argv[0], argv[0]);
+        exit(1);
+    }
+
+    stats_enable(opts.stats);
+    compile_file(source, &opts);
+    stats_print(stderr);
+    return 0;
+}
@@ -0,0 +1,90 @@
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "error.h"
+
+// ERRORS
+// The command line tools print a message and exit on any error,
+// a host running scripts in its own process cannot. Errors are
+// raised to the innermost handler of the thread, which is pushed
+// before calling into the language:
+//
+//   ErrorHandler handler;
+//   error_push(&handler);
+//   if (setjmp(handler.env) == 0) {
+//       ...
+//       error_pop(&handler);
+//   } else {
+//       handler.diag has the error, the handler is already popped
+//   }
+//
+// Without a handler the message is printed on the standard output
+// and the process exits like before, see BUDGET_STATUS. Messages
+// are written to the stream returned by error_stream, so they can
+// be composed with the print functions. Memory allocated by the
+// failed code is not released.
+
+static _Thread_local ErrorHandler *current = NULL;
+
+void error_push(ErrorHandler *handler)
+{
+    handler->stream = NULL;
+    handler->buffer = NULL;
+    handler->size = 0;
+    handler->upper = current;
+    current = handler;
+}
+
+void error_pop(ErrorHandler *handler)
+{
+    current = handler->upper;
+}
+
+FILE *error_stream(void)
+{
+    if (current == NULL) {
+        return stdout;
+    }
+    if (current->stream == NULL) {
+        current->stream = open_memstream(&current->buffer, &current->size);
+    }
+    return current->stream;
+}
+
+_Noreturn void error_raise(ErrorKind kind, size_t line)
+{
+    ErrorHandler *handler = current;
+    if (handler == NULL) {
+        exit(kind == E_BUDGET ? BUDGET_STATUS : 1);
+    }
+    error_pop(handler);
+
+    handler->diag.kind = kind;
+    handler->diag.line = line;
+    handler->diag.message[0] = 0;
+    if (handler->stream) {
+        fclose(handler->stream);
+        size_t size = handler->size;
+        while (size > 0 && handler->buffer[size - 1] == '\n') {
+            size--;
+        }
+        if (size >= sizeof(handler->diag.message)) {
+            size = sizeof(handler->diag.message) - 1;
+        }
+        memcpy(handler->diag.message, handler->buffer, size);
+        handler->diag.message[size] = 0;
+        free(handler->buffer);
+    }
+    longjmp(handler->env, 1);
+}
+
+_Noreturn void error_report(ErrorKind kind, size_t line, const char *fmt, ...)
+{
+    va_list args;
+    va_start(args, fmt);
+    vfprintf(error_stream(), fmt, args);
+    va_end(args);
+    error_raise(kind, line);
+}
@@ -0,0 +1,44 @@
+#ifndef ERROR_H
+#define ERROR_H
+
+#include <setjmp.h>
+#include <stddef.h>
+#include <stdio.h>
+
+typedef enum {
+    E_OK,
+    E_IO,
+    E_SYNTAX,
+    E_RUNTIME,
+    E_CODEGEN,
+    E_BUDGET,
+} ErrorKind;
+
+// Exit status of the command line tools when a run exceeds its
+// budget, the one of timeout(1), any other error exits with 1
+#define BUDGET_STATUS 124
+
+// Line is 0 when the error is not about a line of the source
+typedef struct {
+    ErrorKind kind;
+    size_t line;
+    char message[256];
+} Diagnostic;
+
+typedef struct errorhandler ErrorHandler;
+typedef struct errorhandler {
+    jmp_buf env;
+    Diagnostic diag;
+    FILE *stream;
+    char *buffer;
+    size_t size;
+    ErrorHandler *upper;
+} ErrorHandler;
+
+void error_push(ErrorHandler *handler);
+void error_pop(ErrorHandler *handler);
+FILE *error_stream(void);
+_Noreturn void error_raise(ErrorKind kind, size_t line);
+_Noreturn void error_report(ErrorKind kind, size_t line, const char *fmt, ...);
+
+#endif
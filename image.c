@@ -0,0 +1,573 @@
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "vector.h"
+#include "error.h"
+#include "lexer.h"
+#include "ir.h"
+#include "image.h"
+
+// BYTECODE IMAGES
+// A program lowered to the IR and optimized is written as an image
+// that the interpreter maps and runs in place: there is nothing to
+// lex, parse or lower, and since the image holds offsets and never
+// pointers the pages are shared by all the processes mapping it.
+//
+// The image is a header followed by the function table, the code,
+// the constant pool and the symbol table. The code of a function is
+// a stream of 32 bit words, every value of the IR has a register.
+// Phis become parallel moves on the edges that reach their block: a
+// branch is preceded by the moves of its target, the edges of a
+// conditional branch that need moves go through a stub after the
+// block. Images are checked when they are opened so that a bad one
+// is an error and never a crash, they are not trusted otherwise.
+
+typedef struct {
+    size_t size;
+    size_t capacity;
+    uint32_t *items;
+} Words;
+
+typedef struct {
+    size_t size;
+    size_t capacity;
+    double *items;
+} Doubles;
+
+typedef struct {
+    size_t size;
+    size_t capacity;
+    ImageFunc *items;
+} ImageFuncs;
+
+typedef struct {
+    size_t pos;
+    IrBlock *from;
+    IrBlock *to;
+} Edge;
+
+typedef struct {
+    size_t size;
+    size_t capacity;
+    Edge *items;
+} Edges;
+
+typedef struct {
+    IrModule *module;
+    ImageFuncs funcs;
+    Words code;
+    Doubles consts;
+    Buffer symbols;
+} ImageWriter;
+
+uint32_t image_symbol(ImageWriter *w, char *name)
+{
+    uint32_t offset = w->symbols.size;
+    for (size_t i = 0; i <= strlen(name); i++) {
+        v_append(w->symbols, name[i]);
+    }
+    return offset;
+}
+
+uint32_t image_func_index(IrModule *module, IrFunc *func)
+{
+    for (size_t i = 0; i < module->size; i++) {
+        if (module->items[i] == func) {
+            return i;
+        }
+    }
+    error_report(E_CODEGEN, 0, "Call to a function outside of the module\n");
+}
+
+// The moves of the phis of to for the edge coming from from
+void image_moves(ImageWriter *w, IrBlock *from, IrBlock *to)
+{
+    size_t k = 0;
+    while (to->preds.items[k] != from) {
+        k++;
+    }
+    size_t nphis = 0;
+    while (nphis < to->instrs.size && to->instrs.items[nphis]->op == I_PHI) {
+        nphis++;
+    }
+    if (nphis == 0) {
+        return;
+    }
+    v_append(w->code, B_MOVES);
+    v_append(w->code, nphis);
+    for (size_t i = 0; i < nphis; i++) {
+        IrInstr *phi = to->instrs.items[i];
+        v_append(w->code, phi->id);
+        v_append(w->code, phi->ops.items[k]->id);
+    }
+}
+
+bool image_has_phis(IrBlock *block)
+{
+    return block->instrs.size > 0 && block->instrs.items[0]->op == I_PHI;
+}
+
+void image_instr(ImageWriter *w, IrBlock *block, IrInstr *instr, Edges *fixups,
+        Edges *stubs)
+{
+    static const ByteOp ops[] = {
+        [I_COPY] = B_COPY, [I_ADD] = B_ADD, [I_SUB] = B_SUB, [I_MUL] = B_MUL,
+        [I_DIV] = B_DIV, [I_LT] = B_LT, [I_GT] = B_GT, [I_EQ] = B_EQ,
+        [I_NE] = B_NE, [I_NEG] = B_NEG, [I_NOT] = B_NOT,
+    };
+
+    switch (instr->op) {
+    case I_PHI:
+        break;
+    case I_COPY:
+    case I_NEG:
+    case I_NOT:
+    case I_ADD:
+    case I_SUB:
+    case I_MUL:
+    case I_DIV:
+    case I_LT:
+    case I_GT:
+    case I_EQ:
+    case I_NE:
+        v_append(w->code, ops[instr->op]);
+        v_append(w->code, instr->id);
+        for (size_t i = 0; i < instr->ops.size; i++) {
+            v_append(w->code, instr->ops.items[i]->id);
+        }
+        break;
+    case I_CALL:
+        v_append(w->code, B_CALL);
+        v_append(w->code, instr->id);
+        v_append(w->code, image_func_index(w->module, instr->callee));
+        v_append(w->code, instr->ops.size);
+        for (size_t i = 0; i < instr->ops.size; i++) {
+            v_append(w->code, instr->ops.items[i]->id);
+        }
+        break;
+    case I_BR: {
+        image_moves(w, block, instr->targets[0]);
+        v_append(w->code, B_BR);
+        Edge edge = { w->code.size, block, instr->targets[0] };
+        v_append(*fixups, edge);
+        v_append(w->code, 0);
+        break;
+    }
+    case I_CONDBR:
+        v_append(w->code, B_CONDBR);
+        v_append(w->code, instr->ops.items[0]->id);
+        for (size_t i = 0; i < 2; i++) {
+            Edge edge = { w->code.size, block, instr->targets[i] };
+            if (image_has_phis(edge.to)) {
+                v_append(*stubs, edge);
+            } else {
+                v_append(*fixups, edge);
+            }
+            v_append(w->code, 0);
+        }
+        break;
+    case I_RET:
+        v_append(w->code, B_RET);
+        v_append(w->code, instr->ops.items[0]->id);
+        break;
+    default:
+        error_report(E_CODEGEN, 0, "Cannot write IR instruction '%d'\n", instr->op);
+    }
+}
+
+void image_func(ImageWriter *w, IrFunc *func)
+{
+    ir_number(func);
+    ImageFunc f = {
+        .name = image_symbol(w, func->name.data),
+        .line = func->name.line,
+        .nparams = func->params.size,
+        .nregs = func->nvalues,
+        .consts = w->consts.size,
+        .nconsts = func->consts.size,
+        .code = w->code.size,
+    };
+    for (size_t i = 0; i < func->consts.size; i++) {
+        v_append(w->consts, func->consts.items[i]->n);
+    }
+
+    // Targets are patched once every block has its offset
+    size_t *starts = malloc((func->blocks.size + 1) * sizeof(size_t));
+    Edges fixups;
+    v_init(fixups);
+    for (size_t i = 0; i < func->blocks.size; i++) {
+        IrBlock *block = func->blocks.items[i];
+        starts[block->id] = w->code.size - f.code;
+
+        Edges stubs;
+        v_init(stubs);
+        for (size_t j = 0; j < block->instrs.size; j++) {
+            image_instr(w, block, block->instrs.items[j], &fixups, &stubs);
+        }
+        for (size_t j = 0; j < stubs.size; j++) {
+            Edge stub = stubs.items[j];
+            w->code.items[stub.pos] = w->code.size - f.code;
+            image_moves(w, stub.from, stub.to);
+            v_append(w->code, B_BR);
+            Edge edge = { w->code.size, stub.from, stub.to };
+            v_append(fixups, edge);
+            v_append(w->code, 0);
+        }
+        free(stubs.items);
+    }
+    for (size_t i = 0; i < fixups.size; i++) {
+        Edge edge = fixups.items[i];
+        w->code.items[edge.pos] = starts[edge.to->id];
+    }
+    free(fixups.items);
+    free(starts);
+
+    f.size = w->code.size - f.code;
+    v_append(w->funcs, f);
+}
+
+// Writes the module, main is its last function
+void image_write(IrModule *module, char *path)
+{
+    ImageWriter w = { .module = module };
+    v_init(w.funcs);
+    v_init(w.code);
+    v_init(w.consts);
+    v_init(w.symbols);
+    for (size_t i = 0; i < module->size; i++) {
+        image_func(&w, module->items[i]);
+    }
+
+    // The constants are aligned for the doubles to be read in place
+    ImageHeader header = {
+        .magic = IMAGE_MAGIC,
+        .version = IMAGE_VERSION,
+        .nfuncs = w.funcs.size,
+        .main = w.funcs.size - 1,
+        .funcs = sizeof(ImageHeader),
+        .ncode = w.code.size,
+        .nconsts = w.consts.size,
+        .nsymbols = w.symbols.size,
+    };
+    header.code = header.funcs + w.funcs.size * sizeof(ImageFunc);
+    size_t end = header.code + w.code.size * sizeof(uint32_t);
+    size_t pad = (8 - end % 8) % 8;
+    header.consts = end + pad;
+    header.symbols = header.consts + w.consts.size * sizeof(double);
+    header.size = header.symbols + w.symbols.size;
+
+    FILE *f = fopen(path, "wb");
+    if (f == NULL) {
+        error_report(E_IO, 0, "Could not open file %s\n", path);
+    }
+    uint64_t zero = 0;
+    fwrite(&header, sizeof(header), 1, f);
+    fwrite(w.funcs.items, sizeof(ImageFunc), w.funcs.size, f);
+    fwrite(w.code.items, sizeof(uint32_t), w.code.size, f);
+    fwrite(&zero, 1, pad, f);
+    fwrite(w.consts.items, sizeof(double), w.consts.size, f);
+    fwrite(w.symbols.items, 1, w.symbols.size, f);
+    bool failed = ferror(f) != 0;
+    if (fclose(f) || failed) {
+        error_report(E_IO, 0, "Could not write file %s\n", path);
+    }
+
+    free(w.funcs.items);
+    free(w.code.items);
+    free(w.consts.items);
+    free(w.symbols.items);
+}
+
+// Returns the number of words of the instruction at pc, or 0 when
+// it is unknown or does not fit in the code of the function
+uint64_t image_len(const uint32_t *code, uint32_t pc, uint32_t size)
+{
+    uint64_t len = 0;
+    switch (code[pc]) {
+    case B_COPY:
+    case B_NEG:
+    case B_NOT:
+        len = 3;
+        break;
+    case B_ADD:
+    case B_SUB:
+    case B_MUL:
+    case B_DIV:
+    case B_LT:
+    case B_GT:
+    case B_EQ:
+    case B_NE:
+    case B_CONDBR:
+        len = 4;
+        break;
+    case B_CALL:
+        len = pc + 3 < size ? 4 + (uint64_t)code[pc + 3] : 0;
+        break;
+    case B_MOVES:
+        len = pc + 1 < size ? 2 + 2 * (uint64_t)code[pc + 1] : 0;
+        break;
+    case B_BR:
+    case B_RET:
+        len = 2;
+        break;
+    }
+    return pc + len <= size ? len : 0;
+}
+
+// Checks that every instruction only uses registers of the function,
+// that calls pass the right number of arguments and that branches
+// land on instructions. Returns NULL or the error.
+char *image_check_func(Image *image, const ImageFunc *func)
+{
+    const uint32_t *code = image->code + func->code;
+    uint32_t size = func->size;
+    bool *starts = calloc(size + 1, sizeof(bool));
+    char *error = NULL;
+
+    uint32_t pc = 0;
+    uint32_t op = B_COPY;
+    while (error == NULL && pc < size) {
+        uint64_t len = image_len(code, pc, size);
+        if (len == 0) {
+            error = "bad instruction";
+            break;
+        }
+        starts[pc] = true;
+        op = code[pc];
+
+        // The words that are registers
+        uint32_t first = 1;
+        uint32_t last = len;
+        if (op == B_CALL) {
+            uint32_t callee = code[pc + 2];
+            if (callee >= image->header->nfuncs
+                    || image->funcs[callee].nparams != code[pc + 3]) {
+                error = "bad call";
+            }
+            first = 4;
+            if (code[pc + 1] >= func->nregs) {
+                error = "register out of range";
+            }
+        } else if (op == B_MOVES) {
+            first = 2;
+        } else if (op == B_BR) {
+            last = 1;
+        } else if (op == B_CONDBR) {
+            last = 2;
+        }
+        for (uint32_t i = first; i < last; i++) {
+            if (code[pc + i] >= func->nregs) {
+                error = "register out of range";
+            }
+        }
+        pc += len;
+    }
+    if (error == NULL && op != B_BR && op != B_CONDBR && op != B_RET) {
+        error = "function does not end with a branch";
+    }
+
+    for (pc = 0; error == NULL && pc < size; pc += image_len(code, pc, size)) {
+        uint32_t first = code[pc] == B_BR ? 1 : 2;
+        uint32_t last = code[pc] == B_BR ? 2 : code[pc] == B_CONDBR ? 4 : 0;
+        for (uint32_t i = first; i < last; i++) {
+            if (code[pc + i] >= size || !starts[code[pc + i]]) {
+                error = "branch out of the code";
+            }
+        }
+    }
+    free(starts);
+    return error;
+}
+
+char *image_check(Image *image)
+{
+    const ImageHeader *h = image->header;
+    if (image->size < sizeof(ImageHeader) || memcmp(h->magic, IMAGE_MAGIC, 4) != 0) {
+        return "not an image";
+    }
+    if (h->version != IMAGE_VERSION) {
+        return "unsupported version";
+    }
+    if (h->size != image->size) {
+        return "truncated";
+    }
+    uint64_t size = image->size;
+    if (h->funcs % sizeof(uint32_t) || h->code % sizeof(uint32_t)
+            || h->consts % sizeof(double)) {
+        return "misaligned section";
+    }
+    if ((uint64_t)h->funcs + (uint64_t)h->nfuncs * sizeof(ImageFunc) > size
+            || (uint64_t)h->code + (uint64_t)h->ncode * sizeof(uint32_t) > size
+            || (uint64_t)h->consts + (uint64_t)h->nconsts * sizeof(double) > size
+            || (uint64_t)h->symbols + h->nsymbols > size) {
+        return "section out of range";
+    }
+    if (h->nsymbols == 0 || image->symbols[h->nsymbols - 1] != '\0') {
+        return "bad symbol table";
+    }
+    if (h->main >= h->nfuncs || image->funcs[h->main].nparams != 0) {
+        return "bad main function";
+    }
+
+    for (uint32_t i = 0; i < h->nfuncs; i++) {
+        const ImageFunc *func = &image->funcs[i];
+        if (func->name >= h->nsymbols
+                || (uint64_t)func->consts + func->nconsts > h->nconsts
+                || (uint64_t)func->nparams + func->nconsts > func->nregs
+                || (uint64_t)func->code + func->size > h->ncode) {
+            return "bad function table";
+        }
+        // Every other register is written by an instruction or a
+        // move, which take at least two words: this bounds the
+        // registers that are allocated on the stack by a call
+        if (func->nregs > (uint64_t)func->nparams + func->nconsts + func->size) {
+            return "bad function table";
+        }
+        char *error = image_check_func(image, func);
+        if (error) {
+            return error;
+        }
+    }
+    return NULL;
+}
+
+// The image is mapped read only and checked, nothing is copied
+void image_open(Image *image, char *path)
+{
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        error_report(E_IO, 0, "Could not open file %s\n", path);
+    }
+    struct stat st;
+    if (fstat(fd, &st) || st.st_size == 0) {
+        close(fd);
+        error_report(E_IO, 0, "Invalid image %s: empty\n", path);
+    }
+    image->size = st.st_size;
+    image->base = mmap(NULL, image->size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (image->base == MAP_FAILED) {
+        error_report(E_IO, 0, "Could not map file %s\n", path);
+    }
+
+    char *base = image->base;
+    image->header = image->base;
+    if (image->size >= sizeof(ImageHeader)) {
+        image->funcs = (const ImageFunc *)(base + image->header->funcs);
+        image->code = (const uint32_t *)(base + image->header->code);
+        image->consts = (const double *)(base + image->header->consts);
+        image->symbols = base + image->header->symbols;
+    }
+    char *error = image_check(image);
+    if (error) {
+        munmap(image->base, image->size);
+        error_report(E_IO, 0, "Invalid image %s: %s\n", path, error);
+    }
+}
+
+double image_call(Image *image, uint32_t index, double *args)
+{
+    const ImageFunc *func = &image->funcs[index];
+    const uint32_t *code = image->code + func->code;
+    double regs[func->nregs + 1];
+    if (func->nparams) {
+        memcpy(regs, args, func->nparams * sizeof(double));
+    }
+    memcpy(regs + func->nparams, image->consts + func->consts,
+        func->nconsts * sizeof(double));
+
+    uint32_t pc = 0;
+    for (;;) {
+        const uint32_t *in = code + pc;
+        switch (in[0]) {
+        case B_COPY:
+            regs[in[1]] = regs[in[2]];
+            pc += 3;
+            break;
+        case B_ADD:
+            regs[in[1]] = regs[in[2]] + regs[in[3]];
+            pc += 4;
+            break;
+        case B_SUB:
+            regs[in[1]] = regs[in[2]] - regs[in[3]];
+            pc += 4;
+            break;
+        case B_MUL:
+            regs[in[1]] = regs[in[2]] * regs[in[3]];
+            pc += 4;
+            break;
+        case B_DIV:
+            regs[in[1]] = regs[in[2]] / regs[in[3]];
+            pc += 4;
+            break;
+        case B_LT:
+            regs[in[1]] = regs[in[2]] < regs[in[3]];
+            pc += 4;
+            break;
+        case B_GT:
+            regs[in[1]] = regs[in[2]] > regs[in[3]];
+            pc += 4;
+            break;
+        case B_EQ:
+            regs[in[1]] = regs[in[2]] == regs[in[3]];
+            pc += 4;
+            break;
+        case B_NE:
+            regs[in[1]] = regs[in[2]] != regs[in[3]];
+            pc += 4;
+            break;
+        case B_NEG:
+            regs[in[1]] = -regs[in[2]];
+            pc += 3;
+            break;
+        case B_NOT:
+            regs[in[1]] = regs[in[2]] == 0;
+            pc += 3;
+            break;
+        case B_CALL: {
+            uint32_t argc = in[3];
+            double call_args[argc + 1];
+            for (uint32_t i = 0; i < argc; i++) {
+                call_args[i] = regs[in[4 + i]];
+            }
+            regs[in[1]] = image_call(image, in[2], call_args);
+            pc += 4 + argc;
+            break;
+        }
+        case B_MOVES: {
+            uint32_t n = in[1];
+            double values[n + 1];
+            for (uint32_t i = 0; i < n; i++) {
+                values[i] = regs[in[3 + 2 * i]];
+            }
+            for (uint32_t i = 0; i < n; i++) {
+                regs[in[2 + 2 * i]] = values[i];
+            }
+            pc += 2 + 2 * n;
+            break;
+        }
+        case B_BR:
+            pc = in[1];
+            break;
+        case B_CONDBR:
+            pc = regs[in[1]] != 0 ? in[2] : in[3];
+            break;
+        case B_RET:
+            return regs[in[1]];
+        }
+    }
+}
+
+int image_run(Image *image)
+{
+    return image_call(image, image->header->main, NULL);
+}
+
+void image_close(Image *image)
+{
+    munmap(image->base, image->size);
+}
@@ -0,0 +1,83 @@
+#ifndef IMAGE_H
+#define IMAGE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "ir.h"
+
+// Bumped whenever the layout of the image or the bytecode
+// changes, images of other versions are rejected
+#define IMAGE_MAGIC "LIMG"
+#define IMAGE_VERSION 1
+
+// The operands are registers unless said otherwise,
+// targets are word offsets in the code of the function
+typedef enum {
+    B_COPY,   // dst a
+    B_ADD,    // dst a b
+    B_SUB,    // dst a b
+    B_MUL,    // dst a b
+    B_DIV,    // dst a b
+    B_LT,     // dst a b
+    B_GT,     // dst a b
+    B_EQ,     // dst a b
+    B_NE,     // dst a b
+    B_NEG,    // dst a
+    B_NOT,    // dst a
+    B_CALL,   // dst func argc args...
+    B_MOVES,  // n (dst src)...
+    B_BR,     // target
+    B_CONDBR, // cond then else
+    B_RET,    // value
+} ByteOp;
+
+// All the offsets are from the start of the image, which holds
+// no pointer: it runs where it is mapped without relocation
+typedef struct {
+    char magic[4];
+    uint32_t version;
+    uint32_t size;
+    uint32_t nfuncs;
+    uint32_t main;
+    uint32_t funcs;
+    uint32_t code;
+    uint32_t ncode;
+    uint32_t consts;
+    uint32_t nconsts;
+    uint32_t symbols;
+    uint32_t nsymbols;
+} ImageHeader;
+
+// The registers of the parameters come first, then the ones of
+// the constants, filled from the pool. The name is an offset in
+// the symbol table, the line is the one of the definition: the
+// IR does not keep the lines of the instructions.
+typedef struct {
+    uint32_t name;
+    uint32_t line;
+    uint32_t nparams;
+    uint32_t nregs;
+    uint32_t consts;
+    uint32_t nconsts;
+    uint32_t code;
+    uint32_t size;
+} ImageFunc;
+
+typedef struct {
+    void *base;
+    size_t size;
+    const ImageHeader *header;
+    const ImageFunc *funcs;
+    const uint32_t *code;
+    const double *consts;
+    const char *symbols;
+} Image;
+
+void image_write(IrModule *module, char *path);
+void image_open(Image *image, char *path);
+double image_call(Image *image, uint32_t index, double *args);
+int image_run(Image *image);
+void image_close(Image *image);
+
+#endif
@@ -0,0 +1,157 @@
+#include <stdbool.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "vector.h"
+#include "error.h"
+#include "lexer.h"
+#include "parser.h"
+#include "import.h"
+
+// IMPORTS
+// import "path"; makes the functions of another file callable.
+// Imported files can only define functions and import other
+// files, paths are relative to the file containing the import.
+// Every file is lexed and parsed once, then the interpreter
+// splices the functions into the program while the code generator
+// compiles every file as a separate unit and links them together.
+
+// Returns the canonical path, so that the same file
+// imported with different paths is loaded once
+char *import_path(char *from, char *path)
+{
+    char *slash = strrchr(from, '/');
+    size_t dirlen = slash && path[0] != '/' ? (size_t)(slash - from + 1) : 0;
+    char *joined = malloc(dirlen + strlen(path) + 1);
+    memcpy(joined, from, dirlen);
+    strcpy(joined + dirlen, path);
+
+    char *resolved = realpath(joined, NULL);
+    if (resolved == NULL) {
+        error_report(E_IO, 0, "Could not open file %s\n", joined);
+    }
+    free(joined);
+    return resolved;
+}
+
+// Loads the file and, recursively, the files it imports,
+// returns its index in imports
+size_t import_file(Imports *imports, char *from, Token path)
+{
+    char *resolved = import_path(from, path.data);
+    for (size_t i = 0; i < imports->size; i++) {
+        if (strcmp(imports->items[i]->path, resolved) == 0) {
+            free(resolved);
+            return i;
+        }
+    }
+
+    Import *imp = malloc(sizeof(Import));
+    imp->path = resolved;
+    v_init(imp->deps);
+    v_init(imp->content);
+    FILE *f = fopen(resolved, "r");
+    if (f == NULL) {
+        error_report(E_IO, 0, "Could not open file %s\n", resolved);
+    }
+    get_content(f, &imp->content);
+    fclose(f);
+
+    lexer_init(&imp->lexer, imp->content.items);
+    get_tokens(&imp->lexer);
+    Parser p;
+    parser_init(&p, &imp->lexer);
+    imp->program = parse_program(&p);
+    for (size_t i = 0; i < imp->program.size; i++) {
+        if (imp->program.items[i].type != S_FUNC) {
+            error_report(E_SYNTAX, 0, "Imported file %s can only define functions\n", resolved);
+        }
+    }
+
+    // The file is added before its imports so that
+    // import cycles terminate
+    size_t index = imports->size;
+    v_append(*imports, imp);
+    for (size_t i = 0; i < imp->program.imports.size; i++) {
+        size_t dep = import_file(imports, imp->path, imp->program.imports.items[i]);
+        v_append(imp->deps, dep);
+    }
+    return index;
+}
+
+// Loads all the files imported by the program in the file source
+void imports_load(Imports *imports, Program *pr, char *source)
+{
+    v_init(*imports);
+    for (size_t i = 0; i < pr->imports.size; i++) {
+        import_file(imports, source, pr->imports.items[i]);
+    }
+}
+
+void closure_visit(Imports *imports, size_t index, bool *seen, Deps *deps)
+{
+    Import *imp = imports->items[index];
+    for (size_t i = 0; i < imp->deps.size; i++) {
+        size_t dep = imp->deps.items[i];
+        if (!seen[dep]) {
+            seen[dep] = true;
+            v_append(*deps, dep);
+            closure_visit(imports, dep, seen, deps);
+        }
+    }
+}
+
+// The files imported directly or indirectly by a file, without
+// the file itself, always in the same order
+void import_closure(Imports *imports, size_t index, Deps *deps)
+{
+    v_init(*deps);
+    bool *seen = calloc(imports->size, sizeof(bool));
+    seen[index] = true;
+    closure_visit(imports, index, seen, deps);
+    free(seen);
+}
+
+// The functions of the files, the statements are shared
+// with the imports and must not be freed
+Program import_externs(Imports *imports, Deps *deps)
+{
+    Program externs;
+    v_init(externs);
+    v_init(externs.imports);
+    for (size_t i = 0; i < deps->size; i++) {
+        Program *pr = &imports->items[deps->items[i]]->program;
+        for (size_t j = 0; j < pr->size; j++) {
+            v_append(externs, pr->items[j]);
+        }
+    }
+    return externs;
+}
+
+// Moves the functions of all the imported files at the end of the
+// program, the statements of the program keep their position so
+// that profiles of the program stay valid
+void imports_splice(Program *pr, Imports *imports)
+{
+    for (size_t i = 0; i < imports->size; i++) {
+        Program *imported = &imports->items[i]->program;
+        for (size_t j = 0; j < imported->size; j++) {
+            v_append(*pr, imported->items[j]);
+        }
+        imported->size = 0;
+    }
+}
+
+void imports_free(Imports *imports)
+{
+    for (size_t i = 0; i < imports->size; i++) {
+        Import *imp = imports->items[i];
+        program_free(&imp->program);
+        lexer_free(&imp->lexer);
+        free(imp->content.items);
+        free(imp->deps.items);
+        free(imp->path);
+        free(imp);
+    }
+    free(imports->items);
+}
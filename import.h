@@ -0,0 +1,37 @@
+#ifndef IMPORT_H
+#define IMPORT_H
+
+#include "lexer.h"
+#include "parser.h"
+
+typedef struct {
+    size_t size;
+    size_t capacity;
+    size_t *items;
+} Deps;
+
+// A file is loaded once however many files import it, deps
+// are the indices of the files it imports directly
+typedef struct {
+    char *path;
+    Buffer content;
+    Lexer lexer;
+    Program program;
+    Deps deps;
+} Import;
+
+typedef struct {
+    size_t size;
+    size_t capacity;
+    Import **items;
+} Imports;
+
+char *import_path(char *from, char *path);
+size_t import_file(Imports *imports, char *from, Token path);
+void imports_load(Imports *imports, Program *pr, char *source);
+void import_closure(Imports *imports, size_t index, Deps *deps);
+Program import_externs(Imports *imports, Deps *deps);
+void imports_splice(Program *pr, Imports *imports);
+void imports_free(Imports *imports);
+
+#endif
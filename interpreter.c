@@ -4,6 +4,12 @@
 #include "lexer.h"
 #include "parser.h"
 #include "interpreter.h"
+#include "tier.h"
+#include "snapshot.h"
+#include "budget.h"
+#include "lineprof.h"
+#include "stats.h"
+#include "error.h"
 
 Token bool_negate(Token t)
 {
@@ -19,22 +25,47 @@ Token bool_negate(Token t)
             return make_token(T_TRUE);
         }
     } else {
-        printf("Cannot negate token '");
-        print_token(t);
-        printf("'\n");
-        exit(1);
+        fprintf(error_stream(), "Cannot negate token '");
+        fprint_token(error_stream(), t);
+        fprintf(error_stream(), "'\n");
+        error_raise(E_RUNTIME, 0);
     }
 }
 
-Token double_negate(Token t)
+// Numbers computed by a run, its variables, functions and the
+// arguments of its calls are allocated in the arena of the run
+// when it has one, they are then released all at once when the
+// run ends, even when it is aborted by an error. Numbers are
+// charged to the heap budget of the run when it has one.
+static _Thread_local Arena *numbers = NULL;
+static _Thread_local Budget *heap = NULL;
+
+void *run_alloc(size_t size)
 {
-    double n = ((double *)t.data)[0];
-    n = -n;
-    double *n_new = malloc(sizeof(double));
+    return numbers ? arena_alloc(numbers, size) : malloc(size);
+}
+
+void run_free(void *ptr)
+{
+    if (numbers == NULL) {
+        free(ptr);
+    }
+}
+
+Token make_number(double n)
+{
+    budget_alloc(heap, sizeof(double));
+    double *n_new = run_alloc(sizeof(double));
     memcpy(n_new, &n, sizeof(double));
     return make_double(n_new);
 }
 
+Token double_negate(Token t)
+{
+    double n = ((double *)t.data)[0];
+    return make_number(-n);
+}
+
 Token eval_unexpr(UnExpr unexpr, Env *env)
 {
     Token arg = eval_expr(unexpr.expr, env);
@@ -44,41 +75,62 @@ Token eval_unexpr(UnExpr unexpr, Env *env)
     case T_MINUS:
         return double_negate(arg);
     default:
-        printf("Token '");
-        print_token(unexpr.op);
-        printf("' is not a unary operator\n");
-        exit(1);
+        fprintf(error_stream(), "Token '");
+        fprint_token(error_stream(), unexpr.op);
+        fprintf(error_stream(), "' is not a unary operator\n");
+        error_raise(E_RUNTIME, 0);
     }
 }
 
+// Logical operators only evaluate the right operand when
+// the left one does not already decide the result
+Token eval_logicexpr(BinExpr binexpr, Env *env)
+{
+    bool lb = is_thruty(eval_expr(binexpr.lexpr, env));
+    if (binexpr.op.type == T_AND && !lb) {
+        return make_token(T_FALSE);
+    }
+    if (binexpr.op.type == T_OR && lb) {
+        return make_token(T_TRUE);
+    }
+
+    bool rb = is_thruty(eval_expr(binexpr.rexpr, env));
+    return rb
+        ? make_token(T_TRUE)
+        : make_token(T_FALSE);
+}
+
 Token eval_binexpr(BinExpr binexpr, Env *env)
 {
+    if (binexpr.op.type == T_AND || binexpr.op.type == T_OR) {
+        return eval_logicexpr(binexpr, env);
+    }
+
     Token lt = eval_expr(binexpr.lexpr, env);
     Token rt = eval_expr(binexpr.rexpr, env);
 
     if (lt.type != T_DOUBLE || rt.type != T_DOUBLE) {
-        printf("Binary expression must be between two doubles\n");
-        exit(1);
+        error_report(E_RUNTIME, 0, "Binary expression must be between two doubles\n");
     }
-    double *n_new = malloc(sizeof(double));
+    double n;
 
     switch (binexpr.op.type) {
     case T_PLUS:
-        *n_new = get_ddata(lt) + get_ddata(rt);
+        n = get_ddata(lt) + get_ddata(rt);
         break;
     case T_MINUS:
-        *n_new = get_ddata(lt) - get_ddata(rt);
+        n = get_ddata(lt) - get_ddata(rt);
         break;
     case T_STAR:
-        *n_new = get_ddata(lt) * get_ddata(rt);
+        n = get_ddata(lt) * get_ddata(rt);
         break;
     case T_SLASH:
-        *n_new = get_ddata(lt) / get_ddata(rt);
+        n = get_ddata(lt) / get_ddata(rt);
         break;
     case T_EQUAL: {
         Token lvalue = binexpr.lexpr.as->termexpr.term;
         env_assign(env, lvalue, rt);
-        *n_new = get_ddata(rt);
+        n = get_ddata(rt);
         break;
     case T_LESS: {
         double ltd = get_ddata(lt);
@@ -97,14 +149,170 @@ Token eval_binexpr(BinExpr binexpr, Env *env)
         return get_ddata(lt) == get_ddata(rt)
             ? make_token(T_TRUE)
             : make_token(T_FALSE);
+    case T_BANG_EQUAL:
+        return get_ddata(lt) != get_ddata(rt)
+            ? make_token(T_TRUE)
+            : make_token(T_FALSE);
     default:
-        printf("Binary operation '");
-        print_token(binexpr.op);
-        printf("' is not supported\n");
-        exit(1);
+        fprintf(error_stream(), "Binary operation '");
+        fprint_token(error_stream(), binexpr.op);
+        fprintf(error_stream(), "' is not supported\n");
+        error_raise(E_RUNTIME, 0);
     }
 
-    return make_double(n_new);
+    return make_number(n);
+}
+
+// QUICKENING
+// The most common shapes of binary expressions are rewritten
+// in place into fused versions that only look up each variable
+// once and skip the generic dispatch. A node is rewritten after
+// it has been evaluated successfully a few times, since the
+// generic evaluation only succeeds on doubles. The fused version
+// guards the type of its variables and deoptimizes back to the
+// generic evaluation when the guard fails.
+bool is_name(Expr expr)
+{
+    return expr.type == TERMINAL
+        && expr.as->termexpr.term.type == T_NAME;
+}
+
+bool is_const(Expr expr)
+{
+    return expr.type == TERMINAL
+        && expr.as->termexpr.term.type == T_DOUBLE;
+}
+
+void quick_shape(BinExpr *binexpr)
+{
+    Quick *q = &binexpr->quick;
+    q->state = Q_NEVER;
+    switch (binexpr->op.type) {
+    case T_EQUAL: {
+        // x = x op y
+        Expr rexpr = binexpr->rexpr;
+        if (!is_name(binexpr->lexpr) || rexpr.type != BINARY) {
+            return;
+        }
+        BinExpr inner = rexpr.as->binexpr;
+        Token x = binexpr->lexpr.as->termexpr.term;
+        if (!is_name(inner.lexpr)
+                || token_cmp(x, inner.lexpr.as->termexpr.term) != 0) {
+            return;
+        }
+        switch (inner.op.type) {
+        case T_PLUS:
+        case T_MINUS:
+        case T_STAR:
+        case T_SLASH:
+            break;
+        default:
+            return;
+        }
+        if (is_const(inner.rexpr)) {
+            q->shape = Q_ASSIGN_CONST;
+            q->c = get_ddata(inner.rexpr.as->termexpr.term);
+        } else if (is_name(inner.rexpr)) {
+            q->shape = Q_ASSIGN_LOCAL;
+            q->y = inner.rexpr.as->termexpr.term;
+        } else {
+            return;
+        }
+        q->x = x;
+        q->op = inner.op.type;
+        q->state = Q_WARMUP;
+        break;
+    }
+    case T_LESS:
+    case T_GREATER:
+    case T_2EQUAL:
+    case T_BANG_EQUAL:
+        // x < 1
+        if (is_name(binexpr->lexpr) && is_const(binexpr->rexpr)) {
+            q->shape = Q_CMP_CONST;
+            q->x = binexpr->lexpr.as->termexpr.term;
+            q->c = get_ddata(binexpr->rexpr.as->termexpr.term);
+            q->op = binexpr->op.type;
+            q->state = Q_WARMUP;
+        }
+        break;
+    default:
+        break;
+    }
+}
+
+// Quickened nodes of shared programs are never rewritten
+// again, a failed guard only falls back to the generic path
+void quick_observe(BinExpr *binexpr)
+{
+    Quick *q = &binexpr->quick;
+    if (q->state == Q_UNSEEN) {
+        quick_shape(binexpr);
+    }
+    if (q->state == Q_WARMUP && ++q->count >= QUICK_THRESHOLD) {
+        q->state = Q_ACTIVE;
+    }
+}
+
+bool quick_deopt(Quick *q, bool shared)
+{
+    if (shared) {
+        return false;
+    }
+    q->count = 0;
+    q->state = ++q->deopts >= QUICK_MAX_DEOPTS
+        ? Q_NEVER
+        : Q_WARMUP;
+    return false;
+}
+
+double quick_apply(TokenType op, double x, double y)
+{
+    switch (op) {
+    case T_PLUS: return x + y;
+    case T_MINUS: return x - y;
+    case T_STAR: return x * y;
+    case T_SLASH: return x / y;
+    case T_LESS: return x < y;
+    case T_GREATER: return x > y;
+    case T_2EQUAL: return x == y;
+    case T_BANG_EQUAL: return x != y;
+    default: return 0;
+    }
+}
+
+// Returns false when a type guard fails, the expression
+// must then be evaluated by the generic path
+bool eval_quick(BinExpr *binexpr, Env *env, Token *res)
+{
+    Quick *q = &binexpr->quick;
+    EnvNode *x = env_lookup(env, q->x);
+    if (x == NULL || x->rvalue.type != T_DOUBLE) {
+        return quick_deopt(q, env->interp->shared);
+    }
+    double xd = get_ddata(x->rvalue);
+
+    switch (q->shape) {
+    case Q_ASSIGN_CONST:
+        x->rvalue = make_number(quick_apply(q->op, xd, q->c));
+        *res = x->rvalue;
+        return true;
+    case Q_ASSIGN_LOCAL: {
+        EnvNode *y = env_lookup(env, q->y);
+        if (y == NULL || y->rvalue.type != T_DOUBLE) {
+            return quick_deopt(q, env->interp->shared);
+        }
+        x->rvalue = make_number(quick_apply(q->op, xd, get_ddata(y->rvalue)));
+        *res = x->rvalue;
+        return true;
+    }
+    case Q_CMP_CONST:
+        *res = quick_apply(q->op, xd, q->c)
+            ? make_token(T_TRUE)
+            : make_token(T_FALSE);
+        return true;
+    }
+    return quick_deopt(q, env->interp->shared);
 }
 
 Token eval_termexpr(TermExpr termexpr, Env *env)
@@ -118,33 +326,112 @@ Token eval_termexpr(TermExpr termexpr, Env *env)
     case T_NAME:
         return env_get(env, termexpr.term);
     default:
-        printf("Could not evaluate literal '");
-        print_token(termexpr.term);
-        printf("'\n");
-        exit(1);
+        fprintf(error_stream(), "Could not evaluate literal '");
+        fprint_token(error_stream(), termexpr.term);
+        fprintf(error_stream(), "'\n");
+        error_raise(E_RUNTIME, 0);
     }
 }
 
+// Functions are evaluated in a new root environment that
+// only contains the arguments, the caller's variables are
+// not visible from the function body
+Token eval_callexpr(CallExpr callexpr, Env *env)
+{
+    Interp *interp = env->interp;
+    FnNode *fn = fn_get(interp->funcs, callexpr.name);
+    if (fn == NULL) {
+        fprintf(error_stream(), "Undefined function '");
+        fprint_token(error_stream(), callexpr.name);
+        fprintf(error_stream(), "' at line %zu\n", callexpr.name.line);
+        error_raise(E_RUNTIME, callexpr.name.line);
+    }
+
+    FuncStmt *func = fn->func;
+    if (callexpr.args.size != func->args.size) {
+        fprintf(error_stream(), "Wrong number of arguments to '");
+        fprint_token(error_stream(), callexpr.name);
+        fprintf(error_stream(), "' at line %zu\n", callexpr.name.line);
+        error_raise(E_RUNTIME, callexpr.name.line);
+    }
+
+    Token *args = run_alloc(callexpr.args.size * sizeof(Token));
+    for (size_t i = 0; i < callexpr.args.size; i++) {
+        args[i] = eval_expr(callexpr.args.items[i], env);
+    }
+
+    fn->calls++;
+    budget_step(interp->budget);
+    Token ret;
+    if (interp->tier && tier_call(interp->tier, interp->funcs, fn, args, &ret)) {
+        run_free(args);
+        return ret;
+    }
+
+    Env fenv = {
+        .interp = interp,
+        .ret = make_number(0),
+    };
+    for (size_t i = 0; i < func->args.size; i++) {
+        env_define(&fenv, func->args.items[i], args[i]);
+    }
+    run_free(args);
+
+    budget_enter(interp->budget);
+    if (interp->lineprof) {
+        lineprof_call(interp->lineprof, func);
+    }
+    Block block = func->block;
+    for (size_t i = 0; i < block.size; i++) {
+        if (eval_stmt(block.items[i], &fenv)) {
+            break;
+        }
+    }
+    if (interp->lineprof) {
+        lineprof_return(interp->lineprof);
+    }
+    budget_leave(interp->budget);
+
+    free_env(&fenv);
+    return fenv.ret;
+}
+
 Token eval_expr(Expr expr, Env *env)
 {
     switch (expr.type) {
     case UNARY:
         return eval_unexpr(expr.as->unexpr, env);
-    case BINARY:
-        return eval_binexpr(expr.as->binexpr, env);
+    case BINARY: {
+        BinExpr *binexpr = &expr.as->binexpr;
+        Token res;
+        if (binexpr->quick.state == Q_ACTIVE
+                && eval_quick(binexpr, env, &res)) {
+            return res;
+        }
+        res = eval_binexpr(*binexpr, env);
+        if (!env->interp->shared) {
+            quick_observe(binexpr);
+        }
+        return res;
+    }
     case GROUPING:
         return eval_expr(expr.as->groupexpr.expr, env);
     case TERMINAL:
         return eval_termexpr(expr.as->termexpr, env);
+    case CALL:
+        return eval_callexpr(expr.as->callexpr, env);
     default:
-        printf("Expression '");
-        print_expr(expr);
-        printf("' is not supported\n");
-        exit(1);
+        fprintf(error_stream(), "Expression '");
+        fprint_expr(error_stream(), expr);
+        fprintf(error_stream(), "' is not supported\n");
+        error_raise(E_RUNTIME, 0);
     }
 }
 
-void eval_letstmt(LetStmt letstmt, Env *env)
+// Statements return true when a return statement has been
+// executed, the returned value is stored in the root environment
+// and the enclosing statements stop evaluating
+bool eval_letstmt(LetStmt letstmt, Env *env)
 {
     Token name = letstmt.name;
     Token value = eval_expr(letstmt.value, env);
@@ -154,6 +441,7 @@ void eval_letstmt(LetStmt letstmt, Env *env)
     // printf("' to '");
     // print_token(name);
     // printf("'\n");
+    return false;
 }
 
 bool is_thruty(Token t)
@@ -167,101 +455,555 @@ bool is_thruty(Token t)
     return false;
 }
 
-void eval_ifstmt(IfStmt ifstmt, Env *env)
+// Branches and loops count how many times their condition was
+// true and false, the counters are written by --emit-profile.
+// Shared programs are not profiled, the counters would be
+// written by all the threads running the program
+void prof_count(size_t *counter, Env *env)
+{
+    if (!env->interp->shared) {
+        (*counter)++;
+    }
+}
+
+bool eval_ifstmt(IfStmt *ifstmt, Env *env)
 {
-    Token cond = eval_expr(ifstmt.cond, env);
+    Token cond = eval_expr(ifstmt->cond, env);
     if (is_thruty(cond)) {
-        eval_stmt(ifstmt.thenb, env);
+        prof_count(&ifstmt->prof.taken, env);
+        return eval_stmt(ifstmt->thenb, env);
+    } else {
+        prof_count(&ifstmt->prof.skipped, env);
+        return eval_stmt(ifstmt->elseb, env);
+    }
+}
+
+// COUNTED LOOPS
+// Loops counting a variable up (or down) to a bound that the body
+// does not modify are run as a C loop on an unboxed counter. The
+// condition and the step are not evaluated as expressions, the
+// counter is only stored in the environment when the body reads
+// it and when the loop ends. Profiled runs take the general path,
+// the step of a while loop is a statement the profiler counts.
+void expr_uses(Expr expr, Token name, bool *reads, bool *writes)
+{
+    switch (expr.type) {
+    case UNARY:
+        expr_uses(expr.as->unexpr.expr, name, reads, writes);
+        break;
+    case BINARY: {
+        BinExpr binexpr = expr.as->binexpr;
+        if (binexpr.op.type == T_EQUAL && is_name(binexpr.lexpr)
+                && token_cmp(binexpr.lexpr.as->termexpr.term, name) == 0) {
+            *writes = true;
+        } else {
+            expr_uses(binexpr.lexpr, name, reads, writes);
+        }
+        expr_uses(binexpr.rexpr, name, reads, writes);
+        break;
+    }
+    case GROUPING:
+        expr_uses(expr.as->groupexpr.expr, name, reads, writes);
+        break;
+    case TERMINAL:
+        if (is_name(expr) && token_cmp(expr.as->termexpr.term, name) == 0) {
+            *reads = true;
+        }
+        break;
+    case CALL: {
+        // Functions cannot see the variables of the caller
+        Exprs args = expr.as->callexpr.args;
+        for (size_t i = 0; i < args.size; i++) {
+            expr_uses(args.items[i], name, reads, writes);
+        }
+        break;
+    }
+    }
+}
+
+// Shadowing the name with let counts as a write
+void stmt_uses(Stmt stmt, Token name, bool *reads, bool *writes)
+{
+    switch (stmt.type) {
+    case S_LET:
+        if (token_cmp(stmt.as->letstmt.name, name) == 0) {
+            *writes = true;
+        }
+        expr_uses(stmt.as->letstmt.value, name, reads, writes);
+        break;
+    case S_IF:
+        expr_uses(stmt.as->ifstmt.cond, name, reads, writes);
+        stmt_uses(stmt.as->ifstmt.thenb, name, reads, writes);
+        stmt_uses(stmt.as->ifstmt.elseb, name, reads, writes);
+        break;
+    case S_FOR:
+        expr_uses(stmt.as->forstmt.init, name, reads, writes);
+        expr_uses(stmt.as->forstmt.cond, name, reads, writes);
+        expr_uses(stmt.as->forstmt.step, name, reads, writes);
+        stmt_uses(stmt.as->forstmt.thenb, name, reads, writes);
+        break;
+    case S_WHILE:
+        expr_uses(stmt.as->whilestmt.cond, name, reads, writes);
+        stmt_uses(stmt.as->whilestmt.thenb, name, reads, writes);
+        break;
+    case S_BLOCK: {
+        Block block = stmt.as->blockstmt.block;
+        for (size_t i = 0; i < block.size; i++) {
+            stmt_uses(block.items[i], name, reads, writes);
+        }
+        break;
+    }
+    case S_EXPR:
+        expr_uses(stmt.as->exprstmt.expr, name, reads, writes);
+        break;
+    case S_RET:
+        expr_uses(stmt.as->retstmt.expr, name, reads, writes);
+        break;
+    case S_FUNC:
+        *writes = true;
+        break;
+    }
+}
+
+// Analyzes the loop once, body does not include the step
+// and skip is the number of trailing statements of a block
+// body to ignore (the step of a while loop)
+void counted_shape(Counted *c, Expr cond, Expr step, Stmt thenb, size_t skip)
+{
+    c->state = C_NEVER;
+
+    // i < n
+    if (cond.type != BINARY) {
+        return;
+    }
+    BinExpr cmp = cond.as->binexpr;
+    if ((cmp.op.type != T_LESS && cmp.op.type != T_GREATER)
+            || !is_name(cmp.lexpr)
+            || (!is_name(cmp.rexpr) && !is_const(cmp.rexpr))) {
+        return;
+    }
+    Token i = cmp.lexpr.as->termexpr.term;
+
+    // i = i + k
+    if (step.type != BINARY) {
+        return;
+    }
+    BinExpr assign = step.as->binexpr;
+    if (assign.op.type != T_EQUAL || !is_name(assign.lexpr)
+            || token_cmp(assign.lexpr.as->termexpr.term, i) != 0
+            || assign.rexpr.type != BINARY) {
+        return;
+    }
+    BinExpr incr = assign.rexpr.as->binexpr;
+    if ((incr.op.type != T_PLUS && incr.op.type != T_MINUS)
+            || !is_name(incr.lexpr)
+            || token_cmp(incr.lexpr.as->termexpr.term, i) != 0
+            || !is_const(incr.rexpr)) {
+        return;
+    }
+    double k = get_ddata(incr.rexpr.as->termexpr.term);
+
+    // The body must not write i or n
+    bool reads = false;
+    bool writes = false;
+    bool nreads = false;
+    bool nwrites = false;
+    if (thenb.type == S_BLOCK) {
+        Block block = thenb.as->blockstmt.block;
+        for (size_t j = 0; j + skip < block.size; j++) {
+            stmt_uses(block.items[j], i, &reads, &writes);
+            if (is_name(cmp.rexpr)) {
+                stmt_uses(block.items[j], cmp.rexpr.as->termexpr.term,
+                        &nreads, &nwrites);
+            }
+        }
     } else {
-        eval_stmt(ifstmt.elseb, env);
+        stmt_uses(thenb, i, &reads, &writes);
+        if (is_name(cmp.rexpr)) {
+            stmt_uses(thenb, cmp.rexpr.as->termexpr.term, &nreads, &nwrites);
+        }
+    }
+    if (writes || nwrites) {
+        return;
     }
+
+    c->state = C_COUNTED;
+    c->i = i;
+    c->bound = cmp.rexpr;
+    c->cmp = cmp.op.type;
+    c->k = incr.op.type == T_PLUS ? k : -k;
+    c->reads = reads;
 }
 
-void eval_forstmt(ForStmt forstmt, Env *env)
+void counted_for(ForStmt *forstmt)
 {
-    eval_expr(forstmt.init, env);
-    // Token term = eval_expr(forstmt.cond, env);
-    // print_token(term);
-    // is_thruty(term);
-    while (is_thruty(eval_expr(forstmt.cond, env))) {
-        eval_expr(forstmt.step, env);
-        eval_stmt(forstmt.thenb, env);
+    counted_shape(&forstmt->counted, forstmt->cond, forstmt->step,
+            forstmt->thenb, 0);
+}
+
+void counted_while(WhileStmt *whilestmt)
+{
+    whilestmt->counted.state = C_NEVER;
+    Stmt thenb = whilestmt->thenb;
+    if (thenb.type == S_BLOCK && thenb.as->blockstmt.block.size > 0) {
+        Block block = thenb.as->blockstmt.block;
+        Stmt last = block.items[block.size - 1];
+        if (last.type == S_EXPR) {
+            counted_shape(&whilestmt->counted, whilestmt->cond,
+                    last.as->exprstmt.expr, thenb, 1);
+        }
     }
 }
 
-void eval_whilestmt(WhileStmt whilestmt, Env *env)
+// Returns false when the variables are not doubles, the loop is
+// then evaluated generically, otherwise the result of the loop
+// is stored in returned
+bool eval_counted(Counted *c, Stmt thenb, size_t skip, BranchProfile *prof,
+        Env *env, bool *returned)
 {
-    while (is_thruty(eval_expr(whilestmt.cond, env))) {
-        eval_stmt(whilestmt.thenb, env);
+    EnvNode *in = env_lookup(env, c->i);
+    Token bound = eval_expr(c->bound, env);
+    if (in == NULL || in->rvalue.type != T_DOUBLE || bound.type != T_DOUBLE) {
+        return false;
     }
+
+    double i = get_ddata(in->rvalue);
+    double n = get_ddata(bound);
+    double k = c->k;
+    bool less = c->cmp == T_LESS;
+    *returned = false;
+
+    while (less ? i < n : i > n) {
+        prof_count(&prof->taken, env);
+        budget_step(env->interp->budget);
+        if (c->reads) {
+            in->rvalue = make_number(i);
+        }
+
+        if (skip) {
+            // While loops, the step is the last statement of the body
+            Block block = thenb.as->blockstmt.block;
+            Env localenv = {0};
+            localenv.upper = env;
+            localenv.interp = env->interp;
+            for (size_t j = 0; j + skip < block.size && !*returned; j++) {
+                *returned = eval_stmt(block.items[j], &localenv);
+            }
+            free_env(&localenv);
+        } else {
+            *returned = eval_stmt(thenb, env);
+        }
+
+        if (*returned) {
+            break;
+        }
+        i += k;
+    }
+    if (!*returned) {
+        prof_count(&prof->skipped, env);
+    }
+
+    in->rvalue = make_number(i);
+    return true;
+}
+
+// The tier is notified on every back edge and may run
+// the rest of the loop as native code
+bool eval_forstmt(ForStmt *forstmt, Env *env)
+{
+    Tier *tier = env->interp->tier;
+    eval_expr(forstmt->init, env);
+
+    Counted *c = &forstmt->counted;
+    if (c->state == C_UNSEEN) {
+        counted_for(forstmt);
+    }
+    bool returned;
+    if (c->state == C_COUNTED && tier == NULL && env->interp->lineprof == NULL
+            && eval_counted(c, forstmt->thenb, 0, &forstmt->prof, env, &returned)) {
+        return returned;
+    }
+
+    while (is_thruty(eval_expr(forstmt->cond, env))) {
+        prof_count(&forstmt->prof.taken, env);
+        budget_step(env->interp->budget);
+        if (eval_stmt(forstmt->thenb, env)) {
+            return true;
+        }
+        eval_expr(forstmt->step, env);
+        if (tier && tier_loop(tier, forstmt->cond, &forstmt->step,
+                    forstmt->thenb, forstmt->hints, env)) {
+            return false;
+        }
+    }
+    prof_count(&forstmt->prof.skipped, env);
+    return false;
 }
 
-void eval_blockstmt(BlockStmt blockstmt, Env *env)
+bool eval_whilestmt(WhileStmt *whilestmt, Env *env)
+{
+    Tier *tier = env->interp->tier;
+
+    Counted *c = &whilestmt->counted;
+    if (c->state == C_UNSEEN) {
+        counted_while(whilestmt);
+    }
+    bool returned;
+    if (c->state == C_COUNTED && tier == NULL && env->interp->lineprof == NULL
+            && eval_counted(c, whilestmt->thenb, 1, &whilestmt->prof, env, &returned)) {
+        return returned;
+    }
+
+    while (is_thruty(eval_expr(whilestmt->cond, env))) {
+        prof_count(&whilestmt->prof.taken, env);
+        budget_step(env->interp->budget);
+        if (eval_stmt(whilestmt->thenb, env)) {
+            return true;
+        }
+        if (tier && tier_loop(tier, whilestmt->cond, NULL,
+                    whilestmt->thenb, whilestmt->hints, env)) {
+            return false;
+        }
+    }
+    prof_count(&whilestmt->prof.skipped, env);
+    return false;
+}
+
+bool eval_blockstmt(BlockStmt blockstmt, Env *env)
 {
     Block block = blockstmt.block;
     Env localenv = {0};
     localenv.upper = env;
-    for (size_t i = 0; i < block.size; i++) {
-        eval_stmt(block.items[i], &localenv);
+    localenv.interp = env->interp;
+    bool returned = false;
+    for (size_t i = 0; i < block.size && !returned; i++) {
+        returned = eval_stmt(block.items[i], &localenv);
     }
+    free_env(&localenv);
+    return returned;
 }
 
-void eval_exprstmt(ExprStmt exprstmt, Env *env)
+bool eval_exprstmt(ExprStmt exprstmt, Env *env)
 {
     Token value = eval_expr(exprstmt.expr, env);
     // print_token(value);
     // print_token(value);
+    return false;
 }
 
-void eval_retstmt(RetStmt retstmt, Env *env)
+bool eval_retstmt(RetStmt retstmt, Env *env)
 {
     Token value = eval_expr(retstmt.expr, env);
-    exit(get_ddata(value));
-    // print_token(value);
-    // print_token(value);
+    while (env->upper) {
+        env = env->upper;
+    }
+    env->ret = value;
+    return true;
 }
 
-void eval_stmt(Stmt stmt, Env *env)
+bool eval_anystmt(Stmt stmt, Env *env)
 {
     // print_stmt(stmt);
 
     switch (stmt.type) {
     case S_LET:
-        eval_letstmt(stmt.as->letstmt, env);
+        return eval_letstmt(stmt.as->letstmt, env);
+    case S_IF:
+        return eval_ifstmt(&stmt.as->ifstmt, env);
+    case S_FOR:
+        return eval_forstmt(&stmt.as->forstmt, env);
+    case S_WHILE:
+        return eval_whilestmt(&stmt.as->whilestmt, env);
+    case S_BLOCK:
+        return eval_blockstmt(stmt.as->blockstmt, env);
+    case S_EXPR:
+        return eval_exprstmt(stmt.as->exprstmt, env);
+    case S_RET:
+        return eval_retstmt(stmt.as->retstmt, env);
+    case S_FUNC:
+        error_report(E_RUNTIME, 0, "Functions can only be defined at the top level\n");
+    default:
+        fprintf(error_stream(), "Statement '");
+        fprint_stmt(error_stream(), stmt);
+        fprintf(error_stream(), "' is not supported\n");
+        error_raise(E_RUNTIME, 0);
+    }
+}
+
+// Blocks are not profiled, their statements are
+bool eval_stmt(Stmt stmt, Env *env)
+{
+    LineProf *prof = env->interp->lineprof;
+    if (prof == NULL || stmt.type == S_BLOCK) {
+        return eval_anystmt(stmt, env);
+    }
+    LineFrame frame;
+    lineprof_enter(prof, stmt, &frame);
+    bool returned = eval_anystmt(stmt, env);
+    lineprof_leave(prof, &frame);
+    return returned;
+}
+
+// SHARED PROGRAMS
+// A program run by several threads at once must not be written
+// while it runs. The loops and the binary expressions are shaped
+// once before sharing it, quickened nodes are active from the
+// start, and the runs of a shared program do not profile or
+// rewrite it.
+void share_expr(Expr expr)
+{
+    switch (expr.type) {
+    case UNARY:
+        share_expr(expr.as->unexpr.expr);
+        break;
+    case BINARY: {
+        BinExpr *binexpr = &expr.as->binexpr;
+        if (binexpr->quick.state == Q_UNSEEN) {
+            quick_shape(binexpr);
+        }
+        if (binexpr->quick.state == Q_WARMUP) {
+            binexpr->quick.state = Q_ACTIVE;
+        }
+        share_expr(binexpr->lexpr);
+        share_expr(binexpr->rexpr);
+        break;
+    }
+    case GROUPING:
+        share_expr(expr.as->groupexpr.expr);
+        break;
+    case TERMINAL:
+        break;
+    case CALL: {
+        Exprs args = expr.as->callexpr.args;
+        for (size_t i = 0; i < args.size; i++) {
+            share_expr(args.items[i]);
+        }
+        break;
+    }
+    }
+}
+
+void share_stmt(Stmt stmt)
+{
+    switch (stmt.type) {
+    case S_LET:
+        share_expr(stmt.as->letstmt.value);
         break;
     case S_IF:
-        eval_ifstmt(stmt.as->ifstmt, env);
+        share_expr(stmt.as->ifstmt.cond);
+        share_stmt(stmt.as->ifstmt.thenb);
+        share_stmt(stmt.as->ifstmt.elseb);
         break;
-    case S_FOR:
-        eval_forstmt(stmt.as->forstmt, env);
+    case S_FOR: {
+        ForStmt *forstmt = &stmt.as->forstmt;
+        if (forstmt->counted.state == C_UNSEEN) {
+            counted_for(forstmt);
+        }
+        share_expr(forstmt->init);
+        share_expr(forstmt->cond);
+        share_expr(forstmt->step);
+        share_stmt(forstmt->thenb);
         break;
-    case S_WHILE:
-        eval_whilestmt(stmt.as->whilestmt, env);
+    }
+    case S_WHILE: {
+        WhileStmt *whilestmt = &stmt.as->whilestmt;
+        if (whilestmt->counted.state == C_UNSEEN) {
+            counted_while(whilestmt);
+        }
+        share_expr(whilestmt->cond);
+        share_stmt(whilestmt->thenb);
         break;
-    case S_BLOCK:
-        eval_blockstmt(stmt.as->blockstmt, env);
+    }
+    case S_BLOCK: {
+        Block block = stmt.as->blockstmt.block;
+        for (size_t i = 0; i < block.size; i++) {
+            share_stmt(block.items[i]);
+        }
         break;
+    }
     case S_EXPR:
-        eval_exprstmt(stmt.as->exprstmt, env);
+        share_expr(stmt.as->exprstmt.expr);
         break;
     case S_RET:
-        eval_retstmt(stmt.as->retstmt, env);
+        share_expr(stmt.as->retstmt.expr);
+        break;
+    case S_FUNC: {
+        Block block = stmt.as->funcstmt.block;
+        for (size_t i = 0; i < block.size; i++) {
+            share_stmt(block.items[i]);
+        }
         break;
-    default:
-        printf("Statement '");
-        print_stmt(stmt);
-        printf("' is not supported\n");
+    }
     }
 }
 
-void eval_program(Program *pr)
+void eval_share(Program *pr)
 {
-    Env env = {0};
     for (size_t i = 0; i < pr->size; i++) {
-        eval_stmt(pr->items[i], &env);
+        share_stmt(pr->items[i]);
+    }
+}
+
+// Functions are defined before evaluating the program so that
+// they can be called before their definition, the value of a
+// top level return statement is the exit code. Without a return
+// the global variables are printed when dump is set. The caller
+// sets the tier, the arena, the budget, the line profiler and
+// whether the program is shared
+int eval_script(Program *pr, Interp *interp, bool dump)
+{
+    numbers = interp->arena;
+    heap = interp->budget;
+    interp->funcs = NULL;
+    for (size_t i = 0; i < pr->size; i++) {
+        if (pr->items[i].type == S_FUNC) {
+            interp->funcs = fn_define(interp->funcs, &pr->items[i].as->funcstmt);
+        }
+    }
+
+    // The statements of the initialization are skipped when
+    // their globals are restored, or saved after them
+    Env env = {0};
+    env.interp = interp;
+    Snapshot *snap = interp->snapshot;
+    size_t skip = snap && snapshot_restore(snap, &env) ? snap->init : 0;
+    size_t ran = 0;
+    bool returned = false;
+    for (size_t i = 0; i < pr->size && !returned; i++) {
+        if (pr->items[i].type == S_FUNC || ran++ < skip) {
+            continue;
+        }
+        returned = eval_stmt(pr->items[i], &env);
+        if (snap && !skip && !returned && ran == snap->init) {
+            snapshot_save(snap, &env);
+        }
+    }
+
+    int status = 0;
+    if (returned) {
+        status = env.ret.type == T_DOUBLE
+            ? get_ddata(env.ret)
+            : is_thruty(env.ret);
+    } else if (dump) {
+        print_env(&env);
     }
-    print_env(&env);
     free_env(&env);
+    free_fn(interp->funcs);
+    numbers = NULL;
+    heap = NULL;
+    return status;
+}
+
+int eval_program(Program *pr, Tier *tier, Snapshot *snapshot, Budget *budget,
+        LineProf *lineprof)
+{
+    Interp interp = {
+        .tier = tier,
+        .snapshot = snapshot,
+        .budget = budget,
+        .lineprof = lineprof,
+    };
+    return eval_script(pr, &interp, true);
 }
 
 int token_cmp(Token t1, Token t2)
@@ -280,13 +1022,13 @@ EnvNode *en_define(EnvNode *en, Token lvalue, Token rvalue)
             en->right = en_define(en->right, lvalue, rvalue);
             return en;
         } else {
-            printf("Variable '");
-            print_token(lvalue);
-            printf("' is already defined\n");
-            exit(1);
+            fprintf(error_stream(), "Variable '");
+            fprint_token(error_stream(), lvalue);
+            fprintf(error_stream(), "' is already defined\n");
+            error_raise(E_RUNTIME, 0);
         }
     } else {
-        en = malloc(sizeof(EnvNode));
+        en = run_alloc(sizeof(EnvNode));
         en->lvalue = lvalue;
         en->rvalue = rvalue;
         en->left = en->right = NULL;
@@ -294,9 +1036,22 @@ EnvNode *en_define(EnvNode *en, Token lvalue, Token rvalue)
     }
 }
 
+// Depth of the node of lvalue, 1 for the root
+size_t en_depth(EnvNode *en, Token lvalue)
+{
+    size_t depth = 1;
+    for (int cmp; (cmp = token_cmp(lvalue, en->lvalue)) != 0; depth++) {
+        en = cmp < 0 ? en->left : en->right;
+    }
+    return depth;
+}
+
 void env_define(Env *env, Token lvalue, Token rvalue)
 {
     env->root = en_define(env->root, lvalue, rvalue);
+    if (stats.format) {
+        stats_node(&stats.envnodes, &stats.envdepth, en_depth(env->root, lvalue));
+    }
 }
 
 EnvNode *en_assign(EnvNode *en, Token lvalue, Token rvalue)
@@ -324,10 +1079,10 @@ void env_assign(Env *env, Token lvalue, Token rvalue)
     } else if (en == NULL && env->upper) {
         env_assign(env->upper, lvalue, rvalue);
     } else {
-        printf("Undefined variable '");
-        print_token(lvalue);
-        printf("' at line %zu\n", lvalue.line);
-        exit(1);
+        fprintf(error_stream(), "Undefined variable '");
+        fprint_token(error_stream(), lvalue);
+        fprintf(error_stream(), "' at line %zu\n", lvalue.line);
+        error_raise(E_RUNTIME, lvalue.line);
     }
 }
 
@@ -347,6 +1102,15 @@ EnvNode *en_get(EnvNode *en, Token lvalue)
     }
 }
 
+EnvNode *env_lookup(Env *env, Token lvalue)
+{
+    EnvNode *en = en_get(env->root, lvalue);
+    if (en == NULL && env->upper) {
+        return env_lookup(env->upper, lvalue);
+    }
+    return en;
+}
+
 Token env_get(Env *env, Token lvalue)
 {
     EnvNode *en = en_get(env->root, lvalue);
@@ -355,10 +1119,59 @@ Token env_get(Env *env, Token lvalue)
     } else if (en == NULL && env->upper) {
         return env_get(env->upper, lvalue);
     } else {
-        printf("Undefined variable '");
-        print_token(lvalue);
-        printf("' at line %zu\n", lvalue.line);
-        exit(1);
+        fprintf(error_stream(), "Undefined variable '");
+        fprint_token(error_stream(), lvalue);
+        fprintf(error_stream(), "' at line %zu\n", lvalue.line);
+        error_raise(E_RUNTIME, lvalue.line);
+    }
+}
+
+FnNode *fn_define(FnNode *fn, FuncStmt *func)
+{
+    if (fn) {
+        int cmp = token_cmp(func->name, fn->name);
+        if (cmp < 0) {
+            fn->left = fn_define(fn->left, func);
+        } else if (cmp > 0) {
+            fn->right = fn_define(fn->right, func);
+        } else {
+            fprintf(error_stream(), "Function '");
+            fprint_token(error_stream(), func->name);
+            fprintf(error_stream(), "' is already defined\n");
+            error_raise(E_RUNTIME, 0);
+        }
+        return fn;
+    } else {
+        fn = run_alloc(sizeof(FnNode));
+        memset(fn, 0, sizeof(FnNode));
+        fn->name = func->name;
+        fn->func = func;
+        return fn;
+    }
+}
+
+FnNode *fn_get(FnNode *fn, Token name)
+{
+    if (fn) {
+        int cmp = token_cmp(name, fn->name);
+        if (cmp < 0) {
+            return fn_get(fn->left, name);
+        } else if (cmp > 0) {
+            return fn_get(fn->right, name);
+        } else {
+            return fn;
+        }
+    } else {
+        return NULL;
+    }
+}
+
+void free_fn(FnNode *fn)
+{
+    if (fn) {
+        free_fn(fn->left);
+        free_fn(fn->right);
+        run_free(fn);
     }
 }
 
@@ -384,7 +1197,7 @@ void free_en(EnvNode *en)
     if (en) {
         free_en(en->left);
         free_en(en->right);
-        free(en);
+        run_free(en);
     }
 }
 
@@ -392,42 +1205,3 @@ void free_env(Env *env)
 {
     free_en(env->root);
 }
-
-int main(int argc, char **argv)
-{
-    if (argc < 2) {
-        printf("Usage: %s <source.l>\n", argv[0]);
-        exit(1);
-    }
-
-    Buffer b;
-    v_init(b);
-    FILE *f = fopen(argv[1], "r");
-    if (f == NULL) {
-        printf("Could not open file %s\n", argv[1]);
-        exit(1);
-    }
-    get_content(f, &b);
-
-    // Lex
-    Lexer l;
-    lexer_init(&l, b.items);
-    get_tokens(&l);
-    // print_tokens(&l);
-
-    // Parse
-    Parser p;
-    parser_init(&p, &l);
-    Program pr = parse_program(&p);
-
-    // Evaluate
-    eval_program(&pr);
-
-    // Free memory
-    program_free(&pr); // Free statements and expressions
-                       // (program)
-    lexer_free(&l); // Free tokens (lexer and parser)
-    free(b.items); // Free content buffer
-
-    return 0;
-}
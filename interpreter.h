@@ -2,6 +2,13 @@
 #define INTERPRETER_H
 
 #include "parser.h"
+#include "arena.h"
+
+// Number of generic evaluations of a binary expression after
+// which it is quickened, and number of failed type guards
+// after which it is never quickened again
+#define QUICK_THRESHOLD 8
+#define QUICK_MAX_DEOPTS 4
 
 typedef struct envnode EnvNode;
 typedef struct envnode {
@@ -11,16 +18,63 @@ typedef struct envnode {
     EnvNode *right;
 } EnvNode;
 
+typedef enum {
+    JIT_NONE,
+    JIT_PENDING,
+    JIT_DONE,
+    JIT_FAILED,
+} JitState;
+
+typedef struct fnnode FnNode;
+typedef struct fnnode {
+    Token name;
+    FuncStmt *func;
+    size_t calls;
+    JitState jit;
+    double (*native)(double *args);
+    FnNode *left;
+    FnNode *right;
+} FnNode;
+
+typedef struct tier Tier;
+typedef struct snapshot Snapshot;
+typedef struct budget Budget;
+typedef struct lineprof LineProf;
+
+// State shared by all the environments of a run, tier
+// is NULL unless hot code is compiled with the JIT. Numbers
+// are allocated in the arena when there is one, shared
+// programs may be run by other threads at the same time.
+// With a snapshot the globals of the initialization are
+// restored from it, or saved in it, see snapshot.c. The run
+// is aborted when it exceeds its budget, see budget.c, and
+// its statements are profiled with a line profiler
+typedef struct {
+    FnNode *funcs;
+    Tier *tier;
+    Arena *arena;
+    bool shared;
+    Snapshot *snapshot;
+    Budget *budget;
+    LineProf *lineprof;
+} Interp;
+
+// Functions and the program have a root environment with
+// no upper environment, it holds the returned value
 typedef struct env Env;
 typedef struct env {
     EnvNode *root;
     Env *upper;
+    Interp *interp;
+    Token ret;
 } Env;
 
+int token_cmp(Token t1, Token t2);
 EnvNode *en_define(EnvNode *en, Token lvalue, Token rvalue);
 void env_define(Env *env, Token lvalue, Token rvalue);
 EnvNode *en_get(EnvNode *en, Token lvalue);
 Token env_get(Env *env, Token lvalue);
+EnvNode *env_lookup(Env *env, Token lvalue);
 EnvNode *en_assign(EnvNode *en, Token lvalue, Token rvalue);
 void env_assign(Env *env, Token lvalue, Token rvalue);
 void free_en(EnvNode *en);
@@ -28,7 +82,20 @@ void free_env(Env *env);
 void print_en(EnvNode *en);
 void print_env(Env *env);
 
+FnNode *fn_define(FnNode *fn, FuncStmt *func);
+FnNode *fn_get(FnNode *fn, Token name);
+void free_fn(FnNode *fn);
+
+Token make_number(double n);
+void quick_observe(BinExpr *binexpr);
+bool eval_quick(BinExpr *binexpr, Env *env, Token *res);
+bool is_thruty(Token t);
 Token eval_expr(Expr expr, Env *env);
-void eval_stmt(Stmt stmt, Env *env);
+bool eval_anystmt(Stmt stmt, Env *env);
+bool eval_stmt(Stmt stmt, Env *env);
+void eval_share(Program *pr);
+int eval_script(Program *pr, Interp *interp, bool dump);
+int eval_program(Program *pr, Tier *tier, Snapshot *snapshot, Budget *budget,
+        LineProf *lineprof);
 
 #endif
@@ -0,0 +1,234 @@
+#include <stdio.h>
+#include <string.h>
+
+#include "lexer.h"
+#include "parser.h"
+#include "interpreter.h"
+#include "tier.h"
+#include "closure.h"
+#include "iropt.h"
+#include "ireval.h"
+#include "image.h"
+#include "snapshot.h"
+#include "budget.h"
+#include "lineprof.h"
+#include "stats.h"
+#include "profile.h"
+#include "import.h"
+#include "repl.h"
+
+int main(int argc, char **argv)
+{
+    char *source = NULL;
+    bool tiered = false;
+    bool perfmap = false;
+    bool closures = false;
+    bool use_ir = false;
+    char *profile = NULL;
+    char *lines = NULL;
+    size_t rate = 0;
+    char *emit_image = NULL;
+    bool image = false;
+    char *snapshot = NULL;
+    size_t init = 0;
+    BudgetLimits limits = {0};
+    size_t threshold = TIER_THRESHOLD;
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--tiered") == 0) {
+            tiered = true;
+        } else if (strcmp(argv[i], "--perf-map") == 0) {
+            perfmap = true;
+        } else if (strcmp(argv[i], "--closure") == 0) {
+            closures = true;
+        } else if (strcmp(argv[i], "--ir") == 0) {
+            use_ir = true;
+        } else if (strcmp(argv[i], "--repl") == 0) {
+            return repl_run(stdin);
+        } else if (strcmp(argv[i], "--emit-profile") == 0 && i + 1 < argc) {
+            profile = argv[++i];
+        } else if (strcmp(argv[i], "--profile") == 0 && i + 1 < argc) {
+            lines = argv[++i];
+        } else if (strcmp(argv[i], "--profile-rate") == 0 && i + 1 < argc) {
+            rate = strtoul(argv[++i], NULL, 10);
+        } else if (strcmp(argv[i], "--stats") == 0 || strcmp(argv[i], "--time-report") == 0) {
+            stats_enable(STATS_TEXT);
+        } else if (strcmp(argv[i], "--stats=json") == 0) {
+            stats_enable(STATS_JSON);
+        } else if (strcmp(argv[i], "--emit-image") == 0 && i + 1 < argc) {
+            emit_image = argv[++i];
+        } else if (strcmp(argv[i], "--image") == 0) {
+            image = true;
+        } else if (strcmp(argv[i], "--snapshot") == 0 && i + 1 < argc) {
+            snapshot = argv[++i];
+        } else if (strcmp(argv[i], "--init") == 0 && i + 1 < argc) {
+            init = strtoul(argv[++i], NULL, 10);
+        } else if (strcmp(argv[i], "--max-steps") == 0 && i + 1 < argc) {
+            limits.steps = strtoul(argv[++i], NULL, 10);
+        } else if (strcmp(argv[i], "--deadline") == 0 && i + 1 < argc) {
+            limits.seconds = strtod(argv[++i], NULL);
+        } else if (strcmp(argv[i], "--max-heap") == 0 && i + 1 < argc) {
+            limits.heap = strtoul(argv[++i], NULL, 10);
+        } else if (strcmp(argv[i], "--max-depth") == 0 && i + 1 < argc) {
+            limits.depth = strtoul(argv[++i], NULL, 10);
+        } else if (strcmp(argv[i], "--tier-threshold") == 0 && i + 1 < argc) {
+            threshold = strtoul(argv[++i], NULL, 10);
+        } else {
+            source = argv[i];
+        }
+    }
+
+    if (source == NULL) {
+        printf("Usage: %s [--tiered [--perf-map]] [--tier-threshold n] [--closure] [--ir]\n"
+               "          [--emit-profile file] [--profile file [--profile-rate hz]] [--stats[=json]]\n"
+               "          [--snapshot file --init n] [--max-steps n] [--deadline seconds]\n"
+               "          [--max-heap bytes] [--max-depth n] <source.l>\n"
+               "       %s --emit-image <image> <source.l>\n"
+               "       %s --image <image>\n"
+               "       %s --repl\n", argv[0], argv[0], argv[0], argv[0]);
+        exit(1);
+    }
+
+    // An image runs without reading any source
+    if (image) {
+        Image img;
+        image_open(&img, source);
+        int status = image_run(&img);
+        image_close(&img);
+        return status;
+    }
+
+    Buffer b;
+    v_init(b);
+    FILE *f = fopen(source, "r");
+    if (f == NULL) {
+        printf("Could not open file %s\n", source);
+        exit(1);
+    }
+    get_content(f, &b);
+
+    // Lex
+    stats_begin(PHASE_LEX);
+    Lexer l;
+    lexer_init(&l, b.items);
+    get_tokens(&l);
+    // print_tokens(&l);
+    stats_end(PHASE_LEX);
+
+    // Parse
+    stats_begin(PHASE_PARSE);
+    Parser p;
+    parser_init(&p, &l);
+    Program pr = parse_program(&p);
+    size_t nmain = pr.size;
+    stats_end(PHASE_PARSE);
+
+    stats_begin(PHASE_IMPORT);
+    Imports imports;
+    imports_load(&imports, &pr, source);
+    imports_splice(&pr, &imports);
+    stats_end(PHASE_IMPORT);
+    stats.tokens = l.size;
+    for (size_t i = 0; i < imports.size; i++) {
+        stats.tokens += imports.items[i]->lexer.size;
+    }
+    stats_program(&pr);
+
+    // Only the tree walking interpreter collects the profile,
+    // compiled code does not update the counters
+    if ((profile || lines) && (tiered || closures || use_ir)) {
+        printf("--emit-profile and --profile cannot be used with --tiered, --closure or --ir\n");
+        exit(1);
+    }
+
+    // The snapshot holds the globals after the first init top
+    // level statements, which only the interpreters evaluate
+    Snapshot snap;
+    if (snapshot && (init == 0 || closures || use_ir)) {
+        printf("--snapshot needs --init and cannot be used with --closure or --ir\n");
+        exit(1);
+    }
+    if (snapshot) {
+        snapshot_init(&snap, snapshot, init, &pr);
+    }
+
+    // Only the JIT of --tiered generates code at run time
+    if (perfmap && !tiered) {
+        printf("--perf-map can only be used with --tiered\n");
+        exit(1);
+    }
+
+    // Only the interpreter and the code it compiles check the budget,
+    // the compiled code only burns the steps
+    Budget budget;
+    bool limited = budget_limited(limits);
+    if (limited && (closures || use_ir)) {
+        printf("--max-steps, --deadline, --max-heap and --max-depth cannot be used"
+               " with --closure or --ir\n");
+        exit(1);
+    }
+    if ((limits.heap || limits.depth) && tiered) {
+        printf("--max-heap and --max-depth cannot be used with --tiered\n");
+        exit(1);
+    }
+
+    // The image holds the program optimized like with --ir
+    if (emit_image) {
+        IrModule *module = ir_lower(&pr);
+        ir_optimize(module, 2);
+        image_write(module, emit_image);
+        ir_free(module);
+        program_free(&pr);
+        imports_free(&imports);
+        lexer_free(&l);
+        free(b.items);
+        return 0;
+    }
+
+    // Evaluate
+    stats_begin(PHASE_EVAL);
+    int status;
+    if (closures) {
+        status = closure_run(&pr);
+    } else if (use_ir) {
+        status = ir_run(&pr, 2);
+    } else {
+        if (limited) {
+            budget_start(&budget, limits);
+        }
+        Budget *limit = limited ? &budget : NULL;
+        LineProf prof;
+        if (lines) {
+            lineprof_start(&prof, rate);
+        }
+        Tier *tier = tiered ? tier_create(threshold, limit, perfmap) : NULL;
+        status = eval_program(&pr, tier, snapshot ? &snap : NULL, limit, lines ? &prof : NULL);
+        if (lines) {
+            lineprof_stop(&prof);
+            // The content ends with EOF
+            lineprof_write(&prof, &pr, nmain, b.items, b.size - 1, lines);
+            lineprof_free(&prof);
+        }
+        if (tier) {
+            tier_free(tier);
+        }
+        if (snapshot) {
+            snapshot_free(&snap);
+        }
+    }
+
+    stats_end(PHASE_EVAL);
+    stats_print(stderr);
+
+    if (profile) {
+        profile_write(&pr, profile);
+    }
+
+    // Free memory
+    program_free(&pr); // Free statements and expressions
+                       // (program)
+    imports_free(&imports); // Free imported files
+    lexer_free(&l); // Free tokens (lexer and parser)
+    free(b.items); // Free content buffer
+
+    return status;
+}
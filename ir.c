@@ -0,0 +1,926 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "vector.h"
+#include "error.h"
+#include "lexer.h"
+#include "parser.h"
+#include "ir.h"
+
+// MID-LEVEL IR
+// The program is lowered once to a small SSA form shared by the
+// IR interpreter and the LLVM backend, so that the optimizations
+// in iropt.c are written a single time for both engines.
+//
+// A function is a list of basic blocks ending with a terminator,
+// variables do not exist anymore: every assignment defines a new
+// value and the values reaching a join point are merged by phis.
+// Like in the closure compiler values are unboxed doubles and
+// strings are not supported.
+
+static char *ir_opnames[] = {
+    [I_CONST] = "const",
+    [I_PARAM] = "param",
+    [I_PHI] = "phi",
+    [I_COPY] = "copy",
+    [I_ADD] = "add",
+    [I_SUB] = "sub",
+    [I_MUL] = "mul",
+    [I_DIV] = "div",
+    [I_LT] = "lt",
+    [I_GT] = "gt",
+    [I_EQ] = "eq",
+    [I_NE] = "ne",
+    [I_NEG] = "neg",
+    [I_NOT] = "not",
+    [I_CALL] = "call",
+    [I_BR] = "br",
+    [I_CONDBR] = "condbr",
+    [I_RET] = "ret",
+};
+
+IrInstr *make_instr(IrOp op)
+{
+    IrInstr *instr = calloc(1, sizeof(IrInstr));
+    instr->op = op;
+    v_init(instr->ops);
+    return instr;
+}
+
+// Constants are shared by all the uses in a function
+IrInstr *ir_const(IrFunc *func, double n)
+{
+    for (size_t i = 0; i < func->consts.size; i++) {
+        if (memcmp(&func->consts.items[i]->n, &n, sizeof(double)) == 0) {
+            return func->consts.items[i];
+        }
+    }
+    IrInstr *instr = make_instr(I_CONST);
+    instr->n = n;
+    v_append(func->consts, instr);
+    return instr;
+}
+
+IrInstr *ir_instr(IrBlock *block, IrOp op)
+{
+    IrInstr *instr = make_instr(op);
+    instr->block = block;
+    v_append(block->instrs, instr);
+    return instr;
+}
+
+// Phis are kept at the beginning of the block
+IrInstr *ir_phi(IrBlock *block)
+{
+    IrInstr *phi = ir_instr(block, I_PHI);
+    size_t i = block->instrs.size - 1;
+    for (; i > 0 && block->instrs.items[i - 1]->op != I_PHI; i--) {
+        block->instrs.items[i] = block->instrs.items[i - 1];
+    }
+    block->instrs.items[i] = phi;
+    return phi;
+}
+
+IrBlock *ir_block(IrFunc *func)
+{
+    IrBlock *block = calloc(1, sizeof(IrBlock));
+    v_init(block->instrs);
+    v_init(block->preds);
+    v_init(block->incomplete);
+    v_append(func->blocks, block);
+    return block;
+}
+
+void ir_edge(IrBlock *from, IrBlock *to)
+{
+    v_append(to->preds, from);
+}
+
+// Removes the edge and the corresponding operand of the phis
+void ir_unedge(IrBlock *from, IrBlock *to)
+{
+    size_t k = 0;
+    while (k < to->preds.size && to->preds.items[k] != from) {
+        k++;
+    }
+    if (k == to->preds.size) {
+        return;
+    }
+
+    for (size_t i = k; i + 1 < to->preds.size; i++) {
+        to->preds.items[i] = to->preds.items[i + 1];
+    }
+    to->preds.size--;
+
+    for (size_t i = 0; i < to->instrs.size; i++) {
+        IrInstr *phi = to->instrs.items[i];
+        if (phi->op != I_PHI || phi->ops.size <= k) {
+            continue;
+        }
+        for (size_t j = k; j + 1 < phi->ops.size; j++) {
+            phi->ops.items[j] = phi->ops.items[j + 1];
+        }
+        phi->ops.size--;
+    }
+}
+
+IrInstr *ir_terminator(IrBlock *block)
+{
+    if (block->instrs.size == 0) {
+        return NULL;
+    }
+    IrInstr *last = block->instrs.items[block->instrs.size - 1];
+    if (last->op == I_BR || last->op == I_CONDBR || last->op == I_RET) {
+        return last;
+    }
+    return NULL;
+}
+
+// Passes replace instructions with copies of the value they
+// compute, which are only removed by the copyprop pass
+IrInstr *ir_value(IrInstr *instr)
+{
+    while (instr->op == I_COPY) {
+        instr = instr->ops.items[0];
+    }
+    return instr;
+}
+
+// Instructions without side effects that can be removed,
+// merged or moved as long as their operands are available
+bool ir_is_pure(IrOp op)
+{
+    return op >= I_ADD && op <= I_NOT;
+}
+
+IrFunc *ir_func(IrModule *module, Token name)
+{
+    for (size_t i = 0; i < module->size; i++) {
+        if (strcmp(module->items[i]->name.data, name.data) == 0) {
+            return module->items[i];
+        }
+    }
+    return NULL;
+}
+
+// Assigns consecutive ids to the blocks and the values,
+// the IR interpreter uses them as register indexes
+void ir_number(IrFunc *func)
+{
+    size_t id = 0;
+    for (size_t i = 0; i < func->params.size; i++) {
+        func->params.items[i]->id = id++;
+    }
+    for (size_t i = 0; i < func->consts.size; i++) {
+        func->consts.items[i]->id = id++;
+    }
+    for (size_t i = 0; i < func->blocks.size; i++) {
+        IrBlock *block = func->blocks.items[i];
+        block->id = i;
+        for (size_t j = 0; j < block->instrs.size; j++) {
+            block->instrs.items[j]->id = id++;
+        }
+    }
+    func->nvalues = id;
+}
+
+void ir_postorder(IrBlock *block, bool *seen, IrBlocks *post)
+{
+    if (seen[block->id]) {
+        return;
+    }
+    seen[block->id] = true;
+
+    IrInstr *term = ir_terminator(block);
+    if (term && term->op != I_RET) {
+        // Visiting the false target first puts the true one
+        // first in reverse postorder
+        if (term->op == I_CONDBR) {
+            ir_postorder(term->targets[1], seen, post);
+        }
+        ir_postorder(term->targets[0], seen, post);
+    }
+    v_append(*post, block);
+}
+
+// Computes the reverse postorder of the blocks reachable from
+// the entry, every block comes after its dominators and the
+// unreachable ones have SIZE_MAX as their position
+void ir_order(IrFunc *func)
+{
+    ir_number(func);
+    for (size_t i = 0; i < func->blocks.size; i++) {
+        func->blocks.items[i]->rpo = SIZE_MAX;
+    }
+    bool *seen = calloc(func->blocks.size, sizeof(bool));
+    IrBlocks post;
+    v_init(post);
+    ir_postorder(func->blocks.items[0], seen, &post);
+
+    free(func->order.items);
+    v_init(func->order);
+    for (size_t i = post.size; i > 0; i--) {
+        post.items[i - 1]->rpo = func->order.size;
+        v_append(func->order, post.items[i - 1]);
+    }
+    free(post.items);
+    free(seen);
+}
+
+void ir_block_free(IrBlock *block)
+{
+    for (size_t i = 0; i < block->instrs.size; i++) {
+        free(block->instrs.items[i]->ops.items);
+        free(block->instrs.items[i]);
+    }
+    free(block->instrs.items);
+    free(block->preds.items);
+    free(block->incomplete.items);
+    free(block->defs);
+    free(block);
+}
+
+// Removes the blocks that are not reachable from the entry
+// together with their edges
+bool ir_prune(IrFunc *func)
+{
+    ir_order(func);
+    if (func->order.size == func->blocks.size) {
+        return false;
+    }
+
+    size_t size = 0;
+    for (size_t i = 0; i < func->blocks.size; i++) {
+        IrBlock *block = func->blocks.items[i];
+        if (block->rpo != SIZE_MAX) {
+            func->blocks.items[size++] = block;
+            continue;
+        }
+        IrInstr *term = ir_terminator(block);
+        if (term && term->op != I_RET) {
+            ir_unedge(block, term->targets[0]);
+            if (term->op == I_CONDBR) {
+                ir_unedge(block, term->targets[1]);
+            }
+        }
+    }
+    for (size_t i = 0; i < func->blocks.size; i++) {
+        IrBlock *block = func->blocks.items[i];
+        if (block->rpo == SIZE_MAX) {
+            ir_block_free(block);
+        }
+    }
+    func->blocks.size = size;
+    return true;
+}
+
+// SSA CONSTRUCTION
+// Variables are numbered while lowering and every block records
+// the value each variable currently has at its end. Reading a
+// variable not written in the block looks it up recursively in
+// the predecessors, adding a phi when there is more than one.
+// A block is sealed once all its predecessors are known, reads
+// in unsealed blocks (loop headers) get an incomplete phi whose
+// operands are added when the block is sealed.
+// See "Simple and Efficient Construction of Static Single
+// Assignment Form" by Braun et al.
+void ir_write(IrBuilder *b, size_t var, IrBlock *block, IrInstr *value)
+{
+    if (var >= block->ndefs) {
+        block->defs = realloc(block->defs, b->nvars * sizeof(IrInstr *));
+        memset(block->defs + block->ndefs, 0,
+                (b->nvars - block->ndefs) * sizeof(IrInstr *));
+        block->ndefs = b->nvars;
+    }
+    block->defs[var] = value;
+}
+
+void ir_phi_operands(IrBuilder *b, size_t var, IrInstr *phi)
+{
+    IrBlock *block = phi->block;
+    for (size_t i = 0; i < block->preds.size; i++) {
+        IrInstr *value = ir_read(b, var, block->preds.items[i]);
+        v_append(phi->ops, value);
+    }
+}
+
+IrInstr *ir_read(IrBuilder *b, size_t var, IrBlock *block)
+{
+    if (var < block->ndefs && block->defs[var]) {
+        return block->defs[var];
+    }
+
+    IrInstr *value;
+    if (!block->sealed) {
+        value = ir_phi(block);
+        IrIncomplete incomplete = {
+            .var = var,
+            .phi = value,
+        };
+        v_append(block->incomplete, incomplete);
+    } else if (block->preds.size == 0) {
+        // Unreachable code
+        value = ir_const(b->func, 0);
+    } else if (block->preds.size == 1) {
+        value = ir_read(b, var, block->preds.items[0]);
+    } else {
+        // Written before adding the operands to break loops
+        value = ir_phi(block);
+        ir_write(b, var, block, value);
+        ir_phi_operands(b, var, value);
+    }
+    ir_write(b, var, block, value);
+    return value;
+}
+
+void ir_seal(IrBuilder *b, IrBlock *block)
+{
+    for (size_t i = 0; i < block->incomplete.size; i++) {
+        IrIncomplete incomplete = block->incomplete.items[i];
+        ir_phi_operands(b, incomplete.var, incomplete.phi);
+    }
+    block->incomplete.size = 0;
+    block->sealed = true;
+}
+
+// Lowering
+
+IrName *ir_lookup(IrScope *scope, char *name)
+{
+    for (; scope; scope = scope->upper) {
+        for (IrName *node = scope->names; node; node = node->next) {
+            if (strcmp(node->name, name) == 0) {
+                return node;
+            }
+        }
+    }
+    return NULL;
+}
+
+size_t ir_define(IrBuilder *b, Token name)
+{
+    for (IrName *node = b->scope->names; node; node = node->next) {
+        if (strcmp(node->name, name.data) == 0) {
+            fprintf(error_stream(), "Variable '");
+            fprint_token(error_stream(), name);
+            fprintf(error_stream(), "' is already defined\n");
+            error_raise(E_RUNTIME, 0);
+        }
+    }
+
+    IrName *node = malloc(sizeof(IrName));
+    node->name = name.data;
+    node->var = b->nvars++;
+    node->next = b->scope->names;
+    b->scope->names = node;
+    return node->var;
+}
+
+size_t ir_var(IrBuilder *b, Token name)
+{
+    IrName *node = ir_lookup(b->scope, name.data);
+    if (node == NULL) {
+        fprintf(error_stream(), "Undefined variable '");
+        fprint_token(error_stream(), name);
+        fprintf(error_stream(), "' at line %zu\n", name.line);
+        error_raise(E_RUNTIME, name.line);
+    }
+    return node->var;
+}
+
+void ir_scope_free(IrScope *scope)
+{
+    IrName *node = scope->names;
+    while (node) {
+        IrName *next = node->next;
+        free(node);
+        node = next;
+    }
+}
+
+IrInstr *ir_binary(IrBlock *block, IrOp op, IrInstr *lhs, IrInstr *rhs)
+{
+    IrInstr *instr = ir_instr(block, op);
+    v_append(instr->ops, lhs);
+    v_append(instr->ops, rhs);
+    return instr;
+}
+
+void ir_br(IrBlock *from, IrBlock *to)
+{
+    IrInstr *br = ir_instr(from, I_BR);
+    br->targets[0] = to;
+    ir_edge(from, to);
+}
+
+IrInstr *ir_condbr(IrBlock *from, IrInstr *cond, IrBlock *thenb, IrBlock *elseb)
+{
+    IrInstr *br = ir_instr(from, I_CONDBR);
+    v_append(br->ops, cond);
+    br->targets[0] = thenb;
+    br->targets[1] = elseb;
+    ir_edge(from, thenb);
+    ir_edge(from, elseb);
+    return br;
+}
+
+// The right operand gets its own block like in the code
+// generator, the result is merged with a phi
+IrInstr *lower_logicexpr(IrBuilder *b, BinExpr binexpr)
+{
+    bool is_and = binexpr.op.type == T_AND;
+    IrInstr *lhs = lower_expr(b, binexpr.lexpr);
+    IrBlock *lhsb = b->cur;
+    IrBlock *rhsb = ir_block(b->func);
+    IrBlock *end = ir_block(b->func);
+    if (is_and) {
+        ir_condbr(lhsb, lhs, rhsb, end);
+    } else {
+        ir_condbr(lhsb, lhs, end, rhsb);
+    }
+    ir_seal(b, rhsb);
+
+    b->cur = rhsb;
+    IrInstr *rhs = lower_expr(b, binexpr.rexpr);
+    rhs = ir_binary(b->cur, I_NE, rhs, ir_const(b->func, 0));
+    ir_br(b->cur, end);
+    ir_seal(b, end);
+
+    b->cur = end;
+    IrInstr *phi = ir_phi(end);
+    for (size_t i = 0; i < end->preds.size; i++) {
+        IrInstr *value = end->preds.items[i] == lhsb
+            ? ir_const(b->func, is_and ? 0 : 1)
+            : rhs;
+        v_append(phi->ops, value);
+    }
+    return phi;
+}
+
+IrInstr *lower_binexpr(IrBuilder *b, BinExpr binexpr)
+{
+    if (binexpr.op.type == T_AND || binexpr.op.type == T_OR) {
+        return lower_logicexpr(b, binexpr);
+    }
+
+    if (binexpr.op.type == T_EQUAL) {
+        if (binexpr.lexpr.type != TERMINAL
+                || binexpr.lexpr.as->termexpr.term.type != T_NAME) {
+            fprintf(error_stream(), "Expression ");
+            fprint_expr(error_stream(), binexpr.lexpr);
+            fprintf(error_stream(), " is not an lvalue\n");
+            error_raise(E_RUNTIME, 0);
+        }
+        size_t var = ir_var(b, binexpr.lexpr.as->termexpr.term);
+        IrInstr *rhs = lower_expr(b, binexpr.rexpr);
+        ir_write(b, var, b->cur, rhs);
+        return rhs;
+    }
+
+    IrOp op;
+    switch (binexpr.op.type) {
+    case T_PLUS:
+        op = I_ADD;
+        break;
+    case T_MINUS:
+        op = I_SUB;
+        break;
+    case T_STAR:
+        op = I_MUL;
+        break;
+    case T_SLASH:
+        op = I_DIV;
+        break;
+    case T_LESS:
+        op = I_LT;
+        break;
+    case T_GREATER:
+        op = I_GT;
+        break;
+    case T_2EQUAL:
+        op = I_EQ;
+        break;
+    case T_BANG_EQUAL:
+        op = I_NE;
+        break;
+    default:
+        fprintf(error_stream(), "Token '");
+        fprint_token(error_stream(), binexpr.op);
+        fprintf(error_stream(), "' is not a binary operator\n");
+        error_raise(E_RUNTIME, 0);
+    }
+    IrInstr *lhs = lower_expr(b, binexpr.lexpr);
+    IrInstr *rhs = lower_expr(b, binexpr.rexpr);
+    return ir_binary(b->cur, op, lhs, rhs);
+}
+
+IrInstr *lower_termexpr(IrBuilder *b, TermExpr termexpr)
+{
+    Token term = termexpr.term;
+    switch (term.type) {
+    case T_DOUBLE:
+        return ir_const(b->func, get_ddata(term));
+    case T_TRUE:
+        return ir_const(b->func, 1);
+    case T_FALSE:
+        return ir_const(b->func, 0);
+    case T_NAME:
+        return ir_read(b, ir_var(b, term), b->cur);
+    default:
+        fprintf(error_stream(), "Could not lower literal '");
+        fprint_token(error_stream(), term);
+        fprintf(error_stream(), "'\n");
+        error_raise(E_RUNTIME, 0);
+    }
+}
+
+IrInstr *lower_callexpr(IrBuilder *b, CallExpr callexpr)
+{
+    IrFunc *callee = ir_func(b->module, callexpr.name);
+    if (callee == NULL || callee->is_main) {
+        fprintf(error_stream(), "Undefined function '");
+        fprint_token(error_stream(), callexpr.name);
+        fprintf(error_stream(), "' at line %zu\n", callexpr.name.line);
+        error_raise(E_RUNTIME, callexpr.name.line);
+    }
+    if (callee->params.size != callexpr.args.size) {
+        fprintf(error_stream(), "Wrong number of arguments to '");
+        fprint_token(error_stream(), callexpr.name);
+        fprintf(error_stream(), "' at line %zu\n", callexpr.name.line);
+        error_raise(E_RUNTIME, callexpr.name.line);
+    }
+
+    IrInstrs args;
+    v_init(args);
+    for (size_t i = 0; i < callexpr.args.size; i++) {
+        IrInstr *arg = lower_expr(b, callexpr.args.items[i]);
+        v_append(args, arg);
+    }
+    IrInstr *call = ir_instr(b->cur, I_CALL);
+    free(call->ops.items);
+    call->ops = args;
+    call->callee = callee;
+    return call;
+}
+
+IrInstr *lower_expr(IrBuilder *b, Expr expr)
+{
+    switch (expr.type) {
+    case UNARY: {
+        IrInstr *value = lower_expr(b, expr.as->unexpr.expr);
+        IrOp op = expr.as->unexpr.op.type == T_BANG ? I_NOT : I_NEG;
+        IrInstr *instr = ir_instr(b->cur, op);
+        v_append(instr->ops, value);
+        return instr;
+    }
+    case BINARY:
+        return lower_binexpr(b, expr.as->binexpr);
+    case GROUPING:
+        return lower_expr(b, expr.as->groupexpr.expr);
+    case TERMINAL:
+        return lower_termexpr(b, expr.as->termexpr);
+    case CALL:
+        return lower_callexpr(b, expr.as->callexpr);
+    default:
+        fprintf(error_stream(), "Expression '");
+        fprint_expr(error_stream(), expr);
+        fprintf(error_stream(), "' is not supported\n");
+        error_raise(E_RUNTIME, 0);
+    }
+}
+
+// Loops have the same shape as in the code generator, the
+// block ending with the back edge is marked as the latch and
+// keeps the hints of the loop
+void lower_loop(IrBuilder *b, Expr *cond, Expr *step, Stmt thenb,
+        LoopHints hints, BranchProfile prof)
+{
+    IrBlock *header = ir_block(b->func);
+    IrBlock *body = ir_block(b->func);
+    IrBlock *latch = ir_block(b->func);
+    IrBlock *exit = ir_block(b->func);
+    ir_br(b->cur, header);
+
+    b->cur = header;
+    IrInstr *value = lower_expr(b, *cond);
+    ir_condbr(b->cur, value, body, exit)->prof = prof;
+    ir_seal(b, body);
+    ir_seal(b, exit);
+
+    b->cur = body;
+    lower_stmt(b, thenb);
+    ir_br(b->cur, latch);
+    ir_seal(b, latch);
+
+    b->cur = latch;
+    if (step) {
+        lower_expr(b, *step);
+    }
+    b->cur->latch = true;
+    b->cur->hints = hints;
+    ir_br(b->cur, header);
+    ir_seal(b, header);
+
+    b->cur = exit;
+}
+
+void lower_stmt(IrBuilder *b, Stmt stmt)
+{
+    switch (stmt.type) {
+    case S_LET: {
+        // The value is lowered before defining the name,
+        // like in the interpreter
+        IrInstr *value = lower_expr(b, stmt.as->letstmt.value);
+        size_t var = ir_define(b, stmt.as->letstmt.name);
+        ir_write(b, var, b->cur, value);
+        break;
+    }
+    case S_IF: {
+        IfStmt ifstmt = stmt.as->ifstmt;
+        IrInstr *cond = lower_expr(b, ifstmt.cond);
+        IrBlock *thenb = ir_block(b->func);
+        IrBlock *elseb = ir_block(b->func);
+        IrBlock *end = ir_block(b->func);
+        ir_condbr(b->cur, cond, thenb, elseb)->prof = ifstmt.prof;
+        ir_seal(b, thenb);
+        ir_seal(b, elseb);
+
+        b->cur = thenb;
+        lower_stmt(b, ifstmt.thenb);
+        ir_br(b->cur, end);
+
+        b->cur = elseb;
+        lower_stmt(b, ifstmt.elseb);
+        ir_br(b->cur, end);
+        ir_seal(b, end);
+
+        b->cur = end;
+        break;
+    }
+    case S_FOR: {
+        ForStmt forstmt = stmt.as->forstmt;
+        lower_expr(b, forstmt.init);
+        lower_loop(b, &forstmt.cond, &forstmt.step, forstmt.thenb,
+                forstmt.hints, forstmt.prof);
+        break;
+    }
+    case S_WHILE: {
+        WhileStmt whilestmt = stmt.as->whilestmt;
+        lower_loop(b, &whilestmt.cond, NULL, whilestmt.thenb,
+                whilestmt.hints, whilestmt.prof);
+        break;
+    }
+    case S_BLOCK:
+        lower_block(b, stmt.as->blockstmt.block);
+        break;
+    case S_EXPR:
+        lower_expr(b, stmt.as->exprstmt.expr);
+        break;
+    case S_RET: {
+        IrInstr *value = lower_expr(b, stmt.as->retstmt.expr);
+        IrInstr *ret = ir_instr(b->cur, I_RET);
+        v_append(ret->ops, value);
+
+        // The statements following the return are unreachable
+        b->cur = ir_block(b->func);
+        b->cur->sealed = true;
+        break;
+    }
+    case S_FUNC:
+        error_report(E_RUNTIME, 0, "Functions can only be defined at the top level\n");
+    }
+}
+
+void lower_block(IrBuilder *b, Block block)
+{
+    IrScope scope = {
+        .upper = b->scope,
+    };
+    b->scope = &scope;
+    for (size_t i = 0; i < block.size; i++) {
+        lower_stmt(b, block.items[i]);
+    }
+    b->scope = scope.upper;
+    ir_scope_free(&scope);
+}
+
+// Falling off the end of a function returns 0, then the state
+// needed only during the construction is freed and the code
+// following the returns is removed
+void lower_end(IrBuilder *b)
+{
+    if (ir_terminator(b->cur) == NULL) {
+        IrInstr *ret = ir_instr(b->cur, I_RET);
+        v_append(ret->ops, ir_const(b->func, 0));
+    }
+
+    IrFunc *func = b->func;
+    for (size_t i = 0; i < func->blocks.size; i++) {
+        IrBlock *block = func->blocks.items[i];
+        free(block->defs);
+        block->defs = NULL;
+        block->ndefs = 0;
+        free(block->incomplete.items);
+        v_init(block->incomplete);
+    }
+    ir_prune(func);
+}
+
+IrFunc *make_func(IrModule *module, Token name)
+{
+    IrFunc *func = calloc(1, sizeof(IrFunc));
+    func->name = name;
+    v_init(func->params);
+    v_init(func->consts);
+    v_init(func->blocks);
+    v_init(func->order);
+    v_append(*module, func);
+    return func;
+}
+
+// All the functions are declared before lowering any body so
+// that calls can be resolved to their IrFunc
+IrModule *ir_lower(Program *pr)
+{
+    IrModule *module = malloc(sizeof(IrModule));
+    v_init(*module);
+
+    for (size_t i = 0; i < pr->size; i++) {
+        if (pr->items[i].type != S_FUNC) {
+            continue;
+        }
+        FuncStmt *funcstmt = &pr->items[i].as->funcstmt;
+        if (ir_func(module, funcstmt->name)) {
+            fprintf(error_stream(), "Function '");
+            fprint_token(error_stream(), funcstmt->name);
+            fprintf(error_stream(), "' is already defined\n");
+            error_raise(E_RUNTIME, 0);
+        }
+        IrFunc *func = make_func(module, funcstmt->name);
+        for (size_t j = 0; j < funcstmt->args.size; j++) {
+            IrInstr *param = make_instr(I_PARAM);
+            param->param = j;
+            v_append(func->params, param);
+        }
+    }
+
+    IrBuilder b = {
+        .module = module,
+    };
+    for (size_t i = 0; i < pr->size; i++) {
+        if (pr->items[i].type != S_FUNC) {
+            continue;
+        }
+        FuncStmt *funcstmt = &pr->items[i].as->funcstmt;
+        IrScope scope = {0};
+        b.func = ir_func(module, funcstmt->name);
+        b.scope = &scope;
+        b.nvars = 0;
+        b.cur = ir_block(b.func);
+        b.cur->sealed = true;
+        for (size_t j = 0; j < funcstmt->args.size; j++) {
+            size_t var = ir_define(&b, funcstmt->args.items[j]);
+            ir_write(&b, var, b.cur, b.func->params.items[j]);
+        }
+        lower_block(&b, funcstmt->block);
+        lower_end(&b);
+        ir_scope_free(&scope);
+    }
+
+    Token name = {
+        .type = T_NAME,
+        .data = "main",
+    };
+    IrScope scope = {0};
+    b.func = make_func(module, name);
+    b.func->is_main = true;
+    b.scope = &scope;
+    b.nvars = 0;
+    b.cur = ir_block(b.func);
+    b.cur->sealed = true;
+    for (size_t i = 0; i < pr->size; i++) {
+        if (pr->items[i].type != S_FUNC) {
+            lower_stmt(&b, pr->items[i]);
+        }
+    }
+    lower_end(&b);
+    ir_scope_free(&scope);
+
+    for (size_t i = 0; i < module->size; i++) {
+        ir_number(module->items[i]);
+    }
+    return module;
+}
+
+// Printing
+
+void ir_print_value(IrInstr *value)
+{
+    if (value->op == I_CONST) {
+        printf("%g", value->n);
+    } else {
+        printf("%%%zu", value->id);
+    }
+}
+
+void ir_print_instr(IrInstr *instr)
+{
+    printf("    ");
+    if (instr->op != I_BR && instr->op != I_CONDBR && instr->op != I_RET) {
+        printf("%%%zu = ", instr->id);
+    }
+    printf("%s", ir_opnames[instr->op]);
+
+    if (instr->op == I_PHI) {
+        for (size_t i = 0; i < instr->ops.size; i++) {
+            printf(i ? ", [" : " [");
+            ir_print_value(instr->ops.items[i]);
+            printf(", b%zu]", instr->block->preds.items[i]->id);
+        }
+        printf("\n");
+        return;
+    }
+
+    if (instr->op == I_CALL) {
+        printf(" %s", (char *)instr->callee->name.data);
+    }
+    for (size_t i = 0; i < instr->ops.size; i++) {
+        printf(i ? ", " : " ");
+        ir_print_value(instr->ops.items[i]);
+    }
+    if (instr->op == I_CONDBR) {
+        printf(", b%zu, b%zu", instr->targets[0]->id, instr->targets[1]->id);
+    } else if (instr->op == I_BR) {
+        printf(" b%zu", instr->targets[0]->id);
+        if (instr->block->latch) {
+            printf(" !loop");
+        }
+    }
+    printf("\n");
+}
+
+void ir_print_func(IrFunc *func)
+{
+    ir_number(func);
+    printf("fn %s(", (char *)func->name.data);
+    for (size_t i = 0; i < func->params.size; i++) {
+        printf(i ? ", %%%zu" : "%%%zu", func->params.items[i]->id);
+    }
+    printf(") {\n");
+
+    for (size_t i = 0; i < func->blocks.size; i++) {
+        IrBlock *block = func->blocks.items[i];
+        printf("b%zu:", block->id);
+        if (block->preds.size) {
+            printf(" ; preds");
+            for (size_t j = 0; j < block->preds.size; j++) {
+                printf(" b%zu", block->preds.items[j]->id);
+            }
+        }
+        printf("\n");
+        for (size_t j = 0; j < block->instrs.size; j++) {
+            ir_print_instr(block->instrs.items[j]);
+        }
+    }
+    printf("}\n");
+}
+
+void ir_print(IrModule *module)
+{
+    for (size_t i = 0; i < module->size; i++) {
+        ir_print_func(module->items[i]);
+        if (i + 1 < module->size) {
+            printf("\n");
+        }
+    }
+}
+
+void instr_free(IrInstr *instr)
+{
+    free(instr->ops.items);
+    free(instr);
+}
+
+void ir_free(IrModule *module)
+{
+    for (size_t i = 0; i < module->size; i++) {
+        IrFunc *func = module->items[i];
+        for (size_t j = 0; j < func->params.size; j++) {
+            instr_free(func->params.items[j]);
+        }
+        for (size_t j = 0; j < func->consts.size; j++) {
+            instr_free(func->consts.items[j]);
+        }
+        for (size_t j = 0; j < func->blocks.size; j++) {
+            ir_block_free(func->blocks.items[j]);
+        }
+        free(func->params.items);
+        free(func->consts.items);
+        free(func->blocks.items);
+        free(func->order.items);
+        free(func);
+    }
+    free(module->items);
+    free(module);
+}
@@ -0,0 +1,154 @@
+#ifndef IR_H
+#define IR_H
+
+#include "parser.h"
+
+typedef enum {
+    I_CONST,
+    I_PARAM,
+    I_PHI,
+    I_COPY,
+    I_ADD,
+    I_SUB,
+    I_MUL,
+    I_DIV,
+    I_LT,
+    I_GT,
+    I_EQ,
+    I_NE,
+    I_NEG,
+    I_NOT,
+    I_CALL,
+    I_BR,
+    I_CONDBR,
+    I_RET,
+} IrOp;
+
+typedef struct irinstr IrInstr;
+typedef struct irblock IrBlock;
+typedef struct irfunc IrFunc;
+
+typedef struct {
+    size_t size;
+    size_t capacity;
+    IrInstr **items;
+} IrInstrs;
+
+typedef struct {
+    size_t size;
+    size_t capacity;
+    IrBlock **items;
+} IrBlocks;
+
+// Every instruction defines a single double value, booleans are
+// 1 and 0 like in the closure compiler. Constants and parameters
+// do not belong to any block. The operands of a phi are in the
+// same order as the predecessors of its block, the terminator
+// is always the last instruction of a block. Conditional branches
+// keep the profile of the statement they come from.
+typedef struct irinstr {
+    IrOp op;
+    size_t id;
+    double n;
+    size_t param;
+    IrInstrs ops;
+    IrBlock *block;
+    IrBlock *targets[2];
+    IrFunc *callee;
+    BranchProfile prof;
+    bool dead;
+} IrInstr;
+
+typedef struct {
+    size_t var;
+    IrInstr *phi;
+} IrIncomplete;
+
+typedef struct {
+    size_t size;
+    size_t capacity;
+    IrIncomplete *items;
+} IrIncompletes;
+
+// The definitions of the variables and the sealed flag are only
+// used while building the SSA form, the dominator fields are
+// filled by ir_dominators
+typedef struct irblock {
+    size_t id;
+    IrInstrs instrs;
+    IrBlocks preds;
+    IrInstr **defs;
+    size_t ndefs;
+    IrIncompletes incomplete;
+    bool sealed;
+    bool latch;
+    LoopHints hints;
+    size_t rpo;
+    IrBlock *idom;
+} IrBlock;
+
+typedef struct irfunc {
+    Token name;
+    bool is_main;
+    IrInstrs params;
+    IrInstrs consts;
+    IrBlocks blocks;
+    IrBlocks order;
+    size_t nvalues;
+} IrFunc;
+
+typedef struct {
+    size_t size;
+    size_t capacity;
+    IrFunc **items;
+} IrModule;
+
+typedef struct irname IrName;
+typedef struct irname {
+    char *name;
+    size_t var;
+    IrName *next;
+} IrName;
+
+typedef struct irscope IrScope;
+typedef struct irscope {
+    IrName *names;
+    IrScope *upper;
+} IrScope;
+
+typedef struct {
+    IrModule *module;
+    IrFunc *func;
+    IrBlock *cur;
+    IrScope *scope;
+    size_t nvars;
+} IrBuilder;
+
+IrInstr *ir_const(IrFunc *func, double n);
+IrInstr *ir_instr(IrBlock *block, IrOp op);
+IrInstr *ir_phi(IrBlock *block);
+IrBlock *ir_block(IrFunc *func);
+void ir_edge(IrBlock *from, IrBlock *to);
+void ir_unedge(IrBlock *from, IrBlock *to);
+IrInstr *ir_terminator(IrBlock *block);
+IrInstr *ir_value(IrInstr *instr);
+bool ir_is_pure(IrOp op);
+IrFunc *ir_func(IrModule *module, Token name);
+void ir_number(IrFunc *func);
+void ir_order(IrFunc *func);
+void ir_block_free(IrBlock *block);
+bool ir_prune(IrFunc *func);
+
+void ir_write(IrBuilder *b, size_t var, IrBlock *block, IrInstr *value);
+IrInstr *ir_read(IrBuilder *b, size_t var, IrBlock *block);
+void ir_seal(IrBuilder *b, IrBlock *block);
+IrInstr *lower_expr(IrBuilder *b, Expr expr);
+void lower_stmt(IrBuilder *b, Stmt stmt);
+void lower_block(IrBuilder *b, Block block);
+IrModule *ir_lower(Program *pr);
+
+void ir_print_func(IrFunc *func);
+void ir_print(IrModule *module);
+void ir_free(IrModule *module);
+
+#endif
@@ -0,0 +1,129 @@
+#include <stdio.h>
+#include <string.h>
+
+#include "vector.h"
+#include "error.h"
+#include "lexer.h"
+#include "parser.h"
+#include "ir.h"
+#include "iropt.h"
+#include "ireval.h"
+
+// IR INTERPRETER
+// Every call gets a register for each value of the function, the
+// registers of the constants and parameters are filled on entry.
+// The phis of a block are evaluated together when the block is
+// entered, reading the operand of the edge that has been taken.
+
+double ir_call(IrFunc *func, double *args)
+{
+    double regs[func->nvalues + 1];
+    for (size_t i = 0; i < func->params.size; i++) {
+        regs[func->params.items[i]->id] = args[i];
+    }
+    for (size_t i = 0; i < func->consts.size; i++) {
+        regs[func->consts.items[i]->id] = func->consts.items[i]->n;
+    }
+
+    IrBlock *prev = NULL;
+    IrBlock *block = func->blocks.items[0];
+    for (;;) {
+        IrInstrs instrs = block->instrs;
+        size_t i = 0;
+        if (prev) {
+            size_t k = 0;
+            while (block->preds.items[k] != prev) {
+                k++;
+            }
+            size_t nphis = 0;
+            while (nphis < instrs.size && instrs.items[nphis]->op == I_PHI) {
+                nphis++;
+            }
+            double values[nphis + 1];
+            for (i = 0; i < nphis; i++) {
+                values[i] = regs[instrs.items[i]->ops.items[k]->id];
+            }
+            for (i = 0; i < nphis; i++) {
+                regs[instrs.items[i]->id] = values[i];
+            }
+        }
+
+        for (; i < instrs.size; i++) {
+            IrInstr *instr = instrs.items[i];
+            IrInstr **ops = instr->ops.items;
+            double *res = &regs[instr->id];
+            switch (instr->op) {
+            case I_COPY:
+                *res = regs[ops[0]->id];
+                break;
+            case I_ADD:
+                *res = regs[ops[0]->id] + regs[ops[1]->id];
+                break;
+            case I_SUB:
+                *res = regs[ops[0]->id] - regs[ops[1]->id];
+                break;
+            case I_MUL:
+                *res = regs[ops[0]->id] * regs[ops[1]->id];
+                break;
+            case I_DIV:
+                *res = regs[ops[0]->id] / regs[ops[1]->id];
+                break;
+            case I_LT:
+                *res = regs[ops[0]->id] < regs[ops[1]->id];
+                break;
+            case I_GT:
+                *res = regs[ops[0]->id] > regs[ops[1]->id];
+                break;
+            case I_EQ:
+                *res = regs[ops[0]->id] == regs[ops[1]->id];
+                break;
+            case I_NE:
+                *res = regs[ops[0]->id] != regs[ops[1]->id];
+                break;
+            case I_NEG:
+                *res = -regs[ops[0]->id];
+                break;
+            case I_NOT:
+                *res = regs[ops[0]->id] == 0;
+                break;
+            case I_CALL: {
+                double args[instr->ops.size + 1];
+                for (size_t j = 0; j < instr->ops.size; j++) {
+                    args[j] = regs[ops[j]->id];
+                }
+                *res = ir_call(instr->callee, args);
+                break;
+            }
+            case I_BR:
+                prev = block;
+                block = instr->targets[0];
+                break;
+            case I_CONDBR:
+                prev = block;
+                block = instr->targets[regs[ops[0]->id] != 0 ? 0 : 1];
+                break;
+            case I_RET:
+                return regs[ops[0]->id];
+            default:
+                error_report(E_RUNTIME, 0, "Cannot evaluate IR instruction '%d'\n", instr->op);
+            }
+        }
+    }
+}
+
+// The program is lowered and optimized at the given level,
+// main is the last function of the module
+int ir_run(Program *pr, int level)
+{
+    IrModule *module = ir_lower(pr);
+    ir_optimize(module, level);
+    for (size_t i = 0; i < module->size; i++) {
+        ir_number(module->items[i]);
+    }
+
+    IrFunc *main_func = module->items[module->size - 1];
+    int status = ir_call(main_func, NULL);
+
+    ir_free(module);
+    return status;
+}
@@ -0,0 +1,9 @@
+#ifndef IREVAL_H
+#define IREVAL_H
+
+#include "ir.h"
+
+double ir_call(IrFunc *func, double *args);
+int ir_run(Program *pr, int level);
+
+#endif
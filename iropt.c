@@ -0,0 +1,648 @@
+#include <stdio.h>
+#include <string.h>
+
+#include "vector.h"
+#include "error.h"
+#include "ir.h"
+#include "iropt.h"
+
+// IR PASSES
+// Every pass works on a single function and returns true when it
+// changed it. Instead of rewriting all the uses of a value, passes
+// turn the instructions they simplify into copies of the new value,
+// the copyprop pass then points the uses directly to the value and
+// removes the copies. For this reason the pass manager always runs
+// copyprop at the end of a pipeline.
+
+// Dominators are computed with the iterative algorithm from
+// "A Simple, Fast Dominance Algorithm" by Cooper et al, blocks
+// that are not reachable from the entry have no idom
+IrBlock *ir_intersect(IrBlock *a, IrBlock *b)
+{
+    while (a != b) {
+        while (a->rpo > b->rpo) {
+            a = a->idom;
+        }
+        while (b->rpo > a->rpo) {
+            b = b->idom;
+        }
+    }
+    return a;
+}
+
+void ir_dominators(IrFunc *func)
+{
+    ir_order(func);
+    for (size_t i = 0; i < func->blocks.size; i++) {
+        func->blocks.items[i]->idom = NULL;
+    }
+    IrBlock *entry = func->order.items[0];
+    entry->idom = entry;
+
+    bool changed = true;
+    while (changed) {
+        changed = false;
+        for (size_t i = 1; i < func->order.size; i++) {
+            IrBlock *block = func->order.items[i];
+            IrBlock *idom = NULL;
+            for (size_t j = 0; j < block->preds.size; j++) {
+                IrBlock *pred = block->preds.items[j];
+                if (pred->idom == NULL) {
+                    continue;
+                }
+                idom = idom ? ir_intersect(pred, idom) : pred;
+            }
+            if (block->idom != idom) {
+                block->idom = idom;
+                changed = true;
+            }
+        }
+    }
+}
+
+bool ir_dominates(IrBlock *a, IrBlock *b)
+{
+    while (b != a && b->idom != b) {
+        b = b->idom;
+    }
+    return b == a;
+}
+
+void ir_replace(IrInstr *instr, IrInstr *value)
+{
+    instr->op = I_COPY;
+    instr->ops.size = 0;
+    v_append(instr->ops, value);
+}
+
+// Frees the instructions marked as dead
+void ir_sweep(IrFunc *func)
+{
+    for (size_t i = 0; i < func->blocks.size; i++) {
+        IrBlock *block = func->blocks.items[i];
+        size_t size = 0;
+        for (size_t j = 0; j < block->instrs.size; j++) {
+            IrInstr *instr = block->instrs.items[j];
+            if (instr->dead) {
+                free(instr->ops.items);
+                free(instr);
+            } else {
+                block->instrs.items[size++] = instr;
+            }
+        }
+        block->instrs.size = size;
+    }
+}
+
+// A phi is redundant when all its operands, ignoring
+// the phi itself, are the same value
+IrInstr *phi_value(IrInstr *phi)
+{
+    IrInstr *same = NULL;
+    for (size_t i = 0; i < phi->ops.size; i++) {
+        IrInstr *value = ir_value(phi->ops.items[i]);
+        if (value == phi || value == same) {
+            continue;
+        }
+        if (same) {
+            return NULL;
+        }
+        same = value;
+    }
+    return same;
+}
+
+// Simplify CFG
+
+// Branches on constants become unconditional
+bool fold_branches(IrFunc *func)
+{
+    bool changed = false;
+    for (size_t i = 0; i < func->blocks.size; i++) {
+        IrBlock *block = func->blocks.items[i];
+        IrInstr *term = ir_terminator(block);
+        if (term == NULL || term->op != I_CONDBR) {
+            continue;
+        }
+        IrInstr *cond = ir_value(term->ops.items[0]);
+        IrBlock *taken;
+        IrBlock *other;
+        if (term->targets[0] == term->targets[1]) {
+            taken = other = term->targets[0];
+        } else if (cond->op == I_CONST) {
+            taken = term->targets[cond->n != 0 ? 0 : 1];
+            other = term->targets[cond->n != 0 ? 1 : 0];
+        } else {
+            continue;
+        }
+        ir_unedge(block, other);
+        term->op = I_BR;
+        term->ops.size = 0;
+        term->targets[0] = taken;
+        term->targets[1] = NULL;
+        changed = true;
+    }
+    return changed;
+}
+
+// A block with a single predecessor ending with a branch to it
+// is appended to the predecessor, its phis become copies
+bool merge_blocks(IrFunc *func)
+{
+    bool changed = false;
+    for (size_t i = 1; i < func->blocks.size; i++) {
+        IrBlock *block = func->blocks.items[i];
+        if (block->preds.size != 1) {
+            continue;
+        }
+        IrBlock *pred = block->preds.items[0];
+        IrInstr *term = ir_terminator(pred);
+        if (pred == block || pred->latch || term == NULL || term->op != I_BR) {
+            continue;
+        }
+
+        term->dead = true;
+        pred->instrs.size--;
+        free(term->ops.items);
+        free(term);
+        for (size_t j = 0; j < block->instrs.size; j++) {
+            IrInstr *instr = block->instrs.items[j];
+            if (instr->op == I_PHI) {
+                instr->op = I_COPY;
+            }
+            instr->block = pred;
+            v_append(pred->instrs, instr);
+        }
+        pred->latch = block->latch;
+        pred->hints = block->hints;
+
+        IrInstr *last = ir_terminator(pred);
+        if (last && last->op != I_RET) {
+            for (size_t t = 0; t < 2 && last->targets[t]; t++) {
+                IrBlocks *preds = &last->targets[t]->preds;
+                for (size_t k = 0; k < preds->size; k++) {
+                    if (preds->items[k] == block) {
+                        preds->items[k] = pred;
+                    }
+                }
+                if (last->targets[0] == last->targets[1]) {
+                    break;
+                }
+            }
+        }
+
+        block->instrs.size = 0;
+        ir_block_free(block);
+        for (size_t j = i; j + 1 < func->blocks.size; j++) {
+            func->blocks.items[j] = func->blocks.items[j + 1];
+        }
+        func->blocks.size--;
+        i--;
+        changed = true;
+    }
+    return changed;
+}
+
+bool pass_simplifycfg(IrFunc *func)
+{
+    bool changed = fold_branches(func);
+    changed |= ir_prune(func);
+    changed |= merge_blocks(func);
+    return changed;
+}
+
+// Constant propagation
+
+double ir_fold(IrOp op, double a, double b)
+{
+    switch (op) {
+    case I_ADD:
+        return a + b;
+    case I_SUB:
+        return a - b;
+    case I_MUL:
+        return a * b;
+    case I_DIV:
+        return a / b;
+    case I_LT:
+        return a < b;
+    case I_GT:
+        return a > b;
+    case I_EQ:
+        return a == b;
+    case I_NE:
+        return a != b;
+    case I_NEG:
+        return -a;
+    case I_NOT:
+        return a == 0;
+    default:
+        error_report(E_CODEGEN, 0, "Cannot fold instruction '%d'\n", op);
+    }
+}
+
+// Folds the instructions with constant operands and the branches
+// on constants until nothing changes, code that becomes unreachable
+// is removed so that its values do not reach the phis anymore
+bool pass_constprop(IrFunc *func)
+{
+    bool changed = false;
+    bool again = true;
+    while (again) {
+        again = false;
+        for (size_t i = 0; i < func->blocks.size; i++) {
+            IrBlock *block = func->blocks.items[i];
+            for (size_t j = 0; j < block->instrs.size; j++) {
+                IrInstr *instr = block->instrs.items[j];
+                if (instr->op == I_PHI) {
+                    IrInstr *value = phi_value(instr);
+                    if (value && value->op == I_CONST) {
+                        ir_replace(instr, value);
+                        again = true;
+                    }
+                    continue;
+                }
+                if (!ir_is_pure(instr->op)) {
+                    continue;
+                }
+
+                IrInstr *a = ir_value(instr->ops.items[0]);
+                IrInstr *b = instr->ops.size > 1
+                    ? ir_value(instr->ops.items[1])
+                    : a;
+                if (a->op == I_CONST && b->op == I_CONST) {
+                    double n = ir_fold(instr->op, a->n, b->n);
+                    ir_replace(instr, ir_const(func, n));
+                    again = true;
+                }
+            }
+        }
+        if (fold_branches(func)) {
+            ir_prune(func);
+            again = true;
+        }
+        changed |= again;
+    }
+    return changed;
+}
+
+// Copy propagation
+
+bool pass_copyprop(IrFunc *func)
+{
+    bool changed = false;
+
+    // Redundant phis are copies too
+    bool again = true;
+    while (again) {
+        again = false;
+        for (size_t i = 0; i < func->blocks.size; i++) {
+            IrBlock *block = func->blocks.items[i];
+            for (size_t j = 0; j < block->instrs.size; j++) {
+                IrInstr *instr = block->instrs.items[j];
+                if (instr->op != I_PHI) {
+                    continue;
+                }
+                IrInstr *value = phi_value(instr);
+                if (value) {
+                    ir_replace(instr, value);
+                    again = true;
+                }
+            }
+        }
+    }
+
+    for (size_t i = 0; i < func->blocks.size; i++) {
+        IrBlock *block = func->blocks.items[i];
+        for (size_t j = 0; j < block->instrs.size; j++) {
+            IrInstr *instr = block->instrs.items[j];
+            for (size_t k = 0; k < instr->ops.size; k++) {
+                instr->ops.items[k] = ir_value(instr->ops.items[k]);
+            }
+        }
+    }
+
+    for (size_t i = 0; i < func->blocks.size; i++) {
+        IrBlock *block = func->blocks.items[i];
+        for (size_t j = 0; j < block->instrs.size; j++) {
+            IrInstr *instr = block->instrs.items[j];
+            if (instr->op == I_COPY) {
+                instr->dead = true;
+                changed = true;
+            }
+        }
+    }
+    ir_sweep(func);
+    return changed;
+}
+
+// Global value numbering
+// The dominator tree is visited keeping the pure instructions that
+// dominate the current block, an instruction computing the same
+// operation on the same values of one of them is replaced by it.
+
+bool is_commutative(IrOp op)
+{
+    return op == I_ADD || op == I_MUL || op == I_EQ || op == I_NE;
+}
+
+bool same_value(IrInstr *a, IrInstr *b)
+{
+    if (a->op != b->op || a->ops.size != b->ops.size) {
+        return false;
+    }
+    if (a->op == I_PHI && a->block != b->block) {
+        return false;
+    }
+
+    bool same = true;
+    for (size_t i = 0; i < a->ops.size && same; i++) {
+        same = ir_value(a->ops.items[i]) == ir_value(b->ops.items[i]);
+    }
+    if (!same && is_commutative(a->op)) {
+        same = ir_value(a->ops.items[0]) == ir_value(b->ops.items[1])
+            && ir_value(a->ops.items[1]) == ir_value(b->ops.items[0]);
+    }
+    return same;
+}
+
+bool gvn_block(IrBlock *block, IrBlocks *children, IrInstrs *avail)
+{
+    bool changed = false;
+    size_t size = avail->size;
+    for (size_t i = 0; i < block->instrs.size; i++) {
+        IrInstr *instr = block->instrs.items[i];
+        if (!ir_is_pure(instr->op) && instr->op != I_PHI) {
+            continue;
+        }
+
+        IrInstr *found = NULL;
+        for (size_t j = avail->size; j > 0 && !found; j--) {
+            if (same_value(avail->items[j - 1], instr)) {
+                found = avail->items[j - 1];
+            }
+        }
+        if (found) {
+            ir_replace(instr, found);
+            changed = true;
+        } else {
+            v_append(*avail, instr);
+        }
+    }
+
+    IrBlocks *kids = &children[block->rpo];
+    for (size_t i = 0; i < kids->size; i++) {
+        changed |= gvn_block(kids->items[i], children, avail);
+    }
+    avail->size = size;
+    return changed;
+}
+
+bool pass_gvn(IrFunc *func)
+{
+    ir_dominators(func);
+    IrBlocks *children = calloc(func->order.size, sizeof(IrBlocks));
+    for (size_t i = 1; i < func->order.size; i++) {
+        IrBlock *block = func->order.items[i];
+        IrBlocks *kids = &children[block->idom->rpo];
+        if (kids->items == NULL) {
+            v_init(*kids);
+        }
+        v_append(*kids, block);
+    }
+
+    IrInstrs avail;
+    v_init(avail);
+    bool changed = gvn_block(func->order.items[0], children, &avail);
+
+    free(avail.items);
+    for (size_t i = 0; i < func->order.size; i++) {
+        free(children[i].items);
+    }
+    free(children);
+    return changed;
+}
+
+// Loop invariant code motion
+// Every back edge from a latch to a header dominating it defines a
+// natural loop. Pure instructions whose operands are all defined
+// outside of the loop are moved to the preheader, the only block
+// outside of the loop that branches to the header. Since pure
+// instructions cannot trap they can be executed even when the
+// loop is not entered.
+
+void loop_blocks(IrBlock *header, IrBlock *latch, bool *inloop)
+{
+    IrBlocks work;
+    v_init(work);
+    inloop[header->id] = true;
+    if (!inloop[latch->id]) {
+        inloop[latch->id] = true;
+        v_append(work, latch);
+    }
+    while (work.size) {
+        IrBlock *block = work.items[--work.size];
+        for (size_t i = 0; i < block->preds.size; i++) {
+            IrBlock *pred = block->preds.items[i];
+            if (!inloop[pred->id]) {
+                inloop[pred->id] = true;
+                v_append(work, pred);
+            }
+        }
+    }
+    free(work.items);
+}
+
+bool is_invariant(IrInstr *instr, bool *inloop)
+{
+    for (size_t i = 0; i < instr->ops.size; i++) {
+        IrInstr *op = ir_value(instr->ops.items[i]);
+        instr->ops.items[i] = op;
+        if (op->block && inloop[op->block->id]) {
+            return false;
+        }
+    }
+    return true;
+}
+
+bool hoist_loop(IrFunc *func, IrBlock *header, IrBlock *latch)
+{
+    bool *inloop = calloc(func->blocks.size, sizeof(bool));
+    loop_blocks(header, latch, inloop);
+
+    IrBlock *preheader = NULL;
+    for (size_t i = 0; i < header->preds.size; i++) {
+        IrBlock *pred = header->preds.items[i];
+        if (inloop[pred->id]) {
+            continue;
+        }
+        if (preheader) {
+            free(inloop);
+            return false;
+        }
+        preheader = pred;
+    }
+    IrInstr *term = preheader ? ir_terminator(preheader) : NULL;
+    if (term == NULL || term->op != I_BR) {
+        free(inloop);
+        return false;
+    }
+
+    bool changed = false;
+    for (size_t i = 0; i < func->order.size; i++) {
+        IrBlock *block = func->order.items[i];
+        if (!inloop[block->id]) {
+            continue;
+        }
+        size_t j = 0;
+        while (j < block->instrs.size) {
+            IrInstr *instr = block->instrs.items[j];
+            if (!ir_is_pure(instr->op) || !is_invariant(instr, inloop)) {
+                j++;
+                continue;
+            }
+
+            for (size_t k = j; k + 1 < block->instrs.size; k++) {
+                block->instrs.items[k] = block->instrs.items[k + 1];
+            }
+            block->instrs.size--;
+
+            // Before the terminator of the preheader
+            v_append(preheader->instrs, term);
+            preheader->instrs.items[preheader->instrs.size - 2] = instr;
+            instr->block = preheader;
+            changed = true;
+        }
+    }
+    free(inloop);
+    return changed;
+}
+
+bool pass_licm(IrFunc *func)
+{
+    ir_dominators(func);
+    bool changed = false;
+    for (size_t i = 0; i < func->order.size; i++) {
+        IrBlock *block = func->order.items[i];
+        IrInstr *term = ir_terminator(block);
+        if (term == NULL || term->op == I_RET) {
+            continue;
+        }
+        for (size_t t = 0; t < 2 && term->targets[t]; t++) {
+            IrBlock *header = term->targets[t];
+            if (ir_dominates(header, block)) {
+                changed |= hoist_loop(func, header, block);
+            }
+        }
+    }
+    return changed;
+}
+
+// Dead code elimination
+
+bool is_removable(IrInstr *instr)
+{
+    return ir_is_pure(instr->op) || instr->op == I_PHI || instr->op == I_COPY;
+}
+
+bool pass_dce(IrFunc *func)
+{
+    ir_number(func);
+    size_t *uses = calloc(func->nvalues, sizeof(size_t));
+    for (size_t i = 0; i < func->blocks.size; i++) {
+        IrBlock *block = func->blocks.items[i];
+        for (size_t j = 0; j < block->instrs.size; j++) {
+            IrInstr *instr = block->instrs.items[j];
+            for (size_t k = 0; k < instr->ops.size; k++) {
+                if (instr->ops.items[k] != instr) {
+                    uses[instr->ops.items[k]->id]++;
+                }
+            }
+        }
+    }
+
+    bool changed = false;
+    bool again = true;
+    while (again) {
+        again = false;
+        for (size_t i = 0; i < func->blocks.size; i++) {
+            IrBlock *block = func->blocks.items[i];
+            for (size_t j = 0; j < block->instrs.size; j++) {
+                IrInstr *instr = block->instrs.items[j];
+                if (instr->dead || !is_removable(instr) || uses[instr->id]) {
+                    continue;
+                }
+                instr->dead = true;
+                for (size_t k = 0; k < instr->ops.size; k++) {
+                    if (instr->ops.items[k] != instr) {
+                        uses[instr->ops.items[k]->id]--;
+                    }
+                }
+                again = changed = true;
+            }
+        }
+    }
+    free(uses);
+    ir_sweep(func);
+    return changed;
+}
+
+// PASS MANAGER
+// Pipelines are comma separated lists of pass names like
+// "constprop,gvn,licm", each pass is run on every function
+
+static const IrPass ir_passes[] = {
+    { "simplifycfg", pass_simplifycfg },
+    { "constprop", pass_constprop },
+    { "copyprop", pass_copyprop },
+    { "gvn", pass_gvn },
+    { "licm", pass_licm },
+    { "dce", pass_dce },
+};
+
+static const size_t ir_passes_size = (sizeof(ir_passes) / sizeof(IrPass));
+
+const IrPass *ir_pass(char *name, size_t len)
+{
+    for (size_t i = 0; i < ir_passes_size; i++) {
+        if (strlen(ir_passes[i].name) == len
+                && strncmp(ir_passes[i].name, name, len) == 0) {
+            return &ir_passes[i];
+        }
+    }
+    error_report(E_CODEGEN, 0, "Unknown IR pass '%.*s'\n", (int)len, name);
+}
+
+void ir_run_passes(IrModule *module, char *pipeline)
+{
+    char *name = pipeline;
+    while (*name) {
+        size_t len = strcspn(name, ",");
+        const IrPass *pass = ir_pass(name, len);
+        for (size_t i = 0; i < module->size; i++) {
+            pass->run(module->items[i]);
+        }
+        name += len;
+        if (*name == ',') {
+            name++;
+        }
+    }
+
+    for (size_t i = 0; i < module->size; i++) {
+        pass_copyprop(module->items[i]);
+        ir_number(module->items[i]);
+    }
+}
+
+void ir_optimize(IrModule *module, int level)
+{
+    if (level <= 0) {
+        return;
+    }
+    if (level == 1) {
+        ir_run_passes(module, "simplifycfg,constprop,copyprop,dce,simplifycfg");
+    } else {
+        ir_run_passes(module, "simplifycfg,constprop,copyprop,gvn,licm,"
+                "copyprop,dce,simplifycfg");
+    }
+}
@@ -0,0 +1,28 @@
+#ifndef IROPT_H
+#define IROPT_H
+
+#include "ir.h"
+
+typedef bool (*IrPassFn)(IrFunc *func);
+
+typedef struct {
+    char *name;
+    IrPassFn run;
+} IrPass;
+
+void ir_dominators(IrFunc *func);
+bool ir_dominates(IrBlock *a, IrBlock *b);
+void ir_replace(IrInstr *instr, IrInstr *value);
+void ir_sweep(IrFunc *func);
+
+bool pass_simplifycfg(IrFunc *func);
+bool pass_constprop(IrFunc *func);
+bool pass_copyprop(IrFunc *func);
+bool pass_gvn(IrFunc *func);
+bool pass_licm(IrFunc *func);
+bool pass_dce(IrFunc *func);
+
+void ir_run_passes(IrModule *module, char *pipeline);
+void ir_optimize(IrModule *module, int level);
+
+#endif
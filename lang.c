@@ -0,0 +1,131 @@
+#include <stdio.h>
+#include <string.h>
+
+#include "vector.h"
+#include "error.h"
+#include "lexer.h"
+#include "parser.h"
+#include "interpreter.h"
+#include "tier.h"
+#include "import.h"
+#include "lang.h"
+
+// LIBRARY
+// Runs scripts in the process of a host instead of spawning the
+// interpreter for every script:
+//
+//   LangContext *ctx = lang_create(0);
+//   LangScript *script = lang_compile(ctx, "return 1 + 2;", NULL);
+//   int result;
+//   if (script && lang_run(ctx, script, &result) == E_OK) {
+//       ...
+//   }
+//
+// Errors are returned instead of exiting, the message is in
+// ctx->diag. A runaway script is stopped by setting ctx->limits,
+// see budget.c. The memory allocated by a failed compilation is
+// not released. A context must only be used by one thread at a
+// time, its arena holds the values, variables and functions of
+// the current run, an aborted run leaves nothing behind. Scripts
+// are shared programs that are not written while they run, so
+// the same script can be run by several contexts at the same
+// time. The JIT uses the global LLVM context, tiered runs must
+// not overlap.
+
+LangContext *lang_create(size_t threshold)
+{
+    LangContext *ctx = malloc(sizeof(LangContext));
+    ctx->threshold = threshold;
+    arena_init(&ctx->arena);
+    ctx->limits = (BudgetLimits) {0};
+    ctx->diag.kind = E_OK;
+    ctx->diag.line = 0;
+    ctx->diag.message[0] = 0;
+    return ctx;
+}
+
+void lang_destroy(LangContext *ctx)
+{
+    arena_free(&ctx->arena);
+    free(ctx);
+}
+
+// Imports are relative to path, or to the working directory
+// when path is NULL. Returns NULL on error
+LangScript *lang_compile(LangContext *ctx, const char *source, const char *path)
+{
+    LangScript *script = malloc(sizeof(LangScript));
+    v_init(script->content);
+    for (const char *c = source; *c; c++) {
+        v_append(script->content, *c);
+    }
+    v_append(script->content, EOF);
+
+    ErrorHandler handler;
+    error_push(&handler);
+    if (setjmp(handler.env) == 0) {
+        lexer_init(&script->lexer, script->content.items);
+        get_tokens(&script->lexer);
+        Parser p;
+        parser_init(&p, &script->lexer);
+        script->program = parse_program(&p);
+        imports_load(&script->imports, &script->program, path ? (char *)path : "");
+        imports_splice(&script->program, &script->imports);
+        eval_share(&script->program);
+        error_pop(&handler);
+    } else {
+        ctx->diag = handler.diag;
+        return NULL;
+    }
+    ctx->diag.kind = E_OK;
+    return script;
+}
+
+// The result is the value of the top level return statement,
+// or 0 when the script does not return
+ErrorKind lang_run(LangContext *ctx, LangScript *script, int *result)
+{
+    // The compiled code only burns the steps, a native recursion
+    // would never reach the checks of the depth and the heap
+    if (ctx->threshold && (ctx->limits.heap || ctx->limits.depth)) {
+        ctx->diag.kind = E_BUDGET;
+        ctx->diag.line = 0;
+        snprintf(ctx->diag.message, sizeof(ctx->diag.message),
+            "The heap and depth limits cannot be used with the JIT");
+        return ctx->diag.kind;
+    }
+    Budget *budget = NULL;
+    if (budget_limited(ctx->limits)) {
+        budget = &ctx->budget;
+        budget_start(budget, ctx->limits);
+    }
+    Interp interp = {
+        .tier = ctx->threshold ? tier_create(ctx->threshold, budget, false) : NULL,
+        .arena = &ctx->arena,
+        .shared = true,
+        .budget = budget,
+    };
+    ErrorHandler handler;
+    error_push(&handler);
+    if (setjmp(handler.env) == 0) {
+        *result = eval_script(&script->program, &interp, false);
+        error_pop(&handler);
+        ctx->diag.kind = E_OK;
+    } else {
+        ctx->diag = handler.diag;
+    }
+    if (interp.tier) {
+        tier_free(interp.tier);
+    }
+    arena_reset(&ctx->arena);
+    return ctx->diag.kind;
+}
+
+void lang_free(LangScript *script)
+{
+    program_free(&script->program);
+    imports_free(&script->imports);
+    lexer_free(&script->lexer);
+    free(script->content.items);
+    free(script);
+}
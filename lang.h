@@ -0,0 +1,37 @@
+#ifndef LANG_H
+#define LANG_H
+
+#include "arena.h"
+#include "error.h"
+#include "lexer.h"
+#include "parser.h"
+#include "import.h"
+#include "budget.h"
+
+// Hot code is compiled with the JIT when threshold is not 0,
+// diag is the error of the last failed call. Every run gets
+// the limits, a run exceeding them fails with E_BUDGET. With
+// the JIT only the steps and the deadline can be limited.
+typedef struct {
+    size_t threshold;
+    Arena arena;
+    BudgetLimits limits;
+    Budget budget;
+    Diagnostic diag;
+} LangContext;
+
+// A parsed script with its imports, it can be run many times
+typedef struct {
+    Buffer content;
+    Lexer lexer;
+    Program program;
+    Imports imports;
+} LangScript;
+
+LangContext *lang_create(size_t threshold);
+void lang_destroy(LangContext *ctx);
+LangScript *lang_compile(LangContext *ctx, const char *source, const char *path);
+ErrorKind lang_run(LangContext *ctx, LangScript *script, int *result);
+void lang_free(LangScript *script);
+
+#endif
@@ -3,9 +3,10 @@
 #include <stdbool.h>
 
 #include "vector.h"
+#include "error.h"
 #include "lexer.h"
 
-static char *keywords[] = {
+static const char *const keywords[] = {
     "let",
     "if",
     "else",
@@ -17,6 +18,7 @@ static char *keywords[] = {
     "false",
     "fn",
     "return",
+    "import",
 };
 
 static const size_t keywords_size = (sizeof(keywords) / sizeof(char *));
@@ -126,9 +128,10 @@ TokenType get_keyword(char *name)
         return T_FN;
     } else if (strcmp(name, "return") == 0) {
         return T_RETURN;
+    } else if (strcmp(name, "import") == 0) {
+        return T_IMPORT;
     } else { // Unexpected
-        printf("No keyword enum matches string\n");
-        exit(1);
+        error_report(E_SYNTAX, 0, "No keyword enum matches string\n");
     }
 }
 
@@ -234,8 +237,8 @@ bool get_token(Lexer *l)
     // Handle signle character tokens
     case '(': t.type = T_LPAREN; break;
     case ')': t.type = T_RPAREN; break;
-    case ']': t.type = T_LSBRACE; break;
-    case '[': t.type = T_RSBRACE; break;
+    case '[': t.type = T_LSBRACE; break;
+    case ']': t.type = T_RSBRACE; break;
     case '{': t.type = T_LBRACE; break;
     case '}': t.type = T_RBRACE; break;
     case ',': t.type = T_COMMA; break;
@@ -289,8 +292,7 @@ bool get_token(Lexer *l)
     case '"': {
         char *string = get_string(l);
         if (string == NULL) {
-            printf("Unterminated string at line %zu\n", l->line);
-            exit(1);
+            error_report(E_SYNTAX, l->line, "Unterminated string at line %zu\n", l->line);
         } else {
             t.type = T_STRING;
             t.data = string;
@@ -340,58 +342,88 @@ double get_ddata(Token t)
     return ((double *)t.data)[0];
 }
 
-void print_token(Token t)
+// 64 bit FNV-1a, also the hash of the compilation cache
+uint64_t fnv_hash(uint64_t hash, const void *data, size_t size)
+{
+    const unsigned char *bytes = data;
+    for (size_t i = 0; i < size; i++) {
+        hash ^= bytes[i];
+        hash *= 0x100000001b3;
+    }
+    return hash;
+}
+
+// Hashes the type and the data of the token, the line is left
+// out so that moving a function around keeps its hash
+uint64_t token_hash(uint64_t hash, Token t)
+{
+    hash = fnv_hash(hash, &t.type, sizeof(t.type));
+    if (t.type == T_DOUBLE) {
+        hash = fnv_hash(hash, t.data, sizeof(double));
+    } else if (t.data) {
+        hash = fnv_hash(hash, t.data, strlen(t.data) + 1);
+    }
+    return hash;
+}
+
+void fprint_token(FILE *f, Token t)
 {
     switch (t.type) {
-        case T_LPAREN:printf("("); break;
-        case T_RPAREN:printf(")"); break;
-        case T_LSBRACE:printf("["); break;
-        case T_RSBRACE:printf("]"); break;
-        case T_LBRACE:printf("{"); break;
-        case T_RBRACE:printf("}"); break;
-        case T_COMMA:printf(","); break;
-        case T_SEMICOLON:printf(";"); break;
-        case T_DOT:printf("."); break;
-        case T_COLON:printf(":"); break;
-        case T_PLUS:printf("+"); break;
-        case T_MINUS:printf("-"); break;
-        case T_STAR:printf("*"); break;
-        case T_SLASH:printf("/"); break;
-        case T_EQUAL:printf("="); break;
-        case T_2EQUAL:printf("=="); break;
-        case T_BANG:printf("!"); break;
-        case T_BANG_EQUAL:printf("!="); break;
-        case T_LESS:printf("<"); break;
-        case T_2LESS:printf("<<"); break;
-        case T_GREATER:printf(">"); break;
-        case T_2GREATER:printf(">>"); break;
-        case T_EOF:printf("EOF"); break;
+        case T_LPAREN:fprintf(f, "("); break;
+        case T_RPAREN:fprintf(f, ")"); break;
+        case T_LSBRACE:fprintf(f, "["); break;
+        case T_RSBRACE:fprintf(f, "]"); break;
+        case T_LBRACE:fprintf(f, "{"); break;
+        case T_RBRACE:fprintf(f, "}"); break;
+        case T_COMMA:fprintf(f, ","); break;
+        case T_SEMICOLON:fprintf(f, ";"); break;
+        case T_DOT:fprintf(f, "."); break;
+        case T_COLON:fprintf(f, ":"); break;
+        case T_PLUS:fprintf(f, "+"); break;
+        case T_MINUS:fprintf(f, "-"); break;
+        case T_STAR:fprintf(f, "*"); break;
+        case T_SLASH:fprintf(f, "/"); break;
+        case T_EQUAL:fprintf(f, "="); break;
+        case T_2EQUAL:fprintf(f, "=="); break;
+        case T_BANG:fprintf(f, "!"); break;
+        case T_BANG_EQUAL:fprintf(f, "!="); break;
+        case T_LESS:fprintf(f, "<"); break;
+        case T_2LESS:fprintf(f, "<<"); break;
+        case T_GREATER:fprintf(f, ">"); break;
+        case T_2GREATER:fprintf(f, ">>"); break;
+        case T_EOF:fprintf(f, "EOF"); break;
         case T_STRING:
-            printf("\"%s\"", (char *)t.data);
+            fprintf(f, "\"%s\"", (char *)t.data);
             break;
         case T_DOUBLE:
-            printf("$%f$", *((double *)t.data));
+            fprintf(f, "$%f$", *((double *)t.data));
             break;
         case T_NAME:
-            printf("%%%s%%", (char *)t.data);
+            fprintf(f, "%%%s%%", (char *)t.data);
             break;
-        case T_LET:printf("let");break;
-        case T_IF:printf("if");break;
-        case T_ELSE:printf("else");break;
-        case T_FOR:printf("for");break;
-        case T_WHILE:printf("while");break;
-        case T_OR:printf("or");break;
-        case T_AND:printf("and");break;
-        case T_TRUE:printf("true");break;
-        case T_FALSE:printf("false");break;
-        case T_FN:printf("fn");break;
-        case T_RETURN:printf("return");break;
+        case T_LET:fprintf(f, "let");break;
+        case T_IF:fprintf(f, "if");break;
+        case T_ELSE:fprintf(f, "else");break;
+        case T_FOR:fprintf(f, "for");break;
+        case T_WHILE:fprintf(f, "while");break;
+        case T_OR:fprintf(f, "or");break;
+        case T_AND:fprintf(f, "and");break;
+        case T_TRUE:fprintf(f, "true");break;
+        case T_FALSE:fprintf(f, "false");break;
+        case T_FN:fprintf(f, "fn");break;
+        case T_RETURN:fprintf(f, "return");break;
+        case T_IMPORT:fprintf(f, "import");break;
         default:
-            printf("unk");
+            fprintf(f, "unk");
             break;
     }
 }
 
+void print_token(Token t)
+{
+    fprint_token(stdout, t);
+}
+
 void print_tokens(Lexer *l)
 {
     for (size_t i = 0; i < l->size; i++) {
@@ -2,8 +2,12 @@
 #define LEXER_H
 
 #include <stdbool.h>
+#include <stdint.h>
 #include <stdio.h>
 
+// Initial value of the 64 bit FNV-1a hashes
+#define FNV_OFFSET 0xcbf29ce484222325
+
 typedef struct {
     size_t size;
     size_t capacity;
@@ -48,6 +52,7 @@ typedef enum {
     T_FALSE,        // false
     T_FN,           // fn
     T_RETURN,       // return
+    T_IMPORT,       // import
 } TokenType;
 
 typedef struct {
@@ -86,6 +91,9 @@ Token make_name(char *string);
 bool get_token(Lexer *l);
 void get_tokens(Lexer *l);
 double get_ddata(Token t);
+uint64_t fnv_hash(uint64_t hash, const void *data, size_t size);
+uint64_t token_hash(uint64_t hash, Token t);
+void fprint_token(FILE *f, Token t);
 void print_token(Token t);
 void print_tokens(Lexer *l);
 
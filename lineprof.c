@@ -0,0 +1,414 @@
+#include <signal.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/time.h>
+#include <time.h>
+
+#include "vector.h"
+#include "error.h"
+#include "lexer.h"
+#include "parser.h"
+#include "lineprof.h"
+
+// LINE PROFILES
+// The interpreter tells the profiler when every statement starts
+// and ends and when every function is called and returns. Costs
+// are kept per statement in each node of the calling context tree,
+// the path of calls from main, so the same statement reached from
+// two callers has two costs.
+//
+// Without a rate every statement is counted and timed, its self
+// time is the wall clock time spent in it minus the time of the
+// statements nested in it, including the ones of the functions it
+// calls: the condition of a loop gets the time of the condition
+// and the step, its body gets the rest. Timing every statement
+// costs about as much as evaluating it, with a rate the statements
+// are only counted and a SIGPROF timer samples the statement being
+// evaluated every 1 / rate seconds of CPU time instead.
+//
+// The costs are written as the source annotated with the totals of
+// every line, and as folded stacks for flamegraph.pl:
+//
+//   main:12;fib:3;fib:3;fib:2 1520
+//
+// where every frame is a function and the line it is at, and the
+// value is the self time in microseconds or the number of samples.
+// This is unrelated to --emit-profile, which records the branches
+// taken for the code generator, see profile.c.
+
+static LineProf *volatile sampled = NULL;
+static struct sigaction previous;
+
+double lineprof_now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+// Only touches costs that already exist, the tree is never
+// written by the handler
+void lineprof_sample(int signal)
+{
+    (void)signal;
+    LineProf *prof = sampled;
+    if (prof) {
+        prof->samples++;
+        if (prof->cost) {
+            prof->cost->samples++;
+        }
+    }
+}
+
+void lineprof_start(LineProf *prof, size_t rate)
+{
+    memset(prof, 0, sizeof(LineProf));
+    prof->rate = rate;
+    prof->node = &prof->root;
+    if (rate == 0) {
+        return;
+    }
+
+    sampled = prof;
+    struct sigaction action = {0};
+    action.sa_handler = lineprof_sample;
+    action.sa_flags = SA_RESTART;
+    sigemptyset(&action.sa_mask);
+    sigaction(SIGPROF, &action, &previous);
+
+    long usec = rate > 1000000 ? 1 : 1000000 / rate;
+    struct itimerval timer = {
+        .it_interval = {.tv_sec = usec / 1000000, .tv_usec = usec % 1000000},
+        .it_value = {.tv_sec = usec / 1000000, .tv_usec = usec % 1000000},
+    };
+    setitimer(ITIMER_PROF, &timer, NULL);
+}
+
+void lineprof_stop(LineProf *prof)
+{
+    if (prof->rate == 0) {
+        return;
+    }
+    struct itimerval timer = {0};
+    setitimer(ITIMER_PROF, &timer, NULL);
+    sigaction(SIGPROF, &previous, NULL);
+    sampled = NULL;
+}
+
+StmtCost *cost_get(StmtCost **node, AnyStmt *key)
+{
+    while (*node && (*node)->key != key) {
+        node = key < (*node)->key
+            ? &(*node)->left
+            : &(*node)->right;
+    }
+    if (*node == NULL) {
+        *node = calloc(1, sizeof(StmtCost));
+        (*node)->key = key;
+    }
+    return *node;
+}
+
+CallNode *kid_get(CallNode *parent, StmtCost *site, FuncStmt *func)
+{
+    CallNode **node = &parent->kids;
+    while (*node && ((*node)->site != site || (*node)->func != func)) {
+        bool less = site < (*node)->site
+            || (site == (*node)->site && func < (*node)->func);
+        node = less ? &(*node)->left : &(*node)->right;
+    }
+    if (*node == NULL) {
+        *node = calloc(1, sizeof(CallNode));
+        (*node)->func = func;
+        (*node)->site = site;
+        (*node)->parent = parent;
+    }
+    return *node;
+}
+
+void lineprof_enter(LineProf *prof, Stmt stmt, LineFrame *frame)
+{
+    StmtCost *cost = cost_get(&prof->node->costs, stmt.as);
+    cost->line = stmt.line;
+    cost->count++;
+    frame->upper = prof->cost;
+    prof->cost = cost;
+    if (prof->rate == 0) {
+        frame->nested = prof->nested;
+        prof->nested = 0;
+        frame->start = lineprof_now();
+    }
+}
+
+void lineprof_leave(LineProf *prof, LineFrame *frame)
+{
+    if (prof->rate == 0) {
+        double elapsed = lineprof_now() - frame->start;
+        prof->cost->self += elapsed - prof->nested;
+        prof->nested = frame->nested + elapsed;
+    }
+    prof->cost = frame->upper;
+}
+
+// The statement being evaluated is the site of the call
+void lineprof_call(LineProf *prof, FuncStmt *func)
+{
+    prof->node = kid_get(prof->node, prof->cost, func);
+}
+
+void lineprof_return(LineProf *prof)
+{
+    prof->node = prof->node->parent;
+}
+
+// The totals of every statement over all the calling contexts
+void totals_costs(StmtCost **totals, StmtCost *cost)
+{
+    if (cost == NULL) {
+        return;
+    }
+    StmtCost *total = cost_get(totals, cost->key);
+    total->line = cost->line;
+    total->count += cost->count;
+    total->self += cost->self;
+    total->samples += cost->samples;
+    totals_costs(totals, cost->left);
+    totals_costs(totals, cost->right);
+}
+
+void totals_node(StmtCost **totals, CallNode *node)
+{
+    if (node == NULL) {
+        return;
+    }
+    totals_costs(totals, node->costs);
+    totals_node(totals, node->kids);
+    totals_node(totals, node->left);
+    totals_node(totals, node->right);
+}
+
+// Statements on the same line are added, the count of a line
+// is the one of its first statement
+void lines_stmt(StmtCost *lines, StmtCost **totals, Stmt stmt)
+{
+    StmtCost *line = &lines[stmt.line];
+    if (stmt.type != S_BLOCK && stmt.type != S_FUNC) {
+        StmtCost *total = cost_get(totals, stmt.as);
+        if (line->key == NULL) {
+            line->key = stmt.as;
+            line->count = total->count;
+        }
+        line->self += total->self;
+        line->samples += total->samples;
+    }
+
+    switch (stmt.type) {
+    case S_IF:
+        lines_stmt(lines, totals, stmt.as->ifstmt.thenb);
+        lines_stmt(lines, totals, stmt.as->ifstmt.elseb);
+        break;
+    case S_FOR:
+        lines_stmt(lines, totals, stmt.as->forstmt.thenb);
+        break;
+    case S_WHILE:
+        lines_stmt(lines, totals, stmt.as->whilestmt.thenb);
+        break;
+    case S_BLOCK:
+        for (size_t i = 0; i < stmt.as->blockstmt.block.size; i++) {
+            lines_stmt(lines, totals, stmt.as->blockstmt.block.items[i]);
+        }
+        break;
+    case S_FUNC:
+        for (size_t i = 0; i < stmt.as->funcstmt.block.size; i++) {
+            lines_stmt(lines, totals, stmt.as->funcstmt.block.items[i]);
+        }
+        break;
+    default:
+        break;
+    }
+}
+
+void free_costs(StmtCost *cost)
+{
+    if (cost) {
+        free_costs(cost->left);
+        free_costs(cost->right);
+        free(cost);
+    }
+}
+
+// Only the statements of the first nmain of the program are
+// in the source, the following ones come from imported files
+void write_listing(LineProf *prof, Program *pr, size_t nmain, char *source, size_t size,
+        FILE *f)
+{
+    size_t nlines = 1;
+    for (size_t i = 0; i < size; i++) {
+        nlines += source[i] == '\n';
+    }
+    StmtCost *lines = calloc(nlines + 1, sizeof(StmtCost));
+    StmtCost *totals = NULL;
+    totals_node(&totals, &prof->root);
+    for (size_t i = 0; i < nmain && i < pr->size; i++) {
+        if (pr->items[i].line <= nlines) {
+            lines_stmt(lines, &totals, pr->items[i]);
+        }
+    }
+
+    double total = 0;
+    for (size_t i = 1; i <= nlines; i++) {
+        total += lines[i].self;
+    }
+    if (prof->rate) {
+        fprintf(f, "# %zu samples at %zu Hz\n", prof->samples, prof->rate);
+        fprintf(f, "%12s %8s %7s  source\n", "count", "samples", "%");
+    } else {
+        fprintf(f, "# %.3f ms in the statements\n", total * 1e3);
+        fprintf(f, "%12s %12s %7s  source\n", "count", "self ms", "%");
+    }
+
+    char *c = source;
+    char *end = source + size;
+    for (size_t i = 1; i <= nlines && c < end; i++) {
+        char *eol = memchr(c, '\n', end - c);
+        int len = eol ? eol - c : end - c;
+        StmtCost line = lines[i];
+        if (line.key == NULL) {
+            fprintf(f, "%12s %*s %7s  ", "", prof->rate ? 8 : 12, "", "");
+        } else if (prof->rate) {
+            double share = prof->samples ? 100.0 * line.samples / prof->samples : 0;
+            fprintf(f, "%12zu %8zu %6.1f%%  ", line.count, line.samples, share);
+        } else {
+            double share = total > 0 ? 100.0 * line.self / total : 0;
+            fprintf(f, "%12zu %12.3f %6.1f%%  ", line.count, line.self * 1e3, share);
+        }
+        fprintf(f, "%.*s\n", len, c);
+        c += len + 1;
+    }
+
+    free_costs(totals);
+    free(lines);
+}
+
+void prefix_add(Buffer *prefix, char *s)
+{
+    prefix->size--;
+    for (char *c = s; *c; c++) {
+        v_append(*prefix, *c);
+    }
+    v_append(*prefix, '\0');
+}
+
+void folded_costs(LineProf *prof, StmtCost *cost, char *prefix, Stacks *stacks)
+{
+    if (cost == NULL) {
+        return;
+    }
+    folded_costs(prof, cost->left, prefix, stacks);
+    size_t value = prof->rate ? cost->samples : (size_t)(cost->self * 1e6 + 0.5);
+    if (value) {
+        size_t len = strlen(prefix) + 32;
+        Stack stack = {malloc(len), value};
+        snprintf(stack.frames, len, "%s:%zu", prefix, cost->line);
+        v_append(*stacks, stack);
+    }
+    folded_costs(prof, cost->right, prefix, stacks);
+}
+
+void folded_node(LineProf *prof, CallNode *node, Buffer *prefix, Stacks *stacks);
+
+void folded_kids(LineProf *prof, CallNode *kid, Buffer *prefix, Stacks *stacks)
+{
+    if (kid == NULL) {
+        return;
+    }
+    folded_kids(prof, kid->left, prefix, stacks);
+    size_t size = prefix->size;
+    char frame[64];
+    snprintf(frame, sizeof(frame), ":%zu;", kid->site ? kid->site->line : 0);
+    prefix_add(prefix, frame);
+    prefix_add(prefix, kid->func->name.data);
+    folded_node(prof, kid, prefix, stacks);
+    prefix->size = size;
+    prefix->items[size - 1] = '\0';
+    folded_kids(prof, kid->right, prefix, stacks);
+}
+
+void folded_node(LineProf *prof, CallNode *node, Buffer *prefix, Stacks *stacks)
+{
+    folded_costs(prof, node->costs, prefix->items, stacks);
+    folded_kids(prof, node->kids, prefix, stacks);
+}
+
+int stack_compare(const void *a, const void *b)
+{
+    return strcmp(((Stack *)a)->frames, ((Stack *)b)->frames);
+}
+
+// Frames only tell the function and the line, so different
+// statements on a line, like a loop and its step, or calls from
+// the same line give the same stack. They are sorted to write
+// each stack once with the sum of their values.
+void write_folded(Stacks *stacks, FILE *f)
+{
+    qsort(stacks->items, stacks->size, sizeof(Stack), stack_compare);
+    for (size_t i = 0; i < stacks->size;) {
+        Stack stack = stacks->items[i++];
+        while (i < stacks->size && strcmp(stacks->items[i].frames, stack.frames) == 0) {
+            stack.value += stacks->items[i].value;
+            free(stacks->items[i++].frames);
+        }
+        fprintf(f, "%s %zu\n", stack.frames, stack.value);
+        free(stack.frames);
+    }
+}
+
+// The listing is written to path and the folded stacks
+// to path.folded
+void lineprof_write(LineProf *prof, Program *pr, size_t nmain, char *source, size_t size,
+        char *path)
+{
+    FILE *f = fopen(path, "w");
+    if (f == NULL) {
+        error_report(E_IO, 0, "Could not create file %s\n", path);
+    }
+    write_listing(prof, pr, nmain, source, size, f);
+    fclose(f);
+
+    size_t len = strlen(path) + sizeof(".folded");
+    char *folded = malloc(len);
+    snprintf(folded, len, "%s.folded", path);
+    f = fopen(folded, "w");
+    if (f == NULL) {
+        error_report(E_IO, 0, "Could not create file %s\n", folded);
+    }
+    Buffer prefix;
+    v_init(prefix);
+    v_append(prefix, '\0');
+    prefix_add(&prefix, "main");
+    Stacks stacks;
+    v_init(stacks);
+    folded_node(prof, &prof->root, &prefix, &stacks);
+    write_folded(&stacks, f);
+    fclose(f);
+    free(stacks.items);
+    free(prefix.items);
+    free(folded);
+}
+
+void free_node(CallNode *node)
+{
+    if (node) {
+        free_costs(node->costs);
+        free_node(node->kids);
+        free_node(node->left);
+        free_node(node->right);
+        free(node);
+    }
+}
+
+void lineprof_free(LineProf *prof)
+{
+    free_costs(prof->root.costs);
+    free_node(prof->root.kids);
+}
@@ -0,0 +1,76 @@
+#ifndef LINEPROF_H
+#define LINEPROF_H
+
+#include <stddef.h>
+
+#include "parser.h"
+
+// Cost of a statement in a calling context, self is the time
+// spent in it outside of its nested statements and calls
+typedef struct stmtcost StmtCost;
+typedef struct stmtcost {
+    AnyStmt *key;
+    size_t line;
+    size_t count;
+    double self;
+    size_t samples;
+    StmtCost *left;
+    StmtCost *right;
+} StmtCost;
+
+// A node of the calling context tree, the children are the
+// functions called from the node, keyed by the statement of
+// the call and the function. The root is main.
+typedef struct callnode CallNode;
+typedef struct callnode {
+    FuncStmt *func;
+    StmtCost *site;
+    CallNode *parent;
+    CallNode *kids;
+    CallNode *left;
+    CallNode *right;
+    StmtCost *costs;
+} CallNode;
+
+// A line of the folded stacks, the frames from main to the
+// statement separated by ';' and the self time or samples
+typedef struct {
+    char *frames;
+    size_t value;
+} Stack;
+
+typedef struct {
+    size_t size;
+    size_t capacity;
+    Stack *items;
+} Stacks;
+
+// State of a statement being evaluated, restored when it ends
+typedef struct {
+    StmtCost *upper;
+    double start;
+    double nested;
+} LineFrame;
+
+// Rate is the number of samples per second of CPU time, 0 times
+// every statement instead. Cost is the statement being evaluated.
+typedef struct lineprof {
+    size_t rate;
+    CallNode root;
+    CallNode *node;
+    StmtCost *volatile cost;
+    double nested;
+    size_t samples;
+} LineProf;
+
+void lineprof_start(LineProf *prof, size_t rate);
+void lineprof_enter(LineProf *prof, Stmt stmt, LineFrame *frame);
+void lineprof_leave(LineProf *prof, LineFrame *frame);
+void lineprof_call(LineProf *prof, FuncStmt *func);
+void lineprof_return(LineProf *prof);
+void lineprof_stop(LineProf *prof);
+void lineprof_write(LineProf *prof, Program *pr, size_t nmain, char *source, size_t size,
+        char *path);
+void lineprof_free(LineProf *prof);
+
+#endif
@@ -2,6 +2,7 @@
 #include <string.h>
 
 #include "vector.h"
+#include "error.h"
 #include "parser.h"
 #include "lexer.h"
 
@@ -19,35 +20,53 @@ void parser_free(Parser *p)
     }
 }
 
-void print_expr(Expr expr)
+void fprint_expr(FILE *f, Expr expr)
 {
     switch (expr.type) {
     case UNARY: {
-        print_token(expr.as->unexpr.op);
-        print_expr(expr.as->unexpr.expr);
+        fprint_token(f, expr.as->unexpr.op);
+        fprint_expr(f, expr.as->unexpr.expr);
         break;
     }
     case BINARY: {
-        print_expr(expr.as->binexpr.lexpr);
-        print_token(expr.as->binexpr.op);
-        print_expr(expr.as->binexpr.rexpr);
+        fprint_expr(f, expr.as->binexpr.lexpr);
+        fprint_token(f, expr.as->binexpr.op);
+        fprint_expr(f, expr.as->binexpr.rexpr);
         break;
     }
     case GROUPING: {
-        printf("(");
-        print_expr(expr.as->groupexpr.expr);
-        printf(")");
+        fprintf(f, "(");
+        fprint_expr(f, expr.as->groupexpr.expr);
+        fprintf(f, ")");
         break;
     }
     case TERMINAL:
-        print_token(expr.as->termexpr.term);
+        fprint_token(f, expr.as->termexpr.term);
         break;
+    case CALL: {
+        fprint_token(f, expr.as->callexpr.name);
+        fprintf(f, "(");
+        Exprs args = expr.as->callexpr.args;
+        for (size_t i = 0; i < args.size; i++) {
+            if (i > 0) {
+                fprintf(f, ",");
+            }
+            fprint_expr(f, args.items[i]);
+        }
+        fprintf(f, ")");
+        break;
+    }
     default:
-        printf("unk");
+        fprintf(f, "unk");
         break;
     }
 }
 
+void print_expr(Expr expr)
+{
+    fprint_expr(stdout, expr);
+}
+
 Expr make_unexpr(Token op, Expr expr)
 {
     UnExpr unexpr = {
@@ -119,12 +138,30 @@ Expr make_termexpr(Token term)
     return expr;
 }
 
+Expr make_callexpr(Token name, Exprs args)
+{
+    CallExpr callexpr = {
+        .name = name,
+        .args = args,
+    };
+
+    AnyExpr *as = malloc(sizeof(AnyExpr));
+    as->callexpr = callexpr;
+
+    Expr expr = {
+        .type = CALL,
+        .as = as,
+    };
+
+    return expr;
+}
+
 bool is_token(Parser *p, TokenType tt)
 {
     return p->tokens[p->pos].type == tt;
 }
 
-void sync(Parser *p)
+void parser_sync(Parser *p)
 {
     while (p->pos < p->size) {
         switch (p->tokens[p->pos].type) {
@@ -142,10 +179,37 @@ void sync(Parser *p)
 
 Expr parse_expr(Parser *p);
 
+// Function calls take a comma separated list of arguments,
+// the name has already been checked by parse_terminal
+Expr parse_callexpr(Parser *p)
+{
+    Token name = p->tokens[p->pos];
+    p->pos += 2; // name (
+
+    Exprs args;
+    v_init(args);
+    while (!is_token(p, T_RPAREN)) {
+        Expr arg = parse_expr(p);
+        v_append(args, arg);
+
+        if (is_token(p, T_COMMA)) {
+            p->pos++;
+        } else if (!is_token(p, T_RPAREN)) {
+            error_report(E_SYNTAX, name.line, "Expected ')' at line %zu\n", name.line);
+        }
+    }
+    p->pos++; // )
+
+    return make_callexpr(name, args);
+}
+
 Expr parse_terminal(Parser *p)
 {
     Token terminal = p->tokens[p->pos];
-    if (is_token(p, T_DOUBLE)
+    if (is_token(p, T_NAME)
+            && p->tokens[p->pos+1].type == T_LPAREN) {
+        return parse_callexpr(p);
+    } else if (is_token(p, T_DOUBLE)
             || is_token(p, T_STRING)
             || is_token(p, T_NAME)
             || is_token(p, T_TRUE) || is_token(p, T_FALSE)) {
@@ -159,14 +223,13 @@ Expr parse_terminal(Parser *p)
             p->pos++;
             return make_groupexpr(expr);
         } else {
-            printf("Expected ')' at line %zu\n", terminal.line);
-            exit(1);
+            error_report(E_SYNTAX, terminal.line, "Expected ')' at line %zu\n", terminal.line);
         }
     } else {
-        printf("Unexpected token '");
-        print_token(terminal);
-        printf("' at line %zu\n", terminal.line);
-        exit(1);
+        fprintf(error_stream(), "Unexpected token '");
+        fprint_token(error_stream(), terminal);
+        fprintf(error_stream(), "' at line %zu\n", terminal.line);
+        error_raise(E_SYNTAX, terminal.line);
     }
 }
 
@@ -345,6 +408,14 @@ void expr_free(Expr expr)
         break;
     case TERMINAL:
         break;
+    case CALL: {
+        Exprs args = expr.as->callexpr.args;
+        for (size_t i = 0; i < args.size; i++) {
+            expr_free(args.items[i]);
+        }
+        free(args.items);
+        break;
+    }
     }
     free(expr.as);
 }
@@ -369,6 +440,8 @@ Stmt make_ifstmt(Expr cond, Stmt thenb, Stmt elseb)
     as->ifstmt.cond = cond;
     as->ifstmt.thenb = thenb;
     as->ifstmt.elseb = elseb;
+    as->ifstmt.line = 0;
+    as->ifstmt.prof = (BranchProfile) {0};
 
     Stmt stmt_new = {
         .type = S_IF,
@@ -378,13 +451,17 @@ Stmt make_ifstmt(Expr cond, Stmt thenb, Stmt elseb)
     return stmt_new;
 }
 
-Stmt make_forstmt(Expr init, Expr cond, Expr step, Stmt thenb)
+Stmt make_forstmt(Expr init, Expr cond, Expr step, Stmt thenb, LoopHints hints)
 {
     AnyStmt *as = malloc(sizeof(AnyStmt));
     as->forstmt.init = init;
     as->forstmt.cond = cond;
     as->forstmt.step = step;
     as->forstmt.thenb = thenb;
+    as->forstmt.hints = hints;
+    as->forstmt.counted = (Counted) {0};
+    as->forstmt.line = 0;
+    as->forstmt.prof = (BranchProfile) {0};
 
     Stmt stmt_new = {
         .type = S_FOR,
@@ -394,11 +471,15 @@ Stmt make_forstmt(Expr init, Expr cond, Expr step, Stmt thenb)
     return stmt_new;
 }
 
-Stmt make_whilestmt(Expr cond, Stmt thenb)
+Stmt make_whilestmt(Expr cond, Stmt thenb, LoopHints hints)
 {
     AnyStmt *as = malloc(sizeof(AnyStmt));
     as->whilestmt.cond = cond;
     as->whilestmt.thenb = thenb;
+    as->whilestmt.hints = hints;
+    as->whilestmt.counted = (Counted) {0};
+    as->whilestmt.line = 0;
+    as->whilestmt.prof = (BranchProfile) {0};
 
     Stmt stmt_new = {
         .type = S_WHILE,
@@ -414,6 +495,7 @@ Stmt make_funcstmt(Token name, Args args, Block block)
     as->funcstmt.name = name;
     as->funcstmt.args = args;
     as->funcstmt.block = block;
+    as->funcstmt.hash = 0;
 
     Stmt stmt = {
         .type = S_FUNC,
@@ -467,9 +549,8 @@ Stmt parse_exprstmt(Parser *p)
     Expr expr = parse_expr(p);
     Stmt exprstmt = make_exprstmt(expr);
     if (!is_token(p, T_SEMICOLON)) {
-        printf("Expected ';' at line %zu\n",
+        error_report(E_SYNTAX, p->tokens[p->pos].line, "Expected ';' at line %zu\n",
                 p->tokens[p->pos].line);
-        exit(1);
     }
     p->pos++;
     return exprstmt;
@@ -482,9 +563,8 @@ Stmt parse_retstmt(Parser *p)
         Expr expr = parse_expr(p);
         Stmt retstmt = make_retstmt(expr);
         if (!is_token(p, T_SEMICOLON)) {
-            printf("Expected ';' at line %zu\n",
+            error_report(E_SYNTAX, p->tokens[p->pos].line, "Expected ';' at line %zu\n",
                     p->tokens[p->pos].line);
-            exit(1);
         }
         p->pos++;
         return retstmt;
@@ -497,6 +577,8 @@ Stmt parse_retstmt(Parser *p)
 Stmt parse_funcstmt(Parser *p)
 {
     if (is_token(p, T_FN)) {
+        size_t start = p->pos;
+
         // Parse name
         p->pos++;
         Token name = p->tokens[p->pos];
@@ -524,6 +606,7 @@ Stmt parse_funcstmt(Parser *p)
         p->pos++; // }
 
         Stmt stmt = make_funcstmt(name, args, block);
+        stmt.as->funcstmt.hash = parser_hash(p, start, FNV_OFFSET);
 
         return stmt;
     } else {
@@ -553,15 +636,69 @@ Stmt parse_blockstmt(Parser *p)
     }
 }
 
+// Parses the optional list of loop hints, each hint is a
+// name optionally followed by a number:
+// '[' (NAME DOUBLE? (',' NAME DOUBLE?)*)? ']'
+LoopHints parse_loophints(Parser *p)
+{
+    LoopHints hints = {0};
+    if (!is_token(p, T_LSBRACE)) {
+        return hints;
+    }
+    p->pos++; // [
+
+    while (!is_token(p, T_RSBRACE)) {
+        Token name = p->tokens[p->pos];
+        if (!is_token(p, T_NAME)) {
+            error_report(E_SYNTAX, name.line, "Expected loop hint at line %zu\n", name.line);
+        }
+        p->pos++;
+
+        size_t n = 0;
+        if (is_token(p, T_DOUBLE)) {
+            n = get_ddata(p->tokens[p->pos]);
+            p->pos++;
+        }
+
+        if (strcmp(name.data, "vectorize") == 0) {
+            hints.vectorize = H_ENABLE;
+            hints.width = n;
+        } else if (strcmp(name.data, "novectorize") == 0) {
+            hints.vectorize = H_DISABLE;
+        } else if (strcmp(name.data, "unroll") == 0) {
+            hints.unroll = H_ENABLE;
+            hints.count = n;
+        } else if (strcmp(name.data, "nounroll") == 0) {
+            hints.unroll = H_DISABLE;
+        } else {
+            error_report(E_SYNTAX, name.line, "Unknown loop hint '%s' at line %zu\n",
+                    (char *)name.data, name.line);
+        }
+
+        if (is_token(p, T_COMMA)) {
+            p->pos++;
+        } else if (!is_token(p, T_RSBRACE)) {
+            error_report(E_SYNTAX, p->tokens[p->pos].line, "Expected ']' at line %zu\n",
+                    p->tokens[p->pos].line);
+        }
+    }
+    p->pos++; // ]
+
+    return hints;
+}
+
 Stmt parse_whilestmt(Parser *p)
 {
     if (is_token(p, T_WHILE)) {
+        size_t line = p->tokens[p->pos].line;
         p->pos++;
+        LoopHints hints = parse_loophints(p);
         Expr cond = parse_expr(p);
 
         Stmt thenb = parse_stmt(p);
 
-        Stmt whilestmt = make_whilestmt(cond, thenb);
+        Stmt whilestmt = make_whilestmt(cond, thenb, hints);
+        whilestmt.as->whilestmt.line = line;
         return whilestmt;
     } else {
         Stmt blockstmt = parse_blockstmt(p);
@@ -572,7 +709,9 @@ Stmt parse_whilestmt(Parser *p)
 Stmt parse_forstmt(Parser *p)
 {
     if (is_token(p, T_FOR)) {
+        size_t line = p->tokens[p->pos].line;
         p->pos++;
+        LoopHints hints = parse_loophints(p);
         Expr init = parse_expr(p);
 
         p->pos++;
@@ -583,7 +722,8 @@ Stmt parse_forstmt(Parser *p)
 
         Stmt thenb = parse_stmt(p);
 
-        Stmt forstmt = make_forstmt(init, cond, step, thenb);
+        Stmt forstmt = make_forstmt(init, cond, step, thenb, hints);
+        forstmt.as->forstmt.line = line;
         return forstmt;
     } else {
         Stmt whilestmt = parse_whilestmt(p);
@@ -594,6 +734,7 @@ Stmt parse_forstmt(Parser *p)
 Stmt parse_ifstmt(Parser *p)
 {
     if (is_token(p, T_IF)) {
+        size_t line = p->tokens[p->pos].line;
         p->pos++;
         Expr cond = parse_expr(p);
 
@@ -610,6 +751,7 @@ Stmt parse_ifstmt(Parser *p)
         }
 
         Stmt ifstmt = make_ifstmt(cond, thenb, elseb);
+        ifstmt.as->ifstmt.line = line;
         return ifstmt;
     } else {
         Stmt whilestmt = parse_forstmt(p);
@@ -624,17 +766,15 @@ Stmt parse_declstmt(Parser *p)
         Token name = p->tokens[p->pos];
         p->pos++;
         if (!is_token(p, T_EQUAL)) {
-            printf("Expected '=' at line %zu\n",
+            error_report(E_SYNTAX, p->tokens[p->pos].line, "Expected '=' at line %zu\n",
                     p->tokens[p->pos].line);
-            exit(1);
         }
         p->pos++;
         Expr value = parse_expr(p);
 
         if (!is_token(p, T_SEMICOLON)) {
-            printf("Expected ';' at line %zu\n",
+            error_report(E_SYNTAX, p->tokens[p->pos].line, "Expected ';' at line %zu\n",
                     p->tokens[p->pos].line);
-            exit(1);
         }
         p->pos++;
 
@@ -648,90 +788,135 @@ Stmt parse_declstmt(Parser *p)
 
 Stmt parse_stmt(Parser *p)
 {
+    size_t line = p->tokens[p->pos].line;
     Stmt stmt = parse_declstmt(p);
+    stmt.line = line;
     return stmt;
 }
 
+// import "path";
+Token parse_import(Parser *p)
+{
+    p->pos++; // import
+    Token path = p->tokens[p->pos];
+    if (path.type != T_STRING) {
+        error_report(E_SYNTAX, path.line, "Expected a path after 'import' at line %zu\n", path.line);
+    }
+    p->pos++;
+    if (!is_token(p, T_SEMICOLON)) {
+        error_report(E_SYNTAX, p->tokens[p->pos].line, "Expected ';' at line %zu\n",
+                p->tokens[p->pos].line);
+    }
+    p->pos++;
+    return path;
+}
+
+// Adds the tokens parsed since start to the hash
+uint64_t parser_hash(Parser *p, size_t start, uint64_t hash)
+{
+    for (size_t i = start; i < p->pos; i++) {
+        hash = token_hash(hash, p->tokens[i]);
+    }
+    return hash;
+}
+
+// Imports can only appear at the top level
 Program parse_program(Parser *p)
 {
     Program program;
     v_init(program);
+    v_init(program.imports);
+    program.hash = FNV_OFFSET;
 
     while (!is_token(p, T_EOF)) {
+        if (is_token(p, T_IMPORT)) {
+            Token path = parse_import(p);
+            v_append(program.imports, path);
+            continue;
+        }
+        size_t start = p->pos;
         Stmt stmt = parse_stmt(p);
         v_append(program, stmt);
+        if (stmt.type != S_FUNC) {
+            program.hash = parser_hash(p, start, program.hash);
+        }
     }
 
     return program;
 }
 
-void print_stmt(Stmt stmt)
+void fprint_stmt(FILE *f, Stmt stmt)
 {
     switch (stmt.type) {
     case S_LET:
-        printf("let ");
-        print_token(stmt.as->letstmt.name);
-        printf(" = ");
-        print_expr(stmt.as->letstmt.value);
-        printf(";\n");
+        fprintf(f, "let ");
+        fprint_token(f, stmt.as->letstmt.name);
+        fprintf(f, " = ");
+        fprint_expr(f, stmt.as->letstmt.value);
+        fprintf(f, ";\n");
         break;
     case S_IF:
-        printf("if ");
-        print_expr(stmt.as->ifstmt.cond);
-        printf(" ");
-        print_stmt(stmt.as->ifstmt.thenb);
-        printf("else ");
-        print_stmt(stmt.as->ifstmt.elseb);
+        fprintf(f, "if ");
+        fprint_expr(f, stmt.as->ifstmt.cond);
+        fprintf(f, " ");
+        fprint_stmt(f, stmt.as->ifstmt.thenb);
+        fprintf(f, "else ");
+        fprint_stmt(f, stmt.as->ifstmt.elseb);
         break;
     case S_FOR:
-        printf("for ");
-        print_expr(stmt.as->forstmt.init);
-        printf("; ");
-        print_expr(stmt.as->forstmt.step);
-        printf("; ");
-        print_expr(stmt.as->forstmt.cond);
-        printf(" ");
-        print_stmt(stmt.as->forstmt.thenb);
+        fprintf(f, "for ");
+        fprint_expr(f, stmt.as->forstmt.init);
+        fprintf(f, "; ");
+        fprint_expr(f, stmt.as->forstmt.step);
+        fprintf(f, "; ");
+        fprint_expr(f, stmt.as->forstmt.cond);
+        fprintf(f, " ");
+        fprint_stmt(f, stmt.as->forstmt.thenb);
         break;
     case S_WHILE:
-        printf("while ");
-        print_expr(stmt.as->whilestmt.cond);
-        printf(" ");
-        print_stmt(stmt.as->whilestmt.thenb);
+        fprintf(f, "while ");
+        fprint_expr(f, stmt.as->whilestmt.cond);
+        fprintf(f, " ");
+        fprint_stmt(f, stmt.as->whilestmt.thenb);
         break;
     case S_BLOCK:
-        printf("{\n");
+        fprintf(f, "{\n");
         Block block = stmt.as->blockstmt.block;
         for (size_t i = 0; i < block.size; i++) {
-            print_stmt(block.items[i]);
+            fprint_stmt(f, block.items[i]);
         }
-        printf("}\n");
+        fprintf(f, "}\n");
         break;
     case S_FUNC: {
-        printf("fn");
-        print_token(stmt.as->funcstmt.name);
+        fprintf(f, "fn");
+        fprint_token(f, stmt.as->funcstmt.name);
         Args args = stmt.as->funcstmt.args;
         for (size_t i = 0; i < args.size; i++) {
-            print_token(args.items[i]);
+            fprint_token(f, args.items[i]);
         }
-        printf("{\n");
+        fprintf(f, "{\n");
         Block block = stmt.as->funcstmt.block;
         for (size_t i = 0; i < block.size; i++) {
-            print_stmt(block.items[i]);
+            fprint_stmt(f, block.items[i]);
         }
-        printf("}\n");
+        fprintf(f, "}\n");
         break;
     }
     case S_EXPR:
-        print_expr(stmt.as->exprstmt.expr);
-        printf(";\n");
+        fprint_expr(f, stmt.as->exprstmt.expr);
+        fprintf(f, ";\n");
         break;
     case S_RET:
-        printf("return");
-        print_expr(stmt.as->retstmt.expr);
+        fprintf(f, "return");
+        fprint_expr(f, stmt.as->retstmt.expr);
     }
 }
 
+void print_stmt(Stmt stmt)
+{
+    fprint_stmt(stdout, stmt);
+}
+
 void stmt_free(Stmt stmt)
 {
     switch (stmt.type) {
@@ -767,6 +952,7 @@ void stmt_free(Stmt stmt)
             stmt_free(block.items[i]);
         }
         free(block.items);
+        free(stmt.as->funcstmt.args.items);
         break;
     }
     case S_EXPR:
@@ -792,6 +978,7 @@ void program_free(Program *p)
         stmt_free(p->items[i]);
     }
     free(p->items);
+    free(p->imports.items);
 }
 
 // int main(void)
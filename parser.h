@@ -9,6 +9,7 @@ typedef enum {
     BINARY,
     GROUPING,
     TERMINAL,
+    CALL,
 } ExprType;
 
 typedef union anyexpr AnyExpr;
@@ -26,10 +27,39 @@ typedef struct {
     Expr expr;
 } UnExpr;
 
+typedef enum {
+    Q_UNSEEN,
+    Q_NEVER,
+    Q_WARMUP,
+    Q_ACTIVE,
+} QuickState;
+
+typedef enum {
+    Q_ASSIGN_CONST, // x = x op 1
+    Q_ASSIGN_LOCAL, // x = x op y
+    Q_CMP_CONST,    // x < 1
+} QuickShape;
+
+// Filled by the interpreter when the node is quickened:
+// a binary expression with one of the shapes above is
+// replaced by a fused version after being evaluated
+// QUICK_THRESHOLD times on doubles
+typedef struct {
+    QuickState state;
+    QuickShape shape;
+    TokenType op;
+    Token x;
+    Token y;
+    double c;
+    size_t count;
+    size_t deopts;
+} Quick;
+
 typedef struct {
     Expr lexpr;
     Token op;
     Expr rexpr;
+    Quick quick;
 } BinExpr;
 
 typedef struct {
@@ -40,12 +70,24 @@ typedef struct {
     Token term;
 } TermExpr;
 
+typedef struct {
+    size_t size;
+    size_t capacity;
+    Expr *items;
+} Exprs;
+
+typedef struct {
+    Token name;
+    Exprs args;
+} CallExpr;
+
 // Single dinamically allocated struct
 typedef union anyexpr {
     UnExpr unexpr;
     BinExpr binexpr;
     GroupExpr groupexpr;
     TermExpr termexpr;
+    CallExpr callexpr;
 } AnyExpr;
 
 typedef struct {
@@ -56,13 +98,16 @@ typedef struct {
 
 void parser_init(Parser *p, Lexer *l);
 void parser_free(Parser *p);
+void fprint_expr(FILE *f, Expr expr);
 void print_expr(Expr expr);
 Expr make_unexpr(Token op, Expr expr);
 Expr make_binexpr(Expr lexpr, Token op, Expr rexpr);
 Expr make_groupexpr(Expr expr);
 Expr make_termexpr(Token term);
+Expr make_callexpr(Token name, Exprs args);
 bool is_token(Parser *p, TokenType tt);
-void sync(Parser *p);
+void parser_sync(Parser *p);
+Expr parse_callexpr(Parser *p);
 Expr parse_terminal(Parser *p);
 Expr parse_unary(Parser *p);
 Expr parse_factor(Parser *p);
@@ -88,8 +133,10 @@ typedef enum {
 
 typedef union anystmt AnyStmt;
 
+// Line is the one of the first token of the statement
 typedef struct {
     StmtType type;
+    size_t line;
     AnyStmt *as;
 } Stmt;
 
@@ -98,22 +145,73 @@ typedef struct {
     Expr value;
 } LetStmt;
 
+// Filled by the interpreter and by profile_read, taken counts
+// the times the condition was true (the then branch or the loop
+// body was executed) and skipped the times it was false
+typedef struct {
+    size_t taken;
+    size_t skipped;
+} BranchProfile;
+
 typedef struct {
     Expr cond;
     Stmt thenb;
     Stmt elseb;
+    size_t line;
+    BranchProfile prof;
 } IfStmt;
 
+typedef enum {
+    H_DEFAULT,
+    H_ENABLE,
+    H_DISABLE,
+} HintKind;
+
+// Optimization hints attached to a loop with the
+// syntax 'while [vectorize 4, unroll 8] cond { ... }'
+typedef struct {
+    HintKind vectorize;
+    size_t width;
+    HintKind unroll;
+    size_t count;
+} LoopHints;
+
+typedef enum {
+    C_UNSEEN,
+    C_NEVER,
+    C_COUNTED,
+} CountedState;
+
+// Filled by the interpreter for the loops with the shape
+// 'for i = a; i < n; i = i + k' (or a while loop ending with
+// the step) whose body does not write i or n
+typedef struct {
+    CountedState state;
+    Token i;
+    Expr bound;
+    TokenType cmp;
+    double k;
+    bool reads;
+} Counted;
+
 typedef struct {
     Expr init;
     Expr cond;
     Expr step;
     Stmt thenb;
+    LoopHints hints;
+    Counted counted;
+    size_t line;
+    BranchProfile prof;
 } ForStmt;
 
 typedef struct {
     Expr cond;
     Stmt thenb;
+    LoopHints hints;
+    Counted counted;
+    size_t line;
+    BranchProfile prof;
 } WhileStmt;
 
 typedef struct {
@@ -136,10 +234,14 @@ typedef struct {
     Expr expr;
 } ExprStmt;
 
+// The hash covers the tokens of the function, from fn to the
+// closing brace, it is the fingerprint used by codegen to find
+// the functions that changed since the last build
 typedef struct {
     Token name;
     Args args;
     Block block;
+    uint64_t hash;
 } FuncStmt;
 
 typedef struct {
@@ -160,27 +262,37 @@ typedef union anystmt {
 
 Stmt make_letstmt(Token name, Expr value);
 Stmt make_ifstmt(Expr cond, Stmt thenb, Stmt elseb);
-Stmt make_forstmt(Expr init, Expr step, Expr cond, Stmt thenb);
-Stmt make_whilestmt(Expr cond, Stmt thenb);
+Stmt make_forstmt(Expr init, Expr cond, Expr step, Stmt thenb, LoopHints hints);
+Stmt make_whilestmt(Expr cond, Stmt thenb, LoopHints hints);
 Stmt make_blockstmt(Block block);
 Stmt make_exprstmt(Expr expr);
+Stmt make_funcstmt(Token name, Args args, Block block);
 Stmt make_retstmt(Expr expr);
 Stmt parse_retstmt(Parser *p);
 Stmt parse_exprstmt(Parser *p);
 Stmt parse_blockstmt(Parser *p);
+LoopHints parse_loophints(Parser *p);
 Stmt parse_whilestmt(Parser *p);
 Stmt parse_forstmt(Parser *p);
 Stmt parse_ifstmt(Parser *p);
 Stmt parse_declstmt(Parser *p);
 Stmt parse_stmt(Parser *p);
+uint64_t parser_hash(Parser *p, size_t start, uint64_t hash);
 
+// The paths of the imported files are kept apart from the
+// statements, see import.c. The hash covers the tokens of
+// the statements of main, the ones outside of the functions.
 typedef struct {
     size_t size;
     size_t capacity;
     Stmt *items;
+    Args imports;
+    uint64_t hash;
 } Program;
 
+Token parse_import(Parser *p);
 Program parse_program(Parser *p);
+void fprint_stmt(FILE *f, Stmt stmt);
 void print_stmt(Stmt stmt);
 void stmt_free(Stmt stmt);
 void print_program(Program *p);
@@ -0,0 +1,147 @@
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include "vector.h"
+#include "error.h"
+#include "perfmap.h"
+
+// PERF MAPS
+// perf finds the symbols of the code generated at run time in
+// /tmp/perf-PID.map, one line per function with its address
+// and its size in hex:
+//
+//   7f3a2c001000 4b fib
+//
+// MCJIT does not tell the size of the functions, so with a map
+// the JIT allocates its sections with this memory manager, which
+// records where the code is: a function ends at the next function
+// of its section or at the end of the section. The sections are
+// carved out of one reserved region so that the code stays within
+// reach of its constants with the small code model, every section
+// starts on a page to get its own protection.
+
+size_t page_round(size_t size)
+{
+    size_t page = sysconf(_SC_PAGESIZE);
+    return (size + page - 1) / page * page;
+}
+
+uint8_t *perfmap_alloc(PerfMap *map, uintptr_t size, unsigned alignment)
+{
+    size_t rounded = page_round(size ? size : 1);
+    if (alignment > (size_t)sysconf(_SC_PAGESIZE) || map->used + rounded > PERFMAP_REGION) {
+        return NULL;
+    }
+    uint8_t *start = map->region + map->used;
+    map->used += rounded;
+    return start;
+}
+
+uint8_t *perfmap_code(void *opaque, uintptr_t size, unsigned alignment,
+        unsigned id, const char *name)
+{
+    (void)id;
+    (void)name;
+    PerfMap *map = opaque;
+    uint8_t *start = perfmap_alloc(map, size, alignment);
+    if (start) {
+        CodeSection section = {.start = start, .size = size};
+        v_append(map->code, section);
+    }
+    return start;
+}
+
+uint8_t *perfmap_data(void *opaque, uintptr_t size, unsigned alignment,
+        unsigned id, const char *name, LLVMBool readonly)
+{
+    (void)id;
+    (void)name;
+    (void)readonly;
+    return perfmap_alloc(opaque, size, alignment);
+}
+
+// The code sections loaded since the last call become executable,
+// the data stays writable
+LLVMBool perfmap_finalize(void *opaque, char **error)
+{
+    PerfMap *map = opaque;
+    for (; map->protected < map->code.size; map->protected++) {
+        CodeSection section = map->code.items[map->protected];
+        if (mprotect(section.start, page_round(section.size), PROT_READ | PROT_EXEC)) {
+            *error = strdup("Could not make the JIT code executable");
+            return 1;
+        }
+    }
+    return 0;
+}
+
+void perfmap_destroy(void *opaque)
+{
+    PerfMap *map = opaque;
+    fclose(map->f);
+    munmap(map->region, PERFMAP_REGION);
+    free(map->code.items);
+    free(map);
+}
+
+// The memory manager owns the map, it is closed with
+// the execution engine
+LLVMMCJITMemoryManagerRef perfmap_create(PerfMap **out)
+{
+    PerfMap *map = calloc(1, sizeof(PerfMap));
+    *out = map;
+    v_init(map->code);
+    char path[64];
+    snprintf(path, sizeof(path), "/tmp/perf-%d.map", (int)getpid());
+    map->f = fopen(path, "w");
+    if (map->f == NULL) {
+        error_report(E_IO, 0, "Could not create file %s\n", path);
+    }
+    map->region = mmap(NULL, PERFMAP_REGION, PROT_READ | PROT_WRITE,
+        MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (map->region == MAP_FAILED) {
+        error_report(E_CODEGEN, 0, "Could not reserve memory for the JIT\n");
+    }
+    return LLVMCreateSimpleMCJITMemoryManager(map, perfmap_code, perfmap_data,
+        perfmap_finalize, perfmap_destroy);
+}
+
+CodeSection *section_find(PerfMap *map, uint64_t addr)
+{
+    for (size_t i = 0; i < map->code.size; i++) {
+        CodeSection *section = &map->code.items[i];
+        if (addr >= (uintptr_t)section->start
+                && addr < (uintptr_t)section->start + section->size) {
+            return section;
+        }
+    }
+    return NULL;
+}
+
+// Writes the functions of a module once its code is finalized,
+// the map is flushed so that perf sees them if the run crashes
+void perfmap_write(PerfMap *map, LLVMExecutionEngineRef engine, char **names, size_t n)
+{
+    uint64_t *addrs = malloc((n + 1) * sizeof(uint64_t));
+    for (size_t i = 0; i < n; i++) {
+        addrs[i] = LLVMGetFunctionAddress(engine, names[i]);
+    }
+    for (size_t i = 0; i < n; i++) {
+        CodeSection *section = section_find(map, addrs[i]);
+        if (section == NULL) {
+            continue;
+        }
+        uint64_t end = (uintptr_t)section->start + section->size;
+        for (size_t j = 0; j < n; j++) {
+            if (addrs[j] > addrs[i] && addrs[j] < end) {
+                end = addrs[j];
+            }
+        }
+        fprintf(map->f, "%lx %lx %s\n", (unsigned long)addrs[i],
+            (unsigned long)(end - addrs[i]), names[i]);
+    }
+    fflush(map->f);
+    free(addrs);
+}
@@ -0,0 +1,37 @@
+#ifndef PERFMAP_H
+#define PERFMAP_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#include "llvm-c/ExecutionEngine.h"
+
+// Bytes of address space reserved for the code of the JIT
+#define PERFMAP_REGION (256 << 20)
+
+typedef struct {
+    uint8_t *start;
+    size_t size;
+} CodeSection;
+
+typedef struct {
+    size_t size;
+    size_t capacity;
+    CodeSection *items;
+} CodeSections;
+
+// The sections are allocated in region, used bytes of it are
+// taken, the first protected code sections are executable
+typedef struct perfmap {
+    FILE *f;
+    uint8_t *region;
+    size_t used;
+    CodeSections code;
+    size_t protected;
+} PerfMap;
+
+LLVMMCJITMemoryManagerRef perfmap_create(PerfMap **map);
+void perfmap_write(PerfMap *map, LLVMExecutionEngineRef engine, char **names, size_t n);
+
+#endif
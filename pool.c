@@ -0,0 +1,72 @@
+#include <pthread.h>
+#include <stdlib.h>
+#include <sys/sysinfo.h>
+
+#include "pool.h"
+
+// THREAD POOL
+// Runs the jobs 0..njobs-1 on a fixed number of threads, every
+// thread takes the next job that has not been started yet. Jobs
+// must only write their own slot of the results, so the output
+// does not depend on the number of threads or on the order in
+// which the jobs complete.
+typedef struct {
+    pthread_mutex_t lock;
+    size_t next;
+    size_t njobs;
+    PoolJob job;
+    void *arg;
+} Pool;
+
+// One thread per core
+size_t pool_threads(void)
+{
+    int n = get_nprocs();
+    return n > 0 ? n : 1;
+}
+
+void *pool_worker(void *arg)
+{
+    Pool *pool = arg;
+    for (;;) {
+        pthread_mutex_lock(&pool->lock);
+        size_t index = pool->next++;
+        pthread_mutex_unlock(&pool->lock);
+        if (index >= pool->njobs) {
+            return NULL;
+        }
+        pool->job(pool->arg, index);
+    }
+}
+
+// The calling thread works too, a single thread runs all the
+// jobs without creating any thread. When a thread cannot be
+// created the jobs are run by the threads that could, at worst
+// by the calling thread alone.
+void pool_run(size_t nthreads, size_t njobs, PoolJob job, void *arg)
+{
+    Pool pool = {
+        .next = 0,
+        .njobs = njobs,
+        .job = job,
+        .arg = arg,
+    };
+    pthread_mutex_init(&pool.lock, NULL);
+
+    if (nthreads > njobs) {
+        nthreads = njobs;
+    }
+    pthread_t *threads = malloc((nthreads + 1) * sizeof(pthread_t));
+    size_t started = 1;
+    while (started < nthreads
+            && pthread_create(&threads[started], NULL, pool_worker, &pool) == 0) {
+        started++;
+    }
+    pool_worker(&pool);
+    for (size_t i = 1; i < started; i++) {
+        pthread_join(threads[i], NULL);
+    }
+
+    pthread_mutex_destroy(&pool.lock);
+    free(threads);
+}
@@ -0,0 +1,11 @@
+#ifndef POOL_H
+#define POOL_H
+
+#include <stddef.h>
+
+typedef void (*PoolJob)(void *arg, size_t index);
+
+size_t pool_threads(void);
+void pool_run(size_t nthreads, size_t njobs, PoolJob job, void *arg);
+
+#endif
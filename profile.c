@@ -0,0 +1,140 @@
+#include <stdio.h>
+#include <string.h>
+
+#include "vector.h"
+#include "error.h"
+#include "lexer.h"
+#include "parser.h"
+#include "profile.h"
+
+// PROFILES
+// The interpreter counts how many times the condition of every
+// if, for and while statement was true and false. The counters are
+// written to a text file, one line per statement:
+//
+//   if 12 0 1500 20
+//
+// with the kind of statement, its line, its index among the
+// statements of the same kind on that line, the taken and the
+// skipped counts. The code generator reads the file back into a
+// program parsed from the same source and turns the counters
+// into branch weights.
+
+void sites_stmt(Stmt stmt, ProfileSites *sites);
+
+void sites_add(ProfileSites *sites, char *kind, size_t line, BranchProfile *prof)
+{
+    size_t index = 0;
+    for (size_t i = 0; i < sites->size; i++) {
+        ProfileSite site = sites->items[i];
+        if (site.line == line && strcmp(site.kind, kind) == 0) {
+            index++;
+        }
+    }
+    ProfileSite site = {
+        .kind = kind,
+        .line = line,
+        .index = index,
+        .prof = prof,
+    };
+    v_append(*sites, site);
+}
+
+void sites_block(Block block, ProfileSites *sites)
+{
+    for (size_t i = 0; i < block.size; i++) {
+        sites_stmt(block.items[i], sites);
+    }
+}
+
+void sites_stmt(Stmt stmt, ProfileSites *sites)
+{
+    switch (stmt.type) {
+    case S_IF:
+        sites_add(sites, "if", stmt.as->ifstmt.line, &stmt.as->ifstmt.prof);
+        sites_stmt(stmt.as->ifstmt.thenb, sites);
+        sites_stmt(stmt.as->ifstmt.elseb, sites);
+        break;
+    case S_FOR:
+        sites_add(sites, "for", stmt.as->forstmt.line, &stmt.as->forstmt.prof);
+        sites_stmt(stmt.as->forstmt.thenb, sites);
+        break;
+    case S_WHILE:
+        sites_add(sites, "while", stmt.as->whilestmt.line, &stmt.as->whilestmt.prof);
+        sites_stmt(stmt.as->whilestmt.thenb, sites);
+        break;
+    case S_BLOCK:
+        sites_block(stmt.as->blockstmt.block, sites);
+        break;
+    case S_FUNC:
+        sites_block(stmt.as->funcstmt.block, sites);
+        break;
+    default:
+        break;
+    }
+}
+
+// Collects the branches of the program in source order
+void profile_sites(Program *pr, ProfileSites *sites)
+{
+    v_init(*sites);
+    for (size_t i = 0; i < pr->size; i++) {
+        sites_stmt(pr->items[i], sites);
+    }
+}
+
+void profile_write(Program *pr, char *path)
+{
+    FILE *f = fopen(path, "w");
+    if (f == NULL) {
+        error_report(E_IO, 0, "Could not open file %s\n", path);
+    }
+
+    ProfileSites sites;
+    profile_sites(pr, &sites);
+    fprintf(f, "# kind line index taken skipped\n");
+    for (size_t i = 0; i < sites.size; i++) {
+        ProfileSite site = sites.items[i];
+        fprintf(f, "%s %zu %zu %zu %zu\n", site.kind, site.line, site.index,
+                site.prof->taken, site.prof->skipped);
+    }
+    free(sites.items);
+    fclose(f);
+}
+
+// Lines that do not match any statement are ignored, the
+// profile may come from an older version of the source
+void profile_read(Program *pr, char *path)
+{
+    FILE *f = fopen(path, "r");
+    if (f == NULL) {
+        error_report(E_IO, 0, "Could not open file %s\n", path);
+    }
+
+    ProfileSites sites;
+    profile_sites(pr, &sites);
+
+    char line[256];
+    while (fgets(line, sizeof(line), f)) {
+        if (line[0] == '#') {
+            continue;
+        }
+        char kind[16];
+        size_t lineno, index, taken, skipped;
+        if (sscanf(line, "%15s %zu %zu %zu %zu", kind, &lineno, &index,
+                    &taken, &skipped) != 5) {
+            error_report(E_SYNTAX, 0, "Invalid profile line '%s'\n", strtok(line, "\n"));
+        }
+        for (size_t i = 0; i < sites.size; i++) {
+            ProfileSite site = sites.items[i];
+            if (site.line == lineno && site.index == index
+                    && strcmp(site.kind, kind) == 0) {
+                site.prof->taken = taken;
+                site.prof->skipped = skipped;
+                break;
+            }
+        }
+    }
+    free(sites.items);
+    fclose(f);
+}
@@ -0,0 +1,23 @@
+#ifndef PROFILE_H
+#define PROFILE_H
+
+#include "parser.h"
+
+typedef struct {
+    char *kind;
+    size_t line;
+    size_t index;
+    BranchProfile *prof;
+} ProfileSite;
+
+typedef struct {
+    size_t size;
+    size_t capacity;
+    ProfileSite *items;
+} ProfileSites;
+
+void profile_sites(Program *pr, ProfileSites *sites);
+void profile_write(Program *pr, char *path);
+void profile_read(Program *pr, char *path);
+
+#endif
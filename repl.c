@@ -0,0 +1,269 @@
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "llvm-c/Core.h"
+#include "llvm-c/Analysis.h"
+#include "llvm-c/ExecutionEngine.h"
+#include "llvm-c/Target.h"
+
+#include "vector.h"
+#include "error.h"
+#include "lexer.h"
+#include "parser.h"
+#include "codegen.h"
+#include "repl.h"
+
+// REPL
+// Every entry is compiled on its own into a new module which is
+// added to a single MCJIT execution engine, nothing entered before
+// is compiled again. The variables defined at the top level of an
+// entry are external globals and its functions have external
+// linkage, the following modules only declare them and MCJIT
+// resolves them across modules. The other statements go in a
+// function repl.N returning the value of the last expression
+// statement, or of a return, which is printed.
+//
+// Definitions are kept only when the whole entry compiles, like
+// in the interpreter variables and functions cannot be defined
+// twice.
+
+void repl_init(Repl *repl)
+{
+    LLVMLinkInMCJIT();
+    LLVMInitializeNativeTarget();
+    LLVMInitializeNativeAsmPrinter();
+
+    struct LLVMMCJITCompilerOptions options;
+    LLVMInitializeMCJITCompilerOptions(&options, sizeof(options));
+    options.OptLevel = 2;
+
+    char *error = NULL;
+    LLVMModuleRef module = LLVMModuleCreateWithName("repl");
+    if (LLVMCreateMCJITCompilerForModule(&repl->engine, module,
+                &options, sizeof(options), &error)) {
+        error_report(E_CODEGEN, 0, "Could not create JIT: %s\n", error);
+    }
+    repl->builder = LLVMCreateBuilder();
+    v_init(repl->vars);
+    v_init(repl->funcs);
+    repl->lines = 0;
+}
+
+void repl_free(Repl *repl)
+{
+    LLVMDisposeExecutionEngine(repl->engine);
+    LLVMDisposeBuilder(repl->builder);
+    for (size_t i = 0; i < repl->vars.size; i++) {
+        free(repl->vars.items[i]);
+    }
+    for (size_t i = 0; i < repl->funcs.size; i++) {
+        free(repl->funcs.items[i].name);
+    }
+    free(repl->vars.items);
+    free(repl->funcs.items);
+}
+
+bool repl_defined(Repl *repl, char *name)
+{
+    for (size_t i = 0; i < repl->vars.size; i++) {
+        if (strcmp(repl->vars.items[i], name) == 0) {
+            return true;
+        }
+    }
+    for (size_t i = 0; i < repl->funcs.size; i++) {
+        if (strcmp(repl->funcs.items[i].name, name) == 0) {
+            return true;
+        }
+    }
+    return false;
+}
+
+// The definitions of the previous entries
+void repl_declare(Repl *repl, Codegen *codegen)
+{
+    LLVMTypeRef type = LLVMDoubleType();
+    for (size_t i = 0; i < repl->vars.size; i++) {
+        char *name = repl->vars.items[i];
+        nv_insert(codegen->nvalues, name, LLVMAddGlobal(codegen->module, type, name));
+    }
+    for (size_t i = 0; i < repl->funcs.size; i++) {
+        ReplFunc func = repl->funcs.items[i];
+        LLVMTypeRef *params = malloc(func.argc * sizeof(LLVMTypeRef));
+        for (size_t j = 0; j < func.argc; j++) {
+            params[j] = type;
+        }
+        LLVMAddFunction(codegen->module, func.name,
+            LLVMFunctionType(type, params, func.argc, false));
+        free(params);
+    }
+}
+
+// Returns true when the entry has a value to print
+bool repl_gen(Repl *repl, Codegen *codegen, Program *pr, char *name)
+{
+    for (size_t i = 0; i < pr->size; i++) {
+        Stmt stmt = pr->items[i];
+        Token defined = stmt.type == S_FUNC ? stmt.as->funcstmt.name
+            : stmt.type == S_LET ? stmt.as->letstmt.name
+            : (Token){0};
+        if (defined.data && repl_defined(repl, defined.data)) {
+            error_report(E_CODEGEN, defined.line, "Name '%s' is already defined at line %zu\n",
+                    (char *)defined.data, defined.line);
+        }
+    }
+
+    gen_protos(codegen->module, *pr);
+    for (size_t i = 0; i < pr->size; i++) {
+        if (pr->items[i].type == S_FUNC) {
+            gen_funcstmt(codegen, pr->items[i].as->funcstmt);
+        }
+    }
+
+    LLVMTypeRef type = LLVMDoubleType();
+    LLVMValueRef func = LLVMAddFunction(codegen->module, name,
+        LLVMFunctionType(type, NULL, 0, false));
+    LLVMPositionBuilderAtEnd(codegen->builder, LLVMAppendBasicBlock(func, "entry"));
+    LLVMValueRef value = LLVMConstReal(type, 0);
+    bool show = false;
+    for (size_t i = 0; i < pr->size; i++) {
+        Stmt stmt = pr->items[i];
+        if (stmt.type == S_LET) {
+            LetStmt letstmt = stmt.as->letstmt;
+            LLVMValueRef global = LLVMAddGlobal(codegen->module, type, letstmt.name.data);
+            LLVMSetInitializer(global, LLVMConstReal(type, 0));
+            LLVMBuildStore(codegen->builder,
+                gen_double(codegen, gen_expr(codegen, letstmt.value)), global);
+            nv_insert(codegen->nvalues, letstmt.name.data, global);
+        } else if (stmt.type == S_EXPR && i + 1 == pr->size) {
+            value = gen_double(codegen, gen_expr(codegen, stmt.as->exprstmt.expr));
+            show = true;
+        } else if (stmt.type != S_FUNC) {
+            show = show || stmt.type == S_RET;
+            gen_stmt(codegen, stmt);
+        }
+    }
+    LLVMBuildRet(codegen->builder, value);
+    return show;
+}
+
+void repl_eval(Repl *repl, char *source)
+{
+    Lexer l;
+    lexer_init(&l, source);
+    get_tokens(&l);
+    Parser p;
+    parser_init(&p, &l);
+    Program pr = parse_program(&p);
+    if (pr.imports.size > 0) {
+        error_report(E_SYNTAX, 0, "Imports are not supported in the REPL\n");
+    }
+
+    char name[32];
+    snprintf(name, sizeof(name), "repl.%zu", repl->lines++);
+    LLVMModuleRef module = LLVMModuleCreateWithName(name);
+    NamedValues nvalues = {0};
+    Codegen codegen = {
+        .context = LLVMGetGlobalContext(),
+        .builder = repl->builder,
+        .module = module,
+        .nvalues = &nvalues,
+    };
+    repl_declare(repl, &codegen);
+    bool show = repl_gen(repl, &codegen, &pr, name);
+    free_nvnode(nvalues.root);
+
+    char *error = NULL;
+    if (LLVMVerifyModule(module, LLVMReturnStatusAction, &error)) {
+        error_report(E_CODEGEN, 0, "Invalid module: %s\n", error);
+    }
+    LLVMDisposeMessage(error);
+    optimize_module(module, 2);
+    LLVMAddModule(repl->engine, module);
+
+    // The entry is kept from here on
+    for (size_t i = 0; i < pr.size; i++) {
+        Stmt stmt = pr.items[i];
+        if (stmt.type == S_LET) {
+            v_append(repl->vars, strdup(stmt.as->letstmt.name.data));
+        } else if (stmt.type == S_FUNC) {
+            ReplFunc func = {
+                .name = strdup(stmt.as->funcstmt.name.data),
+                .argc = stmt.as->funcstmt.args.size,
+            };
+            v_append(repl->funcs, func);
+        }
+    }
+
+    double (*entry)(void) = (double (*)(void))LLVMGetFunctionAddress(repl->engine, name);
+    double value = entry();
+    if (show) {
+        printf("%g\n", value);
+    }
+    for (size_t i = 0; i < pr.size; i++) {
+        if (pr.items[i].type == S_LET) {
+            char *var = pr.items[i].as->letstmt.name.data;
+            double *ptr = (double *)LLVMGetGlobalValueAddress(repl->engine, var);
+            printf("%s = %g\n", var, *ptr);
+        }
+    }
+
+    program_free(&pr);
+    lexer_free(&l);
+}
+
+// An entry continues on the next lines while it has unclosed
+// braces, errors are printed and the session goes on
+int repl_run(FILE *in)
+{
+    Repl repl;
+    repl_init(&repl);
+    bool prompt = isatty(fileno(in));
+
+    Buffer entry;
+    v_init(entry);
+    int depth = 0;
+    char *line = NULL;
+    size_t size = 0;
+    for (;;) {
+        if (prompt) {
+            printf(depth > 0 ? "... " : "> ");
+            fflush(stdout);
+        }
+        if (getline(&line, &size, in) < 0) {
+            break;
+        }
+        for (char *c = line; *c; c++) {
+            depth += *c == '{' ? 1 : *c == '}' ? -1 : 0;
+            v_append(entry, *c);
+        }
+        if (depth > 0) {
+            continue;
+        }
+
+        // The semicolon of a last expression can be left out
+        size_t end = entry.size;
+        while (end > 0 && strchr(" \t\r\n", entry.items[end - 1])) {
+            end--;
+        }
+        if (end > 0 && entry.items[end - 1] != ';' && entry.items[end - 1] != '}') {
+            v_append(entry, ';');
+        }
+        v_append(entry, EOF);
+        ErrorHandler handler;
+        error_push(&handler);
+        if (setjmp(handler.env) == 0) {
+            repl_eval(&repl, entry.items);
+            error_pop(&handler);
+        } else {
+            printf("%s\n", handler.diag.message);
+        }
+        entry.size = 0;
+        depth = 0;
+    }
+
+    free(line);
+    free(entry.items);
+    repl_free(&repl);
+    return 0;
+}
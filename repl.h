@@ -0,0 +1,41 @@
+#ifndef REPL_H
+#define REPL_H
+
+#include <stdio.h>
+
+#include "llvm-c/Core.h"
+#include "llvm-c/ExecutionEngine.h"
+
+typedef struct {
+    char *name;
+    size_t argc;
+} ReplFunc;
+
+typedef struct {
+    size_t size;
+    size_t capacity;
+    ReplFunc *items;
+} ReplFuncs;
+
+typedef struct {
+    size_t size;
+    size_t capacity;
+    char **items;
+} ReplVars;
+
+// Vars and funcs are the globals and functions defined by the
+// previous lines, lines counts the modules added to the engine
+typedef struct {
+    LLVMExecutionEngineRef engine;
+    LLVMBuilderRef builder;
+    ReplVars vars;
+    ReplFuncs funcs;
+    size_t lines;
+} Repl;
+
+void repl_init(Repl *repl);
+void repl_free(Repl *repl);
+void repl_eval(Repl *repl, char *source);
+int repl_run(FILE *in);
+
+#endif
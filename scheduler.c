@@ -0,0 +1,194 @@
+#include <pthread.h>
+#include <stdlib.h>
+
+#include "vector.h"
+#include "lang.h"
+#include "pool.h"
+#include "scheduler.h"
+
+// SCHEDULER
+// Runs queued scripts on a fixed set of worker threads. Every
+// worker has its own queue and its own context, so the values of
+// a run come from the arena of the worker and the errors are
+// reported in its diagnostic. Submitted jobs are spread over the
+// queues, a worker runs the jobs of its own queue and steals from
+// the other queues when it is empty.
+//
+// queued counts the jobs that are in a queue and not claimed yet.
+// A worker claims a job by decrementing it before looking at the
+// queues, so a claimed job is always found in some queue. pending
+// also counts the jobs that are running, sched_wait waits for it
+// to drop to zero. Scripts run on the workers without the JIT.
+
+void queue_init(SchedQueue *queue)
+{
+    pthread_mutex_init(&queue->lock, NULL);
+    queue->head = 0;
+    v_init(*queue);
+}
+
+void queue_push(SchedQueue *queue, SchedJob job)
+{
+    pthread_mutex_lock(&queue->lock);
+    v_append(*queue, job);
+    pthread_mutex_unlock(&queue->lock);
+}
+
+bool queue_pop(SchedQueue *queue, SchedJob *job, bool steal)
+{
+    pthread_mutex_lock(&queue->lock);
+    bool found = queue->head < queue->size;
+    if (found) {
+        *job = steal
+            ? queue->items[queue->head++]
+            : queue->items[--queue->size];
+        if (queue->head == queue->size) {
+            queue->head = queue->size = 0;
+        }
+    }
+    pthread_mutex_unlock(&queue->lock);
+    return found;
+}
+
+void queue_free(SchedQueue *queue)
+{
+    pthread_mutex_destroy(&queue->lock);
+    free(queue->items);
+}
+
+// Own queue first, then the others starting from the next worker
+SchedJob sched_take(SchedWorker *worker)
+{
+    Sched *sched = worker->sched;
+    SchedJob job;
+    for (;;) {
+        if (queue_pop(&worker->queue, &job, false)) {
+            return job;
+        }
+        for (size_t i = 1; i < sched->nworkers; i++) {
+            SchedWorker *victim = &sched->workers[(worker->index + i) % sched->nworkers];
+            if (queue_pop(&victim->queue, &job, true)) {
+                return job;
+            }
+        }
+    }
+}
+
+void *sched_worker(void *arg)
+{
+    SchedWorker *worker = arg;
+    Sched *sched = worker->sched;
+    for (;;) {
+        pthread_mutex_lock(&sched->lock);
+        while (sched->queued == 0 && !sched->stop) {
+            pthread_cond_wait(&sched->wake, &sched->lock);
+        }
+        if (sched->queued == 0) {
+            pthread_mutex_unlock(&sched->lock);
+            return NULL;
+        }
+        sched->queued--;
+        pthread_mutex_unlock(&sched->lock);
+
+        SchedJob job = sched_take(worker);
+        int result = 0;
+        ErrorKind kind = lang_run(worker->ctx, job.script, &result);
+        job.done(job.arg, kind, result, &worker->ctx->diag);
+
+        pthread_mutex_lock(&sched->lock);
+        if (--sched->pending == 0) {
+            pthread_cond_broadcast(&sched->idle);
+        }
+        pthread_mutex_unlock(&sched->lock);
+    }
+}
+
+// One worker per core when nworkers is 0, returns NULL when
+// the threads cannot be created
+Sched *sched_create(size_t nworkers)
+{
+    Sched *sched = malloc(sizeof(Sched));
+    sched->nworkers = nworkers ? nworkers : pool_threads();
+    sched->workers = malloc(sched->nworkers * sizeof(SchedWorker));
+    pthread_mutex_init(&sched->lock, NULL);
+    pthread_cond_init(&sched->wake, NULL);
+    pthread_cond_init(&sched->idle, NULL);
+    sched->next = 0;
+    sched->queued = 0;
+    sched->pending = 0;
+    sched->stop = false;
+
+    for (size_t i = 0; i < sched->nworkers; i++) {
+        SchedWorker *worker = &sched->workers[i];
+        worker->sched = sched;
+        worker->index = i;
+        worker->ctx = lang_create(0);
+        queue_init(&worker->queue);
+    }
+    // The workers that did not start are released, the
+    // ones that did are stopped by sched_free
+    for (size_t i = 0; i < sched->nworkers; i++) {
+        SchedWorker *worker = &sched->workers[i];
+        if (pthread_create(&worker->thread, NULL, sched_worker, worker)) {
+            for (size_t j = i; j < sched->nworkers; j++) {
+                queue_free(&sched->workers[j].queue);
+                lang_destroy(sched->workers[j].ctx);
+            }
+            sched->nworkers = i;
+            sched_free(sched);
+            return NULL;
+        }
+    }
+    return sched;
+}
+
+// The script must stay alive until its job is done
+void sched_submit(Sched *sched, LangScript *script, SchedDone done, void *arg)
+{
+    SchedJob job = {
+        .script = script,
+        .done = done,
+        .arg = arg,
+    };
+    pthread_mutex_lock(&sched->lock);
+    size_t index = sched->next++ % sched->nworkers;
+    sched->pending++;
+    pthread_mutex_unlock(&sched->lock);
+
+    queue_push(&sched->workers[index].queue, job);
+
+    pthread_mutex_lock(&sched->lock);
+    sched->queued++;
+    pthread_cond_signal(&sched->wake);
+    pthread_mutex_unlock(&sched->lock);
+}
+
+void sched_wait(Sched *sched)
+{
+    pthread_mutex_lock(&sched->lock);
+    while (sched->pending > 0) {
+        pthread_cond_wait(&sched->idle, &sched->lock);
+    }
+    pthread_mutex_unlock(&sched->lock);
+}
+
+// Runs the jobs that are still queued before stopping
+void sched_free(Sched *sched)
+{
+    pthread_mutex_lock(&sched->lock);
+    sched->stop = true;
+    pthread_cond_broadcast(&sched->wake);
+    pthread_mutex_unlock(&sched->lock);
+
+    for (size_t i = 0; i < sched->nworkers; i++) {
+        SchedWorker *worker = &sched->workers[i];
+        pthread_join(worker->thread, NULL);
+        queue_free(&worker->queue);
+        lang_destroy(worker->ctx);
+    }
+    pthread_cond_destroy(&sched->wake);
+    pthread_cond_destroy(&sched->idle);
+    pthread_mutex_destroy(&sched->lock);
+    free(sched->workers);
+    free(sched);
+}
@@ -0,0 +1,56 @@
+#ifndef SCHEDULER_H
+#define SCHEDULER_H
+
+#include <pthread.h>
+#include <stdbool.h>
+
+#include "lang.h"
+
+// Called on the worker thread when a script has been run,
+// diag is only valid during the call
+typedef void (*SchedDone)(void *arg, ErrorKind kind, int result, Diagnostic *diag);
+
+typedef struct {
+    LangScript *script;
+    SchedDone done;
+    void *arg;
+} SchedJob;
+
+// The owner takes jobs from the end of its queue and
+// thieves take them from the start
+typedef struct {
+    pthread_mutex_t lock;
+    size_t head;
+    size_t size;
+    size_t capacity;
+    SchedJob *items;
+} SchedQueue;
+
+typedef struct sched Sched;
+
+typedef struct {
+    Sched *sched;
+    size_t index;
+    pthread_t thread;
+    SchedQueue queue;
+    LangContext *ctx;
+} SchedWorker;
+
+typedef struct sched {
+    SchedWorker *workers;
+    size_t nworkers;
+    pthread_mutex_t lock;
+    pthread_cond_t wake;
+    pthread_cond_t idle;
+    size_t next;
+    size_t queued;
+    size_t pending;
+    bool stop;
+} Sched;
+
+Sched *sched_create(size_t nworkers);
+void sched_submit(Sched *sched, LangScript *script, SchedDone done, void *arg);
+void sched_wait(Sched *sched);
+void sched_free(Sched *sched);
+
+#endif
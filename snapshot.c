@@ -0,0 +1,240 @@
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "vector.h"
+#include "error.h"
+#include "lexer.h"
+#include "parser.h"
+#include "interpreter.h"
+#include "snapshot.h"
+
+// HEAP SNAPSHOTS
+// The global environment is saved once the top level statements
+// of the initialization have run. Values are immutable, numbers
+// and strings are never written after being created, so a later
+// run maps the file and the restored variables point directly to
+// the values in it: there is nothing to copy or relocate, only the
+// nodes of the environment are allocated. The variables are saved
+// in preorder so that the tree is rebuilt with the same shape.
+//
+// The key covers the statements of main, the functions and init,
+// a snapshot of another version of the program is never restored:
+// the initialization runs again and the snapshot is replaced.
+
+typedef struct {
+    size_t size;
+    size_t capacity;
+    SnapshotVar *items;
+} SnapshotVars;
+
+typedef struct {
+    size_t size;
+    size_t capacity;
+    double *items;
+} SnapshotValues;
+
+typedef struct {
+    SnapshotVars vars;
+    SnapshotValues values;
+    Buffer strings;
+} SnapshotWriter;
+
+void snapshot_init(Snapshot *snap, char *path, size_t init, Program *pr)
+{
+    snap->path = path;
+    snap->init = init;
+    snap->base = NULL;
+    snap->size = 0;
+
+    uint64_t key = fnv_hash(FNV_OFFSET, &pr->hash, sizeof(pr->hash));
+    for (size_t i = 0; i < pr->size; i++) {
+        if (pr->items[i].type == S_FUNC) {
+            FuncStmt *func = &pr->items[i].as->funcstmt;
+            key = fnv_hash(key, &func->hash, sizeof(func->hash));
+        }
+    }
+    snap->key = fnv_hash(key, &init, sizeof(init));
+}
+
+uint32_t snapshot_string(SnapshotWriter *w, char *s)
+{
+    uint32_t offset = w->strings.size;
+    for (size_t i = 0; i <= strlen(s); i++) {
+        v_append(w->strings, s[i]);
+    }
+    return offset;
+}
+
+void snapshot_var(SnapshotWriter *w, EnvNode *en)
+{
+    if (en == NULL) {
+        return;
+    }
+    Token value = en->rvalue;
+    SnapshotVar var = {
+        .name = snapshot_string(w, en->lvalue.data),
+        .type = value.type,
+    };
+    switch (value.type) {
+    case T_DOUBLE:
+        var.value = w->values.size;
+        v_append(w->values, get_ddata(value));
+        break;
+    case T_STRING:
+        var.value = snapshot_string(w, value.data);
+        break;
+    case T_TRUE:
+    case T_FALSE:
+        break;
+    default:
+        fprintf(error_stream(), "Cannot save the value '");
+        fprint_token(error_stream(), value);
+        fprintf(error_stream(), "' of '");
+        fprint_token(error_stream(), en->lvalue);
+        fprintf(error_stream(), "' in a snapshot\n");
+        error_raise(E_RUNTIME, 0);
+    }
+    v_append(w->vars, var);
+    snapshot_var(w, en->left);
+    snapshot_var(w, en->right);
+}
+
+// The file is written under a temporary name and renamed,
+// a run restoring it never sees a partial snapshot
+void snapshot_save(Snapshot *snap, Env *env)
+{
+    SnapshotWriter w;
+    v_init(w.vars);
+    v_init(w.values);
+    v_init(w.strings);
+    snapshot_var(&w, env->root);
+
+    SnapshotHeader header = {
+        .magic = SNAPSHOT_MAGIC,
+        .version = SNAPSHOT_VERSION,
+        .key = snap->key,
+        .init = snap->init,
+        .nvars = w.vars.size,
+        .values = sizeof(SnapshotHeader),
+        .nvalues = w.values.size,
+    };
+    header.vars = header.values + w.values.size * sizeof(double);
+    header.strings = header.vars + w.vars.size * sizeof(SnapshotVar);
+    header.size = header.strings + w.strings.size;
+
+    size_t size = strlen(snap->path) + 16;
+    char *tmp = malloc(size);
+    snprintf(tmp, size, "%s.XXXXXX", snap->path);
+    int fd = mkstemp(tmp);
+    FILE *f = fd < 0 ? NULL : fdopen(fd, "wb");
+    if (f == NULL) {
+        error_report(E_IO, 0, "Could not create file %s\n", tmp);
+    }
+    fchmod(fd, 0644);
+    fwrite(&header, sizeof(header), 1, f);
+    fwrite(w.values.items, sizeof(double), w.values.size, f);
+    fwrite(w.vars.items, sizeof(SnapshotVar), w.vars.size, f);
+    fwrite(w.strings.items, 1, w.strings.size, f);
+    bool failed = ferror(f) != 0;
+    if (fclose(f) || failed || rename(tmp, snap->path)) {
+        unlink(tmp);
+        error_report(E_IO, 0, "Could not write file %s\n", snap->path);
+    }
+
+    free(tmp);
+    free(w.vars.items);
+    free(w.values.items);
+    free(w.strings.items);
+}
+
+bool snapshot_valid(Snapshot *snap)
+{
+    const SnapshotHeader *h = snap->base;
+    const char *base = snap->base;
+    if (snap->size < sizeof(SnapshotHeader)
+            || memcmp(h->magic, SNAPSHOT_MAGIC, 4) != 0
+            || h->version != SNAPSHOT_VERSION
+            || h->key != snap->key || h->init != snap->init
+            || h->size != snap->size
+            || h->values % sizeof(double) || h->vars % sizeof(uint32_t)
+            || (uint64_t)h->values + (uint64_t)h->nvalues * sizeof(double) > h->size
+            || (uint64_t)h->vars + (uint64_t)h->nvars * sizeof(SnapshotVar) > h->size
+            || h->strings > h->size) {
+        return false;
+    }
+
+    // Strings are terminated inside of the file
+    size_t nstrings = h->size - h->strings;
+    if (nstrings > 0 && base[h->size - 1] != '\0') {
+        return false;
+    }
+    const SnapshotVar *vars = (const SnapshotVar *)(base + h->vars);
+    for (uint32_t i = 0; i < h->nvars; i++) {
+        SnapshotVar var = vars[i];
+        bool value_ok = var.type == T_TRUE || var.type == T_FALSE
+            || (var.type == T_DOUBLE && var.value < h->nvalues)
+            || (var.type == T_STRING && var.value < nstrings);
+        if (var.name >= nstrings || !value_ok) {
+            return false;
+        }
+    }
+    return true;
+}
+
+// Returns false when there is no snapshot of this program
+// yet, the initialization then has to run
+bool snapshot_restore(Snapshot *snap, Env *env)
+{
+    int fd = open(snap->path, O_RDONLY);
+    if (fd < 0) {
+        return false;
+    }
+    struct stat st;
+    if (fstat(fd, &st) || st.st_size == 0) {
+        close(fd);
+        return false;
+    }
+    snap->size = st.st_size;
+    snap->base = mmap(NULL, snap->size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (snap->base == MAP_FAILED) {
+        snap->base = NULL;
+        return false;
+    }
+    if (!snapshot_valid(snap)) {
+        snapshot_free(snap);
+        return false;
+    }
+
+    const SnapshotHeader *h = snap->base;
+    char *base = snap->base;
+    char *strings = base + h->strings;
+    double *values = (double *)(base + h->values);
+    const SnapshotVar *vars = (const SnapshotVar *)(base + h->vars);
+    for (uint32_t i = 0; i < h->nvars; i++) {
+        Token name = {
+            .type = T_NAME,
+            .data = strings + vars[i].name,
+        };
+        Token value = make_token(vars[i].type);
+        if (value.type == T_DOUBLE) {
+            value.data = &values[vars[i].value];
+        } else if (value.type == T_STRING) {
+            value.data = strings + vars[i].value;
+        }
+        env_define(env, name, value);
+    }
+    return true;
+}
+
+void snapshot_free(Snapshot *snap)
+{
+    if (snap->base) {
+        munmap(snap->base, snap->size);
+        snap->base = NULL;
+    }
+}
@@ -0,0 +1,54 @@
+#ifndef SNAPSHOT_H
+#define SNAPSHOT_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "interpreter.h"
+
+// Bumped whenever the layout of the file changes,
+// snapshots of other versions are taken again
+#define SNAPSHOT_MAGIC "LSNP"
+#define SNAPSHOT_VERSION 1
+
+// The values come first so that the doubles are aligned
+typedef struct {
+    char magic[4];
+    uint32_t version;
+    uint64_t key;
+    uint64_t init;
+    uint32_t size;
+    uint32_t nvars;
+    uint32_t values;
+    uint32_t nvalues;
+    uint32_t vars;
+    uint32_t strings;
+} SnapshotHeader;
+
+// The value is an index in the values for a number and
+// an offset in the strings for a string, the name is an
+// offset in the strings too
+typedef struct {
+    uint32_t name;
+    uint32_t type;
+    uint32_t value;
+} SnapshotVar;
+
+// The initialization is made of the first init top level
+// statements of the program, the key identifies the program
+// and init. The file stays mapped while the program runs,
+// the restored values point into it.
+typedef struct snapshot {
+    char *path;
+    size_t init;
+    uint64_t key;
+    void *base;
+    size_t size;
+} Snapshot;
+
+void snapshot_init(Snapshot *snap, char *path, size_t init, Program *pr);
+bool snapshot_restore(Snapshot *snap, Env *env);
+void snapshot_save(Snapshot *snap, Env *env);
+void snapshot_free(Snapshot *snap);
+
+#endif
@@ -0,0 +1,280 @@
+#include <malloc.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <time.h>
+
+#include "vector.h"
+#include "parser.h"
+#include "stats.h"
+
+// STATISTICS
+// With --stats the tools time their phases and count the objects
+// they create, the report is written on the standard error when
+// they are done, as text or as JSON with --stats=json:
+//
+//   phase         runs     wall ms      cpu ms     heap KB
+//   parse            1      12.345      12.301       +2048
+//
+// Cpu is the time of the whole process, with parallel code
+// generation it is more than the wall clock time. The heap is
+// measured with mallinfo2, it covers the memory allocated by
+// LLVM too. Nothing is measured when the statistics are off,
+// the checks are a single load in the code that counts.
+
+Stats stats = {
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+};
+
+static char *phase_names[] = {
+    [PHASE_LEX] = "lex",
+    [PHASE_PARSE] = "parse",
+    [PHASE_IMPORT] = "import",
+    [PHASE_IR] = "ir",
+    [PHASE_CODEGEN] = "codegen",
+    [PHASE_LINK] = "link",
+    [PHASE_EMIT] = "emit",
+    [PHASE_EVAL] = "eval",
+};
+
+void stats_enable(StatsFormat format)
+{
+    stats.format = format;
+    v_init(stats.passes);
+}
+
+double stats_clock(clockid_t clock)
+{
+    struct timespec ts;
+    clock_gettime(clock, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+double stats_wall(void)
+{
+    return stats_clock(CLOCK_MONOTONIC);
+}
+
+double stats_thread_cpu(void)
+{
+    return stats_clock(CLOCK_THREAD_CPUTIME_ID);
+}
+
+long stats_heap(void)
+{
+    struct mallinfo2 info = mallinfo2();
+    return info.uordblks + info.hblkhd;
+}
+
+void stats_begin(Phase phase)
+{
+    if (stats.format == STATS_OFF) {
+        return;
+    }
+    PhaseStats *ps = &stats.phases[phase];
+    ps->wall_start = stats_wall();
+    ps->cpu_start = stats_clock(CLOCK_PROCESS_CPUTIME_ID);
+    ps->heap_start = stats_heap();
+}
+
+void stats_end(Phase phase)
+{
+    if (stats.format == STATS_OFF) {
+        return;
+    }
+    PhaseStats *ps = &stats.phases[phase];
+    ps->runs++;
+    ps->wall += stats_wall() - ps->wall_start;
+    ps->cpu += stats_clock(CLOCK_PROCESS_CPUTIME_ID) - ps->cpu_start;
+    ps->heap += stats_heap() - ps->heap_start;
+}
+
+void stats_expr(Expr expr)
+{
+    stats.exprs++;
+    switch (expr.type) {
+    case UNARY:
+        stats_expr(expr.as->unexpr.expr);
+        break;
+    case BINARY:
+        stats_expr(expr.as->binexpr.lexpr);
+        stats_expr(expr.as->binexpr.rexpr);
+        break;
+    case GROUPING:
+        stats_expr(expr.as->groupexpr.expr);
+        break;
+    case CALL:
+        for (size_t i = 0; i < expr.as->callexpr.args.size; i++) {
+            stats_expr(expr.as->callexpr.args.items[i]);
+        }
+        break;
+    case TERMINAL:
+        break;
+    }
+}
+
+void stats_block(Block block);
+
+void stats_stmt(Stmt stmt)
+{
+    stats.stmts++;
+    switch (stmt.type) {
+    case S_LET:
+        stats_expr(stmt.as->letstmt.value);
+        break;
+    case S_IF:
+        stats_expr(stmt.as->ifstmt.cond);
+        stats_stmt(stmt.as->ifstmt.thenb);
+        stats_stmt(stmt.as->ifstmt.elseb);
+        break;
+    case S_FOR:
+        stats_expr(stmt.as->forstmt.init);
+        stats_expr(stmt.as->forstmt.cond);
+        stats_expr(stmt.as->forstmt.step);
+        stats_stmt(stmt.as->forstmt.thenb);
+        break;
+    case S_WHILE:
+        stats_expr(stmt.as->whilestmt.cond);
+        stats_stmt(stmt.as->whilestmt.thenb);
+        break;
+    case S_BLOCK:
+        stats_block(stmt.as->blockstmt.block);
+        break;
+    case S_EXPR:
+        stats_expr(stmt.as->exprstmt.expr);
+        break;
+    case S_FUNC:
+        stats_block(stmt.as->funcstmt.block);
+        break;
+    case S_RET:
+        stats_expr(stmt.as->retstmt.expr);
+        break;
+    }
+}
+
+void stats_block(Block block)
+{
+    for (size_t i = 0; i < block.size; i++) {
+        stats_stmt(block.items[i]);
+    }
+}
+
+// Counts the statements and the expressions of the program
+void stats_program(Program *pr)
+{
+    if (stats.format == STATS_OFF) {
+        return;
+    }
+    for (size_t i = 0; i < pr->size; i++) {
+        stats_stmt(pr->items[i]);
+    }
+}
+
+// Called for every node added to a tree, with its depth
+void stats_node(atomic_size_t *count, atomic_size_t *depth, size_t node_depth)
+{
+    atomic_fetch_add(count, 1);
+    size_t max = atomic_load(depth);
+    while (node_depth > max && !atomic_compare_exchange_weak(depth, &max, node_depth)) {
+    }
+}
+
+void stats_passes(char *pipeline, double wall, double cpu)
+{
+    pthread_mutex_lock(&stats.lock);
+    PassStats *ps = NULL;
+    for (size_t i = 0; i < stats.passes.size; i++) {
+        if (strcmp(stats.passes.items[i].pipeline, pipeline) == 0) {
+            ps = &stats.passes.items[i];
+        }
+    }
+    if (ps == NULL) {
+        PassStats new = {.pipeline = strdup(pipeline)};
+        v_append(stats.passes, new);
+        ps = &stats.passes.items[stats.passes.size - 1];
+    }
+    ps->runs++;
+    ps->wall += wall;
+    ps->cpu += cpu;
+    pthread_mutex_unlock(&stats.lock);
+}
+
+void stats_print_text(FILE *f, long rss)
+{
+    fprintf(f, "%-12s %6s %12s %12s %12s\n", "phase", "runs", "wall ms", "cpu ms", "heap KB");
+    for (int i = 0; i < NPHASES; i++) {
+        PhaseStats ps = stats.phases[i];
+        if (ps.runs) {
+            fprintf(f, "%-12s %6zu %12.3f %12.3f %+12ld\n", phase_names[i], ps.runs,
+                ps.wall * 1e3, ps.cpu * 1e3, ps.heap / 1024);
+        }
+    }
+    int width = strlen("llvm passes");
+    for (size_t i = 0; i < stats.passes.size; i++) {
+        int len = strlen(stats.passes.items[i].pipeline);
+        width = len > width ? len : width;
+    }
+    if (stats.passes.size) {
+        fprintf(f, "\n%-*s %6s %12s %12s\n", width, "llvm passes", "runs", "wall ms", "cpu ms");
+    }
+    for (size_t i = 0; i < stats.passes.size; i++) {
+        PassStats ps = stats.passes.items[i];
+        fprintf(f, "%-*s %6zu %12.3f %12.3f\n", width, ps.pipeline, ps.runs,
+            ps.wall * 1e3, ps.cpu * 1e3);
+    }
+    fprintf(f, "\n%-20s %12zu\n", "tokens", stats.tokens);
+    fprintf(f, "%-20s %12zu\n", "statements", stats.stmts);
+    fprintf(f, "%-20s %12zu\n", "expressions", stats.exprs);
+    fprintf(f, "%-20s %12zu (max depth %zu)\n", "env nodes",
+        atomic_load(&stats.envnodes), atomic_load(&stats.envdepth));
+    fprintf(f, "%-20s %12zu (max depth %zu)\n", "named values",
+        atomic_load(&stats.nvnodes), atomic_load(&stats.nvdepth));
+    fprintf(f, "%-20s %12ld\n", "peak rss KB", rss);
+}
+
+void stats_print_json(FILE *f, long rss)
+{
+    fprintf(f, "{\"phases\": {");
+    const char *sep = "";
+    for (int i = 0; i < NPHASES; i++) {
+        PhaseStats ps = stats.phases[i];
+        if (ps.runs) {
+            fprintf(f, "%s\"%s\": {\"runs\": %zu, \"wall_ms\": %.3f, \"cpu_ms\": %.3f, "
+                "\"heap_bytes\": %ld}", sep, phase_names[i], ps.runs,
+                ps.wall * 1e3, ps.cpu * 1e3, ps.heap);
+            sep = ", ";
+        }
+    }
+    fprintf(f, "}, \"passes\": [");
+    for (size_t i = 0; i < stats.passes.size; i++) {
+        PassStats ps = stats.passes.items[i];
+        fprintf(f, "%s{\"pipeline\": \"%s\", \"runs\": %zu, \"wall_ms\": %.3f, "
+            "\"cpu_ms\": %.3f}", i ? ", " : "", ps.pipeline, ps.runs,
+            ps.wall * 1e3, ps.cpu * 1e3);
+    }
+    fprintf(f, "], \"objects\": {\"tokens\": %zu, \"statements\": %zu, "
+        "\"expressions\": %zu, \"env_nodes\": %zu, \"env_depth\": %zu, "
+        "\"named_values\": %zu, \"named_values_depth\": %zu}, \"peak_rss_kb\": %ld}\n",
+        stats.tokens, stats.stmts, stats.exprs,
+        atomic_load(&stats.envnodes), atomic_load(&stats.envdepth),
+        atomic_load(&stats.nvnodes), atomic_load(&stats.nvdepth), rss);
+}
+
+void stats_print(FILE *f)
+{
+    if (stats.format == STATS_OFF) {
+        return;
+    }
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    if (stats.format == STATS_JSON) {
+        stats_print_json(f, usage.ru_maxrss);
+    } else {
+        stats_print_text(f, usage.ru_maxrss);
+    }
+    for (size_t i = 0; i < stats.passes.size; i++) {
+        free(stats.passes.items[i].pipeline);
+    }
+    free(stats.passes.items);
+    v_init(stats.passes);
+}
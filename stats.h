@@ -0,0 +1,85 @@
+#ifndef STATS_H
+#define STATS_H
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdio.h>
+
+#include "parser.h"
+
+typedef enum {
+    PHASE_LEX,
+    PHASE_PARSE,
+    PHASE_IMPORT,
+    PHASE_IR,
+    PHASE_CODEGEN,
+    PHASE_LINK,
+    PHASE_EMIT,
+    PHASE_EVAL,
+    NPHASES,
+} Phase;
+
+typedef enum {
+    STATS_OFF,
+    STATS_TEXT,
+    STATS_JSON,
+} StatsFormat;
+
+// Heap is the growth of the bytes in use during the phase, it is
+// negative when the phase releases more than it allocates
+typedef struct {
+    size_t runs;
+    double wall;
+    double cpu;
+    long heap;
+    double wall_start;
+    double cpu_start;
+    long heap_start;
+} PhaseStats;
+
+// Time spent in every pass pipeline given to LLVM, cpu is the
+// one of the threads that ran it
+typedef struct {
+    char *pipeline;
+    size_t runs;
+    double wall;
+    double cpu;
+} PassStats;
+
+typedef struct {
+    size_t size;
+    size_t capacity;
+    PassStats *items;
+} PassStatsList;
+
+// Counts of the objects created by the tools, the depths are the
+// ones of the deepest binary trees of variables and named values.
+// The counters are updated by the threads of codegen at the same
+// time, the rest by the main thread.
+typedef struct {
+    StatsFormat format;
+    PhaseStats phases[NPHASES];
+    PassStatsList passes;
+    pthread_mutex_t lock;
+    size_t tokens;
+    size_t stmts;
+    size_t exprs;
+    atomic_size_t envnodes;
+    atomic_size_t envdepth;
+    atomic_size_t nvnodes;
+    atomic_size_t nvdepth;
+} Stats;
+
+extern Stats stats;
+
+void stats_enable(StatsFormat format);
+double stats_thread_cpu(void);
+double stats_wall(void);
+void stats_begin(Phase phase);
+void stats_end(Phase phase);
+void stats_program(Program *pr);
+void stats_node(atomic_size_t *count, atomic_size_t *depth, size_t node_depth);
+void stats_passes(char *pipeline, double wall, double cpu);
+void stats_print(FILE *f);
+
+#endif
@@ -0,0 +1,568 @@
+#include <stdio.h>
+#include <string.h>
+
+#include "llvm-c/Core.h"
+#include "llvm-c/ExecutionEngine.h"
+#include "llvm-c/Target.h"
+
+#include "vector.h"
+#include "error.h"
+#include "lexer.h"
+#include "parser.h"
+#include "interpreter.h"
+#include "codegen.h"
+#include "budget.h"
+#include "perfmap.h"
+#include "tier.h"
+
+// TIERED EXECUTION
+// The program starts in the tree walking interpreter, which
+// counts the calls of every function and the back edges of
+// every loop. When a counter reaches the threshold the code
+// is generated with the gen_* functions in a new module that
+// is added to the MCJIT execution engine, from then on the
+// interpreter calls the native code instead.
+//
+// Functions are called through a wrapper taking the arguments
+// as an array of doubles. Loops are compiled as regions: a
+// function taking pointers to the variables of the enclosing
+// environments that the loop uses, which runs the remaining
+// iterations and writes the variables back.
+//
+// With a budget the compiled code burns the fuel of the run,
+// a native loop that never ends is aborted like an interpreted
+// one. The native code does not count the depth nor the heap,
+// so those limits cannot be used with the JIT.
+//
+// With a perf map every function and loop is written to
+// /tmp/perf-PID.map when its code is ready, see perfmap.c, so
+// that perf report attributes the samples of native code to
+// them instead of to an unknown address.
+
+typedef struct {
+    size_t size;
+    size_t capacity;
+    char **items;
+} Names;
+
+typedef struct loopnode LoopNode;
+typedef struct loopnode {
+    AnyExpr *key;
+    size_t backedges;
+    JitState jit;
+    Names vars;
+    void (*native)(double **vars);
+    LoopNode *left;
+    LoopNode *right;
+} LoopNode;
+
+typedef struct {
+    size_t size;
+    size_t capacity;
+    FnNode **items;
+} Pending;
+
+struct tier {
+    size_t threshold;
+    Budget *budget;
+    PerfMap *perfmap;
+    size_t modules;
+    LLVMExecutionEngineRef engine;
+    LLVMBuilderRef builder;
+    LoopNode *loops;
+};
+
+// Compilability checks, the code generator exits on the
+// constructs it does not support so they must be rejected
+// before generating anything
+typedef struct {
+    FnNode *funcs;
+    Names defined;
+    Names *free;
+    Pending *pending;
+} Check;
+
+bool names_has(Names *names, char *name)
+{
+    for (size_t i = 0; i < names->size; i++) {
+        if (strcmp(names->items[i], name) == 0) {
+            return true;
+        }
+    }
+    return false;
+}
+
+bool check_func(Check *upper, FnNode *fn);
+
+bool check_expr(Check *check, Expr expr)
+{
+    switch (expr.type) {
+    case UNARY:
+        return check_expr(check, expr.as->unexpr.expr);
+    case BINARY: {
+        BinExpr binexpr = expr.as->binexpr;
+        if (binexpr.op.type == T_EQUAL
+                && (binexpr.lexpr.type != TERMINAL
+                    || binexpr.lexpr.as->termexpr.term.type != T_NAME)) {
+            return false;
+        }
+        return check_expr(check, binexpr.lexpr)
+            && check_expr(check, binexpr.rexpr);
+    }
+    case GROUPING:
+        return check_expr(check, expr.as->groupexpr.expr);
+    case TERMINAL: {
+        Token term = expr.as->termexpr.term;
+        if (term.type == T_STRING) {
+            return false;
+        }
+        if (term.type == T_NAME && !names_has(&check->defined, term.data)) {
+            // In a loop region the variables of the enclosing
+            // environments become arguments of the region
+            if (check->free == NULL) {
+                return false;
+            }
+            v_append(*check->free, term.data);
+            v_append(check->defined, term.data);
+        }
+        return true;
+    }
+    case CALL: {
+        CallExpr callexpr = expr.as->callexpr;
+        FnNode *fn = fn_get(check->funcs, callexpr.name);
+        if (fn == NULL || fn->func->args.size != callexpr.args.size) {
+            return false;
+        }
+        for (size_t i = 0; i < callexpr.args.size; i++) {
+            if (!check_expr(check, callexpr.args.items[i])) {
+                return false;
+            }
+        }
+        return check_func(check, fn);
+    }
+    }
+    return false;
+}
+
+bool check_stmt(Check *check, Stmt stmt)
+{
+    switch (stmt.type) {
+    case S_LET: {
+        // Named values are not scoped by the code generator
+        LetStmt letstmt = stmt.as->letstmt;
+        if (names_has(&check->defined, letstmt.name.data)) {
+            return false;
+        }
+        bool ok = check_expr(check, letstmt.value);
+        v_append(check->defined, letstmt.name.data);
+        return ok;
+    }
+    case S_IF:
+        return check_expr(check, stmt.as->ifstmt.cond)
+            && check_stmt(check, stmt.as->ifstmt.thenb)
+            && check_stmt(check, stmt.as->ifstmt.elseb);
+    case S_FOR:
+        return check_expr(check, stmt.as->forstmt.init)
+            && check_expr(check, stmt.as->forstmt.cond)
+            && check_expr(check, stmt.as->forstmt.step)
+            && check_stmt(check, stmt.as->forstmt.thenb);
+    case S_WHILE:
+        return check_expr(check, stmt.as->whilestmt.cond)
+            && check_stmt(check, stmt.as->whilestmt.thenb);
+    case S_BLOCK: {
+        Block block = stmt.as->blockstmt.block;
+        for (size_t i = 0; i < block.size; i++) {
+            if (!check_stmt(check, block.items[i])) {
+                return false;
+            }
+        }
+        return true;
+    }
+    case S_EXPR:
+        return check_expr(check, stmt.as->exprstmt.expr);
+    case S_RET:
+        // A region cannot return from the enclosing function
+        return check->free == NULL
+            && check_expr(check, stmt.as->retstmt.expr);
+    case S_FUNC:
+        return false;
+    }
+    return false;
+}
+
+// Checks the function and all the functions it calls, the ones
+// that are not compiled yet are added to the pending list
+bool check_func(Check *upper, FnNode *fn)
+{
+    switch (fn->jit) {
+    case JIT_DONE:
+    case JIT_PENDING:
+        return true;
+    case JIT_FAILED:
+        return false;
+    case JIT_NONE:
+        break;
+    }
+
+    fn->jit = JIT_PENDING;
+    v_append(*upper->pending, fn);
+
+    Check check = {
+        .funcs = upper->funcs,
+        .pending = upper->pending,
+    };
+    v_init(check.defined);
+    FuncStmt *func = fn->func;
+    for (size_t i = 0; i < func->args.size; i++) {
+        v_append(check.defined, func->args.items[i].data);
+    }
+
+    bool ok = true;
+    for (size_t i = 0; i < func->block.size && ok; i++) {
+        ok = check_stmt(&check, func->block.items[i]);
+    }
+    free(check.defined.items);
+
+    if (!ok) {
+        fn->jit = JIT_FAILED;
+    }
+    return ok;
+}
+
+void declare_funcs(LLVMModuleRef module, FnNode *fn)
+{
+    if (fn) {
+        gen_funcproto(module, *fn->func);
+        declare_funcs(module, fn->left);
+        declare_funcs(module, fn->right);
+    }
+}
+
+char *wrapper_name(FnNode *fn)
+{
+    char *name = malloc(strlen(fn->name.data) + sizeof(".tier"));
+    sprintf(name, "%s.tier", (char *)fn->name.data);
+    return name;
+}
+
+// The module is optimized before being handed to the
+// execution engine, which only does instruction selection
+// The budget outlives the code, its address and the one of
+// budget_refuel are constants of the modules
+void tier_fuel(Tier *tier, Codegen *codegen)
+{
+    if (tier->budget == NULL) {
+        return;
+    }
+    LLVMTypeRef i64 = LLVMInt64Type();
+    codegen->fuel = LLVMConstIntToPtr(
+        LLVMConstInt(i64, (uintptr_t)&tier->budget->fuel, false),
+        LLVMPointerType(i64, 0));
+    codegen->refuel = LLVMConstIntToPtr(
+        LLVMConstInt(i64, (uintptr_t)budget_refuel, false),
+        LLVMPointerType(refuel_type(LLVMGetGlobalContext()), 0));
+}
+
+void add_module(Tier *tier, LLVMModuleRef module)
+{
+    optimize_module(module, 2);
+    LLVMAddModule(tier->engine, module);
+    tier->modules++;
+}
+
+// Every function gets its own module with the declarations of
+// all the other functions, MCJIT resolves the calls between
+// modules when the code is finalized
+void emit_func(Tier *tier, FnNode *funcs, FnNode *fn)
+{
+    LLVMModuleRef module = LLVMModuleCreateWithName(fn->name.data);
+    Codegen codegen = {
+        .context = LLVMGetGlobalContext(),
+        .builder = tier->builder,
+        .module = module,
+    };
+    tier_fuel(tier, &codegen);
+    declare_funcs(module, funcs);
+    gen_funcstmt(&codegen, *fn->func);
+
+    // double name.tier(double *args)
+    LLVMValueRef func = LLVMGetNamedFunction(module, fn->name.data);
+    LLVMTypeRef ptr_type = LLVMPointerType(LLVMDoubleType(), 0);
+    LLVMTypeRef proto = LLVMFunctionType(LLVMDoubleType(), &ptr_type, 1, false);
+    char *name = wrapper_name(fn);
+    LLVMValueRef wrapper = LLVMAddFunction(module, name, proto);
+    free(name);
+
+    LLVMBasicBlockRef bb = LLVMAppendBasicBlock(wrapper, "entry");
+    LLVMPositionBuilderAtEnd(tier->builder, bb);
+    size_t argc = fn->func->args.size;
+    LLVMValueRef *args = malloc(argc * sizeof(LLVMValueRef));
+    for (size_t i = 0; i < argc; i++) {
+        LLVMValueRef index = LLVMConstInt(LLVMInt64Type(), i, false);
+        LLVMValueRef ptr = LLVMBuildGEP2(tier->builder, LLVMDoubleType(),
+            LLVMGetParam(wrapper, 0), &index, 1, "argptr");
+        args[i] = LLVMBuildLoad2(tier->builder, LLVMDoubleType(), ptr, "arg");
+    }
+    LLVMValueRef ret = LLVMBuildCall2(tier->builder, LLVMGlobalGetValueType(func),
+        func, args, argc, "ret");
+    LLVMBuildRet(tier->builder, ret);
+    free(args);
+
+    add_module(tier, module);
+}
+
+// Once all the modules of the pending functions have been added
+// their addresses can be resolved
+void emit_pending(Tier *tier, FnNode *funcs, Pending *pending, bool ok)
+{
+    for (size_t i = 0; i < pending->size; i++) {
+        FnNode *fn = pending->items[i];
+        if (ok) {
+            emit_func(tier, funcs, fn);
+        } else if (fn->jit == JIT_PENDING) {
+            // Only the failing function is marked, the other
+            // ones can be compiled when they become hot
+            fn->jit = JIT_NONE;
+        }
+    }
+    for (size_t i = 0; i < pending->size && ok; i++) {
+        FnNode *fn = pending->items[i];
+        char *name = wrapper_name(fn);
+        fn->native = (double (*)(double *))LLVMGetFunctionAddress(tier->engine, name);
+        fn->jit = JIT_DONE;
+        if (tier->perfmap) {
+            char *names[] = {fn->name.data, name};
+            perfmap_write(tier->perfmap, tier->engine, names, 2);
+        }
+        free(name);
+    }
+    free(pending->items);
+}
+
+void compile_func(Tier *tier, FnNode *funcs, FnNode *fn)
+{
+    Pending pending;
+    v_init(pending);
+    Check check = {
+        .funcs = funcs,
+        .pending = &pending,
+    };
+    bool ok = check_func(&check, fn);
+    emit_pending(tier, funcs, &pending, ok);
+}
+
+bool tier_call(Tier *tier, FnNode *funcs, FnNode *fn, Token *args, Token *ret)
+{
+    if (fn->jit == JIT_NONE && fn->calls >= tier->threshold) {
+        compile_func(tier, funcs, fn);
+    }
+    if (fn->jit != JIT_DONE) {
+        return false;
+    }
+
+    size_t argc = fn->func->args.size;
+    double *values = malloc(argc * sizeof(double));
+    for (size_t i = 0; i < argc; i++) {
+        if (args[i].type != T_DOUBLE) {
+            free(values);
+            return false;
+        }
+        values[i] = get_ddata(args[i]);
+    }
+    *ret = make_number(fn->native(values));
+    free(values);
+    return true;
+}
+
+LoopNode *loop_get(LoopNode **node, AnyExpr *key)
+{
+    while (*node && (*node)->key != key) {
+        node = key < (*node)->key
+            ? &(*node)->left
+            : &(*node)->right;
+    }
+    if (*node == NULL) {
+        *node = calloc(1, sizeof(LoopNode));
+        (*node)->key = key;
+    }
+    return *node;
+}
+
+// void loop.n(double **vars)
+void emit_loop(Tier *tier, FnNode *funcs, LoopNode *loop,
+        Expr cond, Expr *step, Stmt thenb, LoopHints hints)
+{
+    char name[32];
+    snprintf(name, sizeof(name), "loop.%zu", tier->modules);
+    LLVMModuleRef module = LLVMModuleCreateWithName(name);
+    declare_funcs(module, funcs);
+
+    LLVMTypeRef ptr_type = LLVMPointerType(LLVMPointerType(LLVMDoubleType(), 0), 0);
+    LLVMTypeRef proto = LLVMFunctionType(LLVMVoidType(), &ptr_type, 1, false);
+    LLVMValueRef func = LLVMAddFunction(module, name, proto);
+    LLVMBasicBlockRef bb = LLVMAppendBasicBlock(func, "entry");
+    LLVMPositionBuilderAtEnd(tier->builder, bb);
+
+    NamedValues nvalues = {0};
+    Codegen codegen = {
+        .context = LLVMGetGlobalContext(),
+        .builder = tier->builder,
+        .module = module,
+        .nvalues = &nvalues,
+    };
+    tier_fuel(tier, &codegen);
+
+    // The variables are copied in stack allocations so that mem2reg
+    // can keep them in registers, the pointers could alias
+    size_t size = loop->vars.size;
+    LLVMValueRef *ptrs = malloc(size * sizeof(LLVMValueRef));
+    for (size_t i = 0; i < size; i++) {
+        char *var = loop->vars.items[i];
+        LLVMValueRef index = LLVMConstInt(LLVMInt64Type(), i, false);
+        LLVMValueRef ptrptr = LLVMBuildGEP2(tier->builder,
+            LLVMPointerType(LLVMDoubleType(), 0), LLVMGetParam(func, 0),
+            &index, 1, "varptr");
+        ptrs[i] = LLVMBuildLoad2(tier->builder,
+            LLVMPointerType(LLVMDoubleType(), 0), ptrptr, var);
+        LLVMValueRef alloca = gen_alloca(&codegen, var);
+        LLVMValueRef value = LLVMBuildLoad2(tier->builder, LLVMDoubleType(),
+            ptrs[i], var);
+        LLVMBuildStore(tier->builder, value, alloca);
+        nv_insert(&nvalues, var, alloca);
+    }
+
+    gen_loop(&codegen, &cond, step, thenb, hints, (BranchProfile) {0});
+
+    for (size_t i = 0; i < size; i++) {
+        char *var = loop->vars.items[i];
+        LLVMValueRef alloca = nv_lookup(&nvalues, var);
+        LLVMValueRef value = LLVMBuildLoad2(tier->builder, LLVMDoubleType(),
+            alloca, var);
+        LLVMBuildStore(tier->builder, value, ptrs[i]);
+    }
+    LLVMBuildRetVoid(tier->builder);
+    free_nvnode(nvalues.root);
+    free(ptrs);
+
+    add_module(tier, module);
+    loop->native = (void (*)(double **))LLVMGetFunctionAddress(tier->engine, name);
+    if (tier->perfmap) {
+        char *names[] = {name};
+        perfmap_write(tier->perfmap, tier->engine, names, 1);
+    }
+}
+
+void compile_loop(Tier *tier, FnNode *funcs, LoopNode *loop,
+        Expr cond, Expr *step, Stmt thenb, LoopHints hints)
+{
+    Pending pending;
+    v_init(pending);
+    v_init(loop->vars);
+    Check check = {
+        .funcs = funcs,
+        .free = &loop->vars,
+        .pending = &pending,
+    };
+    v_init(check.defined);
+
+    bool ok = check_expr(&check, cond)
+        && (step == NULL || check_expr(&check, *step))
+        && check_stmt(&check, thenb);
+    free(check.defined.items);
+
+    emit_pending(tier, funcs, &pending, ok);
+    if (ok) {
+        emit_loop(tier, funcs, loop, cond, step, thenb, hints);
+        loop->jit = JIT_DONE;
+    } else {
+        loop->jit = JIT_FAILED;
+    }
+}
+
+// Called at the end of every iteration, returns true when the
+// remaining iterations have been executed by native code
+bool tier_loop(Tier *tier, Expr cond, Expr *step, Stmt thenb, LoopHints hints, Env *env)
+{
+    LoopNode *loop = loop_get(&tier->loops, cond.as);
+    loop->backedges++;
+    if (loop->jit == JIT_NONE && loop->backedges >= tier->threshold) {
+        compile_loop(tier, env->interp->funcs, loop, cond, step, thenb, hints);
+    }
+    if (loop->jit != JIT_DONE) {
+        return false;
+    }
+
+    // The variables are copied out of the environment and
+    // written back after the loop, they must all be doubles
+    size_t size = loop->vars.size;
+    EnvNode **nodes = malloc(size * sizeof(EnvNode *));
+    double *values = malloc(size * sizeof(double));
+    double **ptrs = malloc(size * sizeof(double *));
+    bool ok = true;
+    for (size_t i = 0; i < size && ok; i++) {
+        Token name = make_name(loop->vars.items[i]);
+        nodes[i] = env_lookup(env, name);
+        ok = nodes[i] && nodes[i]->rvalue.type == T_DOUBLE;
+        if (ok) {
+            values[i] = get_ddata(nodes[i]->rvalue);
+            ptrs[i] = &values[i];
+        }
+    }
+
+    if (ok) {
+        loop->native(ptrs);
+        for (size_t i = 0; i < size; i++) {
+            nodes[i]->rvalue = make_number(values[i]);
+        }
+    }
+
+    free(ptrs);
+    free(values);
+    free(nodes);
+    return ok;
+}
+
+Tier *tier_create(size_t threshold, Budget *budget, bool perfmap)
+{
+    LLVMLinkInMCJIT();
+    LLVMInitializeNativeTarget();
+    LLVMInitializeNativeAsmPrinter();
+
+    Tier *tier = calloc(1, sizeof(Tier));
+    tier->threshold = threshold;
+    tier->budget = budget;
+    tier->builder = LLVMCreateBuilder();
+
+    struct LLVMMCJITCompilerOptions options;
+    LLVMInitializeMCJITCompilerOptions(&options, sizeof(options));
+    options.OptLevel = 2;
+    if (perfmap) {
+        options.MCJMM = perfmap_create(&tier->perfmap);
+    }
+
+    char *error = NULL;
+    LLVMModuleRef module = LLVMModuleCreateWithName("tier");
+    if (LLVMCreateMCJITCompilerForModule(&tier->engine, module,
+                &options, sizeof(options), &error)) {
+        error_report(E_CODEGEN, 0, "Could not create JIT: %s\n", error);
+    }
+    return tier;
+}
+
+void free_loop(LoopNode *loop)
+{
+    if (loop) {
+        free_loop(loop->left);
+        free_loop(loop->right);
+        free(loop->vars.items);
+        free(loop);
+    }
+}
+
+void tier_free(Tier *tier)
+{
+    LLVMDisposeExecutionEngine(tier->engine);
+    LLVMDisposeBuilder(tier->builder);
+    free_loop(tier->loops);
+    free(tier);
+}
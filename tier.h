@@ -0,0 +1,17 @@
+#ifndef TIER_H
+#define TIER_H
+
+#include "interpreter.h"
+
+// Number of calls of a function, or back edges of
+// a loop, after which it is compiled with the JIT
+#define TIER_THRESHOLD 1000
+
+// The compiled code burns the budget when there is one, with
+// perfmap its functions are listed in /tmp/perf-PID.map
+Tier *tier_create(size_t threshold, Budget *budget, bool perfmap);
+void tier_free(Tier *tier);
+bool tier_call(Tier *tier, FnNode *funcs, FnNode *fn, Token *args, Token *ret);
+bool tier_loop(Tier *tier, Expr cond, Expr *step, Stmt thenb, LoopHints hints, Env *env);
+
+#endif